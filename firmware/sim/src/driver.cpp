@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "driver.hpp"
+#include <cassert>
+
+
+namespace board
+{
+namespace motor
+{
+namespace
+{
+
+PWMParameters g_pwm_params;
+Status g_status;
+Limits g_limits;
+
+math::Vector<2> g_phase_currents_ab = math::Vector<2>::Zero();
+math::Vector<3> g_pwm_setpoint = math::Vector<3>::Zero();
+
+}
+
+unsigned PWMHandle::total_number_of_active_handles_ = 0;
+
+void PWMHandle::setPWM(const math::Vector<3>& abc)
+{
+    if (!active_)
+    {
+        active_ = true;
+        total_number_of_active_handles_++;
+    }
+
+    g_pwm_setpoint = abc;
+}
+
+void PWMHandle::release()
+{
+    if (active_)
+    {
+        active_ = false;
+        assert(total_number_of_active_handles_ > 0);
+        total_number_of_active_handles_--;
+        if (total_number_of_active_handles_ == 0)
+        {
+            g_pwm_setpoint.setZero();
+        }
+    }
+}
+
+bool PWMHandle::isUnique() const
+{
+    return (total_number_of_active_handles_ == 0) ||
+           ((total_number_of_active_handles_ == 1) && active_);
+}
+
+bool isCalibrationInProgress()
+{
+    return false;
+}
+
+PWMParameters getPWMParameters()
+{
+    return g_pwm_params;
+}
+
+math::Vector<2> getPhaseCurrentsAB()
+{
+    return (PWMHandle::getTotalNumberOfActiveHandles() > 0) ? g_phase_currents_ab : math::Vector<2>::Zero();
+}
+
+float getInverterVoltage()
+{
+    return g_status.inverter_voltage;
+}
+
+Status getStatus()
+{
+    return g_status;
+}
+
+const Limits& getLimits()
+{
+    return g_limits;
+}
+
+}
+}
+
+namespace sim
+{
+
+void configureDriver(const board::motor::PWMParameters& pwm_params,
+                     const board::motor::Status& status)
+{
+    board::motor::g_pwm_params = pwm_params;
+    board::motor::g_status = status;
+
+    board::motor::g_limits.measurement_range.inverter_voltage = {0.0F, 60.0F};
+    board::motor::g_limits.safe_operating_area.inverter_voltage = {4.5F, 55.0F};
+    board::motor::g_limits.measurement_range.inverter_temperature =
+        {math::convertCelsiusToKelvin(-40.0F), math::convertCelsiusToKelvin(150.0F)};
+    board::motor::g_limits.safe_operating_area.inverter_temperature =
+        {math::convertCelsiusToKelvin(-40.0F), math::convertCelsiusToKelvin(100.0F)};
+}
+
+void setPhaseCurrents(const math::Vector<2>& phase_currents_ab)
+{
+    board::motor::g_phase_currents_ab = phase_currents_ab;
+}
+
+math::Vector<3> getPWMSetpoint()
+{
+    return board::motor::g_pwm_setpoint;
+}
+
+}
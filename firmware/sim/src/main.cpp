@@ -0,0 +1,1096 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Closed loop simulation of the motor control core against a PMSM plant model, with benchmarks.
+ * Run without arguments to execute all scenarios, or list the scenarios to run:
+ *      foc_bench [spinup] [observer] [motor_id] [fixed_point] [--observer-q=Q0,Q1,Q2,Q3] [--observer-r=R0,R1]
+ *                [--flux-observer]
+ * The option --flux-observer enables the flux observer at cruise, see foc::MotorRunner.
+ * The timing is measured on the host, so it is only useful for comparison against another build on the same host;
+ * the IRQ profiler stages are measured using the emulated cycle counter, see hal.h.
+ */
+
+#include "pmsm_plant.hpp"
+#include "driver.hpp"
+#include <foc/motor_runner.hpp>
+#include <foc/motor_id/task.hpp>
+#include <foc/observer/observer.hpp>
+#include <foc/observer/flux_observer.hpp>
+#include <foc/fixed_point.hpp>
+#include <board/irq_profiler.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+namespace
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+constexpr double Pi = 3.14159265358979323846;
+
+/**
+ * Configuration of the simulated system; a small multirotor motor with a propeller by default.
+ */
+struct Setup
+{
+    sim::PMSMPlant::Parameters plant;
+
+    foc::MotorParameters motor;
+    foc::ControllerParameters controller;
+    foc::InverterParameters inverter;
+    foc::observer::Parameters observer;
+    foc::motor_id::Parameters motor_id;
+
+    board::motor::PWMParameters pwm;
+    unsigned fast_irq_to_main_irq_period_ratio = 2;
+
+    board::motor::Status hw_status;
+
+    /// Sinusoidal ripple of the inverter voltage, e.g. due to long battery leads; not applied by default
+    double vbus_ripple_amplitude = 0;       ///< Volt
+    double vbus_ripple_frequency = 0;       ///< Hertz
+
+    Setup()
+    {
+        plant.phi = 1.0e-3;
+        plant.rs = 0.1;
+        plant.ld = 28e-6;
+        plant.lq = 32e-6;
+        plant.num_pole_pairs = 7;
+        plant.inertia = 90e-6;
+        plant.viscous_friction = 1e-6;
+        plant.drag = 0.2e-6;
+        plant.dead_time_duty_loss = 80e-9 / 25e-6;
+
+        // The controller is given the exact model; the estimation errors are then caused by the controller itself
+        motor.num_poles = std::uint_fast8_t(plant.num_pole_pairs * 2U);
+        motor.max_current = 20.0F;
+        motor.min_current = 0.5F;
+        motor.spinup_current = 5.0F;
+        motor.phi = Scalar(plant.phi);
+        motor.rs = Scalar(plant.rs);
+        motor.ld = Scalar(plant.ld);
+        motor.lq = Scalar(plant.lq);
+
+        // The dead time compensation is configured as if it was calibrated by the hardware test
+        inverter.effective_dead_time_positive = 80e-9F;
+        inverter.effective_dead_time_negative = 80e-9F;
+
+        // 40 kHz PWM, see the driver for the derivation of the constraints
+        pwm.period = 25e-6F;
+        pwm.fast_irq_period = pwm.period;
+        pwm.dead_time = 100e-9F;
+        pwm.upper_limit = 0.95F;
+
+        hw_status.inverter_temperature = math::convertCelsiusToKelvin(25.0F);
+        hw_status.inverter_voltage = 14.8F;
+        hw_status.current_sensor_gain = 20.0F;
+        hw_status.power_ok = true;
+    }
+
+    Scalar getMainIRQPeriod() const { return pwm.fast_irq_period * Scalar(fast_irq_to_main_irq_period_ratio); }
+};
+
+/**
+ * Collects durations of repeated invocations and computes the order statistics.
+ */
+class DurationRecorder
+{
+    std::vector<double> samples_;
+    double overhead_ = 0;
+
+    using Clock = std::chrono::steady_clock;
+
+public:
+    DurationRecorder()
+    {
+        // Calibrating away the overhead of the clock itself
+        std::vector<double> calibration;
+        for (unsigned i = 0; i < 10000; i++)
+        {
+            const auto a = Clock::now();
+            const auto b = Clock::now();
+            calibration.push_back(std::chrono::duration<double, std::nano>(b - a).count());
+        }
+        std::sort(calibration.begin(), calibration.end());
+        overhead_ = calibration[calibration.size() / 2];
+    }
+
+    template <typename Callable>
+    auto measure(Callable&& callable)
+    {
+        const auto started_at = Clock::now();
+        struct Finalizer
+        {
+            DurationRecorder& recorder;
+            const Clock::time_point started_at;
+            ~Finalizer()
+            {
+                const double ns = std::chrono::duration<double, std::nano>(Clock::now() - started_at).count();
+                recorder.samples_.push_back(std::max(0.0, ns - recorder.overhead_));
+            }
+        } finalizer{*this, started_at};
+        return callable();
+    }
+
+    double getMean() const
+    {
+        double sum = 0;
+        for (auto x : samples_)
+        {
+            sum += x;
+        }
+        return samples_.empty() ? 0.0 : (sum / double(samples_.size()));
+    }
+
+    void print(const char* name) const
+    {
+        if (samples_.empty())
+        {
+            return;
+        }
+
+        auto sorted = samples_;
+        std::sort(sorted.begin(), sorted.end());
+
+        double sum = 0;
+        for (auto x : sorted)
+        {
+            sum += x;
+        }
+
+        const auto percentile = [&](double p) { return sorted[std::size_t(double(sorted.size() - 1U) * p)]; };
+
+        std::printf("%-28s %10zu %8.0f %8.0f %8.0f %8.0f\n",
+                    name, sorted.size(), sum / double(sorted.size()), percentile(0.5), percentile(0.99), sorted.back());
+    }
+
+    static void printHeader()
+    {
+        std::printf("%-28s %10s %8s %8s %8s %8s\n", "ns per call", "calls", "mean", "median", "p99", "max");
+    }
+};
+
+/**
+ * Runs the control loop against the plant. The timing of the IRQs is replicated:
+ * the phase currents are sampled in the middle of the PWM period, the new PWM setpoint is applied at the
+ * beginning of the next period, and the main IRQ is invoked immediately after every N-th fast IRQ.
+ */
+class Simulator
+{
+    const Setup& setup_;
+    sim::PMSMPlant plant_;
+    board::motor::PWMHandle pwm_handle_;
+    std::array<double, 3> pwm_setpoint_{};
+
+public:
+    explicit Simulator(const Setup& setup) :
+        setup_(setup),
+        plant_(setup.plant)
+    {
+        sim::configureDriver(setup.pwm, setup.hw_status);
+    }
+
+    /**
+     * @param duration      Simulated time, seconds.
+     * @param fast_irq      Signature: std::pair<Vector<3>, bool> (const Vector<2>& phase_currents_ab, Const vbus);
+     *                      the second element of the pair enables the PWM outputs.
+     * @param main_irq      Signature: bool (Const period), returns false to stop the simulation.
+     */
+    template <typename FastIRQ, typename MainIRQ>
+    void run(const double duration, FastIRQ fast_irq, MainIRQ main_irq)
+    {
+        const double half_period = double(setup_.pwm.fast_irq_period) * 0.5;
+        const double end_time = plant_.getTime() + duration;
+        unsigned main_irq_counter = 0;
+
+        // The voltage is held constant over each half period, which is adequate for ripple well below the PWM rate
+        const auto get_vbus = [this](const double time)
+        {
+            return double(setup_.hw_status.inverter_voltage) +
+                   setup_.vbus_ripple_amplitude * std::sin(2.0 * Pi * setup_.vbus_ripple_frequency * time);
+        };
+
+        while (plant_.getTime() < end_time)
+        {
+            plant_.step(half_period, pwm_setpoint_, get_vbus(plant_.getTime() + half_period * 0.5));
+
+            const auto ab = plant_.getPhaseCurrentsAB();
+            const Vector<2> phase_currents_ab{ Scalar(ab[0]), Scalar(ab[1]) };
+            sim::setPhaseCurrents(phase_currents_ab);
+
+            // Sampled synchronously with the phase currents, like on the real board
+            const auto output = fast_irq(phase_currents_ab, Scalar(get_vbus(plant_.getTime())));
+            if (output.second)
+            {
+                pwm_handle_.setPWM(output.first);
+            }
+            else
+            {
+                pwm_handle_.release();
+            }
+
+            plant_.step(half_period, pwm_setpoint_, get_vbus(plant_.getTime() + half_period * 0.5));
+
+            const auto new_setpoint = sim::getPWMSetpoint();
+            pwm_setpoint_ = { double(new_setpoint[0]), double(new_setpoint[1]), double(new_setpoint[2]) };
+
+            if (++main_irq_counter >= setup_.fast_irq_to_main_irq_period_ratio)
+            {
+                main_irq_counter = 0;
+                if (!main_irq(setup_.getMainIRQPeriod()))
+                {
+                    break;
+                }
+            }
+        }
+
+        pwm_handle_.release();
+        pwm_setpoint_ = {};
+    }
+
+    const sim::PMSMPlant& getPlant() const { return plant_; }
+    sim::PMSMPlant& getPlant() { return plant_; }
+};
+
+double normalizeAngle(double x)
+{
+    x = std::fmod(x + Pi, Pi * 2.0);
+    return ((x < 0) ? (x + Pi * 2.0) : x) - Pi;
+}
+
+double computeRMS(const std::vector<double>& samples)
+{
+    double sum = 0;
+    for (auto x : samples)
+    {
+        sum += x * x;
+    }
+    return samples.empty() ? 0.0 : std::sqrt(sum / double(samples.size()));
+}
+
+/**
+ * Inputs of the observer, recorded from a closed loop run for the replay benchmark.
+ */
+struct ObserverInput
+{
+    Scalar dt = 0;
+    Vector<2> idq = Vector<2>::Zero();
+    Vector<2> udq = Vector<2>::Zero();
+};
+
+struct SpinupCase
+{
+    const char* name;
+    foc::MotorRunner::Direction direction;
+    Scalar iq_setpoint;
+    double load_torque;
+    double inertia_multiplier;
+    double initial_electrical_angular_velocity;     ///< Nonzero if the rotor is windmilling before the start
+};
+
+const SpinupCase SpinupCases[] =
+{
+    { "prop fwd 8A",          foc::MotorRunner::Direction::Forward,  8.0F, 0.0,  1.0,     0.0 },
+    { "prop rev 8A",          foc::MotorRunner::Direction::Reverse,  8.0F, 0.0,  1.0,     0.0 },
+    { "prop fwd 3A",          foc::MotorRunner::Direction::Forward,  3.0F, 0.0,  1.0,     0.0 },
+    { "prop+load fwd 8A",     foc::MotorRunner::Direction::Forward,  8.0F, 0.02, 1.0,     0.0 },
+    { "heavy rotor fwd 8A",   foc::MotorRunner::Direction::Forward,  8.0F, 0.0,  3.0,     0.0 },
+    { "windmill fwd 8A",      foc::MotorRunner::Direction::Forward,  8.0F, 0.0,  1.0,  1500.0 },
+    { "windmill rev 8A",      foc::MotorRunner::Direction::Reverse,  8.0F, 0.0,  1.0, -1500.0 },
+    { "windmill slow fwd 8A", foc::MotorRunner::Direction::Forward,  8.0F, 0.0,  1.0,   300.0 },
+    { "windmill back fwd 8A", foc::MotorRunner::Direction::Forward,  8.0F, 0.0,  1.0,  -800.0 },
+};
+
+constexpr double SpinupCaseDuration = 2.5;
+constexpr double SteadyStateWindow = 0.5;
+constexpr double ConvergenceWindow = 0.1;
+
+const char* stateToString(foc::MotorRunner::State state)
+{
+    switch (state)
+    {
+    case foc::MotorRunner::State::Catching: return "Catching";
+    case foc::MotorRunner::State::Spinup:   return "Spinup";
+    case foc::MotorRunner::State::Running:  return "Running";
+    case foc::MotorRunner::State::Stopped:  return "Stopped";
+    case foc::MotorRunner::State::Stalled:  return "Stalled";
+    default:                                return "?";
+    }
+}
+
+void printSpinupCaseHeader()
+{
+    std::printf("%-20s %-8s %10s %12s %12s %11s %9s %11s\n",
+                "case", "state", "spinup ms", "conv ang deg", "rms ang deg", "rms spd %", "rms Iq A", "final w rad/s");
+}
+
+void runSpinupCase(const Setup& base_setup,
+                   const SpinupCase& cs,
+                   DurationRecorder& fast_irq_recorder,
+                   DurationRecorder& main_irq_recorder,
+                   std::vector<ObserverInput>* const out_observer_inputs)
+{
+    Setup setup = base_setup;
+    setup.plant.load_torque = cs.load_torque;
+    setup.plant.inertia *= cs.inertia_multiplier;
+
+    Simulator simulator(setup);
+    simulator.getPlant().setMechanicalAngularVelocity(cs.initial_electrical_angular_velocity /
+                                                      double(setup.plant.num_pole_pairs));
+
+    foc::MotorRunner runner(setup.controller, setup.motor, setup.observer, setup.inverter, setup.pwm, cs.direction);
+
+    const Scalar sign = (cs.direction == foc::MotorRunner::Direction::Reverse) ? -1.0F : 1.0F;
+
+    double running_since = -1;
+    std::vector<double> angle_errors_convergence;
+    std::vector<double> angle_errors_steady;
+    std::vector<double> speed_errors_steady;
+    std::vector<double> iq_errors_steady;
+
+    const auto fast_irq = [&](const Vector<2>& phase_currents_ab, Const vbus)
+    {
+        const Vector<3> pwm = fast_irq_recorder.measure([&]() {
+            return runner.updatePWMOutputsFromIRQ(phase_currents_ab, vbus);
+        });
+        return std::make_pair(pwm, runner.getState() == foc::MotorRunner::State::Catching ||
+                                   runner.getState() == foc::MotorRunner::State::Spinup ||
+                                   runner.getState() == foc::MotorRunner::State::Running);
+    };
+
+    const auto main_irq = [&](Const period)
+    {
+        if (out_observer_inputs != nullptr)
+        {
+            ObserverInput inp;
+            inp.dt = period;
+            inp.idq = runner.getIdq();
+            inp.udq = runner.getUdq();
+            out_observer_inputs->push_back(inp);
+        }
+
+        main_irq_recorder.measure([&]() { runner.updateStateEstimation(period, setup.hw_status); });
+
+        const auto& plant = simulator.getPlant();
+        const double time = plant.getTime();
+
+        if (runner.getState() == foc::MotorRunner::State::Running)
+        {
+            if (running_since < 0)
+            {
+                running_since = time;
+                runner.setSetpoint({ sign * cs.iq_setpoint, foc::MotorRunner::Setpoint::Mode::Iq });
+            }
+
+            const double angle_error = normalizeAngle(double(runner.getElectricalAngularPosition()) -
+                                                      plant.getElectricalAngularPosition());
+            if (time - running_since < ConvergenceWindow)
+            {
+                angle_errors_convergence.push_back(angle_error);
+            }
+            if (time > SpinupCaseDuration - SteadyStateWindow)
+            {
+                angle_errors_steady.push_back(angle_error);
+                speed_errors_steady.push_back((double(runner.getElectricalAngularVelocity()) -
+                                               plant.getElectricalAngularVelocity()) /
+                                              plant.getElectricalAngularVelocity());
+                iq_errors_steady.push_back(plant.getIq() - double(sign * cs.iq_setpoint));
+            }
+        }
+        return (runner.getState() == foc::MotorRunner::State::Catching) ||
+               (runner.getState() == foc::MotorRunner::State::Spinup) ||
+               (runner.getState() == foc::MotorRunner::State::Running);
+    };
+
+    simulator.run(SpinupCaseDuration, fast_irq, main_irq);
+
+    double max_convergence_error = 0;
+    for (auto x : angle_errors_convergence)
+    {
+        max_convergence_error = std::max(max_convergence_error, std::abs(x));
+    }
+
+    const auto rad2deg = [](double x) { return x * 180.0 / Pi; };
+
+    std::printf("%-20s %-8s %10.0f %12.1f %12.1f %11.2f %9.2f %11.0f\n",
+                cs.name,
+                stateToString(runner.getState()),
+                (running_since >= 0) ? (running_since * 1e3) : -1.0,
+                rad2deg(max_convergence_error),
+                rad2deg(computeRMS(angle_errors_steady)),
+                computeRMS(speed_errors_steady) * 100.0,
+                computeRMS(iq_errors_steady),
+                simulator.getPlant().getElectricalAngularVelocity());
+}
+
+void printIRQProfilerStatistics()
+{
+    using namespace board::irq_profiler;
+
+    std::printf("%-28s %10s %8s %8s\n", "IRQ profiler, ns (emulated)", "samples", "mean", "max");
+    for (unsigned i = 0; i < NumStages; i++)
+    {
+        const auto stats = getStatistics(Stage(i));
+        if (stats.num_samples > 0)
+        {
+            std::printf("%-28s %10u %8.0f %8.0f\n",
+                        getStageName(Stage(i)),
+                        unsigned(stats.num_samples),
+                        double(stats.getAverageDuration()) * 1e9,
+                        double(stats.getWorstDuration()) * 1e9);
+        }
+    }
+}
+
+void runSpinupScenario(const Setup& setup)
+{
+    std::printf("\n=== Spinup, %.1f s per case ===\n", SpinupCaseDuration);
+    std::printf("Convergence: max angle error within %.0f ms after the transition to Running;\n"
+                "steady state: RMS errors within the last %.0f ms.\n",
+                ConvergenceWindow * 1e3, SteadyStateWindow * 1e3);
+    printSpinupCaseHeader();
+
+    board::irq_profiler::reset();
+
+    DurationRecorder fast_irq_recorder;
+    DurationRecorder main_irq_recorder;
+
+    for (const auto& cs : SpinupCases)
+    {
+        runSpinupCase(setup, cs, fast_irq_recorder, main_irq_recorder, nullptr);
+    }
+
+    std::printf("\n");
+    DurationRecorder::printHeader();
+    fast_irq_recorder.print("updatePWMOutputsFromIRQ");
+    main_irq_recorder.print("updateStateEstimation");
+    std::printf("\n");
+    printIRQProfilerStatistics();
+}
+
+/**
+ * Runs the same spinup case with a rippling inverter voltage, with different configurations of the feed-forward
+ * compensation, see foc::InverterVoltageFeedForward.
+ */
+void runVbusRippleScenario(const Setup& base_setup)
+{
+    struct RippleCase
+    {
+        double frequency;
+        bool feedforward;
+        Scalar prediction_horizon;
+    };
+
+    static const RippleCase Cases[] =
+    {
+        {  300.0, false, 0.0F },
+        {  300.0, true,  0.0F },
+        {  300.0, true,  0.5F },
+        { 2000.0, false, 0.0F },
+        { 2000.0, true,  0.0F },
+        { 2000.0, true,  0.5F },
+        { 2000.0, true,  1.0F },
+    };
+
+    constexpr double RippleAmplitude = 1.5;
+
+    std::printf("\n=== Inverter voltage ripple %.1f V ===\n", RippleAmplitude);
+    printSpinupCaseHeader();
+
+    DurationRecorder fast_irq_recorder;
+    DurationRecorder main_irq_recorder;
+
+    for (const auto& rc : Cases)
+    {
+        Setup setup = base_setup;
+        setup.vbus_ripple_amplitude = RippleAmplitude;
+        setup.vbus_ripple_frequency = rc.frequency;
+        setup.inverter.vbus_feedforward = rc.feedforward;
+        setup.inverter.vbus_prediction_horizon = rc.prediction_horizon;
+
+        char name[32];
+        std::snprintf(name, sizeof(name), "%.0fHz ff %s %.1f", rc.frequency, rc.feedforward ? "on" : "off",
+                      double(rc.prediction_horizon));
+
+        SpinupCase cs = SpinupCases[0];
+        cs.name = name;
+        runSpinupCase(setup, cs, fast_irq_recorder, main_irq_recorder, nullptr);
+    }
+}
+
+/**
+ * Replays the inputs recorded from a closed loop run through all observer implementations.
+ */
+void runObserverScenario(const Setup& setup)
+{
+    constexpr unsigned MinNumUpdates = 500000;
+
+    std::printf("\n=== Observer ===\n%s\n", setup.observer.toString().c_str());
+
+    std::vector<ObserverInput> inputs;
+    {
+        DurationRecorder dummy_a;
+        DurationRecorder dummy_b;
+        printSpinupCaseHeader();
+        runSpinupCase(setup, SpinupCases[0], dummy_a, dummy_b, &inputs);
+    }
+
+    if (inputs.empty())
+    {
+        std::printf("Nothing recorded\n");
+        return;
+    }
+
+    const unsigned num_passes = (MinNumUpdates + unsigned(inputs.size()) - 1U) / unsigned(inputs.size());
+
+    const auto benchmark = [&](auto observer, const char* name)
+    {
+        std::vector<Scalar> angles;
+        angles.reserve(inputs.size());
+
+        double total_ns = 0;
+        for (unsigned pass = 0; pass < num_passes; pass++)
+        {
+            auto obs = observer;
+            obs.setDirectionConstraint(foc::observer::DirectionConstraint::Forward);
+
+            const auto started_at = std::chrono::steady_clock::now();
+            for (const auto& x : inputs)
+            {
+                obs.update(x.dt, x.idq, x.udq);
+                if (pass == 0)
+                {
+                    angles.push_back(obs.getAngularPosition());
+                }
+            }
+            total_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() -
+                                                                 started_at).count();
+        }
+
+        std::printf("%-28s %10zu %8.0f\n",
+                    name, inputs.size() * num_passes, total_ns / double(inputs.size() * num_passes));
+        return angles;
+    };
+
+    std::printf("%-28s %10s %8s\n", "ns per update", "updates", "mean");
+
+    const auto optimized = benchmark(foc::observer::Observer(setup.observer,
+                                                             setup.motor.phi,
+                                                             setup.motor.ld,
+                                                             setup.motor.lq,
+                                                             setup.motor.rs),
+                                     "Observer::update");
+
+    const auto reference = benchmark(foc::observer::ReferenceObserver(setup.observer,
+                                                                      setup.motor.phi,
+                                                                      setup.motor.ld,
+                                                                      setup.motor.lq,
+                                                                      setup.motor.rs),
+                                     "ReferenceObserver::update");
+
+    double max_discrepancy = 0;
+    for (std::size_t i = 0; i < optimized.size(); i++)
+    {
+        max_discrepancy = std::max(max_discrepancy,
+                                   std::abs(normalizeAngle(double(optimized[i]) - double(reference[i]))));
+    }
+    std::printf("Max angle discrepancy between the implementations: %.3f deg\n", max_discrepancy * 180.0 / Pi);
+
+    /*
+     * Only the timing is meaningful for the flux observer: the recorded inputs are in the frame of the EKF,
+     * whereas the flux observer runs in its own frame. Its accuracy is evaluated in closed loop instead,
+     * see the spinup scenario with --flux-observer.
+     */
+    (void) benchmark(foc::observer::FluxObserver(setup.observer,
+                                                 setup.motor.phi,
+                                                 setup.motor.ld,
+                                                 setup.motor.lq,
+                                                 setup.motor.rs),
+                     "FluxObserver::update");
+}
+
+/**
+ * Closed loop current control by foc::ThreePhaseVoltageModulator with the given Idq filter, using the true rotor
+ * angle; the rotor is free. Iq steps up from zero, then down, so the overshoot is measured on the first step.
+ */
+template <typename IdqFilter>
+void runIdqFilterCase(const Setup& setup,
+                      const char* name,
+                      Const crossover_frequency)
+{
+    constexpr double Duration = 0.1;
+    constexpr Scalar FirstStep = 5.0F;
+    constexpr Scalar SecondStep = -2.0F;
+
+    using Modulator = foc::ThreePhaseVoltageModulator<IdqFilter, foc::DeadTimeCompensationPolicy::Enabled>;
+
+    // Zero crossover frequency selects the default gains
+    Const wc = Scalar(2.0 * Pi) * crossover_frequency;
+    Modulator modulator(setup.motor.lq, setup.motor.rs, setup.motor.max_current, setup.pwm,
+                        wc * setup.motor.lq, wc * setup.motor.rs);
+    modulator.configureDeadTimeCompensation(setup.inverter.effective_dead_time_positive,
+                                            setup.inverter.effective_dead_time_negative,
+                                            setup.inverter.dead_time_compensation_transition_current);
+    modulator.configureInverterVoltageFeedForward(setup.inverter.vbus_feedforward,
+                                                  setup.inverter.vbus_prediction_horizon);
+
+    foc::IdqFilterConfig filter_config;
+    filter_config.cutoff_frequency = setup.controller.idq_filter_cutoff_frequency;
+    filter_config.notch_frequency = setup.controller.idq_notch_frequency;
+    filter_config.ld = setup.motor.ld;
+    filter_config.lq = setup.motor.lq;
+    filter_config.rs = setup.motor.rs;
+    filter_config.phi = setup.motor.phi;
+    modulator.configureIdqFilter(filter_config);
+
+    Simulator simulator(setup);
+    DurationRecorder recorder;
+
+    std::vector<double> Iq_errors;
+    double peak_Iq = 0;
+    double steady_state_error = 0;      // Averaged at the end of each step, so it includes the bias of the filter
+    unsigned num_steady_state_samples = 0;
+
+    simulator.run(Duration,
+        [&](const Vector<2>& phase_currents_ab, Const vbus) -> std::pair<Vector<3>, bool>
+        {
+            const auto& plant = simulator.getPlant();
+            const double time = plant.getTime();
+            const bool first = time < Duration * 0.5;
+            Const reference_Iq = first ? FirstStep : SecondStep;
+
+            const auto out = recorder.measure([&]()
+                {
+                    return modulator.onNextPWMPeriod(phase_currents_ab,
+                                                     vbus,
+                                                     Scalar(plant.getElectricalAngularVelocity()),
+                                                     Scalar(normalizeAngle(plant.getElectricalAngularPosition())),
+                                                     { reference_Iq, Modulator::Setpoint::Mode::Iq });
+                });
+
+            Iq_errors.push_back(plant.getIq() - double(reference_Iq));
+            if (first)
+            {
+                peak_Iq = std::max(peak_Iq, plant.getIq());
+            }
+            if (std::fmod(time, Duration * 0.5) > Duration * 0.4)
+            {
+                steady_state_error += std::abs(Iq_errors.back());
+                num_steady_state_samples++;
+            }
+
+            return { out.pwm_setpoint, true };
+        },
+        [](Const) { return true; });
+
+    char gains[16] = "default";
+    if (crossover_frequency > 0)
+    {
+        std::snprintf(gains, sizeof(gains), "%.0f Hz", double(crossover_frequency));
+    }
+
+    std::printf("%-28s %10s %12.3f %12.3f %12.1f %8.0f\n",
+                name,
+                gains,
+                computeRMS(Iq_errors),
+                steady_state_error / double(std::max(1U, num_steady_state_samples)),
+                (peak_Iq / double(FirstStep) - 1.0) * 100.0,
+                recorder.getMean());
+}
+
+void runIdqFilterScenario(const Setup& setup)
+{
+    std::printf("\n=== Idq filters, Iq steps %.0f A and %.0f A ===\n", 5.0, -2.0);
+    std::printf("%-28s %10s %12s %12s %12s %8s\n", "filter", "crossover", "rms Iq err A", "steady err A",
+                "overshoot %", "ns/call");
+
+    for (Scalar fc : { 0.0F, 1000.0F, 2000.0F, 3000.0F })
+    {
+        runIdqFilterCase<foc::IdqMovingAverageFilter<5>>(setup, "moving average 5", fc);
+        runIdqFilterCase<foc::IdqFirstOrderFilter>(setup, "first order", fc);
+        runIdqFilterCase<foc::IdqNotchFilter>(setup, "notch", fc);
+        runIdqFilterCase<foc::IdqDelayCompensatingObserver>(setup, "delay compensating observer", fc);
+    }
+
+    // The observer relies on the motor model, so it is also evaluated with the model errors
+    Setup mismatched_setup = setup;
+    mismatched_setup.motor.ld *= 1.3F;
+    mismatched_setup.motor.lq *= 1.3F;
+    mismatched_setup.motor.phi *= 1.1F;
+    mismatched_setup.motor.rs *= 0.8F;
+    for (Scalar fc : { 2000.0F, 3000.0F })
+    {
+        runIdqFilterCase<foc::IdqDelayCompensatingObserver>(mismatched_setup, "observer, L+30% phi+10%", fc);
+    }
+}
+
+/**
+ * Closed loop current control by foc::fixed_point::CurrentLoop using the true rotor angle, with the float chain
+ * evaluated on the same ADC samples alongside; the float chain is the same as in the firmware, but it does not
+ * drive the plant. The rotor is free, so the back EMF grows during the run.
+ */
+void runFixedPointScenario(const Setup& setup)
+{
+    constexpr double Duration = 0.3;
+    // Two 12-bit samples per IRQ, the current sensor offsets are at mid scale, 1 milliohm shunts
+    constexpr Scalar ADCVoltsPerCount = 3.3F / 4095.0F / 2.0F;
+    constexpr Scalar CurrentSensorZeroOffset = 1.65F;
+    constexpr Scalar ShuntResistance = 1e-3F;
+    constexpr std::uint16_t PWMTop = 2250;                  // Center aligned at 180 MHz
+
+    std::printf("\n=== Fixed point current loop, %.1f s ===\n", Duration);
+
+    Const amperes_per_volt = 1.0F / (ShuntResistance * setup.hw_status.current_sensor_gain);
+    Const vbus = setup.hw_status.inverter_voltage;
+
+    foc::CurrentPIController pi_d(setup.motor.lq, setup.motor.rs, setup.motor.max_current, setup.pwm.fast_irq_period);
+    foc::CurrentPIController pi_q(setup.motor.lq, setup.motor.rs, setup.motor.max_current, setup.pwm.fast_irq_period);
+
+    foc::fixed_point::CurrentLoop::Configuration config;
+    config.adc_volts_per_count = ADCVoltsPerCount;
+    config.current_sensor_zero_offsets = { CurrentSensorZeroOffset, CurrentSensorZeroOffset };
+    config.current_sensor_amperes_per_volt = amperes_per_volt;
+    config.full_scale_current = pi_q.getFullScaleCurrent();
+    config.proportional_gain = pi_q.getProportionalGain();
+    config.integral_gain = pi_q.getIntegralGain();
+    config.pwm_top = PWMTop;
+
+    foc::fixed_point::CurrentLoop loop;
+    loop.configure(config, vbus);
+
+    Simulator simulator(setup);
+
+    DurationRecorder fixed_point_recorder;
+    DurationRecorder float_recorder;
+
+    double max_Idq_discrepancy = 0;
+    double max_Udq_discrepancy = 0;
+    int max_ccr_discrepancy = 0;
+    std::vector<double> Iq_errors;
+
+    Scalar reference_Iq = 0;
+
+    simulator.run(Duration,
+        [&](const Vector<2>& phase_currents_ab, Const) -> std::pair<Vector<3>, bool>
+        {
+            const double time = simulator.getPlant().getTime();
+            // Steps in both directions
+            reference_Iq = (time < Duration * 0.4) ? 5.0F : ((time < Duration * 0.7) ? -2.0F : 10.0F);
+            loop.setReference(0.0F, reference_Iq);
+
+            std::array<std::uint32_t, 2> adc_sums{};
+            for (unsigned i = 0; i < 2; i++)
+            {
+                Const volts = CurrentSensorZeroOffset + phase_currents_ab[int(i)] / amperes_per_volt;
+                adc_sums[i] = std::uint32_t(std::lround(volts / ADCVoltsPerCount));
+            }
+
+            const auto angle = normalizeAngle(simulator.getPlant().getElectricalAngularPosition());
+            const auto angle_sincos = math::sincos(math::normalizeAngle(Scalar(angle)));
+
+            const auto fixed = fixed_point_recorder.measure([&]()
+                {
+                    return loop.update(adc_sums, foc::fixed_point::packSinCos(angle_sincos));
+                });
+
+            std::array<std::uint16_t, 3> float_ccr{};
+            Vector<2> float_Idq;
+            Vector<2> float_Udq;
+            float_recorder.measure([&]()
+                {
+                    // Same arithmetic as in the board driver
+                    Vector<2> currents;
+                    for (unsigned i = 0; i < 2; i++)
+                    {
+                        currents[int(i)] = (Scalar(adc_sums[i]) * ADCVoltsPerCount - CurrentSensorZeroOffset) *
+                                           amperes_per_volt;
+                    }
+
+                    float_Idq = foc::performParkTransform(foc::performClarkeTransform(currents), angle_sincos);
+                    float_Udq[0] = pi_d.computeVoltage(0.0F, float_Idq[0], vbus);
+                    float_Udq[1] = pi_q.computeVoltage(reference_Iq, float_Idq[1], vbus);
+
+                    const auto pwm =
+                        foc::performSpaceVectorTransform(foc::performInverseParkTransform(float_Udq, angle_sincos),
+                                                         vbus).first;
+                    for (unsigned i = 0; i < 3; i++)
+                    {
+                        float_ccr[i] = std::uint16_t(std::min(1.0F, std::max(0.0F, pwm[int(i)])) * Scalar(PWMTop) +
+                                                     0.4F);
+                    }
+                });
+
+            const Vector<2> fixed_Idq(foc::fixed_point::fromQ15(foc::fixed_point::getLow(fixed.Idq)),
+                                      foc::fixed_point::fromQ15(foc::fixed_point::getHigh(fixed.Idq)));
+            const Vector<2> fixed_Udq(foc::fixed_point::fromQ15(foc::fixed_point::getLow(fixed.Udq)),
+                                      foc::fixed_point::fromQ15(foc::fixed_point::getHigh(fixed.Udq)));
+
+            max_Idq_discrepancy = std::max(max_Idq_discrepancy,
+                                           double((fixed_Idq * config.full_scale_current - float_Idq)
+                                                  .cwiseAbs().maxCoeff()));
+            max_Udq_discrepancy = std::max(max_Udq_discrepancy,
+                                           double((fixed_Udq * vbus - float_Udq).cwiseAbs().maxCoeff()));
+
+            Vector<3> duty_cycles;
+            for (unsigned i = 0; i < 3; i++)
+            {
+                max_ccr_discrepancy = std::max(max_ccr_discrepancy, std::abs(int(fixed.ccr[i]) - int(float_ccr[i])));
+                duty_cycles[int(i)] = Scalar(fixed.ccr[i]) / Scalar(PWMTop);
+            }
+
+            Iq_errors.push_back(simulator.getPlant().getIq() - double(reference_Iq));
+
+            return { duty_cycles, true };
+        },
+        [](Const) { return true; });
+
+    // Skipping the transient of the first step
+    Iq_errors.erase(Iq_errors.begin(), Iq_errors.begin() + std::ptrdiff_t(Iq_errors.size() / 10U));
+
+    std::printf("Max discrepancy from the float chain: Idq %.4f A, Udq %.4f V, compare value %d counts\n",
+                max_Idq_discrepancy, max_Udq_discrepancy, max_ccr_discrepancy);
+    std::printf("Iq tracking error RMS %.3f A, including the reference steps\n", computeRMS(Iq_errors));
+    std::printf("Final speed %.0f rad/s electrical\n\n", simulator.getPlant().getElectricalAngularVelocity());
+
+    DurationRecorder::printHeader();
+    fixed_point_recorder.print("fixed_point::CurrentLoop");
+    float_recorder.print("Float chain");
+}
+
+constexpr double MaxMotorIdentificationDuration = 300.0;
+
+/// Relative standard error for the fast identification cases, see foc::motor_id::Parameters
+constexpr Scalar FastMotorIdentificationTolerance = 0.005F;
+
+void runMotorIdentificationCase(const Setup& base_setup,
+                                const foc::motor_id::Mode mode,
+                                Const convergence_tolerance,
+                                const char* name)
+{
+    Setup setup = base_setup;
+    setup.motor_id.convergence_tolerance = convergence_tolerance;
+    if (mode == foc::motor_id::Mode::RotationWithoutMechanicalLoad)
+    {
+        // No propeller, but the bearings are not ideal; the identification relies on the rotor losing synchronism
+        setup.plant.drag = 0;
+        setup.plant.load_torque = 2e-3;
+    }
+
+    foc::TaskContext context;
+    context.params.controller = setup.controller;
+    context.params.inverter = setup.inverter;
+    context.params.observer = setup.observer;
+    context.params.motor_id = setup.motor_id;
+    context.params.motor.num_poles = setup.motor.num_poles;
+    context.params.motor.max_current = setup.motor.max_current;
+    context.board.pwm = setup.pwm;
+    context.board.limits = board::motor::getLimits();
+
+    Simulator simulator(setup);
+
+    foc::motor_id::MotorIdentificationTask task(context, mode);
+    foc::ITask::Result result;
+    double sim_time = 0;
+
+    simulator.run(MaxMotorIdentificationDuration,
+                  [&](const Vector<2>& phase_currents_ab, Const vbus)
+                  {
+                      return task.onNextPWMPeriod(phase_currents_ab, vbus);
+                  },
+                  [&](Const period)
+                  {
+                      sim_time += double(period);
+                      result = task.onMainIRQ(period, setup.hw_status);
+                      return !result.finished;
+                  });
+
+    task.applyResultToGlobalContext(context);
+    const auto& m = context.params.motor;
+    const auto& p = setup.plant;
+
+    const auto error = [](Const estimate, double truth) { return (double(estimate) - truth) / truth * 100.0; };
+
+    char phi_error[16] = "-";
+    if (mode != foc::motor_id::Mode::Static)
+    {
+        std::snprintf(phi_error, sizeof(phi_error), "%.1f", error(m.phi, p.phi));
+    }
+
+    // The tuned crossover frequency of the current loop, see foc::motor_id::CurrentLoopTask
+    const auto& c = context.params.controller;
+    char current_loop_bandwidth[16] = "-";
+    if (c.current_loop_kp > 0)
+    {
+        std::snprintf(current_loop_bandwidth, sizeof(current_loop_bandwidth), "%.0f",
+                      double(c.current_loop_kp / m.lq) / (2.0 * Pi));
+    }
+
+    std::printf("%-20s %-9s %6.1f %10.1f %10.1f %10.1f %10s %10s\n",
+                name,
+                !result.finished ? "Timeout" : ((result.exit_code == 0) ? "OK" : "Failed"),
+                sim_time,
+                error(m.rs, p.rs),
+                error(m.ld, p.ld),
+                error(m.lq, p.lq),
+                phi_error,
+                current_loop_bandwidth);
+
+    if (result.finished && (result.exit_code != 0))
+    {
+        std::printf("Exit code %u\n", unsigned(result.exit_code));
+    }
+}
+
+void runMotorIdentificationScenario(const Setup& setup)
+{
+    std::printf("\n=== Motor identification ===\n");
+    std::printf("%-20s %-9s %6s %10s %10s %10s %10s %10s\n", "mode", "result", "time s", "Rs err %", "Ld err %",
+                "Lq err %", "Phi err %", "CL Fc Hz");
+    runMotorIdentificationCase(setup, foc::motor_id::Mode::Static, 0.0F, "static");
+    runMotorIdentificationCase(setup, foc::motor_id::Mode::RotationWithoutMechanicalLoad, 0.0F, "rotation");
+    runMotorIdentificationCase(setup, foc::motor_id::Mode::Static, FastMotorIdentificationTolerance, "static fast");
+    runMotorIdentificationCase(setup, foc::motor_id::Mode::RotationWithoutMechanicalLoad,
+                               FastMotorIdentificationTolerance, "rotation fast");
+}
+
+bool parseDiagonal(const char* arg, const char* prefix, Scalar* out, int size)
+{
+    const auto len = std::strlen(prefix);
+    if (std::strncmp(arg, prefix, len) != 0)
+    {
+        return false;
+    }
+
+    arg += len;
+    for (int i = 0; i < size; i++)
+    {
+        char* end = nullptr;
+        out[i] = std::strtof(arg, &end);
+        if (end == arg)
+        {
+            std::fprintf(stderr, "Invalid value: %s\n", arg);
+            std::exit(1);
+        }
+        arg = (*end == ',') ? (end + 1) : end;
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    Setup setup;
+
+    bool run_spinup = false;
+    bool run_observer = false;
+    bool run_motor_id = false;
+    bool run_fixed_point = false;
+    bool run_vbus_ripple = false;
+    bool run_idq_filter = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* const arg = argv[i];
+        Scalar q[4] = {};
+        Scalar r[2] = {};
+
+        if      (std::strcmp(arg, "spinup") == 0)   { run_spinup = true; }
+        else if (std::strcmp(arg, "observer") == 0) { run_observer = true; }
+        else if (std::strcmp(arg, "motor_id") == 0) { run_motor_id = true; }
+        else if (std::strcmp(arg, "fixed_point") == 0) { run_fixed_point = true; }
+        else if (std::strcmp(arg, "vbus_ripple") == 0) { run_vbus_ripple = true; }
+        else if (std::strcmp(arg, "idq_filter") == 0) { run_idq_filter = true; }
+        else if (parseDiagonal(arg, "--observer-q=", q, 4))
+        {
+            setup.observer.Q = math::makeDiagonalMatrix(q[0], q[1], q[2], q[3]);
+        }
+        else if (parseDiagonal(arg, "--observer-r=", r, 2))
+        {
+            setup.observer.R = math::makeDiagonalMatrix(r[0], r[1]);
+        }
+        else if (std::strcmp(arg, "--flux-observer") == 0)
+        {
+            setup.observer.flux_observer_at_cruise = true;
+        }
+        else
+        {
+            std::fprintf(stderr,
+                         "Usage: %s [spinup] [observer] [motor_id] [fixed_point] [vbus_ripple] [idq_filter] "
+                         "[--observer-q=Q0,Q1,Q2,Q3] [--observer-r=R0,R1] [--flux-observer]\n",
+                         argv[0]);
+            return 1;
+        }
+    }
+
+    if (!run_spinup && !run_observer && !run_motor_id && !run_fixed_point && !run_vbus_ripple && !run_idq_filter)
+    {
+        run_spinup = run_observer = run_motor_id = run_fixed_point = run_vbus_ripple = run_idq_filter = true;
+    }
+
+    if (!setup.observer.isValid())
+    {
+        std::fprintf(stderr, "Invalid observer parameters\n");
+        return 1;
+    }
+
+    std::printf("Motor:\n%s\n", setup.motor.toString().c_str());
+
+    if (run_spinup)
+    {
+        runSpinupScenario(setup);
+    }
+    if (run_observer)
+    {
+        runObserverScenario(setup);
+    }
+    if (run_motor_id)
+    {
+        runMotorIdentificationScenario(setup);
+    }
+    if (run_fixed_point)
+    {
+        runFixedPointScenario(setup);
+    }
+    if (run_vbus_ripple)
+    {
+        runVbusRippleScenario(setup);
+    }
+    if (run_idq_filter)
+    {
+        runIdqFilterScenario(setup);
+    }
+
+    return 0;
+}
@@ -0,0 +1,234 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <array>
+#include <algorithm>
+#include <cmath>
+
+
+namespace sim
+{
+/**
+ * Averaged model of a permanent magnet synchronous motor fed by an ideal three-phase inverter, in the rotor frame.
+ * The switching ripple is not modeled, i.e. the phase voltages are the PWM duty cycles times the bus voltage,
+ * less the voltage lost during the dead time, which depends on the polarity of the phase current.
+ * The model is integrated in double precision using RK4, so it does not share the numeric errors of the firmware.
+ * Model:
+ *      dId/dt = (Ud - Rs Id + We Lq Iq) / Ld
+ *      dIq/dt = (Uq - Rs Iq - We Ld Id - We Phi) / Lq
+ *      T      = 3/2 Pp (Phi Iq + (Ld - Lq) Id Iq)
+ *      dWm/dt = (T - B Wm - Kd Wm |Wm| - Tload) / J
+ *      dTe/dt = We = Pp Wm
+ * All units are SI units (Weber, Henry, Ohm, Volt, Second, Radian).
+ */
+class PMSMPlant
+{
+public:
+    struct Parameters
+    {
+        double phi = 0;                 ///< Field flux linkage
+        double rs = 0;                  ///< Phase resistance
+        double ld = 0;                  ///< Direct axis inductance
+        double lq = 0;                  ///< Quadrature axis inductance
+        unsigned num_pole_pairs = 0;
+        double inertia = 0;             ///< Rotor and load, kg m^2
+        double viscous_friction = 0;    ///< N m s
+        double drag = 0;                ///< Propeller-like load, N m s^2
+        double load_torque = 0;         ///< Constant load opposing the rotation, N m
+        double dead_time_duty_loss = 0; ///< Effective dead time divided by the PWM period
+    };
+
+private:
+    static constexpr double Pi = 3.14159265358979323846;
+    static constexpr double SquareRootOf3 = 1.73205080756887729353;
+    static constexpr double DeadTimeTransitionCurrent = 0.5;   ///< Same as the default compensation setting
+
+    // Id, Iq, mechanical angular velocity, electrical angular position
+    using State = std::array<double, 4>;
+
+    const Parameters params_;
+    State x_{};
+    double time_ = 0;
+
+    State computeDerivative(const State& x, const double ud, const double uq) const
+    {
+        const double id = x[0];
+        const double iq = x[1];
+        const double wm = x[2];
+        const double we = wm * double(params_.num_pole_pairs);
+
+        const double torque = 1.5 * double(params_.num_pole_pairs) *
+                              (params_.phi * iq + (params_.ld - params_.lq) * id * iq);
+
+        const double friction = params_.viscous_friction * wm + params_.drag * wm * std::abs(wm);
+
+        // Static load does not reverse the rotor once it has stopped
+        double load = 0;
+        if (std::abs(wm) > 1e-3)
+        {
+            load = std::copysign(params_.load_torque, wm);
+        }
+        else if (std::abs(torque) > params_.load_torque)
+        {
+            load = std::copysign(params_.load_torque, torque);
+        }
+        else
+        {
+            load = torque;
+        }
+
+        return {
+            (ud - params_.rs * id + we * params_.lq * iq) / params_.ld,
+            (uq - params_.rs * iq - we * params_.ld * id - we * params_.phi) / params_.lq,
+            (torque - friction - load) / params_.inertia,
+            we
+        };
+    }
+
+    void integrate(const double dt, const double ualpha, const double ubeta)
+    {
+        const auto advance = [](const State& x, const State& dx, const double h)
+        {
+            State out;
+            for (unsigned i = 0; i < out.size(); i++)
+            {
+                out[i] = x[i] + dx[i] * h;
+            }
+            return out;
+        };
+
+        // The voltage vector is fixed in the stator frame, so it rotates in the rotor frame during the step
+        const auto derivative = [&](const State& x)
+        {
+            const double c = std::cos(x[3]);
+            const double s = std::sin(x[3]);
+            return computeDerivative(x, ualpha * c + ubeta * s, -ualpha * s + ubeta * c);
+        };
+
+        const State k1 = derivative(x_);
+        const State k2 = derivative(advance(x_, k1, dt * 0.5));
+        const State k3 = derivative(advance(x_, k2, dt * 0.5));
+        const State k4 = derivative(advance(x_, k3, dt));
+
+        for (unsigned i = 0; i < x_.size(); i++)
+        {
+            x_[i] += (k1[i] + 2.0 * k2[i] + 2.0 * k3[i] + k4[i]) * (dt / 6.0);
+        }
+
+        x_[3] = std::fmod(x_[3], Pi * 2.0);
+        if (x_[3] < 0)
+        {
+            x_[3] += Pi * 2.0;
+        }
+
+        time_ += dt;
+    }
+
+public:
+    explicit PMSMPlant(const Parameters& params) :
+        params_(params)
+    { }
+
+    /**
+     * Advances the model by the specified time interval, during which the PWM setpoint stays constant.
+     * The interval is split into substeps that are short compared to the electrical time constant.
+     * @param duration          Seconds.
+     * @param pwm_setpoint      Duty cycles of the phases A, B, C, in [0, 1]; zeros mean that the inverter is off,
+     *                          in which case the phase currents decay through the body diodes (approximated).
+     * @param inverter_voltage  Volts.
+     */
+    void step(const double duration,
+              const std::array<double, 3>& pwm_setpoint,
+              const double inverter_voltage)
+    {
+        const bool active = (pwm_setpoint[0] > 0) || (pwm_setpoint[1] > 0) || (pwm_setpoint[2] > 0);
+
+        const double time_constant = std::min(params_.ld, params_.lq) / params_.rs;
+        const unsigned num_substeps = unsigned(std::ceil(duration / (time_constant * 0.05))) + 1U;
+        const double dt = duration / double(num_substeps);
+
+        for (unsigned i = 0; i < num_substeps; i++)
+        {
+            if (active)
+            {
+                // The current through the low side switch during the dead time raises the phase voltage
+                const auto ab = getPhaseCurrentsAB();
+                const std::array<double, 3> phase_currents{ ab[0], ab[1], -ab[0] - ab[1] };
+                std::array<double, 3> duty = pwm_setpoint;
+                for (unsigned k = 0; k < duty.size(); k++)
+                {
+                    const double polarity = std::max(-1.0, std::min(1.0, phase_currents[k] / DeadTimeTransitionCurrent));
+                    duty[k] -= polarity * params_.dead_time_duty_loss;
+                }
+
+                const double& a = duty[0];
+                const double& b = duty[1];
+                const double& c = duty[2];
+                integrate(dt,
+                          (a - (b + c) * 0.5) * inverter_voltage * (2.0 / 3.0),
+                          (b - c) * inverter_voltage / SquareRootOf3);
+            }
+            else
+            {
+                // The windings are disconnected; the back EMF is assumed to stay below the bus voltage
+                integrate(dt, 0.0, 0.0);
+                x_[0] = 0;
+                x_[1] = 0;
+            }
+        }
+    }
+
+    /**
+     * Phase currents A and B, Amperes.
+     */
+    std::array<double, 2> getPhaseCurrentsAB() const
+    {
+        const double c = std::cos(x_[3]);
+        const double s = std::sin(x_[3]);
+        const double alpha = x_[0] * c - x_[1] * s;
+        const double beta  = x_[0] * s + x_[1] * c;
+        return { alpha, (beta * SquareRootOf3 - alpha) * 0.5 };
+    }
+
+    /**
+     * Sets the initial state of a rotor that is already spinning, e.g. windmilling, in mechanical rad/s.
+     */
+    void setMechanicalAngularVelocity(const double wm) { x_[2] = wm; }
+
+    double getId() const { return x_[0]; }
+    double getIq() const { return x_[1]; }
+
+    double getElectricalAngularVelocity() const { return x_[2] * double(params_.num_pole_pairs); }
+
+    double getElectricalAngularPosition() const { return x_[3]; }
+
+    double getTime() const { return time_; }
+
+    const Parameters& getParameters() const { return params_; }
+};
+
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Host replacement of the CMSIS/HAL definitions used by the motor control core.
+ * The DWT cycle counter is emulated from the host monotonic clock scaled to the MCU core frequency,
+ * and the PRIMASK register is a plain variable, which is adequate because the simulation is single threaded.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#define STM32_SYSCLK            180000000U
+
+namespace sim
+{
+
+std::uint32_t readEmulatedCycleCounter();
+
+extern std::uint32_t g_emulated_primask;
+
+}
+
+struct DWT_Type
+{
+    struct CycleCounter
+    {
+        operator std::uint32_t() const { return sim::readEmulatedCycleCounter(); }
+    } CYCCNT;
+};
+
+extern DWT_Type* const DWT;
+
+inline std::uint32_t __get_PRIMASK() { return sim::g_emulated_primask; }
+inline void __disable_irq()          { sim::g_emulated_primask = 1; }
+inline void __enable_irq()           { sim::g_emulated_primask = 0; }
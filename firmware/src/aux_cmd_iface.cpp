@@ -74,14 +74,14 @@ class Thread : public chibios_rt::BaseStaticThread<2048>
     void doLoadMotorParams(unsigned db_index) const
     {
         const auto entry = motor_database::getByIndex(db_index);
-        log(uavcan_node::LogLevel::INFO, "MotorDB selected '%s'", entry.name.c_str());
+        log(uavcan_node::LogLevel::INFO, "MotorDB selected '%s'", entry.name);
 
         params::writeMotorParameters(entry.parameters);
     }
 
-    void doHardwareTest() const
+    void doHardwareTest(foc::hw_test::Mode mode) const
     {
-        foc::beginHardwareTest();
+        foc::beginHardwareTest(mode);
         while (foc::isHardwareTestInProgress())
         {
             waitFor(0.01F);
@@ -89,6 +89,14 @@ class Thread : public chibios_rt::BaseStaticThread<2048>
         const auto report = foc::getHardwareTestReport();
         log(report.isSuccessful() ? uavcan_node::LogLevel::INFO : uavcan_node::LogLevel::WARNING,
             "HW test result: %s", report.toString().c_str());
+
+        if (report.isSuccessful() && report.getDeadTimeCalibration().available)
+        {
+            auto inverter_params = foc::getParameters().inverter;
+            inverter_params.effective_dead_time_positive = report.getDeadTimeCalibration().effective_dead_time_positive;
+            inverter_params.effective_dead_time_negative = report.getDeadTimeCalibration().effective_dead_time_negative;
+            params::writeInverterParameters(inverter_params);
+        }
     }
 
     void doMotorID(foc::motor_id::Mode mode) const
@@ -100,8 +108,8 @@ class Thread : public chibios_rt::BaseStaticThread<2048>
             return;
         }
 
-        // Hardware testing
-        doHardwareTest();
+        // Hardware testing; the dead time is not needed here, so the quick test is sufficient
+        doHardwareTest(foc::hw_test::Mode::Quick);
 
         if (!foc::getHardwareTestReport().isSuccessful() ||
             !foc::isInactive())
@@ -122,6 +130,7 @@ class Thread : public chibios_rt::BaseStaticThread<2048>
         const auto result = foc::getMotorParameters();
         g_logger.println("Motor params:\n%s", result.toString().c_str());
         params::writeMotorParameters(result);
+        params::writeControllerParameters(foc::getParameters().controller);
     }
 
     void execute(const int cmd)
@@ -153,7 +162,7 @@ class Thread : public chibios_rt::BaseStaticThread<2048>
         }
         else if (cmd == CmdHardwareTest)
         {
-            doHardwareTest();
+            doHardwareTest(foc::hw_test::Mode::Full);
         }
         else if (cmd == CmdMotorIDStatic)
         {
@@ -156,6 +156,22 @@ os::watchdog::Timer init(unsigned watchdog_timeout_msec,
     return wdt;
 }
 
+BaseChannel* getStdIOChannel()
+{
+    return reinterpret_cast<BaseChannel*>(&STDOUT_SD);
+}
+
+void setStdIOBaudRate(std::uint32_t baudrate)
+{
+    static SerialConfig config;
+    config = SerialConfig();
+    config.speed = (baudrate > 0) ? baudrate : SERIAL_DEFAULT_BITRATE;
+    config.cr2 = USART_CR2_STOP1_BITS;
+
+    sdStop(&STDOUT_SD);
+    sdStart(&STDOUT_SD, &config);
+}
+
 __attribute__((noreturn))
 void die(int reason)
 {
@@ -201,6 +217,55 @@ HardwareVersion detectHardwareVersion()
     return v;
 }
 
+namespace
+{
+/// IWDG register keys, see the reference manual
+constexpr std::uint32_t IWDGKeyReload = 0xAAAA;
+constexpr std::uint32_t IWDGKeyUnlock = 0x5555;
+
+/// 32 kHz / 64 * 4096 = 8.2 seconds
+constexpr std::uint32_t IWDGExtendedPrescaler = 4;
+constexpr std::uint32_t IWDGExtendedReload    = 0xFFF;
+
+void reconfigureIWDG(std::uint32_t prescaler, std::uint32_t reload)
+{
+    while ((IWDG->SR & (IWDG_SR_PVU | IWDG_SR_RVU)) != 0)
+    {
+        ;   // The previous update is still in progress, the registers cannot be written yet
+    }
+
+    IWDG->KR  = IWDGKeyUnlock;
+    IWDG->PR  = prescaler;
+    IWDG->RLR = reload;
+
+    while ((IWDG->SR & (IWDG_SR_PVU | IWDG_SR_RVU)) != 0)
+    {
+        ;   // The new values take effect at the next reload only after the update is complete
+    }
+
+    IWDG->KR = IWDGKeyReload;
+}
+
+}
+
+WatchdogTimeoutExtender::WatchdogTimeoutExtender()
+{
+    while ((IWDG->SR & (IWDG_SR_PVU | IWDG_SR_RVU)) != 0)
+    {
+        ;   // The registers read back the old values until the update is complete
+    }
+
+    original_prescaler_ = IWDG->PR;
+    original_reload_    = IWDG->RLR;
+
+    reconfigureIWDG(IWDGExtendedPrescaler, IWDGExtendedReload);
+}
+
+WatchdogTimeoutExtender::~WatchdogTimeoutExtender()
+{
+    reconfigureIWDG(original_prescaler_, original_reload_);
+}
+
 void setRGBLED(const RGB& rgb)
 {
     constexpr unsigned Multiplier = 0xFFFF;
@@ -43,6 +43,17 @@ namespace board
 os::watchdog::Timer init(unsigned watchdog_timeout_msec,
                          os::config::IStorageBackend& cfg_backend);
 
+/**
+ * Returns the serial channel that is used for stdio; useful for binary output.
+ */
+BaseChannel* getStdIOChannel();
+
+/**
+ * Reconfigures the baud rate of the stdio serial port; zero restores the default.
+ * Data that has not been transmitted yet may be lost.
+ */
+void setStdIOBaudRate(std::uint32_t baudrate);
+
 /**
  * Triggers an OS panic with the specified reason code printed into the serial console.
  */
@@ -135,6 +146,22 @@ struct RAIIToggler
     ~RAIIToggler() { Target(false); }
 };
 
+/**
+ * Extends the hardware watchdog timeout to about 8 seconds while the object exists, restoring it afterwards.
+ * This is needed for the flash erase and write operations: the CPU is stalled while the flash is busy, and
+ * erasing a 128K sector takes up to 2 s typically and up to 4 s at the worst case, which exceeds the normal timeout.
+ * The watchdog is reloaded on entry and on exit, so the software watchdog timers are not checked at these points.
+ */
+class WatchdogTimeoutExtender
+{
+    std::uint32_t original_prescaler_;
+    std::uint32_t original_reload_;
+
+public:
+    WatchdogTimeoutExtender();
+    ~WatchdogTimeoutExtender();
+};
+
 /**
  * Measures time intervals starting from the point it was created.
  * The class uses the DWT counter, so the maximum duration it can measure is very limited.
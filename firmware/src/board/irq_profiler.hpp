@@ -0,0 +1,222 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "motor.hpp"
+#include <zubax_chibios/util/heapless.hpp>
+#include <cstdint>
+#include <array>
+
+
+namespace board
+{
+/**
+ * Cycle-accurate profiling of the motor control IRQ hot path.
+ * Every stage accumulates the number of invocations, the total and the worst number of cycles, and a histogram.
+ * The overhead is a couple of DWT reads and a few increments per stage, so it is always enabled.
+ */
+namespace irq_profiler
+{
+/**
+ * The list of instrumentation points.
+ * Stages of the fast IRQ are listed first, then those of the main IRQ.
+ */
+enum class Stage : std::uint8_t
+{
+    ClarkePark,                 ///< Fast IRQ: angle extrapolation, Clarke and Park transforms, Idq filtering
+    CurrentPI,                  ///< Fast IRQ: current PI controllers, cross coupling compensation, Udq limiting
+    SVM,                        ///< Fast IRQ: inverse Park transform, SVM, dead time compensation
+    SetPWM,                     ///< Fast IRQ: conversion to timer ticks and timer register update
+    Observer,                   ///< Main IRQ: state observer update
+    StateUpdate,                ///< Main IRQ: state update and publication for the fast IRQ
+    Setpoint,                   ///< Main IRQ: setpoint computation
+    Command,                    ///< Setpoint command delivery from the posting thread to the main IRQ
+    NumStages_
+};
+
+constexpr unsigned NumStages = unsigned(Stage::NumStages_);
+
+/**
+ * Returns a short human-readable name of the stage, no longer than 4 characters.
+ */
+const char* getStageName(Stage stage);
+
+/**
+ * Per-stage statistics.
+ * Histogram buckets are spaced logarithmically: the bucket N contains samples in the range [2^(N+5), 2^(N+6))
+ * cycles, except for the first and the last buckets, which also contain everything below and above, respectively.
+ * The first bucket is [0, 2^6) cycles; the last one (N = 13) has no upper bound, it starts at 2^18 cycles.
+ * At 180 MHz, the first bucket covers everything below 0.36 us, and the last one everything from 1.46 ms up.
+ */
+struct Statistics
+{
+    static constexpr unsigned NumHistogramBuckets = 14;
+    static constexpr unsigned FirstBucketLog2 = 6;
+
+    std::uint32_t num_samples = 0;
+    std::uint32_t worst_cycles = 0;
+    std::uint64_t total_cycles = 0;
+    std::array<std::uint32_t, NumHistogramBuckets> histogram{};
+
+    void registerSample(const std::uint32_t cycles)
+    {
+        num_samples++;
+        total_cycles += cycles;
+        if (cycles > worst_cycles)
+        {
+            worst_cycles = cycles;
+        }
+
+        // CLZ is a single-cycle instruction on Cortex-M4
+        const unsigned log2 = (cycles > 0) ? (31U - unsigned(__builtin_clz(cycles))) : 0U;
+        const unsigned index = (log2 < FirstBucketLog2) ? 0U : (log2 - FirstBucketLog2 + 1U);
+        histogram[(index < NumHistogramBuckets) ? index : (NumHistogramBuckets - 1U)]++;
+    }
+
+    static float convertCyclesToSeconds(const std::uint64_t cycles)
+    {
+        return float(double(cycles) / double(STM32_SYSCLK));
+    }
+
+    /**
+     * Returns the lower bound of the specified histogram bucket in cycles.
+     */
+    static std::uint32_t getBucketLowerBoundCycles(const unsigned index)
+    {
+        return (index == 0) ? 0U : (1U << (index + FirstBucketLog2 - 1U));
+    }
+
+    float getAverageDuration() const
+    {
+        return (num_samples > 0) ? (convertCyclesToSeconds(total_cycles) / float(num_samples)) : 0.0F;
+    }
+
+    float getWorstDuration() const { return convertCyclesToSeconds(worst_cycles); }
+};
+
+/**
+ * Implementation details, do not use directly.
+ */
+class Storage_
+{
+    static std::array<Statistics, NumStages> stats_;
+
+public:
+    static void registerSample(const Stage stage, const std::uint32_t cycles)
+    {
+        stats_[unsigned(stage)].registerSample(cycles);
+    }
+
+    static Statistics get(const Stage stage)
+    {
+        motor::AbsoluteCriticalSectionLocker locker;
+        return stats_[unsigned(stage)];
+    }
+
+    static void reset()
+    {
+        for (auto& x : stats_)
+        {
+            motor::AbsoluteCriticalSectionLocker locker;
+            x = Statistics();
+        }
+    }
+};
+
+/**
+ * Measures sequential stages of a pipeline. Each call to @ref mark() registers the time spent since the
+ * previous call (or since construction) for the specified stage. Usage:
+ *      StageMeasurer measurer;
+ *      doFirstThing();
+ *      measurer.mark(Stage::First);
+ *      doSecondThing();
+ *      measurer.mark(Stage::Second);
+ */
+class StageMeasurer
+{
+    std::uint32_t started_at_ = DWT->CYCCNT;
+
+public:
+    void mark(const Stage stage)
+    {
+        const std::uint32_t now = DWT->CYCCNT;
+        Storage_::registerSample(stage, now - started_at_);
+        started_at_ = now;
+    }
+};
+
+/**
+ * Registers the time spent since construction until destruction for the specified stage.
+ * The scoped measurer must be declared BEFORE the object whose lifetime is being measured, e.g. a locker.
+ */
+template <Stage S>
+class ScopedStageMeasurer
+{
+    const std::uint32_t started_at_ = DWT->CYCCNT;
+
+public:
+    ~ScopedStageMeasurer()
+    {
+        Storage_::registerSample(S, DWT->CYCCNT - started_at_);
+    }
+};
+
+/**
+ * Returns the current value of the cycle counter, for use with @ref registerInterval().
+ */
+inline std::uint32_t getCycleCount()
+{
+    return DWT->CYCCNT;
+}
+
+/**
+ * Registers the time elapsed since the specified cycle count for the specified stage.
+ * This is useful for intervals that begin and end in different contexts, e.g. a thread and an IRQ.
+ * Must be invoked from the IRQ context.
+ */
+inline void registerInterval(const Stage stage, const std::uint32_t started_at)
+{
+    Storage_::registerSample(stage, DWT->CYCCNT - started_at);
+}
+
+/**
+ * Returns a consistent copy of the statistics of the specified stage.
+ * Can be invoked from any context.
+ */
+inline Statistics getStatistics(const Stage stage)
+{
+    return Storage_::get(stage);
+}
+
+/**
+ * Resets the statistics of all stages.
+ */
+inline void reset()
+{
+    Storage_::reset();
+}
+
+}
+}
@@ -28,8 +28,10 @@
 #include <algorithm>
 #include <functional>
 #include <numeric>
+#include <cmath>
 #include <cassert>
 #include "motor_board_features.hpp"
+#include "irq_profiler.hpp"
 
 
 namespace board
@@ -41,12 +43,60 @@ namespace
 /*
  * Driver configuration
  */
-constexpr unsigned SamplesPerADCPerIRQ = 2;
+#ifndef BOARD_MOTOR_ADC_SAMPLES_PER_IRQ
+# define BOARD_MOTOR_ADC_SAMPLES_PER_IRQ        2
+#endif
+
+#ifndef BOARD_MOTOR_ADC_MODE
+# define BOARD_MOTOR_ADC_MODE                   0
+#endif
+
+/**
+ * Each ADC performs this many conversions per fast IRQ, the results are averaged (oversampling).
+ * More samples reduce noise, but increase the sampling window, which limits the maximum PWM duty cycle.
+ */
+constexpr unsigned SamplesPerADCPerIRQ = BOARD_MOTOR_ADC_SAMPLES_PER_IRQ;
+
+/**
+ * ADC operating mode, selected at compile time via BOARD_MOTOR_ADC_MODE.
+ * See @ref initADC() for details.
+ */
+enum class ADCMode
+{
+    Independent,                        ///< 0 - each ADC has its own DMA stream (default)
+    Simultaneous,                       ///< 1 - triple regular simultaneous mode, one interleaved DMA buffer
+    SimultaneousDoubleBuffered          ///< 2 - same as above, the DMA fills one half while the IRQ reads the other
+};
+
+constexpr ADCMode TheADCMode = ADCMode(BOARD_MOTOR_ADC_MODE);
+
+constexpr bool IsADCSimultaneousModeUsed = TheADCMode != ADCMode::Independent;
+
+static_assert((TheADCMode == ADCMode::Independent) ||
+              (TheADCMode == ADCMode::Simultaneous) ||
+              (TheADCMode == ADCMode::SimultaneousDoubleBuffered), "Invalid ADC mode");
 
 /**
- * Some voltage samples will be re-used from the previous period of the fast IRQ.
+ * In the simultaneous mode the temperature is sampled as the last conversion of the regular sequence,
+ * so the sequence is one conversion longer. The regular sequence cannot be longer than 16 conversions.
  */
-constexpr unsigned InverterVoltageSampleBufferLength = 2 * SamplesPerADCPerIRQ;
+constexpr unsigned ADCRegularSequenceLength = SamplesPerADCPerIRQ + (IsADCSimultaneousModeUsed ? 1U : 0U);
+
+static_assert((SamplesPerADCPerIRQ >= 1) && (ADCRegularSequenceLength <= 16), "Invalid number of ADC samples per IRQ");
+
+static_assert(!(HasPhaseCCurrentSensor && IsADCSimultaneousModeUsed),
+              "Phase C current sensor is supported only in the independent ADC mode");
+
+/**
+ * The inverter voltage is converted in the same sequence as the phase currents, so that the application receives
+ * a sample taken at the same point of the PWM period every time, see @ref handleFastIRQ().
+ */
+constexpr unsigned InverterVoltageSampleBufferLength = SamplesPerADCPerIRQ;
+
+/**
+ * The simultaneous mode DMA buffer contains this many ADC sequences; the DMA controller wraps around it.
+ */
+constexpr unsigned ADCSimultaneousModeNumBlocks = (TheADCMode == ADCMode::SimultaneousDoubleBuffered) ? 2 : 1;
 
 constexpr unsigned FastIRQPriority = 0;
 constexpr unsigned MainIRQPriority = 1;
@@ -54,23 +104,52 @@ constexpr unsigned MainIRQPriority = 1;
 static_assert(FastIRQPriority < MainIRQPriority, "Fast IRQ must be able to preempt the main IRQ");
 static_assert(MainIRQPriority < CORTEX_PRIORITY_SVCALL, "Main IRQ must be able to preempt the RTOS");
 
+/**
+ * The fast IRQ cannot run more often than this. If the PWM frequency is higher, the ADC measurements and the PWM
+ * updates will be performed every N-th PWM period, where N is the smallest integer that satisfies this limit.
+ */
+constexpr float FastIRQMaxFrequency = 80e3F;
+
 /**
  * The true period of the main IRQ will be as close as possible to this value, but never less than it.
+ *
+ * This is a time budget for the main IRQ, which is dominated by the observer update, and it includes the time
+ * the main IRQ spends preempted by the fast IRQ. The sparse observer (see foc::observer::Observer) performs a
+ * fraction of the floating point operations of the dense one, but the budget is kept at the value that was
+ * established for the latter until a smaller one is backed by measurements on the target (see irq_profiler.hpp).
+ * At the highest fast IRQ rate, the main IRQ runs every fourth fast IRQ.
+ *
+ * The budget is verified at run time: the IRQ budget monitor (see foc/irq_budget.hpp) counts the periods where
+ * the main IRQ has exceeded 90% of its period and sheds load if that happens often; the counters and the worst
+ * case load are reported by the CLI command "status". Re-check these figures whenever the main IRQ grows.
  */
 constexpr float MainIRQMinPeriod = 50e-6F;
 
-constexpr float InverterVoltageInnovationWeight = 0.1F;         ///< Has to account for possible aliasing effect
-constexpr float TemperatureInnovationWeight     = 0.001F;       ///< The input is noisy, high damping is necessary
+static_assert((MainIRQMinPeriod * FastIRQMaxFrequency) > 2.0F,
+              "The main IRQ must span more than two fast IRQ periods, otherwise the preemption eats the budget");
+
+constexpr float InverterVoltageInnovationWeight          = 0.1F;     ///< The ripple is removed from the reported value
+constexpr float InverterVoltageRippleInnovationWeight    = 0.001F;   ///< Mean square deviation from the above
+constexpr unsigned InverterVoltageRippleWindowLength     = 4096;     ///< Fast IRQ periods per peak-to-peak update
+constexpr float TemperatureInnovationWeight              = 0.001F;   ///< The input is noisy, high damping is necessary
 
 /*
  * Hardware-defined parameters
  */
 constexpr unsigned TIM1ClockFrequency = STM32_TIMCLK2;
 
+/**
+ * ADC clock is PCLK2/4; every conversion takes 3 sampling cycles plus 12 conversion cycles.
+ * The fixed part accounts for the trigger latency and settling time.
+ */
+constexpr float ADCConversionDuration = 15.0F / (float(STM32_PCLK2) / 4.0F);
+constexpr float ADCSamplingWindowFixedPart = 1.7e-6F;
+
 constexpr unsigned PhaseACurrentChannelIndex    = 13;
 constexpr unsigned PhaseBCurrentChannelIndex    = 12;
 constexpr unsigned InverterVoltageChannelIndex  = 11;
 constexpr unsigned TemperatureChannelIndex      = 10;
+constexpr unsigned PhaseCCurrentChannelIndex    = 14;           ///< PC4, not connected on the Pixhawk ESC v1.6
 
 os::Logger g_logger("Motor HW Driver");
 
@@ -86,11 +165,36 @@ std::uint16_t g_dma_buffer_phase_a_current[SamplesPerADCPerIRQ];
 volatile std::uint32_t g_canary_c = CanaryValue;
 std::uint16_t g_dma_buffer_phase_b_current[SamplesPerADCPerIRQ];
 volatile std::uint32_t g_canary_d = CanaryValue;
+std::uint16_t g_dma_buffer_phase_c_current[SamplesPerADCPerIRQ];
+volatile std::uint32_t g_canary_g = CanaryValue;
+
+/**
+ * Simultaneous mode DMA buffer.
+ * Each conversion of the regular sequence yields one triplet, the DMA controller stores them in the order of ADC index:
+ * ADC1 (inverter voltage or temperature), ADC2 (phase A), ADC3 (phase B).
+ */
+struct ADCSampleTriplet
+{
+    std::uint16_t inverter_voltage;
+    std::uint16_t phase_a_current;
+    std::uint16_t phase_b_current;
+};
+
+typedef ADCSampleTriplet ADCSampleBlock[ADCRegularSequenceLength];
+
+static_assert(sizeof(ADCSampleTriplet) == 6, "Unexpected padding");
+
+volatile std::uint32_t g_canary_e = CanaryValue;
+ADCSampleBlock g_dma_buffer_simultaneous[IsADCSimultaneousModeUsed ? ADCSimultaneousModeNumBlocks : 1];
+volatile std::uint32_t g_canary_f = CanaryValue;
+
+/// In the simultaneous mode, the temperature samples are obtained from the fast IRQ
+volatile std::uint16_t g_simultaneous_mode_temperature_sample;
 
 /*
  * Configuration parameters
  */
-constexpr math::Range<> PWMFrequencyRangeKHz(40.0F,  80.0F);
+constexpr math::Range<> PWMFrequencyRangeKHz(40.0F, 160.0F);
 constexpr math::Range<> PWMDeadTimeRangeNSec(50.0F, 500.0F);
 
 os::config::Param<float> g_config_pwm_frequency_khz ("drv.pwm_freq_khz", 0.0F, 0.0F, PWMFrequencyRangeKHz.max);
@@ -101,10 +205,23 @@ os::config::Param<float> g_config_pwm_dead_time_nsec("drv.pwm_deadt_ns", 0.0F, 0
  */
 PWMParameters g_pwm_params;
 
+/// The content of the TIM1 ARR register when the carrier phase is not being slewed
+std::uint16_t g_nominal_pwm_reload_value;
+
+/// Average change of ARR per fast IRQ, in [-1, 1]; written by the threads, see @ref setCarrierPhaseSlewRate()
+float g_carrier_period_trim_rate;
+float g_carrier_period_trim_accumulator;        ///< Owned by the fast IRQ
+
 unsigned g_fast_irq_to_main_irq_period_ratio;
 
 math::Vector<2> g_phase_currents = math::Vector<2>::Zero();     ///< Most recent phase currents measurement
 
+/**
+ * Index of the phase that had the highest duty cycle during the most recent ADC sampling, hence the narrowest
+ * low side sampling window. Used only if there is a phase C current sensor.
+ */
+unsigned g_phase_with_highest_duty_cycle = 2;
+
 /// Sometimes referred to as VBAT (ideally it should be volatile)
 float g_inverter_voltage;
 
@@ -120,14 +237,18 @@ class IRQTimingStatistics
 
     float worst_duration_ = 0;
     float smoothed_duration_ = 0;
+    float last_duration_ = 0;
 
 public:
     void updateWithNewMeasurement(const float duration)
     {
+        last_duration_ = duration;
         worst_duration_ = std::max(worst_duration_, duration);
         smoothed_duration_ += SmoothingInnovationWeight * (duration - smoothed_duration_);
     }
 
+    float getLastDuration() const { return last_duration_; }
+
     auto toString() const
     {
         float worst = 0;
@@ -162,10 +283,51 @@ public:
 IRQTimingStatistics g_irq_timing_stat_fast;
 IRQTimingStatistics g_irq_timing_stat_main;
 
+/**
+ * Deviation of the synchronously sampled inverter voltage from its low-pass filtered value.
+ * The peak-to-peak value is latched once per window, so that it can be read at any time.
+ * Updated from the fast IRQ.
+ */
+class InverterVoltageRippleStatistics
+{
+    float mean_square_ = 0;
+    float window_min_ = 0;
+    float window_max_ = 0;
+    float peak_to_peak_ = 0;
+    unsigned window_counter_ = 0;
+
+public:
+    void update(const float deviation)
+    {
+        mean_square_ += InverterVoltageRippleInnovationWeight * (deviation * deviation - mean_square_);
+
+        window_min_ = std::min(window_min_, deviation);
+        window_max_ = std::max(window_max_, deviation);
+
+        if (++window_counter_ >= InverterVoltageRippleWindowLength)
+        {
+            peak_to_peak_ = window_max_ - window_min_;
+            window_min_ = window_max_ = deviation;
+            window_counter_ = 0;
+        }
+    }
+
+    float getRMS() const { return std::sqrt(mean_square_); }
+
+    float getPeakToPeak() const { return peak_to_peak_; }
+};
+
+InverterVoltageRippleStatistics g_inverter_voltage_ripple;
+
+std::uint32_t g_main_irq_lost_period_count;             ///< Written by the fast IRQ
+
 
 void initPWM(const double pwm_frequency,
-             const double pwm_dead_time)
+             const double pwm_dead_time,
+             const unsigned fast_irq_decimation_ratio)
 {
+    assert(fast_irq_decimation_ratio >= 1);
+
     {
         AbsoluteCriticalSectionLocker locker;
 
@@ -174,10 +336,19 @@ void initPWM(const double pwm_frequency,
         RCC->APB2RSTR &= ~RCC_APB2RSTR_TIM1RST;
     }
 
-    TIM1->CR1 = TIM_CR1_CMS_0;
+    // ARR is preloaded because it is trimmed at run time, see updateCarrierPeriodTrim()
+    TIM1->CR1 = TIM_CR1_CMS_0 | TIM_CR1_ARPE;
 
-    // MMS - output event on CCR4 match
-    TIM1->CR2 = TIM_CR2_MMS_2 | TIM_CR2_MMS_1 | TIM_CR2_MMS_0 | TIM_CR2_CCUS | TIM_CR2_CCPC;
+    if (fast_irq_decimation_ratio == 1)
+    {
+        // MMS - output event on CCR4 match
+        TIM1->CR2 = TIM_CR2_MMS_2 | TIM_CR2_MMS_1 | TIM_CR2_MMS_0 | TIM_CR2_CCUS | TIM_CR2_CCPC;
+    }
+    else
+    {
+        // MMS - output event on update; the update event rate is reduced by the repetition counter, see below
+        TIM1->CR2 = TIM_CR2_MMS_1 | TIM_CR2_CCUS | TIM_CR2_CCPC;
+    }
 
     // Channels 1, 2, 3 are used for PWM phases A, B, C, respectively
     // Channel 4 is used for synchronization with TIM8, so CCR4 must be always 0
@@ -199,6 +370,7 @@ void initPWM(const double pwm_frequency,
     assert(pwm_cycle_ticks > 100);                      // The lower limit is an arbitrarily selected lowest sane value
 
     TIM1->ARR = pwm_cycle_ticks - 1U;
+    g_nominal_pwm_reload_value = std::uint16_t(pwm_cycle_ticks - 1U);
 
     // Configuring dead time
     auto dead_time_ticks = std::uint16_t(pwm_dead_time * double(TIM1ClockFrequency) + 0.5);
@@ -216,6 +388,19 @@ void initPWM(const double pwm_frequency,
     g_logger.println("PWM cycle %u ticks, dead time %u ticks", pwm_cycle_ticks, dead_time_ticks);
 
     TIM1->CR1 |= TIM_CR1_CEN;
+
+    /*
+     * In the decimated mode, the update event is generated once per N carrier periods (two counter under/overflows
+     * per period), hence the new PWM values are loaded at the beginning of each fast IRQ period only, and the
+     * synchronization timer is reset at the same moment.
+     * Per the RM, in the center-aligned mode the repetition counter must be written after the timer is launched,
+     * otherwise the update event will be generated on overflow rather than underflow.
+     */
+    if (fast_irq_decimation_ratio > 1)
+    {
+        TIM1->RCR = fast_irq_decimation_ratio * 2U - 1U;
+    }
+
     TIM1->EGR = TIM_EGR_COMG | TIM_EGR_UG;
 
     // Freezing configuration
@@ -226,7 +411,7 @@ void initPWM(const double pwm_frequency,
 }
 
 
-void initSynchronizationTimer()
+void initSynchronizationTimer(const unsigned fast_irq_decimation_ratio)
 {
     {
         AbsoluteCriticalSectionLocker locker;
@@ -246,6 +431,10 @@ void initSynchronizationTimer()
      *  1. All phases are shorted; by Kirchhoff's rule, the sum of the phase currents will be zero.
      *  2. Phases which currents we measure are shorted to the ground, guaranteeing that the currents will flow
      *     through the current sensors.
+     *
+     * In the decimated mode, TIM8 is reset by the TIM1 update event once per N carrier periods, and its period is
+     * extended N times, so that the ADC is triggered only at the top of the first carrier period of each fast IRQ
+     * period. This leaves almost N periods for processing before the next update event.
      */
     TIM8->CR1 = TIM_CR1_CMS_0;
 
@@ -259,12 +448,12 @@ void initSynchronizationTimer()
     // The output MUST BE enabled in order for synchronization to work!
     TIM8->CCER = TIM_CCER_CC1E;
 
-    // Same ARR
-    TIM8->ARR = TIM1->ARR;
+    // Same ARR, or N times longer in the decimated mode
+    TIM8->ARR = TIM1->ARR * fast_irq_decimation_ratio;
     assert((TIM8->ARR > 0) && (TIM8->ARR < 0xFFFF));    // Making sure it's initialized indeed
 
     // Configuring the ADC trigger point - at the middle of the PWM period, when all phases are at the LOW level
-    TIM8->CCR1 = TIM8->ARR - 1U;
+    TIM8->CCR1 = TIM1->ARR - 1U;
     assert(TIM8->CCR1 < TIM8->ARR);
 
     // Explicitly ensuring that IRQ are disabled. We use the TIM8 CC IRQ vector for the main IRQ handler, but we
@@ -302,6 +491,26 @@ void initSynchronizationTimer()
 }
 
 
+/**
+ * Fills the regular sequence registers SQR1..SQR3 of the specified ADC.
+ * The channel is converted SamplesPerADCPerIRQ times, then, if the sequence is longer, the last channel follows.
+ */
+void configureADCRegularSequence(ADC_TypeDef* const adc, const unsigned channel, const unsigned last_channel)
+{
+    std::uint32_t sqr[3] = {};          // SQR3 - conversions 1 to 6, SQR2 - 7 to 12, SQR1 - 13 to 16
+
+    for (unsigned i = 0; i < ADCRegularSequenceLength; i++)
+    {
+        const unsigned ch = (i < SamplesPerADCPerIRQ) ? channel : last_channel;
+        sqr[i / 6U] |= ch << ((i % 6U) * 5U);
+    }
+
+    adc->SQR3 = sqr[0];
+    adc->SQR2 = sqr[1];
+    adc->SQR1 = sqr[2] | ((ADCRegularSequenceLength - 1U) << 20);      // Sequence length is identical for all ADC
+}
+
+
 void initADC()
 {
     {
@@ -313,29 +522,44 @@ void initADC()
     }
 
     /*
-     * Enabling all three ADC in independent mode with DMA.
-     * We could use multi-ADC simulatenous mode as well, but it brings no benefit and only increases complexity.
-     * Besides, the documentation provided for multi-ADC mode is scarce at best.
-     *
+     * By default, all three ADC are running in independent mode with DMA.
      * ADCs are running independently, but they all are triggered by the same source and perform identical
      * number of conversions, so despite the independent mode they still operate quasi synchronously. This
      * allows us to use only one IRQ - that of ADC1 - to handle all conversions.
-     *
      * If there is need, it is also possible to configure different sampling modes per ADC - the advantage of
      * independent mode.
+     *
+     * Optionally, the ADCs can be configured in triple regular simultaneous mode (see BOARD_MOTOR_ADC_MODE).
+     * In this mode ADC2 and ADC3 are slaves of ADC1, so the phase currents and the inverter voltage are sampled
+     * at exactly the same instants. The results are moved by a single DMA stream from the common data register into
+     * one interleaved buffer, which is cheaper to process in the IRQ than three separate buffers. Since the sequences
+     * must be identical in length, the temperature is sampled by ADC1 as the last regular conversion instead of
+     * the injected group; the other ADCs perform a dummy conversion of their own channels at the same time.
      */
-    ADC->CCR = ADC_CCR_ADCPRE_0;                        // Prescaler
+    if (IsADCSimultaneousModeUsed)
+    {
+        constexpr unsigned MultiModeTripleRegularSimultaneous = 0b10110;
+        ADC->CCR = ADC_CCR_ADCPRE_0 |                   // Prescaler
+                   MultiModeTripleRegularSimultaneous |
+                   ADC_CCR_DMA_0 |                      // DMA mode 1 - one half-word per request, ADC1, ADC2, ADC3
+                   ADC_CCR_DDS;                         // Continuous DMA requests
+    }
+    else
+    {
+        ADC->CCR = ADC_CCR_ADCPRE_0;                    // Prescaler
+    }
 
     ADC1->CR1 = ADC_CR1_SCAN |  ADC_CR1_EOCIE;          // Only ADC1 can generate interrupts
     ADC2->CR1 = ADC_CR1_SCAN;
     ADC3->CR1 = ADC_CR1_SCAN;
 
     // ADC triggering: RISING EDGE on TIM8 CC1
+    // In the simultaneous mode, only the master ADC is triggered externally, and the DMA is managed via CCR
     constexpr unsigned ExtSel = 0b1101;
     constexpr unsigned CR2 = ADC_CR2_EXTEN_0 | (ExtSel << 24) | ADC_CR2_DDS | ADC_CR2_DMA;
-    ADC1->CR2 = CR2;
-    ADC2->CR2 = CR2;
-    ADC3->CR2 = CR2;
+    ADC1->CR2 = IsADCSimultaneousModeUsed ? (ADC_CR2_EXTEN_0 | (ExtSel << 24)) : CR2;
+    ADC2->CR2 = IsADCSimultaneousModeUsed ? 0 : CR2;
+    ADC3->CR2 = IsADCSimultaneousModeUsed ? 0 : CR2;
 
     /*
      * We're using 3 ticks per sample for all channels.
@@ -365,31 +589,35 @@ void initADC()
 
     /*
      * Initializing the sequences. ADC assignment is as follows:
-     *  ADC     Regular Mode            Injected Mode
-     *  -------------------------------------------------------------
-     *  ADC1    inverter voltage        inverter temperature
-     *  ADC2    phase current A         nothing
-     *  ADC3    phase current B         nothing
+     *  ADC     Regular Mode                        Injected Mode
+     *  -------------------------------------------------------------------------------------
+     *  ADC1    inverter voltage                    inverter temperature (independent mode)
+     *          + temperature (simultaneous mode)
+     *  ADC2    phase current A                     nothing
+     *  ADC3    phase current B                     nothing
+     *
+     * If there is a phase C current sensor, ADC1 samples it in the regular mode instead of the inverter voltage,
+     * and the inverter voltage is moved into the injected group before the temperature.
      */
-    static_assert(SamplesPerADCPerIRQ <= 6, "SQR2 and SQR1 initialization must be updated");
-
-    constexpr unsigned SQR1 = (SamplesPerADCPerIRQ - 1) << 20;          // Sequence length is identical for all ADC
-    ADC1->SQR1 = SQR1;
-    ADC2->SQR1 = SQR1;
-    ADC3->SQR1 = SQR1;
-
-    static constexpr auto fill_sqr = [](unsigned ch)
-        {
-            return (ch << 0) | (ch << 5) | (ch << 10) | (ch << 15) | (ch << 20) | (ch << 25);
-        };
-
-    ADC1->SQR3 = fill_sqr(InverterVoltageChannelIndex);
-    ADC2->SQR3 = fill_sqr(PhaseACurrentChannelIndex);           // ADC2 phase A
-    ADC3->SQR3 = fill_sqr(PhaseBCurrentChannelIndex);           // ADC3 phase B
+    configureADCRegularSequence(ADC1,
+                                HasPhaseCCurrentSensor ? PhaseCCurrentChannelIndex : InverterVoltageChannelIndex,
+                                TemperatureChannelIndex);
+    configureADCRegularSequence(ADC2, PhaseACurrentChannelIndex,   PhaseACurrentChannelIndex);
+    configureADCRegularSequence(ADC3, PhaseBCurrentChannelIndex,   PhaseBCurrentChannelIndex);
 
     // Configuring injected channels
-    ADC1->JSQR = TemperatureChannelIndex << 15;                 // Temperature
-    ADC1->CR1 |= ADC_CR1_JAUTO;                                 // Perform automatic injected conversions after regular
+    if (HasPhaseCCurrentSensor)
+    {
+        ADC1->JSQR = (1U << 20) |                               // Two conversions, JSQ3 and JSQ4
+                     (InverterVoltageChannelIndex << 10) |      // Inverter voltage --> JDR1
+                     (TemperatureChannelIndex << 15);           // Temperature --> JDR2
+        ADC1->CR1 |= ADC_CR1_JAUTO;
+    }
+    else if (!IsADCSimultaneousModeUsed)
+    {
+        ADC1->JSQR = TemperatureChannelIndex << 15;             // Temperature
+        ADC1->CR1 |= ADC_CR1_JAUTO;                             // Perform automatic injected conversions after regular
+    }
 
     /*
      * Configuring DMA - three channels.
@@ -429,26 +657,38 @@ void initADC()
                          DMA_SxCR_EN;
         };
 
-    // DMA2 Stream 0 - ADC1
-    configure_dma(DMA2_Stream0,
-                  &ADC1->DR,
-                  &g_dma_buffer_inverter_voltage[0],
-                  InverterVoltageSampleBufferLength,
-                  0);
-
-    // DMA2 Stream 2 - ADC2
-    configure_dma(DMA2_Stream2,
-                  &ADC2->DR,
-                  &g_dma_buffer_phase_a_current[0],
-                  SamplesPerADCPerIRQ,
-                  1);
-
-    // DMA2 Stream 1 - ADC3
-    configure_dma(DMA2_Stream1,
-                  &ADC3->DR,
-                  &g_dma_buffer_phase_b_current[0],
-                  SamplesPerADCPerIRQ,
-                  2);
+    if (IsADCSimultaneousModeUsed)
+    {
+        // DMA2 Stream 0 - common data register of ADC1/2/3; the other streams are not used
+        configure_dma(DMA2_Stream0,
+                      &ADC->CDR,
+                      &g_dma_buffer_simultaneous[0][0],
+                      sizeof(g_dma_buffer_simultaneous) / sizeof(std::uint16_t),
+                      0);
+    }
+    else
+    {
+        // DMA2 Stream 0 - ADC1
+        configure_dma(DMA2_Stream0,
+                      &ADC1->DR,
+                      HasPhaseCCurrentSensor ? &g_dma_buffer_phase_c_current[0] : &g_dma_buffer_inverter_voltage[0],
+                      HasPhaseCCurrentSensor ? SamplesPerADCPerIRQ : InverterVoltageSampleBufferLength,
+                      0);
+
+        // DMA2 Stream 2 - ADC2
+        configure_dma(DMA2_Stream2,
+                      &ADC2->DR,
+                      &g_dma_buffer_phase_a_current[0],
+                      SamplesPerADCPerIRQ,
+                      1);
+
+        // DMA2 Stream 1 - ADC3
+        configure_dma(DMA2_Stream1,
+                      &ADC3->DR,
+                      &g_dma_buffer_phase_b_current[0],
+                      SamplesPerADCPerIRQ,
+                      2);
+    }
 
     // Everything is configured, enabling ADC
     ADC1->CR2 |= ADC_CR2_ADON;
@@ -494,6 +734,36 @@ inline void setRawPWM(const std::uint16_t a, const std::uint16_t b, const std::u
 }
 
 
+/**
+ * Shifts the phase of the carrier by writing ARR one tick above or below the nominal value for some of the fast IRQ
+ * periods, distributing them evenly in the manner of a sigma-delta modulator.
+ * The new value is loaded at the next update event; the phase shift is 2 ticks per carrier period.
+ * Either way the synchronization timer is reset by TIM1, so the ADC trigger follows the carrier.
+ */
+inline void updateCarrierPeriodTrim()
+{
+    g_carrier_period_trim_accumulator += g_carrier_period_trim_rate;
+
+    int trim = 0;
+    if (g_carrier_period_trim_accumulator >= 0.5F)
+    {
+        trim = 1;
+        g_carrier_period_trim_accumulator -= 1.0F;
+    }
+    else if (g_carrier_period_trim_accumulator <= -0.5F)
+    {
+        trim = -1;
+        g_carrier_period_trim_accumulator += 1.0F;
+    }
+    else
+    {
+        ;   // Nominal period
+    }
+
+    TIM1->ARR = std::uint16_t(int(g_nominal_pwm_reload_value) + trim);
+}
+
+
 inline void checkInvariants()
 {
     assert((ADC->CSR & (ADC_CSR_DOVR1 | ADC_CSR_DOVR2 | ADC_CSR_DOVR3)) == 0);                  // ADC overrun
@@ -507,11 +777,74 @@ inline void checkInvariants()
     (void) g_canary_a;
     (void) g_canary_b;
     (void) g_canary_c;
-    (void) g_canary_d;                                                                           // Bad DMA writes
+    (void) g_canary_d;
+    (void) g_canary_e;
+    (void) g_canary_f;
+    (void) g_canary_g;                                                                           // Bad DMA writes
     assert((g_canary_a == CanaryValue) &&
            (g_canary_b == CanaryValue) &&
            (g_canary_c == CanaryValue) &&
-           (g_canary_d == CanaryValue));
+           (g_canary_d == CanaryValue) &&
+           (g_canary_e == CanaryValue) &&
+           (g_canary_f == CanaryValue) &&
+           (g_canary_g == CanaryValue));
+}
+
+
+/**
+ * The sum of the phase currents is zero, so only two of them are needed.
+ * If all three are measured, the phase that had the highest duty cycle is reconstructed from the other two,
+ * because its low side sampling window was the narrowest.
+ */
+inline math::Vector<2> reconstructPhaseCurrentsAB(const math::Vector<2>& ab)
+{
+    return ab;
+}
+
+inline math::Vector<2> reconstructPhaseCurrentsAB(const math::Vector<3>& abc)
+{
+    switch (g_phase_with_highest_duty_cycle)
+    {
+    case 0:
+    {
+        return { -abc[1] - abc[2], abc[1] };
+    }
+    case 1:
+    {
+        return { abc[0], -abc[0] - abc[2] };
+    }
+    default:
+    {
+        return { abc[0], abc[1] };
+    }
+    }
+}
+
+
+/**
+ * Simultaneous mode only. Returns the block of the DMA buffer that has just been completed.
+ * The end of sequence IRQ of ADC1 may come a few bus cycles before the DMA controller has moved the last results
+ * of the slave ADCs into the memory, so we wait for the transfer complete flag here. The wait is bounded.
+ * In the double buffered mode, the half transfer flag indicates that the first block is ready, and the transfer
+ * complete flag indicates the second one; meanwhile the DMA controller is free to fill the other block.
+ */
+inline const ADCSampleBlock& waitForCompletedADCSampleBlock()
+{
+    constexpr unsigned FlagMask = (TheADCMode == ADCMode::SimultaneousDoubleBuffered) ?
+                                  (DMA_LISR_HTIF0 | DMA_LISR_TCIF0) : DMA_LISR_TCIF0;
+    constexpr unsigned MaxWaitIterations = 100;
+
+    unsigned flags = 0;
+    for (unsigned i = 0; (i < MaxWaitIterations) && (flags == 0); i++)
+    {
+        flags = DMA2->LISR & FlagMask;
+    }
+
+    assert((flags == DMA_LISR_HTIF0) || (flags == DMA_LISR_TCIF0));     // Both flags set means that a block was lost
+    DMA2->LIFCR = flags;
+
+    const unsigned index = ((ADCSimultaneousModeNumBlocks > 1) && ((flags & DMA_LISR_TCIF0) != 0)) ? 1U : 0U;
+    return g_dma_buffer_simultaneous[index];
 }
 
 
@@ -582,22 +915,45 @@ void init()
      * Initializing the MCU peripherals.
      * The variables must be initialized BEFORE the first IRQ is triggered.
      */
+    const unsigned fast_irq_decimation_ratio =
+        unsigned(std::ceil(g_config_pwm_frequency_khz.get() * 1e3F / FastIRQMaxFrequency - 0.001F));
+    assert(fast_irq_decimation_ratio >= 1);
+
     initPWM(double(g_config_pwm_frequency_khz.get()) * 1e3,
-            double(g_config_pwm_dead_time_nsec.get()) * 1e-9);
+            double(g_config_pwm_dead_time_nsec.get()) * 1e-9,
+            fast_irq_decimation_ratio);
 
     g_pwm_params.period = float(double((TIM1->ARR + 1U) * 2U) / double(TIM1ClockFrequency));
 
+    g_pwm_params.fast_irq_period = g_pwm_params.period * float(fast_irq_decimation_ratio);
+
     g_pwm_params.dead_time = float(double(TIM1->BDTR & 0xFFU) / double(TIM1ClockFrequency));
 
-    // TODO FIXME Derive properly from ADC sampling times
-    const float adc_sampling_window = 3e-6F;
+    // In the simultaneous mode the temperature is converted after the phase currents, so it is not accounted for
+    const float adc_sampling_window = ADCSamplingWindowFixedPart + ADCConversionDuration * float(SamplesPerADCPerIRQ);
     g_pwm_params.upper_limit = 1.0F - (adc_sampling_window + g_pwm_params.dead_time) / g_pwm_params.period;
 
-    g_fast_irq_to_main_irq_period_ratio = unsigned(std::ceil(MainIRQMinPeriod / g_pwm_params.period) + 0.4F);
+    if (HasPhaseCCurrentSensor)
+    {
+        /*
+         * The phase with the highest duty cycle is not used, so the sampling window limits only the second highest
+         * duty cycle. The space vector modulation centers the duty cycles at half the upper limit (see
+         * foc::shapeSpaceVectorModulation()), and the peak deviation of the second highest one from the center is
+         * sqrt(3)/2 of that of the highest one, so its peak is (1 + sqrt(3)/2) / 2 of the upper limit; the limit
+         * can be raised accordingly, keeping some margin for the dead time. The bottom clamped mode yields a lower
+         * peak, sqrt(3)/2 of the upper limit.
+         */
+        const float max_upper_limit = 1.0F - 2.0F * g_pwm_params.dead_time / g_pwm_params.period;
+        g_pwm_params.upper_limit = std::min(max_upper_limit,
+                                            g_pwm_params.upper_limit * 4.0F / (2.0F + std::sqrt(3.0F)));
+    }
+
+    g_fast_irq_to_main_irq_period_ratio =
+        unsigned(std::ceil(MainIRQMinPeriod / g_pwm_params.fast_irq_period) + 0.4F);
 
     initADC();
 
-    initSynchronizationTimer();
+    initSynchronizationTimer(fast_irq_decimation_ratio);
 
     // Configuring IRQ
     {
@@ -606,9 +962,12 @@ void init()
         nvicEnableVector(TIM8_CC_IRQn, MainIRQPriority);        // Triggered by software
     }
 
-    g_logger.println("Fast IRQ period: %g us, Main IRQ period: %g us, ratio %u; PWM limit: %0.3f",
+    g_logger.println("PWM period: %g us, Fast IRQ period: %g us (decimation %u), Main IRQ period: %g us, ratio %u; "
+                     "PWM limit: %0.3f",
                      double(g_pwm_params.period) * 1e6,
-                     double(g_pwm_params.period) * double(g_fast_irq_to_main_irq_period_ratio) * 1e6,
+                     double(g_pwm_params.fast_irq_period) * 1e6,
+                     fast_irq_decimation_ratio,
+                     double(g_pwm_params.fast_irq_period) * double(g_fast_irq_to_main_irq_period_ratio) * 1e6,
                      g_fast_irq_to_main_irq_period_ratio,
                      double(g_pwm_params.upper_limit));
 }
@@ -618,6 +977,7 @@ void init()
  */
 unsigned PWMHandle::total_number_of_active_handles_ = 0;
 
+BOARD_RAM_FUNCTION
 void PWMHandle::setPWM(const math::Vector<3>& abc)
 {
     if (!active_)
@@ -633,12 +993,22 @@ void PWMHandle::setPWM(const math::Vector<3>& abc)
         total_number_of_active_handles_++;
     }
 
+    irq_profiler::ScopedStageMeasurer<irq_profiler::Stage::SetPWM> measurer;
+
     static constexpr math::Range<> Lim(0, 1);
 
     assert(Lim.contains(abc[0]) &&
            Lim.contains(abc[1]) &&
            Lim.contains(abc[2]));
 
+    if (HasPhaseCCurrentSensor)
+    {
+        // The new values will be loaded at the next update event, i.e. before the next sampling
+        math::Vector<3>::Index index = 0;
+        (void) abc.maxCoeff(&index);
+        g_phase_with_highest_duty_cycle = unsigned(index);
+    }
+
     const auto arr = float(TIM1->ARR);
 
     setRawPWM(std::uint16_t(Lim.constrain(abc[0]) * arr + 0.4F),
@@ -679,9 +1049,15 @@ bool PWMHandle::isUnique() const
 }
 
 
-void beginCalibration()
+void beginCalibration(const CalibrationMode mode)
 {
-    g_board_features->beginCalibration();
+    const auto status = getStatus();
+
+    const bool incremental =
+        (mode == CalibrationMode::ReuseIfNotDrifted) &&
+        g_board_features->areCachedCurrentZeroOffsetsValid(status.inverter_temperature, status.inverter_voltage);
+
+    g_board_features->beginCalibration(incremental);
 }
 
 bool isCalibrationInProgress()
@@ -694,6 +1070,50 @@ PWMParameters getPWMParameters()
     return g_pwm_params;
 }
 
+std::uint32_t getCarrierPeriodStartCycleCount()
+{
+    std::uint32_t cycle_count = 0;
+    std::uint32_t counter = 0;
+    bool counting_down = false;
+    {
+        AbsoluteCriticalSectionLocker locker;
+        cycle_count = irq_profiler::getCycleCount();
+        counter = TIM1->CNT;
+        counting_down = (TIM1->CR1 & TIM_CR1_DIR) != 0;
+    }
+
+    // Center-aligned mode: the counter goes up to ARR and then back down to zero
+    const std::uint32_t period_ticks = (std::uint32_t(g_nominal_pwm_reload_value) + 1U) * 2U;
+    const std::uint32_t ticks_since_period_start = counting_down ? (period_ticks - counter) : counter;
+
+    constexpr float CyclesPerTick = float(STM32_SYSCLK) / float(TIM1ClockFrequency);
+    return cycle_count - std::uint32_t(float(ticks_since_period_start) * CyclesPerTick + 0.5F);
+}
+
+void setCarrierPhaseSlewRate(float rate)
+{
+    const float max_rate = getMaxCarrierPhaseSlewRate();
+    rate = math::Range<>(-max_rate, max_rate).constrain(rate);
+
+    // One tick of ARR per fast IRQ period shifts the phase by 2 ticks per carrier period
+    g_carrier_period_trim_rate = rate * (float(g_nominal_pwm_reload_value) + 1.0F);     // Atomic write
+}
+
+float getMaxCarrierPhaseSlewRate()
+{
+    return 1.0F / (float(g_nominal_pwm_reload_value) + 1.0F);
+}
+
+MainIRQTiming getMainIRQTiming()
+{
+    AbsoluteCriticalSectionLocker locker;
+
+    MainIRQTiming out;
+    out.last_duration = g_irq_timing_stat_main.getLastDuration();
+    out.num_lost_periods = g_main_irq_lost_period_count;
+    return out;
+}
+
 math::Vector<2> getPhaseCurrentsAB()
 {
     AbsoluteCriticalSectionLocker locker;
@@ -772,6 +1192,8 @@ Status getStatus()
     s.inverter_temperature =
         g_board_features->convertADCVoltageToInverterTemperature(g_inverter_temperature_sensor_voltage);
     s.inverter_voltage = g_inverter_voltage;
+    s.inverter_voltage_ripple_rms = g_inverter_voltage_ripple.getRMS();
+    s.inverter_voltage_ripple_peak_to_peak = g_inverter_voltage_ripple.getPeakToPeak();
 
     s.current_sensor_gain = g_board_features->getCurrentGain();
 
@@ -796,7 +1218,8 @@ const Limits& getLimits()
 extern "C"
 {
 
-/// FAST IRQ (every PWM period, ASAP after ADC measurements are finished)
+/// FAST IRQ (every PWM period or every N-th in the decimated mode, ASAP after ADC measurements are finished)
+BOARD_RAM_FUNCTION
 CH_FAST_IRQ_HANDLER(STM32_ADC_HANDLER)
 {
     using namespace board::motor;
@@ -805,55 +1228,109 @@ CH_FAST_IRQ_HANDLER(STM32_ADC_HANDLER)
 
     board::RAIIToggler<board::setTestPointB> tp_toggler;
 
-    /*
-     * By the time we get here, the DMA controller should have completed all transfers.
-     * Making sure this assumption is true.
-     * Note that we're not checking the inverter voltage DMA channel, because it works asynchronously (see constants).
-     */
-#ifndef NDEBUG
-    constexpr unsigned DMATransferCompleteMask = DMA_LISR_TCIF1 | DMA_LISR_TCIF2;
-    assert((DMA2->LISR & DMATransferCompleteMask) == DMATransferCompleteMask);
-    DMA2->LIFCR = DMATransferCompleteMask;  // Complete flags must be set by the time we get into the ADC handler
-#endif
-
     /*
      * Processing the samples and invoking the application handler.
      * These tasks need to be completed ASAP in order to minimize latency.
      */
-    const math::Vector<2> phase_currents_adc_voltages
+    float current_sensor_adc_voltages[3] = {};         // Phase C is only used if there is a sensor
+    float inverter_voltage_adc_voltage = 0.0F;
+
+    if (IsADCSimultaneousModeUsed)
     {
-        g_board_features->convertADCSamplesToVoltage(g_dma_buffer_phase_a_current),
-        g_board_features->convertADCSamplesToVoltage(g_dma_buffer_phase_b_current)
-    };
+        // Single pass over the interleaved buffer; the last triplet contains the temperature sample
+        const ADCSampleBlock& block = waitForCompletedADCSampleBlock();
+
+        unsigned sum_inverter_voltage = 0;
+        unsigned sum_phase_a_current = 0;
+        unsigned sum_phase_b_current = 0;
+
+        for (unsigned i = 0; i < SamplesPerADCPerIRQ; i++)
+        {
+            sum_inverter_voltage += block[i].inverter_voltage;
+            sum_phase_a_current  += block[i].phase_a_current;
+            sum_phase_b_current  += block[i].phase_b_current;
+        }
+
+        current_sensor_adc_voltages[0] =
+            g_board_features->convertADCSampleSumToVoltage<SamplesPerADCPerIRQ>(sum_phase_a_current);
+        current_sensor_adc_voltages[1] =
+            g_board_features->convertADCSampleSumToVoltage<SamplesPerADCPerIRQ>(sum_phase_b_current);
+        inverter_voltage_adc_voltage =
+            g_board_features->convertADCSampleSumToVoltage<SamplesPerADCPerIRQ>(sum_inverter_voltage);
+
+        g_simultaneous_mode_temperature_sample = block[SamplesPerADCPerIRQ].inverter_voltage;
+    }
+    else
+    {
+        /*
+         * By the time we get here, the DMA controller should have completed all transfers.
+         * Making sure this assumption is true.
+         * The ADC1 stream carries either the inverter voltage or the phase C current; in both cases its sequence
+         * is identical to those of the other ADC, so it completes at the same time.
+         */
+#ifndef NDEBUG
+        constexpr unsigned DMATransferCompleteMask = DMA_LISR_TCIF0 | DMA_LISR_TCIF1 | DMA_LISR_TCIF2;
+        assert((DMA2->LISR & DMATransferCompleteMask) == DMATransferCompleteMask);
+        DMA2->LIFCR = DMATransferCompleteMask;  // Complete flags must be set by the time we get into the ADC handler
+#endif
+
+        current_sensor_adc_voltages[0] = g_board_features->convertADCSamplesToVoltage(g_dma_buffer_phase_a_current);
+        current_sensor_adc_voltages[1] = g_board_features->convertADCSamplesToVoltage(g_dma_buffer_phase_b_current);
+
+        if (HasPhaseCCurrentSensor)
+        {
+            // The injected group is converted after the regular one, so this is the value from the previous period.
+            // It is still taken at the same point of the PWM period every time, so the ripple is not aliased.
+            const std::uint16_t inverter_voltage_sample[1] = { std::uint16_t(ADC1->JDR1) };
+
+            current_sensor_adc_voltages[2] =
+                g_board_features->convertADCSamplesToVoltage(g_dma_buffer_phase_c_current);
+            inverter_voltage_adc_voltage = g_board_features->convertADCSamplesToVoltage(inverter_voltage_sample);
+        }
+        else
+        {
+            inverter_voltage_adc_voltage =
+                g_board_features->convertADCSamplesToVoltage(g_dma_buffer_inverter_voltage);
+        }
+    }
+
+    const CurrentSensorVector phase_currents_adc_voltages =
+        Eigen::Map<const CurrentSensorVector>(&current_sensor_adc_voltages[0]);
 
     // While EN_GATE is low, the current amplifiers are shut down, so we're measuring garbage
-    // Also, both voltages near zero means that the current amplifiers are not activated yet
+    // Also, all voltages near zero means that the current amplifiers are not activated yet
     const bool currents_valid = (PWMHandle::getTotalNumberOfActiveHandles() > 0) &&
                                 g_board_features->areCurrentSensorOutputsValid(phase_currents_adc_voltages);
 
-    g_phase_currents = currents_valid ?
+    const CurrentSensorVector measured_currents = currents_valid ?
         g_board_features->convertADCVoltagesToPhaseCurrents(phase_currents_adc_voltages) :
-        math::Vector<2>::Zero();
+        CurrentSensorVector(CurrentSensorVector::Zero());
 
-    {
-        const float new_inverter_voltage = g_board_features->convertADCVoltageToInverterVoltage(
-            g_board_features->convertADCSamplesToVoltage(g_dma_buffer_inverter_voltage));
+    g_phase_currents = reconstructPhaseCurrentsAB(measured_currents);
 
-        g_inverter_voltage += InverterVoltageInnovationWeight * (new_inverter_voltage - g_inverter_voltage);
-    }
+    const float new_inverter_voltage =
+        g_board_features->convertADCVoltageToInverterVoltage(inverter_voltage_adc_voltage);
+
+    g_inverter_voltage += InverterVoltageInnovationWeight * (new_inverter_voltage - g_inverter_voltage);
+    g_inverter_voltage_ripple.update(new_inverter_voltage - g_inverter_voltage);
+
+    handleFastIRQ(g_phase_currents, new_inverter_voltage);
 
-    handleFastIRQ(g_phase_currents, g_inverter_voltage);
+    updateCarrierPeriodTrim();
 
     /*
      * Current AGC, calibration, that kind of stuff goes here because it's not very time-critical.
      */
     if (g_board_features->isCalibrationInProgress())
     {
-        g_board_features->processCalibration(g_pwm_params.period, phase_currents_adc_voltages);
+        g_board_features->processCalibration(g_pwm_params.fast_irq_period,
+                                             phase_currents_adc_voltages,
+                                             g_inverter_temperature_sensor_voltage,
+                                             g_inverter_voltage);
     }
     else
     {
-        g_board_features->adjustCurrentGain(g_pwm_params.period, g_phase_currents);
+        g_board_features->adjustCurrentGain(g_pwm_params.fast_irq_period, measured_currents);
     }
 
     /*
@@ -878,6 +1355,13 @@ CH_FAST_IRQ_HANDLER(STM32_ADC_HANDLER)
     if (main_irq_trigger_counter >= g_fast_irq_to_main_irq_period_ratio)
     {
         main_irq_trigger_counter = 0;
+
+        // If the previous invocation is still pending or running, the triggers merge and one period is lost
+        if ((NVIC_GetPendingIRQ(TIM8_CC_IRQn) != 0) || (NVIC_GetActive(TIM8_CC_IRQn) != 0))
+        {
+            g_main_irq_lost_period_count++;
+        }
+
         // Triggering the IRQ; it will remain pending until the fast IRQ is finished.
         NVIC_SetPendingIRQ(TIM8_CC_IRQn);
     }
@@ -891,6 +1375,7 @@ CH_FAST_IRQ_HANDLER(STM32_ADC_HANDLER)
 }
 
 /// MAIN IRQ (every N-th PWM period)
+BOARD_RAM_FUNCTION
 CH_FAST_IRQ_HANDLER(STM32_TIM8_CC_HANDLER)
 {
     using namespace board::motor;
@@ -899,14 +1384,20 @@ CH_FAST_IRQ_HANDLER(STM32_TIM8_CC_HANDLER)
 
     board::RAIIToggler<board::setTestPointA> tp_toggler;
 
-    handleMainIRQ(g_pwm_params.period * float(g_fast_irq_to_main_irq_period_ratio));
+    handleMainIRQ(g_pwm_params.fast_irq_period * float(g_fast_irq_to_main_irq_period_ratio));
 
     /*
      * Temperature processing.
      * Injected conversions are triggered automatically, the data register always contains the most recent value.
+     * In the simultaneous mode, the sample is extracted from the regular sequence by the fast IRQ.
      */
     {
-        const std::uint16_t temperature_sample[1] = { std::uint16_t(ADC1->JDR1) };
+        const std::uint16_t temperature_sample[1] =
+        {
+            IsADCSimultaneousModeUsed ? std::uint16_t(g_simultaneous_mode_temperature_sample) :
+            HasPhaseCCurrentSensor    ? std::uint16_t(ADC1->JDR2) :
+                                        std::uint16_t(ADC1->JDR1)
+        };
         const float new_temperature = g_board_features->convertADCSamplesToVoltage(temperature_sample);
         g_inverter_temperature_sensor_voltage +=
             TemperatureInnovationWeight * (new_temperature - g_inverter_temperature_sensor_voltage);
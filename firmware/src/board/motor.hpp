@@ -26,6 +26,7 @@
 
 #include <cstdint>
 #include <board/board.hpp>
+#include <board/ram_function.hpp>
 #include <math/math.hpp>
 #include <zubax_chibios/util/heapless.hpp>
 
@@ -84,13 +85,22 @@ public:
     static unsigned getTotalNumberOfActiveHandles() { return total_number_of_active_handles_; }
 };
 
+/**
+ * @ref beginCalibration().
+ */
+enum class CalibrationMode
+{
+    Full,                   ///< Measure the offsets from scratch
+    ReuseIfNotDrifted       ///< Briefly refine the cached offsets unless the temperature or voltage have drifted
+};
+
 /**
  * This function can be invoked to perform zero offset calibration.
  * It must be guaranteed that during such calibration the motor is NOT spinning,
  * and that no other component will be using the driver while the calibration is in progress.
  * See also @ref isCalibrationInProgress().
  */
-void beginCalibration();
+void beginCalibration(CalibrationMode mode = CalibrationMode::Full);
 
 /**
  * Always returns false unless @ref beginCalibration() was invoked recently.
@@ -102,9 +112,18 @@ bool isCalibrationInProgress();
  */
 struct PWMParameters
 {
-    float period = 0;       ///< Second
-    float dead_time = 0;    ///< Second
-    float upper_limit = 0;  ///< Unitless, (0, 1]
+    float period = 0;           ///< Second, period of the PWM carrier
+    float fast_irq_period = 0;  ///< Second, interval between fast IRQ invocations and PWM updates
+    float dead_time = 0;        ///< Second
+    float upper_limit = 0;      ///< Unitless, (0, 1]
+
+    /**
+     * Number of PWM carrier periods per fast IRQ invocation. Equals 1 unless the PWM frequency is very high.
+     */
+    unsigned getFastIRQDecimationRatio() const
+    {
+        return unsigned(fast_irq_period / period + 0.5F);
+    }
 };
 
 /**
@@ -123,6 +142,35 @@ math::Vector<2> getPhaseCurrentsAB();
  */
 float getInverterVoltage();
 
+/**
+ * Returns the value of the cycle counter (see @ref irq_profiler::getCycleCount()) at the beginning of the current
+ * PWM carrier period, i.e. when the PWM timer was at zero. Used to align the carrier with an external time base.
+ */
+std::uint32_t getCarrierPeriodStartCycleCount();
+
+/**
+ * Slews the phase of the PWM carrier by lengthening or shortening some of the periods by one timer tick.
+ * The rate is the phase shift per unit of time, dimensionless; positive rate delays the carrier.
+ * The rate is constrained by @ref getMaxCarrierPhaseSlewRate(). Zero restores the nominal PWM frequency.
+ * Can be invoked from any thread.
+ */
+void setCarrierPhaseSlewRate(float rate);
+float getMaxCarrierPhaseSlewRate();
+
+/**
+ * @ref getMainIRQTiming().
+ */
+struct MainIRQTiming
+{
+    float last_duration = 0;            ///< Of the previous invocation, including preemption by the fast IRQ; second
+    std::uint32_t num_lost_periods = 0; ///< The main IRQ was still pending or running when it was due again
+};
+
+/**
+ * Used to detect overruns of the main IRQ.
+ */
+MainIRQTiming getMainIRQTiming();
+
 /**
  * Immediately deactivates the PWM outputs (shuts down the carrier).
  * Further use of the driver may not be possible.
@@ -153,7 +201,11 @@ void printStatus();
 struct Status
 {
     float inverter_temperature = 0.0F;          ///< Kelvin
-    float inverter_voltage = 0.0F;              ///< Volt
+    float inverter_voltage = 0.0F;              ///< Volt, low-pass filtered
+
+    /// Deviation of the per-period samples of the inverter voltage from the filtered value, volt
+    float inverter_voltage_ripple_rms = 0.0F;
+    float inverter_voltage_ripple_peak_to_peak = 0.0F;
 
     float current_sensor_gain = 0.0F;           ///< Volt/Volt
 
@@ -171,12 +223,15 @@ struct Status
     {
         return os::heapless::format("Inverter Temperature: %.0f C\n"
                                     "Inverter Voltage    : %.1f\n"
+                                    "Inv. Voltage Ripple : %.2f RMS, %.2f p-p\n"
                                     "Current Sensor Gain : %.1f\n"
                                     "Power OK            : %u\n"
                                     "Overload            : %u\n"
                                     "Fault               : %u",
                                     double(math::convertKelvinToCelsius(inverter_temperature)),
                                     double(inverter_voltage),
+                                    double(inverter_voltage_ripple_rms),
+                                    double(inverter_voltage_ripple_peak_to_peak),
                                     double(current_sensor_gain),
                                     power_ok,
                                     overload,
@@ -230,13 +285,17 @@ const Limits& getLimits();
 
 /**
  * This external handler is invoked from the HIGHEST PRIORITY IRQ context shortly after the middle of every PWM
- * period, as soon as the corresponding ADC measurements are processed.
+ * period, as soon as the corresponding ADC measurements are processed. If the PWM frequency is too high to run the
+ * handler every period, it is invoked every N-th period instead, see @ref PWMParameters::fast_irq_period.
  * Steps were taken to minimize the measurement latency, so the application code can rely on that.
  * The PWM update latency is also minimized: the freshly computed PWM values will be applied on the very next period.
  * This IRQ preempts every other process and maskable IRQ handler in the system.
  *
  * @param phase_currents_ab             Instant currents of phases A and B, in Amperes.
- * @param inverter_voltage              Low-pass filtered VBUS voltage of the inverter, in Volts.
+ * @param inverter_voltage              VBUS voltage of the inverter, in Volts. Not filtered: it is sampled once per
+ *                                      fast IRQ at the same point of the PWM period as the phase currents, so that
+ *                                      the application can compensate the ripple. The filtered value and the
+ *                                      ripple statistics are reported via @ref getStatus().
  */
 extern void handleFastIRQ(const math::Vector<2>& phase_currents_ab,
                           const float inverter_voltage);
@@ -254,7 +313,7 @@ extern void handleFastIRQ(const math::Vector<2>& phase_currents_ab,
  *      F       F       F       F       F       F...
  *       MMMMMMMMMMMMMMMMMMM             MMMMMMMM...
  *
- * @param period                        Equals N * @ref getPWMPeriod(), in seconds.
+ * @param period                        Equals N * @ref PWMParameters::fast_irq_period, in seconds.
  * @param inverter_voltage              See fast IRQ
  */
 extern void handleMainIRQ(const float period);
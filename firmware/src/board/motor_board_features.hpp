@@ -25,12 +25,31 @@
 #pragma once
 
 #include "motor.hpp"
+#include <algorithm>
+#include <cmath>
 
 
 namespace board
 {
 namespace motor
 {
+/**
+ * Set this to 1 if the board has a current shunt in the phase C.
+ * The Pixhawk ESC v1.6 measures only phases A and B.
+ */
+#ifndef BOARD_MOTOR_PHASE_C_CURRENT_SENSOR
+# define BOARD_MOTOR_PHASE_C_CURRENT_SENSOR     0
+#endif
+
+constexpr bool HasPhaseCCurrentSensor = BOARD_MOTOR_PHASE_C_CURRENT_SENSOR != 0;
+
+constexpr unsigned NumCurrentSensors = HasPhaseCCurrentSensor ? 3 : 2;
+
+/**
+ * Per current sensor values (voltages, offsets, currents); the phase order is A, B, C.
+ */
+using CurrentSensorVector = math::Vector<NumCurrentSensors>;
+
 /**
  * This class holds parameters specific to the board we're running on.
  * At some point we'll need to add support for other hardware revisions with different voltage dividers,
@@ -41,14 +60,28 @@ class BoardFeatures final
     static constexpr float ADCReferenceVoltage = 3.3F;
     static constexpr unsigned ADCResolutionBits = 12;
 
-    static constexpr float CurrentOffsetCalibrationDuration = 1.0F;
+    static constexpr float CurrentOffsetCalibrationDuration = 1.0F;             ///< Second, per gain level
+    static constexpr float CurrentOffsetRefinementDuration  = 0.05F;            ///< Second, per gain level
+
+    /**
+     * Incremental calibration folds new measurements into the existing offsets with at least this weight,
+     * so that slow drifts are tracked.
+     */
+    static constexpr float MinCurrentOffsetRefinementWeight = 0.1F;
+
+    /**
+     * If the inverter temperature or voltage changed more than this since the last full calibration,
+     * the cached offsets are not trusted and the full calibration is performed.
+     */
+    static constexpr float MaxTemperatureDriftForCachedCurrentOffsets  = 5.0F;   ///< Kelvin
+    static constexpr float MaxVoltageDriftForCachedCurrentOffsets      = 1.0F;   ///< Volt
 
     static constexpr float MaxUnipolarVoltageAtCurrentSensorOutput  = (ADCReferenceVoltage / 2.0F) * 0.9F;  ///< Volt
     static constexpr float MinCurrentGainSwitchInterval             = 0.01F;                                ///< Second
     static constexpr float CurrentGainAdjustmentHysteresisCoeff     = 0.9F;
 
     /**
-     * If both current sensors output voltages lower than this, we assume that the current amplifiers are
+     * If all current sensors output voltages lower than this, we assume that the current amplifiers are
      * not yet activated.
      * This heuristic helps to avoid unnecessary gain switching shortly after power stage activation.
      * The condition when both channels report that low voltages should never appear during normal operation.
@@ -60,20 +93,22 @@ class BoardFeatures final
     {
         PWMHandle pwm_handle;
         float duration = 0;
-        math::CumulativeAverageComputer<math::Vector<2>> averager;
+        math::CumulativeAverageComputer<CurrentSensorVector> averager;
         bool in_progress = false;
+        bool incremental = false;
 
         void reset()
         {
             pwm_handle.release();
             in_progress = false;
+            incremental = false;
             resetDurationAndAverage();
         }
 
         void resetDurationAndAverage()
         {
             duration = 0;
-            averager = math::CumulativeAverageComputer<math::Vector<2>>(math::Vector<2>::Zero());
+            averager = math::CumulativeAverageComputer<CurrentSensorVector>(CurrentSensorVector::Zero());
         }
 
         CurrentZeroOffsetCalibrator() { reset(); }
@@ -103,18 +138,50 @@ class BoardFeatures final
     const BoardConfig board_config_;
 
     // State variables
-    std::array<math::Vector<2>, 2> current_zero_offsets_low_high_{};             ///< Per gain level
+    std::array<CurrentSensorVector, 2> current_zero_offsets_low_high_{};         ///< Per gain level
+    std::array<std::uint32_t, 2> current_zero_offsets_num_samples_low_high_{};  ///< Per gain level
+
+    /// Conditions of the last full calibration, used to decide whether the cached offsets can be trusted
+    struct CurrentZeroOffsetCalibrationConditions
+    {
+        float inverter_temperature = 0.0F;
+        float inverter_voltage = 0.0F;
+        bool valid = false;
+    } current_zero_offset_calibration_conditions_;
     bool current_amplifier_high_gain_selected_ = true;
     float time_since_current_was_above_high_gain_threshold_ = 0.0F;
 
     CurrentZeroOffsetCalibrator current_zero_offset_calibrator_;
 
 
-    const math::Vector<2>& getCurrentZeroOffsets() const
+    const CurrentSensorVector& getCurrentZeroOffsets() const
     {
         return current_zero_offsets_low_high_[int(current_amplifier_high_gain_selected_)];
     }
 
+    /**
+     * Cumulative average over all calibrations since the last full one, with a lower bound on the weight
+     * of the new measurement.
+     */
+    void updateCurrentZeroOffsets(const int gain_index)
+    {
+        const auto& averager = current_zero_offset_calibrator_.averager;
+        auto& num_samples = current_zero_offsets_num_samples_low_high_[gain_index];
+
+        if (!current_zero_offset_calibrator_.incremental)
+        {
+            num_samples = 0;
+        }
+
+        num_samples = std::min<std::uint32_t>(num_samples + averager.getNumSamples(), 0x7FFFFFFFU);
+
+        const float weight = std::max(MinCurrentOffsetRefinementWeight,
+                                      float(averager.getNumSamples()) / float(num_samples));
+
+        auto& offsets = current_zero_offsets_low_high_[gain_index];
+        offsets += (averager.getAverage() - offsets) * weight;
+    }
+
     void setCurrentAmplifierGain(bool high)
     {
         palWritePad(GPIOB, GPIOB_GAIN, high);
@@ -166,7 +233,7 @@ public:
         board_config_(detectBoardConfig())
     {
         std::fill(current_zero_offsets_low_high_.begin(), current_zero_offsets_low_high_.end(),
-                  math::Vector<2>::Ones() * (ADCReferenceVoltage * 0.5F));
+                  CurrentSensorVector::Ones() * (ADCReferenceVoltage * 0.5F));
 
         palWritePad(GPIOB, GPIOB_GAIN, true);
         current_amplifier_high_gain_selected_ = true;
@@ -184,7 +251,7 @@ public:
     }
 
     void adjustCurrentGain(const float period,
-                           const math::Vector<2>& currents)
+                           const CurrentSensorVector& currents)
     {
         assert(!isCalibrationInProgress());
 
@@ -224,7 +291,7 @@ public:
 
     auto getCurrentSensorsZeroOffsets() const { return current_zero_offsets_low_high_; }
 
-    math::Vector<2> convertADCVoltagesToPhaseCurrents(const math::Vector<2>& raw_voltages) const
+    CurrentSensorVector convertADCVoltagesToPhaseCurrents(const CurrentSensorVector& raw_voltages) const
     {
         return (raw_voltages - getCurrentZeroOffsets()) / (board_config_.current_shunt_resistance * getCurrentGain());
     }
@@ -234,7 +301,25 @@ public:
         return board_config_.temperature_transfer_function(voltage);
     }
 
-    void beginCalibration()
+    /**
+     * True if the inverter temperature and voltage did not drift too far since the last full calibration,
+     * so that the existing offsets only need to be refined.
+     */
+    bool areCachedCurrentZeroOffsetsValid(const float inverter_temperature,
+                                          const float inverter_voltage) const
+    {
+        const auto& cond = current_zero_offset_calibration_conditions_;
+        return cond.valid &&
+               (std::abs(inverter_temperature - cond.inverter_temperature) <=
+                MaxTemperatureDriftForCachedCurrentOffsets) &&
+               (std::abs(inverter_voltage - cond.inverter_voltage) <= MaxVoltageDriftForCachedCurrentOffsets);
+    }
+
+    /**
+     * In the incremental mode, the offsets are measured briefly and folded into the existing values.
+     * Otherwise they are measured from scratch.
+     */
+    void beginCalibration(const bool incremental)
     {
         AbsoluteCriticalSectionLocker locker;
 
@@ -244,6 +329,13 @@ public:
 
             current_zero_offset_calibrator_.reset();
             current_zero_offset_calibrator_.in_progress = true;
+            current_zero_offset_calibrator_.incremental = incremental;
+
+            if (!incremental)
+            {
+                current_zero_offset_calibration_conditions_.valid = false;
+            }
+
             current_zero_offset_calibrator_.pwm_handle.setPWM(math::Vector<3>::Zero());
 
             assert(current_zero_offset_calibrator_.pwm_handle.isUnique());
@@ -255,8 +347,14 @@ public:
         return current_zero_offset_calibrator_.in_progress;
     }
 
+    /**
+     * The filtered inverter temperature sensor voltage and inverter voltage are recorded as the conditions
+     * of a full calibration when it completes.
+     */
     void processCalibration(const float period,
-                            const math::Vector<2>& current_sensors_output_voltages)
+                            const CurrentSensorVector& current_sensors_output_voltages,
+                            const float inverter_temperature_sensor_voltage,
+                            const float inverter_voltage)
     {
         assert(isCalibrationInProgress());
 
@@ -265,16 +363,27 @@ public:
         current_zero_offset_calibrator_.averager.addSample(current_sensors_output_voltages);
         current_zero_offset_calibrator_.duration += period;
 
-        if (current_zero_offset_calibrator_.duration > CurrentOffsetCalibrationDuration)
+        const float required_duration = current_zero_offset_calibrator_.incremental ?
+                                        CurrentOffsetRefinementDuration : CurrentOffsetCalibrationDuration;
+
+        if (current_zero_offset_calibrator_.duration > required_duration)
         {
+            updateCurrentZeroOffsets(int(current_amplifier_high_gain_selected_));
+
             if (current_amplifier_high_gain_selected_)
             {
-                current_zero_offsets_low_high_[1] = current_zero_offset_calibrator_.averager.getAverage();
+                if (!current_zero_offset_calibrator_.incremental)
+                {
+                    // Sampled here rather than at the start because the filters may have not settled yet then
+                    current_zero_offset_calibration_conditions_.inverter_temperature =
+                        convertADCVoltageToInverterTemperature(inverter_temperature_sensor_voltage);
+                    current_zero_offset_calibration_conditions_.inverter_voltage = inverter_voltage;
+                    current_zero_offset_calibration_conditions_.valid = true;
+                }
                 current_zero_offset_calibrator_.reset();
             }
             else
             {
-                current_zero_offsets_low_high_[0] = current_zero_offset_calibrator_.averager.getAverage();
                 setCurrentAmplifierGain(true);
                 current_zero_offset_calibrator_.resetDurationAndAverage();
             }
@@ -284,19 +393,29 @@ public:
     /// Could be static, but we keep it non-static for future proofness.
     template <unsigned NumSamples>
     float convertADCSamplesToVoltage(const std::uint16_t (&x)[NumSamples]) const
+    {
+        return convertADCSampleSumToVoltage<NumSamples>(std::accumulate(std::begin(x), std::end(x), 0U));
+    }
+
+    /**
+     * Same as above, but accepts a sum of NumSamples raw samples.
+     * Useful when the samples are not stored contiguously, e.g. in the interleaved multi-ADC DMA buffer.
+     */
+    template <unsigned NumSamples>
+    float convertADCSampleSumToVoltage(const unsigned sum) const
     {
         constexpr double VoltsPerLSB = double(ADCReferenceVoltage) / double((1U << ADCResolutionBits) - 1);
 
         constexpr float ConversionMultiplier = float(VoltsPerLSB / double(NumSamples));
 
-        return float(std::accumulate(std::begin(x), std::end(x), 0U)) * ConversionMultiplier;
+        return float(sum) * ConversionMultiplier;
     }
 
     /**
      * When current amplifiers are disabled, their outputs are assumed to remain in a certain state.
      * Here we're checking if the outputs are in the said state.
      */
-    bool areCurrentSensorOutputsValid(const math::Vector<2>& current_sensors_output_voltages) const
+    bool areCurrentSensorOutputsValid(const CurrentSensorVector& current_sensors_output_voltages) const
     {
         return current_sensors_output_voltages.mean() > MinCurrentSensorsOutputVoltage;
     }
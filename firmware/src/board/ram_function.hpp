@@ -0,0 +1,50 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+/**
+ * Functions marked with these attributes are executed from SRAM rather than from flash, so that the timing of the
+ * motor control IRQs does not depend on the state of the flash accelerator: its cache is small, and the code
+ * executed by the threads (CLI, UAVCAN) keeps evicting the IRQ code from it.
+ * The code is copied into RAM at startup together with the initialized data, see the section .ramtext in the
+ * linker script. Calls between flash and RAM go through linker veneers, so only the entry points of the hot path
+ * need to be marked; the callees that are inlined into them follow automatically.
+ *
+ * There are two versions because GCC does not allow functions with and without vague linkage in the same section:
+ *  - BOARD_RAM_FUNCTION                - functions defined in translation units;
+ *  - BOARD_RAM_INLINE_FUNCTION         - functions defined in headers, e.g. class members and templates.
+ *
+ * Enabled at build time via BOARD_HOT_PATH_IN_RAM, which is off by default until the kernel benchmark shows a gain
+ * on the target; has no effect on other targets (e.g. the host simulation).
+ * The data stays where it is: all of the SRAM is equally fast, and the STM32F446 has no core coupled memory.
+ */
+#if defined(__arm__) && defined(BOARD_HOT_PATH_IN_RAM) && BOARD_HOT_PATH_IN_RAM
+# define BOARD_RAM_FUNCTION             __attribute__((section(".ramtext")))
+# define BOARD_RAM_INLINE_FUNCTION      __attribute__((section(".ramtext.inline")))
+#else
+# define BOARD_RAM_FUNCTION
+# define BOARD_RAM_INLINE_FUNCTION
+#endif
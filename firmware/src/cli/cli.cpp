@@ -25,8 +25,10 @@
 #include "cli.hpp"
 
 #include <board/board.hpp>
+#include <board/irq_profiler.hpp>
 #include <bootloader_interface/bootloader_interface.hpp>
 #include <uavcan_node/uavcan_node.hpp>
+#include <memory_usage/memory_usage.hpp>
 
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/config/config.hpp>
@@ -36,9 +38,14 @@
 #include <foc/foc.hpp>
 #include <foc/transforms.hpp>
 #include <foc/irq_debug.hpp>
+#include <foc/latency_benchmark.hpp>
+#include <foc/kernel_benchmark.hpp>
+#include <foc/telemetry.hpp>
+#include <foc/blackbox.hpp>
 #include <motor_database/motor_database.hpp>
 #include <params.hpp>
 
+#include <algorithm>
 #include <cstdlib>
 #include <unistd.h>
 
@@ -50,6 +57,34 @@ namespace
 
 RebootRequestCallback g_reboot_request_callback;
 
+/**
+ * Keeps the debug stream subscribed for the lifetime of the object, so that foc::plotRealTimeValues()
+ * has something to print. Does nothing if disabled.
+ */
+class DebugStreamSubscription
+{
+    const bool enabled_;
+
+public:
+    explicit DebugStreamSubscription(const bool enabled,
+                                     const foc::debug_stream::Config& config = params::readDebugStreamConfig()) :
+        enabled_(enabled)
+    {
+        if (enabled_)
+        {
+            foc::debug_stream::subscribe(config);
+        }
+    }
+
+    ~DebugStreamSubscription()
+    {
+        if (enabled_)
+        {
+            foc::debug_stream::unsubscribe();
+        }
+    }
+};
+
 
 class RebootCommand : public os::shell::ICommandHandler
 {
@@ -202,10 +237,15 @@ public:
                             double(info.inverter_power_filtered / voltage),
                             double(voltage));
 
-                std::printf("%6.0f MRPM  %3.0f %%    %5u stalls\n",
+                std::printf("%6.0f MRPM  %3.0f %%    %5u stalls  %5u restarts\n",
                             double(info.mechanical_rpm),
                             double(info.demand_factor_filtered * 100.0F),
-                            static_cast<unsigned>(info.stall_count));
+                            static_cast<unsigned>(info.stall_count),
+                            static_cast<unsigned>(info.restart_count));
+
+                std::printf("Rs %.3f Ohm  Phi %.3f mWb (estimated)\n",
+                            double(info.estimated_rs),
+                            double(info.estimated_phi) * 1e3);
                 printed = true;
             }
         }
@@ -280,11 +320,20 @@ class StatusCommand : public os::shell::ICommandHandler
         cmd_brief_status.execute();
 
         std::puts("\nFOC Parameters:");
-        std::puts(foc::getParameters().toString().c_str());
+        foc::getParameters().print([](const char* name, const char* value)
+            {
+                std::printf("%s:\n%s\n--\n", name, value);
+            });
 
         std::puts("\nMotor control HW:");
         board::motor::printStatus();
 
+        std::puts("\nMain IRQ budget:");
+        std::puts(foc::getIRQBudgetStatus().toString().c_str());
+
+        std::puts("\nThermal model:");
+        std::puts(foc::getThermalStatus().toString().c_str());
+
         std::printf("\nPhase Currents AB: %s\n", math::toString(board::motor::getPhaseCurrentsAB()).c_str());
 
         const auto pwm_params = board::motor::getPWMParameters();
@@ -292,9 +341,11 @@ class StatusCommand : public os::shell::ICommandHandler
         std::printf("\nPWM:\n"
                     "Active handles: %u\n"
                     "Frequency     : %.6f kHz\n"
+                    "Fast IRQ decim: %u\n"
                     "DeadTime      : %.1f nsec\n",
                     board::motor::PWMHandle::getTotalNumberOfActiveHandles(),
                     1e-3 / double(pwm_params.period),
+                    pwm_params.getFastIRQDecimationRatio(),
                     double(pwm_params.dead_time) * 1e9);
     }
 } static cmd_status;
@@ -463,10 +514,12 @@ class SetpointCommand : public os::shell::ICommandHandler
                      " - a      Current\n"
                      " - ra     Ratiometric Current\n"
                      " - v      Voltage\n"
+                     " - r      Mechanical RPM\n"
+                     " - rr     Ratiometric RPM\n"
                      " - (none) Ratiometric Voltage");
             ios.puts("Execute without arguments to stop the motor.");
             ios.puts("Option -p will plot the real time values.");
-            ios.print("\t%s [setpoint=0 [a|ra|v] [-p]]\n", argv[0]);
+            ios.print("\t%s [setpoint=0 [a|ra|v|r|rr] [-p]]\n", argv[0]);
             return;
         }
 
@@ -486,6 +539,8 @@ class SetpointCommand : public os::shell::ICommandHandler
             if (arg.toLowerCase() == "a")  { control_mode = foc::ControlMode::Current; }
             if (arg.toLowerCase() == "ra") { control_mode = foc::ControlMode::RatiometricCurrent; }
             if (arg.toLowerCase() == "v")  { control_mode = foc::ControlMode::Voltage; }
+            if (arg.toLowerCase() == "r")  { control_mode = foc::ControlMode::MRPM; }
+            if (arg.toLowerCase() == "rr") { control_mode = foc::ControlMode::RatiometricMRPM; }
         }
 
         using namespace std;
@@ -494,6 +549,7 @@ class SetpointCommand : public os::shell::ICommandHandler
         switch (control_mode)
         {
         case foc::ControlMode::RatiometricCurrent:
+        case foc::ControlMode::RatiometricMRPM:
         case foc::ControlMode::RatiometricVoltage:
         {
             static constexpr math::Range<> UnityLimits(-1.0F, 1.0F);
@@ -532,12 +588,9 @@ class SetpointCommand : public os::shell::ICommandHandler
             break;
         }
 
-        case foc::ControlMode::RatiometricMRPM:
         case foc::ControlMode::MRPM:
         {
-            sp = 0;
-            ios.puts("ERROR: CONTROL MODE NOT IMPLEMENTED YET");
-            break;
+            break;      // Any value is acceptable, the speed controller will limit the current and voltage
         }
 
         default:
@@ -550,6 +603,8 @@ class SetpointCommand : public os::shell::ICommandHandler
 
         ios.print("Setpoint %.3f mode %d TTL %.1f s\n", double(sp), int(control_mode), double(ttl));
 
+        const DebugStreamSubscription subscription(do_plot);
+
         foc::setSetpoint(control_mode, sp, ttl);
 
         if (do_plot)
@@ -661,6 +716,8 @@ class MotorIdentificationCommand : public os::shell::ICommandHandler
             ;   // Clearing the input buffer
         }
 
+        const DebugStreamSubscription subscription(do_plot);
+
         foc::beginMotorIdentification(mode);
 
         bool aborted = false;
@@ -702,6 +759,12 @@ class MotorIdentificationCommand : public os::shell::ICommandHandler
             {
                 ios.puts("Overwriting custom motor params with identified values");
                 params::writeMotorParameters(params);
+
+                const auto controller_params = foc::getParameters().controller;
+                ios.print("Current loop gains: Kp %.3f V/A, Ki %.1f V/(A*s)\n",
+                          double(controller_params.current_loop_kp),
+                          double(controller_params.current_loop_ki));
+                params::writeControllerParameters(controller_params);
             }
             else
             {
@@ -758,10 +821,12 @@ class HardwareTestCommand : public os::shell::ICommandHandler
 
     void execute(os::shell::BaseChannelWrapper& ios, int argc, char** argv) override
     {
-        ios.print("Testing the hardware (option -p will plot real time values)...\n");
+        ios.print("Testing the hardware (option -p will plot real time values, -q will skip the dead time "
+                  "identification)...\n");
 
         // Parsing optional stuff
         bool do_plot = false;
+        auto mode = foc::hw_test::Mode::Full;
 
         for (int i = 1; i < argc; i++)
         {
@@ -771,6 +836,10 @@ class HardwareTestCommand : public os::shell::ICommandHandler
             {
                 do_plot = true;
             }
+            if (arg == "-q")
+            {
+                mode = foc::hw_test::Mode::Quick;
+            }
         }
 
         // Running
@@ -787,7 +856,9 @@ class HardwareTestCommand : public os::shell::ICommandHandler
             return;
         }
 
-        foc::beginHardwareTest();
+        const DebugStreamSubscription subscription(do_plot);
+
+        foc::beginHardwareTest(mode);
 
         if (do_plot)
         {
@@ -807,7 +878,17 @@ class HardwareTestCommand : public os::shell::ICommandHandler
             ios.print(" Done.\n");
         }
 
-        ios.print("%s\n", foc::getHardwareTestReport().toString().c_str());
+        const auto report = foc::getHardwareTestReport();
+        ios.print("%s\n", report.toString().c_str());
+
+        if (report.isSuccessful() && report.getDeadTimeCalibration().available)
+        {
+            ios.puts("Overwriting inverter params with identified dead time");
+            auto inverter_params = foc::getParameters().inverter;
+            inverter_params.effective_dead_time_positive = report.getDeadTimeCalibration().effective_dead_time_positive;
+            inverter_params.effective_dead_time_negative = report.getDeadTimeCalibration().effective_dead_time_negative;
+            params::writeInverterParameters(inverter_params);
+        }
     }
 } static cmd_hardware_test;
 
@@ -893,10 +974,183 @@ class MotorDatabaseCommand : public os::shell::ICommandHandler
 
 class PlotCommand : public os::shell::ICommandHandler
 {
+    struct TaskEntry
+    {
+        const char* name;
+        foc::TaskID id;
+    };
+
+    /// Same names as reported by the tasks themselves
+    static constexpr unsigned NumTasks = 3;
+    static const TaskEntry* getTasks()
+    {
+        static const TaskEntry tasks[NumTasks] =
+        {
+            { "running",  foc::TaskID::Running },
+            { "hw_test",  foc::TaskID::HardwareTest },
+            { "motor_id", foc::TaskID::MotorIdentification }
+        };
+        return tasks;
+    }
+
     const char* getName() const override { return "plot"; }
 
-    void execute(os::shell::BaseChannelWrapper& ios, int, char**) override
+    static void printUsage(os::shell::BaseChannelWrapper& ios, const char* const name)
     {
+        ios.puts("Stream the selected debug variables of the current task; the defaults are in the dbg.* params.");
+        ios.print("\t%s [decimation [<channel><edge><level> [samples-per-trigger]]]\n", name);
+        ios.print("\t%s list\n", name);
+        ios.print("\t%s sel <task> [variable...]\n", name);
+        ios.puts("Edge is one of: '>' rising, '<' falling, '~' any; e.g. '3>1.5' triggers when channel 3 rises "
+                 "above 1.5.\n"
+                 "The time is reset to zero at the trigger. Samples-per-trigger of zero disables re-arming.\n"
+                 "Selection without variable names restores the default; it is stored in the dbg.sel_* params.");
+    }
+
+    static void printSelection(os::shell::BaseChannelWrapper& ios, const TaskEntry& task)
+    {
+        const auto names = foc::getDebugVariableNames(task.id);
+        const auto selection = foc::debug_stream::getSelection(std::uint8_t(task.id));
+
+        ios.print("%-9s", task.name);
+        for (unsigned i = 0; i < names.size(); i++)
+        {
+            if (names[i] == nullptr)
+            {
+                continue;
+            }
+            int channel = -1;
+            for (unsigned ch = 0; ch < foc::debug_stream::NumChannels; ch++)
+            {
+                if (foc::debug_stream::getVariableIndex(selection, ch) == int(i))
+                {
+                    channel = int(ch);
+                }
+            }
+            if (channel >= 0)
+            {
+                ios.print(" %s[%d]", names[i], channel);
+            }
+            else
+            {
+                ios.print(" %s", names[i]);
+            }
+        }
+        ios.puts("");
+    }
+
+    static void select(os::shell::BaseChannelWrapper& ios, int argc, char** argv)
+    {
+        const TaskEntry* task = nullptr;
+        for (unsigned i = 0; (i < NumTasks) && (argc >= 3); i++)
+        {
+            if (os::heapless::String<>(argv[2]) == getTasks()[i].name)
+            {
+                task = &getTasks()[i];
+            }
+        }
+        if (task == nullptr)
+        {
+            ios.puts("ERROR: Unknown task");
+            return;
+        }
+
+        if ((argc - 3) > int(foc::debug_stream::NumChannels))
+        {
+            ios.print("ERROR: At most %u variables can be selected\n", foc::debug_stream::NumChannels);
+            return;
+        }
+
+        const auto names = foc::getDebugVariableNames(task->id);
+        foc::debug_stream::Selection selection = 0;
+        for (int arg_index = 3; arg_index < argc; arg_index++)
+        {
+            const os::heapless::String<> arg(argv[arg_index]);
+            const auto it = std::find_if(names.begin(), names.end(),
+                                         [&arg](const char* n) { return (n != nullptr) && (arg == n); });
+            if (it == names.end())
+            {
+                ios.print("ERROR: Unknown variable: %s\n", arg.c_str());
+                return;
+            }
+            selection = foc::debug_stream::Selection(selection | (1U << unsigned(it - names.begin())));
+        }
+
+        params::writeDebugVariableSelection(task->id, selection);
+        foc::debug_stream::setSelection(std::uint8_t(task->id), selection);
+        printSelection(ios, *task);
+    }
+
+    /**
+     * Format: <channel><edge><level>, e.g. 3>1.5
+     */
+    static bool parseTrigger(const char* const spec, foc::debug_stream::Config& inout_config)
+    {
+        using namespace std;
+
+        char* end = nullptr;
+        const unsigned long channel = strtoul(spec, &end, 10);
+        if ((end == spec) || (channel >= foc::debug_stream::NumChannels))
+        {
+            return false;
+        }
+
+        switch (*end)
+        {
+        case '>': inout_config.trigger_edge = foc::debug_stream::TriggerEdge::Rising;  break;
+        case '<': inout_config.trigger_edge = foc::debug_stream::TriggerEdge::Falling; break;
+        case '~': inout_config.trigger_edge = foc::debug_stream::TriggerEdge::Any;     break;
+        default:  return false;
+        }
+
+        inout_config.trigger_channel = std::uint8_t(channel);
+        inout_config.trigger_level = strtof(end + 1, nullptr);
+        return true;
+    }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int argc, char** argv) override
+    {
+        using namespace std;
+
+        const os::heapless::String<> cmd((argc >= 2) ? argv[1] : "");
+
+        if (cmd == "list")
+        {
+            for (unsigned i = 0; i < NumTasks; i++)
+            {
+                printSelection(ios, getTasks()[i]);
+            }
+            return;
+        }
+
+        if (cmd == "sel")
+        {
+            select(ios, argc, argv);
+            return;
+        }
+
+        auto config = params::readDebugStreamConfig();
+
+        if (argc >= 2)
+        {
+            config.decimation = std::uint16_t(std::min(strtoul(argv[1], nullptr, 10), 65535UL));
+        }
+        if ((argc >= 3) && !parseTrigger(argv[2], config))
+        {
+            ios.puts("ERROR: Invalid trigger");
+            return;
+        }
+        if (argc >= 4)
+        {
+            config.samples_per_trigger = std::uint16_t(std::min(strtoul(argv[3], nullptr, 10), 65535UL));
+        }
+
+        if ((argc > 4) || !config.isValid())
+        {
+            printUsage(ios, argv[0]);
+            return;
+        }
+
         ios.puts("PRESS ANY KEY TO STOP PLOTTING");
         ::sleep(1);               // Making sure the human has enough time to read the message
 
@@ -905,6 +1159,8 @@ class PlotCommand : public os::shell::ICommandHandler
             ;   // Clearing the input buffer
         }
 
+        const DebugStreamSubscription subscription(true, config);
+
         while (ios.getChar(0) <= 0)
         {
             foc::plotRealTimeValues();
@@ -913,6 +1169,321 @@ class PlotCommand : public os::shell::ICommandHandler
 } static cmd_plot;
 
 
+class TelemetryCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "telem"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int argc, char** argv) override
+    {
+        using namespace std;
+
+        const unsigned decimation = (argc >= 2) ? unsigned(strtoul(argv[1], nullptr, 10)) : 1U;
+        const std::uint32_t baudrate = (argc >= 3) ? std::uint32_t(strtoul(argv[2], nullptr, 10)) : 0U;
+
+        if ((argc > 3) || (decimation == 0))
+        {
+            ios.puts("Stream binary telemetry frames from the IRQs, see foc/telemetry.hpp and tools/serial_plot.");
+            ios.puts("The baud rate is temporarily changed if specified; the default is restored afterwards.");
+            ios.print("\t%s [fast-irq-decimation=1 [baudrate]]\n", argv[0]);
+            return;
+        }
+
+        ios.puts("PRESS ANY KEY TO STOP STREAMING");
+        ::sleep(1);
+
+        while (ios.getChar(1) > 0)
+        {
+            ;   // Clearing the input buffer
+        }
+
+        if (baudrate > 0)
+        {
+            board::setStdIOBaudRate(baudrate);
+        }
+
+        foc::telemetry::start(decimation, &uavcan_node::convertCycleCountToSynchronizedTime);
+
+        while (ios.getChar(0) <= 0)
+        {
+            if (foc::telemetry::flush(board::getStdIOChannel()) == 0)
+            {
+                ::usleep(1000);
+            }
+        }
+
+        foc::telemetry::stop();
+
+        if (baudrate > 0)
+        {
+            ::usleep(10000);      // Letting the remaining bytes out
+            board::setStdIOBaudRate(0);
+        }
+
+        ios.puts("\nTelemetry stopped");
+    }
+} static cmd_telemetry;
+
+
+class BlackboxCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "blackbox"; }
+
+    static const char* getStateName(const foc::blackbox::State state)
+    {
+        switch (state)
+        {
+        case foc::blackbox::State::Disarmed:  return "disarmed";
+        case foc::blackbox::State::Armed:     return "armed";
+        case foc::blackbox::State::Triggered: return "triggered";
+        case foc::blackbox::State::Frozen:    return "frozen";
+        }
+        return "?";
+    }
+
+    template <typename T>
+    static bool readImage(const std::uint32_t offset, T& out)
+    {
+        return foc::blackbox::read(offset, reinterpret_cast<std::uint8_t*>(&out), sizeof(out)) == int(sizeof(out));
+    }
+
+    static void dump(os::shell::BaseChannelWrapper& ios)
+    {
+        using namespace foc::blackbox;
+
+        ImageHeader header;
+        if (!readImage(0, header))
+        {
+            ios.puts("ERROR: Capture is not frozen");
+            return;
+        }
+
+        const auto cycles_per_usec = double(header.cycles_per_second) * 1e-6;
+        const auto usec_since_trigger = [&](std::uint32_t cycle_count)
+            {
+                return double(std::int32_t(cycle_count - header.triggered_at)) / cycles_per_usec;
+            };
+
+        ios.print("# Trigger %u, fast IRQ period %.3f us, decimation %u\n",
+                  unsigned(header.trigger_reason), double(header.fast_irq_period) * 1e6,
+                  unsigned(header.fast_irq_decimation));
+        ios.puts("# F,seq,usec,Ia,Ib,Vinv,PWM A,PWM B,PWM C");
+        ios.puts("# M,seq,usec,task,debug variables...");
+
+        std::uint32_t offset = header.header_size;
+
+        for (unsigned i = 0; i < header.num_fast_irq_records; i++, offset += header.fast_irq_record_size)
+        {
+            FastIRQRecord r;
+            if (!readImage(offset, r))
+            {
+                return;
+            }
+            ios.print("F,%u,%.1f,%.3f,%.3f,%.2f,%.4f,%.4f,%.4f\n",
+                      unsigned(r.sequence), usec_since_trigger(r.cycle_count),
+                      double(r.phase_currents_ab[0]), double(r.phase_currents_ab[1]), double(r.inverter_voltage),
+                      double(r.pwm_setpoint[0]) / 65535.0, double(r.pwm_setpoint[1]) / 65535.0,
+                      double(r.pwm_setpoint[2]) / 65535.0);
+        }
+
+        for (unsigned i = 0; i < header.num_main_irq_records; i++, offset += header.main_irq_record_size)
+        {
+            MainIRQRecord r;
+            if (!readImage(offset, r))
+            {
+                return;
+            }
+            ios.print("M,%u,%.1f,%u", unsigned(r.sequence), usec_since_trigger(r.cycle_count), unsigned(r.task_id));
+            for (auto x : r.debug_variables)
+            {
+                ios.print(",%g", double(x));
+            }
+            ios.puts("");
+        }
+    }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int argc, char** argv) override
+    {
+        using namespace foc::blackbox;
+
+        const os::heapless::String<> cmd((argc >= 2) ? argv[1] : "");
+
+        if (cmd == "arm")
+        {
+            arm(params::readBlackboxConfig());
+        }
+        else if (cmd == "disarm")
+        {
+            disarm();
+        }
+        else if (cmd == "trigger")
+        {
+            trigger(TriggerReason::Manual);
+        }
+        else if (cmd == "dump")
+        {
+            dump(ios);
+            return;
+        }
+        else if (!cmd.empty())
+        {
+            ios.puts("Post-mortem capture of the IRQ data, see foc/blackbox.hpp. Configured via bb.* params.");
+            ios.puts("The frozen capture can also be read via UAVCAN file read, path \"blackbox.bin\".");
+            ios.print("\t%s [arm|disarm|trigger|dump]\n", argv[0]);
+            return;
+        }
+        else
+        {
+            ;   // Just printing the state
+        }
+
+        ios.print("State: %s, trigger reason: %u, image size: %u bytes\n",
+                  getStateName(getState()), unsigned(getTriggerReason()), unsigned(getImageSize()));
+    }
+} static cmd_blackbox;
+
+
+class IRQProfileCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "irqprof"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int argc, char** argv) override
+    {
+        using namespace board::irq_profiler;
+
+        if (argc >= 2)
+        {
+            if (os::heapless::String<>(argv[1]) == "reset")
+            {
+                reset();
+                ios.puts("IRQ profiling statistics reset");
+            }
+            else
+            {
+                ios.print("Usage: %s [reset]\n", argv[0]);
+            }
+            return;
+        }
+
+        ios.puts("Stage    Samples      Avg us   Worst us | Histogram [lower bound us: count]");
+        ios.puts("----------------------------------------+-----------------------------------");
+
+        for (unsigned i = 0; i < NumStages; i++)
+        {
+            const auto stat = getStatistics(Stage(i));
+
+            ios.print("%-5s %10u %10.3f %10.3f |",
+                      getStageName(Stage(i)),
+                      unsigned(stat.num_samples),
+                      double(stat.getAverageDuration()) * 1e6,
+                      double(stat.getWorstDuration()) * 1e6);
+
+            for (unsigned k = 0; k < Statistics::NumHistogramBuckets; k++)
+            {
+                if (stat.histogram[k] > 0)
+                {
+                    ios.print(" %.2f:%u",
+                              double(Statistics::convertCyclesToSeconds(Statistics::getBucketLowerBoundCycles(k))) *
+                              1e6,
+                              unsigned(stat.histogram[k]));
+                }
+            }
+            ios.puts("");
+        }
+    }
+} static cmd_irq_profile;
+
+
+class LatencyBenchmarkCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "latbench"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int argc, char** argv) override
+    {
+        using namespace foc::latency_benchmark;
+
+        if (argc >= 2)
+        {
+            const os::heapless::String<> arg(argv[1]);
+            if (arg == "start")
+            {
+                start();
+                ios.puts("Latency benchmark started, the statistics have been reset");
+            }
+            else if (arg == "stop")
+            {
+                stop();
+                ios.puts("Latency benchmark stopped");
+            }
+            else
+            {
+                ios.print("Usage: %s [start|stop]\n", argv[0]);
+            }
+            return;
+        }
+
+        const auto stat = getStatistics();
+
+        ios.print("Active   : %s\n", isActive() ? "YES" : "NO");
+        ios.print("Samples  : %u\n", unsigned(stat.num_samples));
+        if (stat.num_samples == 0)
+        {
+            return;
+        }
+
+        ios.print("Min/Avg/Max: %.1f / %.1f / %.1f us\n",
+                  double(stat.min_latency) * 1e6,
+                  double(stat.getAverageLatency()) * 1e6,
+                  double(stat.max_latency) * 1e6);
+        ios.print("P50/P90/P99/P99.9: %.0f / %.0f / %.0f / %.0f us\n",
+                  double(stat.getPercentile(50.0F)) * 1e6,
+                  double(stat.getPercentile(90.0F)) * 1e6,
+                  double(stat.getPercentile(99.0F)) * 1e6,
+                  double(stat.getPercentile(99.9F)) * 1e6);
+
+        ios.puts("Histogram [lower bound us: count]:");
+        for (unsigned i = 0; i < Statistics::NumHistogramBuckets; i++)
+        {
+            if (stat.histogram[i] > 0)
+            {
+                ios.print(" %.0f:%u", double(float(i) * Statistics::BucketWidth) * 1e6, unsigned(stat.histogram[i]));
+            }
+        }
+        ios.puts("");
+    }
+} static cmd_latency_benchmark;
+
+
+class KernelBenchmarkCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "kbench"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int argc, char** argv) override
+    {
+        using namespace foc::kernel_benchmark;
+
+        unsigned num_iterations = 0;
+        if (argc >= 2)
+        {
+            num_iterations = unsigned(std::max(0L, std::strtol(argv[1], nullptr, 10)));
+            if ((num_iterations == 0) || (num_iterations > 100000))
+            {
+                ios.print("Usage: %s [iterations]\n", argv[0]);
+                return;
+            }
+        }
+
+        const auto result = run(num_iterations);
+
+        ios.print("Iterations: %u\n", result.num_iterations);
+        for (unsigned i = 0; i < NumKernels; i++)
+        {
+            ios.puts(result.toString(Kernel(i)).c_str());
+        }
+        ios.puts(result.isSuccessful() ? "OK" : "FAILED");
+    }
+} static cmd_kernel_benchmark;
+
+
 class SystemInfoCommand : public os::shell::ICommandHandler
 {
     const char* getName() const override { return "sysinfo"; }
@@ -958,19 +1529,6 @@ class SystemInfoCommand : public os::shell::ICommandHandler
     {
         const char* const ThreadStateNames[] = { CH_STATE_NAMES };
 
-        static const auto gauge_free_stack = [](const ::thread_t* tp)
-        {
-            const std::uint8_t* limit = reinterpret_cast<std::uint8_t*>(tp->p_stklimit);
-            const unsigned current = reinterpret_cast<unsigned>(tp->p_ctx.r13);
-            unsigned num_bytes = 0;
-            while ((*limit++ == CH_DBG_STACK_FILL_VALUE) &&
-                   (reinterpret_cast<unsigned>(limit) < current))
-            {
-                num_bytes++;
-            }
-            return num_bytes;
-        };
-
         std::uint64_t total_cumulative = 0;
 
         {
@@ -1003,7 +1561,7 @@ class SystemInfoCommand : public os::shell::ICommandHandler
             ios.print("%-16s %-9s %5u  %3u   %3u%% | %7.3f %7.3f %8.3f\n",
                       tp->p_name,
                       ThreadStateNames[tp->p_state],
-                      gauge_free_stack(tp),
+                      memory_usage::getThreadStackUsage(tp).free,
                       static_cast<unsigned>(tp->p_prio),
                       average_load,
                       average_timing * 1e3,
@@ -1029,9 +1587,63 @@ class SystemInfoCommand : public os::shell::ICommandHandler
 } static cmd_sysinfo;
 
 
+class MemoryUsageCommand : public os::shell::ICommandHandler
+{
+    const char* getName() const override { return "mem"; }
+
+    void execute(os::shell::BaseChannelWrapper& ios, int, char**) override
+    {
+        constexpr unsigned MaxThreads = 16;
+
+        static const auto print_stack = [](os::shell::BaseChannelWrapper& ios, const memory_usage::StackUsage& su)
+        {
+            if (su.size > 0)
+            {
+                ios.print("%-16s %6u %6u %6u\n", su.name, su.size, su.getPeakUsage(), su.free);
+            }
+            else
+            {
+                ios.print("%-16s %6s %6s %6u\n", su.name, "?", "?", su.free);
+            }
+        };
+
+        ios.puts("Stack [byte]       Size   Peak   Free");
+        print_stack(ios, memory_usage::getIRQStackUsage());
+
+        memory_usage::StackUsage threads[MaxThreads];
+        const unsigned num_threads = memory_usage::getThreadStackUsage(threads, MaxThreads);
+        for (unsigned i = 0; i < std::min(num_threads, MaxThreads); i++)
+        {
+            print_stack(ios, threads[i]);
+        }
+        if (num_threads > MaxThreads)
+        {
+            ios.print("(%u more threads not shown)\n", num_threads - MaxThreads);
+        }
+
+        const auto pool = uavcan_node::getMemoryPoolUsage();
+        ios.print("\nUAVCAN pool: %u blocks of %u B, used %u, peak %u (%u%%)\n",
+                  pool.capacity,
+                  unsigned(uavcan::MemPoolBlockSize),
+                  pool.usage,
+                  pool.peak_usage,
+                  (pool.capacity > 0) ? ((100U * pool.peak_usage) / pool.capacity) : 0U);
+
+        const auto tasks = foc::getTaskPoolUsage();
+        ios.print("Task pool  : %u slots of %u B, largest task %u B, peak %u B (%s)\n",
+                  tasks.num_slots,
+                  tasks.slot_size,
+                  tasks.largest_task_size,
+                  tasks.peak_task_size,
+                  tasks.peak_task_name);
+        ios.print("Motor ID subtask pool: %u B\n", tasks.subtask_pool_size);
+    }
+} static cmd_memory_usage;
+
+
 class CLIThread : public chibios_rt::BaseStaticThread<2048>
 {
-    os::shell::Shell<20> shell_;
+    os::shell::Shell<24> shell_;
     os::Logger logger{"CLI"};
 
     void main() override
@@ -1082,7 +1694,13 @@ public:
         (void) shell_.addCommandHandler(&cmd_hardware_test);
         (void) shell_.addCommandHandler(&cmd_motor_database);
         (void) shell_.addCommandHandler(&cmd_plot);
+        (void) shell_.addCommandHandler(&cmd_telemetry);
+        (void) shell_.addCommandHandler(&cmd_blackbox);
+        (void) shell_.addCommandHandler(&cmd_irq_profile);
+        (void) shell_.addCommandHandler(&cmd_latency_benchmark);
+        (void) shell_.addCommandHandler(&cmd_kernel_benchmark);
         (void) shell_.addCommandHandler(&cmd_sysinfo);
+        (void) shell_.addCommandHandler(&cmd_memory_usage);
     }
 
     virtual ~CLIThread() { }
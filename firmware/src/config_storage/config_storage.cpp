@@ -0,0 +1,471 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config_storage.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <cerrno>
+
+
+namespace config_storage
+{
+namespace
+{
+
+os::Logger g_logger("ConfigStorage");
+
+}
+
+// Out-of-line definitions are needed because of ODR-use
+constexpr unsigned LogStructuredStorage::ImageSize;
+constexpr std::uint32_t LogStructuredStorage::Magic;
+constexpr unsigned LogStructuredStorage::HeaderSize;
+constexpr unsigned LogStructuredStorage::RecordHeaderSize;
+constexpr unsigned LogStructuredStorage::MaxRecordPayloadSize;
+constexpr unsigned LogStructuredStorage::MaxRecordGap;
+constexpr unsigned LogStructuredStorage::MaxSnapshotSize;
+
+LogStructuredStorage::LogStructuredStorage(os::config::IStorageBackend& medium, std::size_t medium_size)
+{
+    assert(medium_size >= MaxSnapshotSize);
+    main_.medium = &medium;
+    main_.size = medium_size;
+    image_.fill(0xFF);
+    persisted_.fill(0xFF);
+}
+
+void LogStructuredStorage::setScratchRegion(os::config::IStorageBackend& medium, std::size_t medium_size)
+{
+    os::MutexLocker locker(mutex_);
+    assert(!initialized_);
+    assert(medium_size >= MaxSnapshotSize);
+    scratch_.medium = &medium;
+    scratch_.size = medium_size;
+}
+
+std::uint8_t LogStructuredStorage::computeCRC(std::uint16_t offset, std::uint8_t size, const std::uint8_t* payload)
+{
+    // CRC-8, polynomial 0x07, initial value 0xFF
+    std::uint8_t crc = 0xFFU;
+    const auto update = [&crc](std::uint8_t byte)
+    {
+        crc = std::uint8_t(crc ^ byte);
+        for (unsigned i = 0; i < 8; i++)
+        {
+            crc = ((crc & 0x80U) != 0) ? std::uint8_t((crc << 1) ^ 0x07U) : std::uint8_t(crc << 1);
+        }
+    };
+
+    update(std::uint8_t(offset));
+    update(std::uint8_t(offset >> 8));
+    update(size);
+    for (unsigned i = 0; i < size; i++)
+    {
+        update(payload[i]);
+    }
+    return crc;
+}
+
+int LogStructuredStorage::replay(Region& region,
+                                 std::array<std::uint8_t, ImageSize>& out_image,
+                                 std::uint32_t& out_num_erasures)
+{
+    out_image.fill(0xFF);
+    region.log_end = HeaderSize;
+
+    std::uint32_t header[HeaderSize / 4] = {};
+    int res = region.medium->read(0, header, HeaderSize);
+    if (res < 0)
+    {
+        return res;
+    }
+
+    if (header[0] != Magic)
+    {
+        return -ENOENT;
+    }
+
+    out_num_erasures = header[1];
+
+    std::size_t pos = HeaderSize;
+    while ((pos + RecordHeaderSize) <= region.size)
+    {
+        std::uint8_t record_header[RecordHeaderSize] = {};
+        res = region.medium->read(pos, record_header, RecordHeaderSize);
+        if (res < 0)
+        {
+            break;
+        }
+
+        if (std::all_of(std::begin(record_header), std::end(record_header),
+                        [](std::uint8_t x) { return x == 0xFFU; }))
+        {
+            break;
+        }
+
+        const auto offset = std::uint16_t(record_header[0] | (record_header[1] << 8));
+        const auto size = record_header[2];
+        if ((size == 0) ||
+            (size > MaxRecordPayloadSize) ||
+            ((offset + size) > ImageSize) ||
+            ((pos + RecordHeaderSize + alignUp(size)) > region.size))
+        {
+            res = -EILSEQ;
+            break;
+        }
+
+        std::uint8_t payload[MaxRecordPayloadSize] = {};
+        res = region.medium->read(pos + RecordHeaderSize, payload, size);
+        if (res < 0)
+        {
+            break;
+        }
+
+        if (computeCRC(offset, size, payload) != record_header[3])
+        {
+            res = -EILSEQ;
+            break;
+        }
+
+        std::copy_n(&payload[0], size, out_image.begin() + offset);
+        pos += RecordHeaderSize + alignUp(size);
+    }
+
+    region.log_end = pos;
+    return (res < 0) ? res : 0;
+}
+
+void LogStructuredStorage::init()
+{
+    initialized_ = true;
+
+    if ((scratch_.medium != nullptr) &&
+        (replay(scratch_, image_, num_erasures_) >= 0))
+    {
+        // The main region may be incomplete, it will be rewritten on the next write
+        persisted_ = image_;
+        compaction_pending_ = true;
+        g_logger.println("Compaction was interrupted, the image is recovered from the scratch region");
+        return;
+    }
+
+    int res = replay(main_, image_, num_erasures_);
+    if (res == -ENOENT)
+    {
+        // Either blank, or written by the legacy backend that stored the raw image at the beginning
+        res = main_.medium->read(0, image_.data(), ImageSize);
+        if (res < 0)
+        {
+            g_logger.println("Image read error %d", res);
+            image_.fill(0xFF);
+        }
+        persisted_ = image_;
+        compaction_pending_ = true;
+        g_logger.println("No log found, the region will be reformatted on the next write");
+        return;
+    }
+
+    persisted_ = image_;
+
+    if (res < 0)
+    {
+        g_logger.println("Log replay stopped at %u: error %d", unsigned(main_.log_end), res);
+        compaction_pending_ = true;
+        return;
+    }
+
+    // An interrupted append may have left a payload behind the last valid record; it cannot be programmed over
+    const std::size_t tail_end = std::min(main_.size, main_.log_end + RecordHeaderSize + MaxRecordPayloadSize);
+    for (std::size_t i = main_.log_end; i < tail_end; i++)
+    {
+        std::uint8_t x = 0;
+        if ((main_.medium->read(i, &x, 1) < 0) || (x != 0xFFU))
+        {
+            g_logger.println("Dirty log tail at %u", unsigned(i));
+            compaction_pending_ = true;
+            break;
+        }
+    }
+}
+
+int LogStructuredStorage::appendRecord(Region& region, std::size_t offset, std::size_t size)
+{
+    std::uint8_t payload[MaxRecordPayloadSize];
+    std::fill(std::begin(payload), std::end(payload), 0xFFU);
+    std::copy_n(image_.begin() + offset, size, &payload[0]);
+
+    int res = region.medium->write(region.log_end + RecordHeaderSize, payload, alignUp(size));
+    if (res < 0)
+    {
+        return res;
+    }
+
+    const std::uint8_t record_header[RecordHeaderSize] =
+    {
+        std::uint8_t(offset),
+        std::uint8_t(offset >> 8),
+        std::uint8_t(size),
+        computeCRC(std::uint16_t(offset), std::uint8_t(size), payload)
+    };
+
+    res = region.medium->write(region.log_end, record_header, RecordHeaderSize);
+    if (res < 0)
+    {
+        // The payload is already programmed, so this location cannot be reused
+        compaction_pending_ = true;
+        return res;
+    }
+
+    std::copy_n(image_.begin() + offset, size, persisted_.begin() + offset);
+    region.log_end += RecordHeaderSize + alignUp(size);
+    return 0;
+}
+
+int LogStructuredStorage::writeChangedRuns(Region& region, std::size_t begin, std::size_t end, bool allow_compaction)
+{
+    std::size_t i = begin;
+    while (i < end)
+    {
+        if (image_[i] == persisted_[i])
+        {
+            i++;
+            continue;
+        }
+
+        // Extending the run over short unchanged gaps, because a record header costs more than a few bytes
+        std::size_t last_changed = i;
+        for (std::size_t k = i + 1; (k < end) && ((k - i) < MaxRecordPayloadSize); k++)
+        {
+            if (image_[k] != persisted_[k])
+            {
+                last_changed = k;
+            }
+            else if ((k - last_changed) > MaxRecordGap)
+            {
+                break;
+            }
+        }
+
+        const std::size_t size = last_changed + 1 - i;
+        if ((region.log_end + RecordHeaderSize + alignUp(size)) > region.size)
+        {
+            return allow_compaction ? compact() : -ENOSPC;
+        }
+
+        const int res = appendRecord(region, i, size);
+        if (res < 0)
+        {
+            return res;
+        }
+        i += size;
+    }
+    return 0;
+}
+
+int LogStructuredStorage::writeSnapshot(Region& region)
+{
+    int res = region.medium->erase();
+    if (res < 0)
+    {
+        return res;
+    }
+
+    persisted_.fill(0xFF);
+    region.log_end = HeaderSize;
+
+    // The scratch region is valid only if it has the header, so there the header goes after the records
+    const bool is_scratch = &region == &scratch_;
+    const std::uint32_t header[HeaderSize / 4] = { Magic, num_erasures_ };
+
+    if (!is_scratch)
+    {
+        res = region.medium->write(0, header, HeaderSize);
+        if (res < 0)
+        {
+            return res;
+        }
+    }
+
+    res = writeChangedRuns(region, 0, ImageSize, false);
+    if (res < 0)
+    {
+        return res;
+    }
+
+    if (is_scratch)
+    {
+        res = region.medium->write(0, header, HeaderSize);
+        if (res < 0)
+        {
+            return res;
+        }
+    }
+
+    // From now on the persisted image is what the region actually yields
+    std::uint32_t num_erasures = 0;
+    res = replay(region, persisted_, num_erasures);
+    if ((res >= 0) &&
+        ((persisted_ != image_) || (num_erasures != num_erasures_)))
+    {
+        res = -EIO;
+    }
+    return res;
+}
+
+int LogStructuredStorage::compact()
+{
+    compaction_pending_ = true;
+    num_erasures_++;
+
+    int res = 0;
+
+    if (scratch_.medium != nullptr)
+    {
+        res = writeSnapshot(scratch_);
+        if (res < 0)
+        {
+            (void) scratch_.medium->erase();    // A snapshot that failed verification must not be recovered from
+            return res;
+        }
+    }
+
+    res = writeSnapshot(main_);
+    if (res < 0)
+    {
+        return res;         // If there is a scratch region, the image will be recovered from it after a reboot
+    }
+
+    if (scratch_.medium != nullptr)
+    {
+        // Until the scratch region is erased, it takes precedence on startup, so nothing can be appended yet
+        res = scratch_.medium->erase();
+        if (res < 0)
+        {
+            return res;
+        }
+    }
+
+    compaction_pending_ = false;
+    erasure_pending_ = false;
+
+    g_logger.println("Compacted: %u bytes, %u erasures", unsigned(main_.log_end), unsigned(num_erasures_));
+    return 0;
+}
+
+int LogStructuredStorage::persistRange(std::size_t begin, std::size_t end)
+{
+    if (compaction_pending_)
+    {
+        return compact();
+    }
+    return writeChangedRuns(main_, begin, end, true);
+}
+
+int LogStructuredStorage::read(std::size_t offset, void* data, std::size_t len)
+{
+    os::MutexLocker locker(mutex_);
+
+    if ((data == nullptr) || ((offset + len) > ImageSize))
+    {
+        return -EINVAL;
+    }
+
+    if (!initialized_)
+    {
+        init();
+    }
+
+    std::copy_n(image_.begin() + offset, len, static_cast<std::uint8_t*>(data));
+    return 0;
+}
+
+int LogStructuredStorage::write(std::size_t offset, const void* data, std::size_t len)
+{
+    os::MutexLocker locker(mutex_);
+
+    if ((data == nullptr) || ((offset + len) > ImageSize))
+    {
+        return -EINVAL;
+    }
+
+    if (!initialized_)
+    {
+        init();
+    }
+
+    std::copy_n(static_cast<const std::uint8_t*>(data), len, image_.begin() + offset);
+
+    return persistRange(offset, offset + len);
+}
+
+int LogStructuredStorage::erase()
+{
+    os::MutexLocker locker(mutex_);
+
+    if (!initialized_)
+    {
+        init();
+    }
+
+    image_.fill(0xFF);
+    erasure_pending_ = true;
+    return 0;
+}
+
+int LogStructuredStorage::flush()
+{
+    os::MutexLocker locker(mutex_);
+
+    if (!initialized_ ||
+        (!erasure_pending_ && !compaction_pending_ && (image_ == persisted_)))
+    {
+        return 0;
+    }
+
+    const int res = persistRange(0, ImageSize);
+    if (res >= 0)
+    {
+        erasure_pending_ = false;
+    }
+    return res;
+}
+
+bool LogStructuredStorage::hasPendingChanges() const
+{
+    os::MutexLocker locker(mutex_);
+    return erasure_pending_ || compaction_pending_ || (image_ != persisted_);
+}
+
+LogStructuredStorage::Statistics LogStructuredStorage::getStatistics() const
+{
+    os::MutexLocker locker(mutex_);
+    Statistics out;
+    out.log_bytes_used = std::uint32_t(main_.log_end);
+    out.log_bytes_total = std::uint32_t(main_.size);
+    out.num_erasures = num_erasures_;
+    return out;
+}
+
+}
@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <zubax_chibios/os.hpp>
+#include <zubax_chibios/config/config.hpp>
+#include <cstdint>
+#include <cstddef>
+#include <array>
+
+
+namespace config_storage
+{
+/**
+ * Log-structured, append-only storage of the configuration image on top of a flash region.
+ *
+ * The configuration core sees a plain linear image of @ref ImageSize bytes, which is kept in RAM.
+ * Every write appends only the bytes that differ from the persisted image, as CRC-protected records, to a log
+ * in the underlying region; the region is erased only when the log is full, after which the current image is
+ * written back as a compact snapshot. Therefore, a typical save costs a few word writes instead of a sector erase,
+ * and the flash wears out proportionally to the amount of changed data rather than to the number of saves.
+ *
+ * Region layout:
+ *      Header      (magic, erase counter)
+ *      Record      (uint16 image offset, uint8 payload size, uint8 CRC-8), payload padded to 4 bytes
+ *      Record
+ *      ...         (erased)
+ *
+ * The payload of a record is written before its header, so an interrupted append never yields a valid record.
+ * A region that does not contain the header is treated as a raw image written by the legacy storage backend.
+ *
+ * The compaction erases the region, so the configuration would be lost if the power failed before the snapshot is
+ * rewritten. This is prevented by a scratch region in a separate flash sector, see @ref setScratchRegion():
+ * the snapshot is written and verified there first, then the main region is rewritten and verified, and only then
+ * the scratch region is erased. A valid snapshot found in the scratch region on startup means that a compaction
+ * was interrupted, so it takes precedence over the main region. The log itself always stays in the main region,
+ * therefore the scratch region can be located where it may be erased by others, e.g. by the bootloader.
+ *
+ * Erasure of the image is deferred until the next write or @ref flush(), because the configuration core
+ * erases the storage immediately before rewriting it from scratch; this way, unchanged values are not re-logged.
+ *
+ * All methods are thread safe.
+ */
+class LogStructuredStorage : public os::config::IStorageBackend
+{
+public:
+    static constexpr unsigned ImageSize = 2048;
+
+    struct Statistics
+    {
+        std::uint32_t log_bytes_used = 0;
+        std::uint32_t log_bytes_total = 0;
+        std::uint32_t num_erasures = 0;         ///< Over the lifetime of the region
+    };
+
+private:
+    static constexpr std::uint32_t Magic = 0x4C474643U;        ///< "CFGL"
+    static constexpr unsigned HeaderSize = 8;
+    static constexpr unsigned RecordHeaderSize = 4;
+    static constexpr unsigned MaxRecordPayloadSize = 32;
+    static constexpr unsigned MaxRecordGap = RecordHeaderSize;  ///< Shorter unchanged runs are merged into records
+
+    /// Worst case, when every byte of the image differs from the erased state
+    static constexpr unsigned MaxSnapshotSize =
+        HeaderSize + (ImageSize / MaxRecordPayloadSize) * (RecordHeaderSize + MaxRecordPayloadSize);
+
+    struct Region
+    {
+        os::config::IStorageBackend* medium = nullptr;
+        std::size_t size = 0;
+        std::size_t log_end = 0;
+    };
+
+    Region main_;
+    Region scratch_;
+
+    mutable chibios_rt::Mutex mutex_;
+
+    std::array<std::uint8_t, ImageSize> image_;                 ///< What the configuration core sees
+    std::array<std::uint8_t, ImageSize> persisted_;             ///< What the region would yield after a reboot
+
+    std::uint32_t num_erasures_ = 0;
+    bool initialized_ = false;
+    bool erasure_pending_ = false;
+    bool compaction_pending_ = false;
+
+    static std::size_t alignUp(std::size_t x) { return (x + 3U) & ~std::size_t(3U); }
+
+    static std::uint8_t computeCRC(std::uint16_t offset, std::uint8_t size, const std::uint8_t* payload);
+
+    /**
+     * Reconstructs the image from the log in the region. Returns -ENOENT if the region does not contain the header;
+     * on other errors, the output contains the records that have been replayed before the error.
+     */
+    int replay(Region& region, std::array<std::uint8_t, ImageSize>& out_image, std::uint32_t& out_num_erasures);
+
+    void init();
+
+    int appendRecord(Region& region, std::size_t offset, std::size_t size);
+
+    /**
+     * Logs the differences between the image and the persisted image within the specified range.
+     * If the log runs out of space, either compacts the region, or fails with -ENOSPC if compaction is not allowed.
+     */
+    int writeChangedRuns(Region& region, std::size_t begin, std::size_t end, bool allow_compaction);
+
+    /**
+     * Erases the region, writes the image into it as a compact log, and verifies it by reading it back.
+     */
+    int writeSnapshot(Region& region);
+
+    int compact();
+
+    int persistRange(std::size_t begin, std::size_t end);
+
+public:
+    LogStructuredStorage(os::config::IStorageBackend& medium, std::size_t medium_size);
+
+    /**
+     * Enables the power loss protection of the compaction, see above. The scratch region must be in a flash sector
+     * that is not shared with the main region. Must be invoked before the storage is accessed for the first time.
+     */
+    void setScratchRegion(os::config::IStorageBackend& medium, std::size_t medium_size);
+
+    int read(std::size_t offset, void* data, std::size_t len) override;
+
+    int write(std::size_t offset, const void* data, std::size_t len) override;
+
+    int erase() override;
+
+    /**
+     * Persists the changes that are still held in RAM, i.e. a deferred erasure, or a write that was denied by
+     * the underlying medium. Should be invoked periodically; does nothing if there are no such changes.
+     */
+    int flush();
+
+    bool hasPendingChanges() const;
+
+    Statistics getStatistics() const;
+};
+
+}
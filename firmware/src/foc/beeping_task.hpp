@@ -39,7 +39,7 @@ class BeepingTask : public ITask
 
     static constexpr Result::ExitCode ExitCodeBadHardwareStatus = 1;
 
-    const TaskContext context_;
+    const TaskContext& context_;        ///< Kept alive by the task handler
 
     Const excitation_period_ = 0;
 
@@ -85,8 +85,8 @@ public:
         // Beeping
         if (remaining_duration_ >= 0)
         {
-            remaining_duration_ -= context_.board.pwm.period;
-            time_to_next_excitation_ -= context_.board.pwm.period;
+            remaining_duration_ -= context_.board.pwm.fast_irq_period;
+            time_to_next_excitation_ -= context_.board.pwm.fast_irq_period;
             if (time_to_next_excitation_ <= 0)
             {
                 time_to_next_excitation_ += excitation_period_;
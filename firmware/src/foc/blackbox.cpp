@@ -0,0 +1,321 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "blackbox.hpp"
+#include <board/motor.hpp>
+#include <board/irq_profiler.hpp>
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <utility>
+
+
+namespace foc
+{
+namespace blackbox
+{
+namespace
+{
+/**
+ * Single producer ring buffer; the consumer may access it only when the producer is stopped.
+ */
+template <typename Record, unsigned Capacity>
+class RecordRing
+{
+    std::array<Record, Capacity> records_{};
+    unsigned next_ = 0;
+    unsigned size_ = 0;
+    unsigned remaining_after_trigger_ = 0;
+
+public:
+    static constexpr unsigned NumRecordsAfterTrigger = Capacity / 4;
+
+    void clear()
+    {
+        next_ = 0;
+        size_ = 0;
+        remaining_after_trigger_ = NumRecordsAfterTrigger;
+    }
+
+    void push(const Record& rec, const bool triggered)
+    {
+        if (triggered)
+        {
+            if (remaining_after_trigger_ == 0)
+            {
+                return;
+            }
+            remaining_after_trigger_--;
+        }
+
+        records_[next_] = rec;
+        next_ = ((next_ + 1U) < Capacity) ? (next_ + 1U) : 0U;
+        size_ = std::min(size_ + 1U, Capacity);
+    }
+
+    bool isAftermathRecorded() const { return remaining_after_trigger_ == 0; }
+
+    unsigned size() const { return size_; }
+
+    /**
+     * Zero index is the oldest record.
+     */
+    const Record& get(const unsigned index) const
+    {
+        assert(index < size_);
+        return records_[(next_ + Capacity - size_ + index) % Capacity];
+    }
+};
+
+constexpr math::Range<> PWMRange(0.0F, 1.0F);
+
+RecordRing<FastIRQRecord, FastIRQRecordCapacity> g_fast_irq_ring;
+RecordRing<MainIRQRecord, MainIRQRecordCapacity> g_main_irq_ring;
+
+volatile State g_state = State::Disarmed;
+Config g_config;
+
+TriggerReason g_trigger_reason = TriggerReason::None;
+std::uint32_t g_triggered_at = 0;
+
+unsigned g_fast_irq_decimation_counter = 0;
+std::uint16_t g_fast_irq_sequence = 0;
+std::uint16_t g_main_irq_sequence = 0;
+
+
+/**
+ * Invoked from both IRQs after every record; the fast IRQ may preempt the main IRQ here, which is harmless.
+ */
+void freezeIfAftermathRecorded()
+{
+    if ((g_state == State::Triggered) &&
+        g_fast_irq_ring.isAftermathRecorded() &&
+        g_main_irq_ring.isAftermathRecorded())
+    {
+        g_state = State::Frozen;
+    }
+}
+
+ImageHeader makeImageHeader()
+{
+    ImageHeader h;
+    h.trigger_reason = std::uint8_t(g_trigger_reason);
+    h.cycles_per_second = std::uint32_t(STM32_SYSCLK);
+    h.triggered_at = g_triggered_at;
+    h.fast_irq_period = board::motor::getPWMParameters().fast_irq_period;
+    h.fast_irq_decimation = g_config.fast_irq_decimation;
+    h.num_fast_irq_records = std::uint16_t(g_fast_irq_ring.size());
+    h.num_main_irq_records = std::uint16_t(g_main_irq_ring.size());
+    return h;
+}
+
+/**
+ * Returns the pointer to the byte at the specified offset of the image, and the number of contiguous bytes
+ * available from there; nullptr past the end.
+ */
+std::pair<const std::uint8_t*, unsigned> locateImageBytes(const ImageHeader& header, std::uint32_t offset)
+{
+    if (offset < sizeof(header))
+    {
+        return {reinterpret_cast<const std::uint8_t*>(&header) + offset, unsigned(sizeof(header) - offset)};
+    }
+    offset -= std::uint32_t(sizeof(header));
+
+    if (offset < (g_fast_irq_ring.size() * sizeof(FastIRQRecord)))
+    {
+        const auto& rec = g_fast_irq_ring.get(offset / sizeof(FastIRQRecord));
+        const unsigned pos = offset % sizeof(FastIRQRecord);
+        return {reinterpret_cast<const std::uint8_t*>(&rec) + pos, unsigned(sizeof(FastIRQRecord) - pos)};
+    }
+    offset -= std::uint32_t(g_fast_irq_ring.size() * sizeof(FastIRQRecord));
+
+    if (offset < (g_main_irq_ring.size() * sizeof(MainIRQRecord)))
+    {
+        const auto& rec = g_main_irq_ring.get(offset / sizeof(MainIRQRecord));
+        const unsigned pos = offset % sizeof(MainIRQRecord);
+        return {reinterpret_cast<const std::uint8_t*>(&rec) + pos, unsigned(sizeof(MainIRQRecord) - pos)};
+    }
+
+    return {nullptr, 0};
+}
+
+} // namespace
+
+void arm(const Config& config)
+{
+    board::motor::AbsoluteCriticalSectionLocker locker;
+
+    g_config = config;
+    g_config.fast_irq_decimation = std::max<std::uint16_t>(g_config.fast_irq_decimation, 1U);
+
+    g_fast_irq_ring.clear();
+    g_main_irq_ring.clear();
+
+    g_trigger_reason = TriggerReason::None;
+    g_triggered_at = 0;
+    g_fast_irq_decimation_counter = 0;
+    g_fast_irq_sequence = 0;
+    g_main_irq_sequence = 0;
+
+    g_state = State::Armed;
+}
+
+void disarm()
+{
+    g_state = State::Disarmed;
+}
+
+void trigger(const TriggerReason reason)
+{
+    if ((reason != TriggerReason::Manual) &&
+        ((g_config.trigger_mask & triggerReasonToMask(reason)) == 0))
+    {
+        return;
+    }
+
+    board::motor::AbsoluteCriticalSectionLocker locker;
+
+    if (g_state == State::Armed)
+    {
+        g_trigger_reason = reason;
+        g_triggered_at = board::irq_profiler::getCycleCount();
+        g_state = State::Triggered;
+    }
+}
+
+State getState()
+{
+    return g_state;
+}
+
+bool isRecording()
+{
+    return (g_state == State::Armed) || (g_state == State::Triggered);
+}
+
+TriggerReason getTriggerReason()
+{
+    return g_trigger_reason;
+}
+
+std::uint32_t getImageSize()
+{
+    if (g_state != State::Frozen)
+    {
+        return 0;
+    }
+
+    return std::uint32_t(sizeof(ImageHeader) +
+                         g_fast_irq_ring.size() * sizeof(FastIRQRecord) +
+                         g_main_irq_ring.size() * sizeof(MainIRQRecord));
+}
+
+int read(const std::uint32_t offset, std::uint8_t* const out_data, const unsigned size)
+{
+    if (g_state != State::Frozen)
+    {
+        return -1;
+    }
+
+    const ImageHeader header = makeImageHeader();
+
+    unsigned num_read = 0;
+    while (num_read < size)
+    {
+        const auto location = locateImageBytes(header, offset + num_read);
+        if (location.first == nullptr)
+        {
+            break;
+        }
+
+        const unsigned chunk = std::min(location.second, size - num_read);
+        std::memcpy(out_data + num_read, location.first, chunk);
+        num_read += chunk;
+    }
+
+    return int(num_read);
+}
+
+BOARD_RAM_FUNCTION
+void onFastIRQ(const math::Vector<2>& phase_currents_ab,
+               const Scalar inverter_voltage,
+               const math::Vector<3>& pwm_setpoint)
+{
+    if (!isRecording())
+    {
+        return;
+    }
+
+    if (os::float_eq::positive(g_config.overcurrent_threshold))
+    {
+        const Scalar max_current = std::max(std::max(std::abs(phase_currents_ab[0]),
+                                                     std::abs(phase_currents_ab[1])),
+                                            std::abs(phase_currents_ab.sum()));
+        if (max_current > g_config.overcurrent_threshold)
+        {
+            trigger(TriggerReason::Overcurrent);
+        }
+    }
+
+    if (++g_fast_irq_decimation_counter < g_config.fast_irq_decimation)
+    {
+        return;
+    }
+    g_fast_irq_decimation_counter = 0;
+
+    FastIRQRecord rec;
+    rec.cycle_count = board::irq_profiler::getCycleCount();
+    rec.phase_currents_ab = {phase_currents_ab[0], phase_currents_ab[1]};
+    rec.inverter_voltage = inverter_voltage;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        rec.pwm_setpoint[i] = std::uint16_t(PWMRange.constrain(pwm_setpoint[i]) * 65535.0F + 0.5F);
+    }
+    rec.sequence = g_fast_irq_sequence++;
+
+    g_fast_irq_ring.push(rec, g_state == State::Triggered);
+    freezeIfAftermathRecorded();
+}
+
+BOARD_RAM_FUNCTION
+void onMainIRQ(const std::uint8_t task_id,
+               const std::array<Scalar, ITask::NumDebugVariables>& debug_variables)
+{
+    if (!isRecording())
+    {
+        return;
+    }
+
+    MainIRQRecord rec;
+    rec.cycle_count = board::irq_profiler::getCycleCount();
+    rec.task_id = task_id;
+    rec.sequence = g_main_irq_sequence++;
+    std::copy(debug_variables.begin(), debug_variables.end(), rec.debug_variables.begin());
+
+    g_main_irq_ring.push(rec, g_state == State::Triggered);
+    freezeIfAftermathRecorded();
+}
+
+}
+}
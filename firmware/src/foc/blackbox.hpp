@@ -0,0 +1,167 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "task.hpp"
+#include <cstdint>
+#include <array>
+
+
+namespace foc
+{
+/**
+ * Post-mortem capture of the IRQ data at full rate.
+ * The fast and the main IRQs write fixed size binary records into two RAM ring buffers, without locking and
+ * without any formatting. When triggered, the recording continues for a quarter of the buffer length, so that
+ * the capture contains both the history and the aftermath of the event, and then the buffers are frozen until
+ * re-armed. The frozen capture can be downloaded via the CLI or via UAVCAN file read, see @ref read().
+ *
+ * Layout of the downloadable image, all fields are little endian:
+ *      Header                  see @ref ImageHeader
+ *      FastIRQRecord[]         oldest first, see @ref FastIRQRecord
+ *      MainIRQRecord[]         oldest first, see @ref MainIRQRecord
+ */
+namespace blackbox
+{
+
+constexpr unsigned FastIRQRecordCapacity = 512;
+constexpr unsigned MainIRQRecordCapacity = 256;
+
+enum class TriggerReason : std::uint8_t
+{
+    None,
+    Fault,              ///< The fault task has been entered
+    Stall,              ///< The running task has detected a stall
+    Overcurrent,        ///< The phase current has exceeded the configured threshold
+    Manual              ///< Requested by the user
+};
+
+constexpr std::uint8_t triggerReasonToMask(const TriggerReason r) { return std::uint8_t(1U << unsigned(r)); }
+
+struct Config
+{
+    /// Bit mask of the enabled trigger reasons, see @ref triggerReasonToMask(). Manual trigger is always enabled.
+    std::uint8_t trigger_mask = triggerReasonToMask(TriggerReason::Fault) |
+                                triggerReasonToMask(TriggerReason::Stall) |
+                                triggerReasonToMask(TriggerReason::Overcurrent);
+
+    float overcurrent_threshold = 0;            ///< Ampere, phase current magnitude; zero disables
+    std::uint16_t fast_irq_decimation = 1;      ///< Every Nth fast IRQ is recorded
+
+    /// The recording costs time in both IRQs, so by default it is started only on request, e.g. via the CLI
+    bool arm_at_boot = false;
+};
+
+enum class State : std::uint8_t
+{
+    Disarmed,
+    Armed,
+    Triggered,          ///< Recording the aftermath
+    Frozen
+};
+
+struct FastIRQRecord
+{
+    std::uint32_t cycle_count = 0;              ///< See board::irq_profiler::getCycleCount()
+    std::array<float, 2> phase_currents_ab{};   ///< Ampere
+    float inverter_voltage = 0;                 ///< Volt
+    std::array<std::uint16_t, 3> pwm_setpoint{};///< [0, 1] scaled to [0, 65535]
+    std::uint16_t sequence = 0;                 ///< Incremented per recorded IRQ
+};
+
+struct MainIRQRecord
+{
+    std::uint32_t cycle_count = 0;
+    std::uint8_t task_id = 0;                   ///< Same as in the fault code
+    std::uint8_t reserved = 0;
+    std::uint16_t sequence = 0;
+    std::array<float, ITask::NumDebugVariables> debug_variables{};      ///< Selection, see debug_stream.hpp
+};
+
+struct ImageHeader
+{
+    static constexpr std::uint32_t MagicValue = 0x31584242U;           ///< "BBX1"
+
+    std::uint32_t magic = MagicValue;
+    std::uint16_t header_size = sizeof(ImageHeader);
+    std::uint8_t trigger_reason = 0;            ///< See @ref TriggerReason
+    std::uint8_t reserved = 0;
+    std::uint32_t cycles_per_second = 0;
+    std::uint32_t triggered_at = 0;             ///< Cycle count
+    float fast_irq_period = 0;                  ///< Second, before decimation
+    std::uint16_t fast_irq_decimation = 0;
+    std::uint16_t fast_irq_record_size = sizeof(FastIRQRecord);
+    std::uint16_t num_fast_irq_records = 0;
+    std::uint16_t main_irq_record_size = sizeof(MainIRQRecord);
+    std::uint16_t num_main_irq_records = 0;
+    std::uint16_t reserved2 = 0;
+};
+
+static_assert(sizeof(FastIRQRecord) == 24, "Record layout");
+static_assert(sizeof(MainIRQRecord) == (8 + 4 * ITask::NumDebugVariables), "Record layout");
+static_assert(sizeof(ImageHeader) == 32, "Header layout");
+
+/**
+ * Clears the buffers and starts recording. Must be invoked from a thread.
+ */
+void arm(const Config& config);
+void disarm();
+
+/**
+ * Can be invoked from any context. Does nothing unless armed and the reason is enabled.
+ */
+void trigger(TriggerReason reason);
+
+State getState();
+
+/**
+ * True if armed or triggered; can be invoked from any context.
+ */
+bool isRecording();
+TriggerReason getTriggerReason();
+
+/**
+ * Returns the size of the downloadable image, or zero if the capture is not frozen.
+ */
+std::uint32_t getImageSize();
+
+/**
+ * Reads the image of the frozen capture; can be invoked from any thread.
+ * @return      Number of bytes read (zero at the end of the image), or negative if the capture is not frozen.
+ */
+int read(std::uint32_t offset, std::uint8_t* out_data, unsigned size);
+
+/**
+ * Invoked from the IRQs; do nothing unless recording.
+ */
+void onFastIRQ(const math::Vector<2>& phase_currents_ab,
+               Scalar inverter_voltage,
+               const math::Vector<3>& pwm_setpoint);
+
+void onMainIRQ(std::uint8_t task_id,
+               const std::array<Scalar, ITask::NumDebugVariables>& debug_variables);
+
+}
+}
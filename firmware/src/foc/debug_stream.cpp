@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "debug_stream.hpp"
+#include "seqlock.hpp"
+#include <board/motor.hpp>
+#include <board/irq_profiler.hpp>
+#include <algorithm>
+
+
+namespace foc
+{
+namespace debug_stream
+{
+namespace
+{
+/*
+ * At the default decimation ratio, the queue covers about 0.2 second of the stream.
+ */
+SPSCQueue<Sample, 64> g_queue;
+
+std::array<volatile Selection, MaxTaskTypes> g_selections{};
+
+volatile bool g_subscribed = false;
+Config g_config;
+
+bool g_waiting_for_trigger = false;
+bool g_stream_started = false;
+bool g_previous_trigger_value_valid = false;
+Scalar g_previous_trigger_value = 0;
+std::uint8_t g_previous_task_id = 0;
+
+unsigned g_decimation_counter = 0;
+unsigned g_remaining_samples = 0;
+std::uint16_t g_sequence = 0;
+
+
+Selection normalizeSelection(const Selection selection)
+{
+    return (selection != 0) ? selection : Selection((1U << NumChannels) - 1U);
+}
+
+bool isTriggered(Const value)
+{
+    if (!g_previous_trigger_value_valid)
+    {
+        return false;
+    }
+
+    Const level = g_config.trigger_level;
+    const bool rising  = (g_previous_trigger_value < level) && (value >= level);
+    const bool falling = (g_previous_trigger_value > level) && (value <= level);
+
+    switch (g_config.trigger_edge)
+    {
+    case TriggerEdge::Rising:  return rising;
+    case TriggerEdge::Falling: return falling;
+    case TriggerEdge::Any:     return rising || falling;
+    case TriggerEdge::None:
+    default:                   return false;
+    }
+}
+
+} // namespace
+
+void setSelection(const std::uint8_t task_id, const Selection selection)
+{
+    if (task_id < MaxTaskTypes)
+    {
+        g_selections[task_id] = selection;
+    }
+}
+
+Selection getSelection(const std::uint8_t task_id)
+{
+    return (task_id < MaxTaskTypes) ? g_selections[task_id] : Selection(0);
+}
+
+int getVariableIndex(const Selection selection, const unsigned channel)
+{
+    const Selection normalized = normalizeSelection(selection);
+    unsigned ch = 0;
+    for (unsigned i = 0; i < ITask::MaxDebugVariables; i++)
+    {
+        if ((normalized & (1U << i)) != 0)
+        {
+            if (ch == channel)
+            {
+                return int(i);
+            }
+            ch++;
+        }
+    }
+    return -1;
+}
+
+BOARD_RAM_FUNCTION
+Channels select(const std::uint8_t task_id, const ITask::DebugVariables& variables)
+{
+    Channels out{};
+
+    Selection mask = normalizeSelection(getSelection(task_id));
+    unsigned ch = 0;
+    for (unsigned i = 0; (i < ITask::MaxDebugVariables) && (ch < NumChannels) && (mask != 0); i++)
+    {
+        if ((mask & 1U) != 0)
+        {
+            out[ch++] = variables[i];
+        }
+        mask = Selection(mask >> 1);
+    }
+
+    return out;
+}
+
+void subscribe(const Config& config)
+{
+    assert(config.isValid());
+
+    g_subscribed = false;
+    {
+        board::motor::AbsoluteCriticalSectionLocker locker;
+        g_config = config;
+        g_config.decimation = std::max<std::uint16_t>(config.decimation, 1U);
+        g_waiting_for_trigger = config.trigger_edge != TriggerEdge::None;
+        g_stream_started = false;
+        g_previous_trigger_value_valid = false;
+        g_decimation_counter = 0;
+        g_remaining_samples = 0;
+        g_sequence = 0;
+        g_queue.clear();
+    }
+    g_subscribed = true;
+}
+
+void unsubscribe()
+{
+    g_subscribed = false;
+    g_queue.clear();
+}
+
+bool isSubscribed()
+{
+    return g_subscribed;
+}
+
+bool read(Sample& out_sample)
+{
+    return g_queue.pop(out_sample);
+}
+
+BOARD_RAM_FUNCTION
+void onMainIRQ(const std::uint8_t task_id, const Channels& values)
+{
+    if (!g_subscribed)
+    {
+        return;
+    }
+
+    // The variables of different tasks are not comparable, so the edge can't span a task switch
+    if (task_id != g_previous_task_id)
+    {
+        g_previous_task_id = task_id;
+        g_previous_trigger_value_valid = false;
+    }
+
+    Const trigger_value = values[g_config.trigger_channel];
+    const bool triggered = g_waiting_for_trigger && isTriggered(trigger_value);
+    g_previous_trigger_value = trigger_value;
+    g_previous_trigger_value_valid = true;
+
+    if (g_waiting_for_trigger)
+    {
+        if (!triggered)
+        {
+            return;
+        }
+        g_waiting_for_trigger = false;
+        g_decimation_counter = 0;
+        g_remaining_samples = g_config.samples_per_trigger;
+    }
+
+    if (g_decimation_counter > 0)
+    {
+        g_decimation_counter--;
+        return;
+    }
+    g_decimation_counter = g_config.decimation - 1U;
+
+    Sample s;
+    s.cycle_count = board::irq_profiler::getCycleCount();
+    s.sequence = g_sequence++;
+    s.task_id = task_id;
+    s.triggered = triggered || !g_stream_started;
+    g_stream_started = true;
+    s.values = values;
+    (void) g_queue.push(s);                     // Dropped samples are detected via the sequence number
+
+    if (g_remaining_samples > 0)
+    {
+        g_remaining_samples--;
+        if (g_remaining_samples == 0)
+        {
+            g_waiting_for_trigger = true;
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,143 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "task.hpp"
+#include <cstdint>
+#include <array>
+
+
+namespace foc
+{
+/**
+ * Subscription-based real time stream of the debug variables of the current task, see ITask::getDebugVariables().
+ * Every task offers a set of named variables; the selection defines which of them are carried in the
+ * samples of the stream, separately for every task. The selected variables are also recorded by the blackbox
+ * and the binary telemetry.
+ *
+ * The main IRQ pushes the samples into a lock-free queue, which is drained by a single consumer thread.
+ * The trigger is evaluated at the full main IRQ rate, before decimation, so the first sample after the trigger
+ * is exactly the one where the trigger condition was met.
+ * If the consumer is too slow, the samples that did not fit into the queue are dropped;
+ * the losses are visible via the sequence numbers.
+ */
+namespace debug_stream
+{
+
+constexpr unsigned NumChannels = ITask::NumDebugVariables;
+
+/**
+ * Task IDs are limited by the fault code format.
+ */
+constexpr unsigned MaxTaskTypes = 16;
+
+/**
+ * Bit mask of the indices in ITask::getDebugVariableNames(). The selected variables are assigned to the channels
+ * in ascending order of their indices; if more than @ref NumChannels are selected, the excess ones are ignored.
+ * Zero selects the default, which is the first @ref NumChannels variables.
+ */
+using Selection = std::uint16_t;
+
+static_assert(sizeof(Selection) * 8 >= ITask::MaxDebugVariables, "Selection mask is too narrow");
+
+using Channels = std::array<Scalar, NumChannels>;
+
+/**
+ * Can be invoked from any context; unknown task IDs are ignored.
+ */
+void setSelection(std::uint8_t task_id, Selection selection);
+
+Selection getSelection(std::uint8_t task_id);
+
+/**
+ * Index of the variable assigned to the channel, or a negative number if the channel is not used.
+ */
+int getVariableIndex(Selection selection, unsigned channel);
+
+/**
+ * Picks the selected variables of the task; unused channels are zero.
+ * Invoked from the main IRQ.
+ */
+Channels select(std::uint8_t task_id, const ITask::DebugVariables& variables);
+
+
+enum class TriggerEdge : std::uint8_t
+{
+    None,           ///< The stream starts immediately and never stops
+    Rising,
+    Falling,
+    Any
+};
+
+struct Config
+{
+    /// Every Nth main IRQ is streamed; the main IRQ runs at tens of kilohertz
+    std::uint16_t decimation = 100;
+
+    TriggerEdge trigger_edge = TriggerEdge::None;
+    std::uint8_t trigger_channel = 0;
+    float trigger_level = 0;
+
+    /// The trigger is re-armed after this many samples; zero streams continuously after the first trigger
+    std::uint16_t samples_per_trigger = 0;
+
+    bool isValid() const
+    {
+        return (decimation > 0) &&
+               (trigger_channel < NumChannels) &&
+               (trigger_edge <= TriggerEdge::Any);
+    }
+};
+
+struct Sample
+{
+    std::uint32_t cycle_count = 0;          ///< See board::irq_profiler::getCycleCount()
+    std::uint16_t sequence = 0;             ///< Incremented per sample including the dropped ones
+    std::uint8_t task_id = 0;               ///< Same as in the fault code
+    bool triggered = false;                 ///< Trigger condition was met here, or the stream has just started
+    Channels values{};
+};
+
+/**
+ * Discards the pending samples and starts streaming with the new configuration.
+ * There can be only one subscriber; it must read the samples from the same thread.
+ */
+void subscribe(const Config& config);
+void unsubscribe();
+
+bool isSubscribed();
+
+/**
+ * Returns false if there are no pending samples.
+ */
+bool read(Sample& out_sample);
+
+/**
+ * Invoked from the main IRQ; does nothing unless subscribed.
+ */
+void onMainIRQ(std::uint8_t task_id, const Channels& values);
+
+}
+}
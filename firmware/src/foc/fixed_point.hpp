@@ -0,0 +1,411 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "transforms.hpp"
+#include <math/math.hpp>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+/**
+ * The fixed-point kernels use the Cortex-M4 DSP instructions if this is set, otherwise the portable implementation,
+ * which produces the same results. By default it follows the target: the instructions are used where available.
+ */
+#ifndef FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+# if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+#  define FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS  1
+# else
+#  define FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS  0
+# endif
+#endif
+
+
+namespace foc
+{
+/**
+ * Fixed-point implementation of the current loop, from the raw ADC counts to the timer compare values.
+ * It mirrors the float chain: the ADC conversion of the board driver, @ref performClarkeTransform(),
+ * @ref performParkTransform(), a pair of @ref CurrentPIController, @ref performInverseParkTransform(),
+ * @ref performSpaceVectorTransform(), and the conversion in board::motor::PWMHandle::setPWM().
+ * The currents are expressed per unit of the full scale current of the PI controllers, and the voltages per unit
+ * of the inverter voltage; the d and q axes are processed together using the dual 16-bit instructions.
+ * The results agree with the float chain within a few least significant bits, see the host benchmark.
+ *
+ * This is a benchmark-only kernel: it is used by the kernel benchmark and the host simulation, the motor control
+ * IRQs always run the float chain of @ref VoltageModulator. It implements neither the dead time compensation,
+ * nor the overmodulation, nor the discontinuous modulation, nor the field weakening, and the observer and the
+ * controllers downstream consume float values, so it cannot be swapped in without dropping these features.
+ */
+namespace fixed_point
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+using Q15 = std::int16_t;
+
+/// Two Q15 values packed into one word, the first one in the lower half
+using Q15x2 = std::uint32_t;
+
+constexpr Q15x2 pack(const Q15 lo, const Q15 hi)
+{
+    return Q15x2(std::uint16_t(lo)) | (Q15x2(std::uint16_t(hi)) << 16);
+}
+
+constexpr Q15 getLow(const Q15x2 x)  { return Q15(std::uint16_t(x & 0xFFFFU)); }
+constexpr Q15 getHigh(const Q15x2 x) { return Q15(std::uint16_t(x >> 16)); }
+
+/**
+ * Saturating conversion from float; not meant for the hot path.
+ */
+inline Q15 toQ15(Const x)
+{
+    return Q15(std::min(32767.0F, std::max(-32768.0F, x * 32768.0F)));
+}
+
+inline Scalar fromQ15(const Q15 x)
+{
+    return Scalar(x) * (1.0F / 32768.0F);
+}
+
+/**
+ * Converts the output of math::sincos() into the packed form expected by @ref CurrentLoop: cos low, sin high.
+ */
+inline Q15x2 packSinCos(const Vector<2>& angle_sincos)
+{
+    return pack(toQ15(angle_sincos[1]), toQ15(angle_sincos[0]));
+}
+
+/**
+ * Wrappers over the DSP instructions.
+ * The portable versions do not track the overflow flag, the callers are responsible for staying in range.
+ */
+namespace dsp
+{
+/// SSAT #16 with an arithmetic right shift
+template <unsigned Shift>
+inline std::int32_t ssat16(const std::int32_t x)
+{
+    static_assert((Shift >= 1) && (Shift <= 31), "Invalid shift");
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    std::int32_t out;
+    asm ("ssat %0, #16, %1, asr %2" : "=r"(out) : "r"(x), "I"(Shift));
+    return out;
+#else
+    return std::min<std::int32_t>(32767, std::max<std::int32_t>(-32768, x >> Shift));
+#endif
+}
+
+/// SMUAD: lo * lo + hi * hi
+inline std::int32_t smuad(const Q15x2 x, const Q15x2 y)
+{
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    std::int32_t out;
+    asm ("smuad %0, %1, %2" : "=r"(out) : "r"(x), "r"(y));
+    return out;
+#else
+    return std::int32_t(getLow(x)) * getLow(y) + std::int32_t(getHigh(x)) * getHigh(y);
+#endif
+}
+
+/// SMUSD: lo * lo - hi * hi
+inline std::int32_t smusd(const Q15x2 x, const Q15x2 y)
+{
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    std::int32_t out;
+    asm ("smusd %0, %1, %2" : "=r"(out) : "r"(x), "r"(y));
+    return out;
+#else
+    return std::int32_t(getLow(x)) * getLow(y) - std::int32_t(getHigh(x)) * getHigh(y);
+#endif
+}
+
+/// SMUADX: lo * hi + hi * lo
+inline std::int32_t smuadx(const Q15x2 x, const Q15x2 y)
+{
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    std::int32_t out;
+    asm ("smuadx %0, %1, %2" : "=r"(out) : "r"(x), "r"(y));
+    return out;
+#else
+    return std::int32_t(getLow(x)) * getHigh(y) + std::int32_t(getHigh(x)) * getLow(y);
+#endif
+}
+
+/// SMUSDX: lo * hi - hi * lo
+inline std::int32_t smusdx(const Q15x2 x, const Q15x2 y)
+{
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    std::int32_t out;
+    asm ("smusdx %0, %1, %2" : "=r"(out) : "r"(x), "r"(y));
+    return out;
+#else
+    return std::int32_t(getLow(x)) * getHigh(y) - std::int32_t(getHigh(x)) * getLow(y);
+#endif
+}
+
+/// QSUB16: saturating subtraction of the halves
+inline Q15x2 qsub16(const Q15x2 x, const Q15x2 y)
+{
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    Q15x2 out;
+    asm ("qsub16 %0, %1, %2" : "=r"(out) : "r"(x), "r"(y));
+    return out;
+#else
+    const auto sub = [](const Q15 a, const Q15 b)
+    {
+        return Q15(std::min<std::int32_t>(32767, std::max<std::int32_t>(-32768, std::int32_t(a) - b)));
+    };
+    return pack(sub(getLow(x), getLow(y)), sub(getHigh(x), getHigh(y)));
+#endif
+}
+
+/// SMLAWB: acc + (x * lo(y)) >> 16
+inline std::int32_t smlawb(const std::int32_t x, const Q15x2 y, const std::int32_t acc)
+{
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    std::int32_t out;
+    asm ("smlawb %0, %1, %2, %3" : "=r"(out) : "r"(x), "r"(y), "r"(acc));
+    return out;
+#else
+    return std::int32_t((std::int64_t(x) * getLow(y)) >> 16) + acc;
+#endif
+}
+
+/// SMLAWT: acc + (x * hi(y)) >> 16
+inline std::int32_t smlawt(const std::int32_t x, const Q15x2 y, const std::int32_t acc)
+{
+#if FOC_FIXED_POINT_USE_DSP_INSTRUCTIONS
+    std::int32_t out;
+    asm ("smlawt %0, %1, %2, %3" : "=r"(out) : "r"(x), "r"(y), "r"(acc));
+    return out;
+#else
+    return std::int32_t((std::int64_t(x) * getHigh(y)) >> 16) + acc;
+#endif
+}
+
+}
+
+/**
+ * See the namespace documentation. Only the phases A and B are measured, like in the two sensor configuration.
+ * The configuration is converted to fixed point by @ref configure() and @ref setInverterVoltage(), which are
+ * not meant to be invoked every period; everything in @ref update() is integer arithmetic.
+ */
+class CurrentLoop
+{
+public:
+    struct Configuration
+    {
+        Scalar adc_volts_per_count = 0;                     ///< Per count of the sum of the samples of one IRQ
+        std::array<Scalar, 2> current_sensor_zero_offsets{};    ///< Volt, phases A and B
+        Scalar current_sensor_amperes_per_volt = 0;         ///< Inverse of the shunt resistance times the gain
+        Scalar full_scale_current = 0;                      ///< Ampere, see CurrentPIController
+        Scalar proportional_gain = 0;                       ///< Volt per unit of the current error
+        Scalar integral_gain = 0;                           ///< Per period
+        std::uint16_t pwm_top = 0;                          ///< Value of the timer auto reload register
+    };
+
+    struct Output
+    {
+        Q15x2 Idq = 0;                                      ///< Per unit of the full scale current
+        Q15x2 Udq = 0;                                      ///< Per unit of the inverter voltage
+        std::array<std::uint16_t, 3> ccr{};                 ///< Timer compare values
+    };
+
+private:
+    static constexpr unsigned ADCOffsetFractionBits = 4;
+    static constexpr unsigned ADCScaleFractionBits  = 16;
+    static constexpr unsigned GainFractionBits      = 27;   ///< Gains up to 16
+    static constexpr unsigned VoltageFractionBits   = GainFractionBits + 15 - 16;       ///< Output of SMLAWB
+
+    static constexpr std::int32_t OneOverSquareRootOf3Q14 = 9459;       ///< 1/sqrt(3), Q14
+    static constexpr std::int32_t TwoOverSquareRootOf3Q14 = 18919;      ///< 2/sqrt(3), Q14
+    static constexpr std::int32_t SquareRootOf3Q14        = 28378;      ///< sqrt(3), Q14
+
+    Configuration config_;
+
+    std::array<std::int32_t, 2> adc_zero_offsets_{};        ///< Counts, ADCOffsetFractionBits
+    std::int32_t adc_scale_ = 0;                            ///< Q15 per offset count, ADCScaleFractionBits
+
+    std::int32_t kp_ = 0;                                   ///< GainFractionBits
+    std::int32_t ki_ = 0;                                   ///< GainFractionBits
+    std::int32_t integrator_limit_ = 0;                     ///< VoltageFractionBits
+
+    Q15x2 reference_Idq_ = 0;
+    std::array<std::int32_t, 2> integrators_{};             ///< Per unit voltage, VoltageFractionBits
+
+    static std::int32_t toFixed(Const x, const unsigned fraction_bits)
+    {
+        return std::int32_t(x * Scalar(1U << fraction_bits));
+    }
+
+    std::int32_t convertADCSumToCurrent(const std::uint32_t adc_sum, const unsigned index) const
+    {
+        const std::int32_t x = std::int32_t(adc_sum << ADCOffsetFractionBits) - adc_zero_offsets_[index];
+        return dsp::ssat16<1>(std::int32_t((std::int64_t(x) * adc_scale_) >> (ADCScaleFractionBits - 1U)));
+    }
+
+    /**
+     * Same as CurrentPIController::computeVoltage(), the axis is selected by the half of the packed error.
+     */
+    template <unsigned Axis>
+    std::int32_t updateAxis(const Q15x2 error)
+    {
+        auto& ui = integrators_[Axis];
+        ui = (Axis == 0) ? dsp::smlawb(ki_, error, ui) : dsp::smlawt(ki_, error, ui);
+        ui = std::min(integrator_limit_, std::max(-integrator_limit_, ui));
+
+        const std::int32_t u = (Axis == 0) ? dsp::smlawb(kp_, error, ui) : dsp::smlawt(kp_, error, ui);
+        return dsp::ssat16<VoltageFractionBits - 15U>(u);
+    }
+
+    std::uint16_t convertDutyCycleToCCR(std::int32_t duty_cycle) const
+    {
+        duty_cycle = std::min<std::int32_t>(32768, std::max<std::int32_t>(0, duty_cycle));
+        // Same rounding as in board::motor::PWMHandle::setPWM()
+        return std::uint16_t((std::uint32_t(duty_cycle) * config_.pwm_top + 13107U) >> 15);
+    }
+
+public:
+    void configure(const Configuration& config,
+                   Const inverter_voltage)
+    {
+        assert(config.current_sensor_amperes_per_volt > 0);
+        assert(config.full_scale_current > 0);
+
+        config_ = config;
+
+        Const volts_per_offset_count = config_.adc_volts_per_count / Scalar(1U << ADCOffsetFractionBits);
+        adc_zero_offsets_[0] = std::int32_t(config_.current_sensor_zero_offsets[0] / volts_per_offset_count);
+        adc_zero_offsets_[1] = std::int32_t(config_.current_sensor_zero_offsets[1] / volts_per_offset_count);
+
+        Const scale = volts_per_offset_count * config_.current_sensor_amperes_per_volt /
+                      config_.full_scale_current * 32768.0F;
+        assert(scale < Scalar(1U << (31U - ADCScaleFractionBits)));
+        adc_scale_ = toFixed(scale, ADCScaleFractionBits);
+
+        integrator_limit_ = toFixed(SquareRootOf3 / 2.0F, VoltageFractionBits);
+
+        setInverterVoltage(inverter_voltage);
+    }
+
+    /**
+     * The gains are normalized by the inverter voltage, so they need to be updated as it changes.
+     * The integrators are kept per unit, unlike in the float controller, where they are kept in volts.
+     */
+    void setInverterVoltage(Const inverter_voltage)
+    {
+        assert(inverter_voltage > 0);
+        Const max_gain = Scalar(1U << (31U - GainFractionBits)) * 0.999F;
+        kp_ = toFixed(std::min(max_gain, config_.proportional_gain / inverter_voltage), GainFractionBits);
+        ki_ = toFixed(std::min(max_gain, config_.proportional_gain * config_.integral_gain / inverter_voltage),
+                      GainFractionBits);
+    }
+
+    void setReference(Const Id, Const Iq)
+    {
+        reference_Idq_ = pack(toQ15(Id / config_.full_scale_current), toQ15(Iq / config_.full_scale_current));
+    }
+
+    void resetIntegrators()
+    {
+        integrators_.fill(0);
+    }
+
+    /**
+     * @param adc_sums          Sums of the raw samples of the phases A and B, as collected by the ADC IRQ
+     * @param angle_sincos      See @ref packSinCos()
+     */
+    Output update(const std::array<std::uint32_t, 2>& adc_sums,
+                  const Q15x2 angle_sincos)
+    {
+        Output out;
+
+        const Q15 phase_a = Q15(convertADCSumToCurrent(adc_sums[0], 0));
+        const Q15 phase_b = Q15(convertADCSumToCurrent(adc_sums[1], 1));
+
+        // Clarke: alpha = a, beta = (a + 2b) / sqrt(3)
+        const Q15x2 alpha_beta =
+            pack(phase_a, Q15(dsp::ssat16<14>(dsp::smuad(pack(phase_a, phase_b),
+                                                         pack(Q15(OneOverSquareRootOf3Q14),
+                                                              Q15(TwoOverSquareRootOf3Q14))))));
+
+        // Park: d = alpha cos + beta sin, q = beta cos - alpha sin
+        out.Idq = pack(Q15(dsp::ssat16<15>(dsp::smuad(alpha_beta, angle_sincos))),
+                       Q15(dsp::ssat16<15>(dsp::smusdx(angle_sincos, alpha_beta))));
+
+        // Both errors at once; the saturation is equivalent to the error constraint of the float controller
+        const Q15x2 error = dsp::qsub16(reference_Idq_, out.Idq);
+
+        out.Udq = pack(Q15(updateAxis<0>(error)),
+                       Q15(updateAxis<1>(error)));
+
+        // Inverse Park: alpha = d cos - q sin, beta = d sin + q cos
+        const std::int32_t u_alpha = dsp::ssat16<15>(dsp::smusd(out.Udq, angle_sincos));
+        const std::int32_t u_beta  = dsp::ssat16<15>(dsp::smuadx(out.Udq, angle_sincos));
+
+        // Space vector transform, same as the float version with the inverter voltage of one
+        const std::int32_t x = u_beta;
+        const std::int32_t y = -((u_alpha * SquareRootOf3Q14 >> 14) + u_beta) / 2;
+        const std::int32_t z = -((u_alpha * SquareRootOf3Q14 >> 14) - u_beta) / 2;
+
+        const unsigned sector_index =
+            (y > 0) ? ((x > 0) ? 3U : ((z > 0) ? 2U : 1U)) : ((x <= 0) ? 0U : ((z > 0) ? 4U : 5U));
+
+        std::int32_t ta = 0;
+        switch (sector_index)
+        {
+        case 0:
+        case 3:
+        {
+            ta = (-x - y) / 2;
+            break;
+        }
+        case 1:
+        case 4:
+        {
+            ta = (-y - z) / 2;
+            break;
+        }
+        default:
+        {
+            ta = (x - z) / 2;
+            break;
+        }
+        }
+
+        out.ccr[0] = convertDutyCycleToCCR(((ta * SquareRootOf3Q14) >> 14) + 16384);
+        out.ccr[1] = convertDutyCycleToCCR((((ta + z) * SquareRootOf3Q14) >> 14) + 16384);
+        out.ccr[2] = convertDutyCycleToCCR((((ta + y) * SquareRootOf3Q14) >> 14) + 16384);
+
+        return out;
+    }
+};
+
+}
+}
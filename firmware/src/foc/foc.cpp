@@ -26,6 +26,10 @@
 #include "transforms.hpp"
 #include "voltage_modulator.hpp"
 #include "irq_debug.hpp"
+#include "latency_benchmark.hpp"
+#include "telemetry.hpp"
+#include "blackbox.hpp"
+#include "debug_stream.hpp"
 
 // Tasks:
 #include "idle_task.hpp"
@@ -35,6 +39,10 @@
 #include "hw_test/task.hpp"
 #include "motor_id/task.hpp"
 
+#include "seqlock.hpp"
+#include <cstdio>
+#include <unistd.h>
+
 
 /*
  * Documents:
@@ -45,12 +53,10 @@ namespace foc
 namespace
 {
 
-TaskContext g_context;
+TaskContextStore g_context_store;
 
 board::motor::PWMHandle g_pwm_handle;
 
-IRQDebugPlotter g_debug_plotter;
-
 using motor_id::MotorIdentificationTask;
 using hw_test::HardwareTestingTask;
 
@@ -63,13 +69,47 @@ typedef TaskHandler
 , MotorIdentificationTask
 > TaskHandlerInstance;
 
-TaskHandlerInstance g_task_handler([]() { return g_context; });
+TaskHandlerInstance g_task_handler(g_context_store);
+
+static_assert(TaskHandlerInstance::getNumTaskTypes() <= debug_stream::MaxTaskTypes, "Too many tasks");
+static_assert(TaskHandlerInstance::getTaskIDOf<IdleTask>()                == unsigned(TaskID::Idle), "Task ID");
+static_assert(TaskHandlerInstance::getTaskIDOf<FaultTask>()               == unsigned(TaskID::Fault), "Task ID");
+static_assert(TaskHandlerInstance::getTaskIDOf<BeepingTask>()             == unsigned(TaskID::Beeping), "Task ID");
+static_assert(TaskHandlerInstance::getTaskIDOf<RunningTask>()             == unsigned(TaskID::Running), "Task ID");
+static_assert(TaskHandlerInstance::getTaskIDOf<HardwareTestingTask>()     == unsigned(TaskID::HardwareTest),
+              "Task ID");
+static_assert(TaskHandlerInstance::getTaskIDOf<MotorIdentificationTask>() == unsigned(TaskID::MotorIdentification),
+              "Task ID");
+
+/**
+ * Time base of the plotted samples, extended to 64 bits; see @ref plotRealTimeValues().
+ */
+std::uint32_t g_plot_previous_cycle_count = 0;
+std::uint64_t g_plot_time_cycles = 0;
+
+/**
+ * State of the running task, published from the main IRQ so that the threads can read it without
+ * blocking the IRQs.
+ */
+struct RunningTaskSnapshot
+{
+    RunningStateInfo info;
+    bool spinup_in_progress = false;
+};
+
+SeqLock<RunningTaskSnapshot> g_running_task_snapshot;
+
+SetpointMailbox g_setpoint_mailbox;
+
+IRQBudgetMonitor g_irq_budget_monitor;
+
+ThermalModel g_thermal_model;
 
 
 inline Scalar convertElectricalAngularVelocityToMechanicalRPM(Const eangvel)
 {
     return convertRotationRateElectricalToMechanical(convertAngularVelocityToRPM(eangvel),
-                                                     g_context.params.motor.num_poles);
+                                                     g_task_handler.getContext().params.motor.num_poles);
 }
 
 } // namespace
@@ -79,10 +119,13 @@ void init(const Parameters& params)
 {
     board::motor::beginCalibration();
 
-    g_context.params = params;
+    g_context_store.update([&params](TaskContext& context)
+        {
+            context.params = params;
 
-    g_context.board.pwm     = board::motor::getPWMParameters();
-    g_context.board.limits  = board::motor::getLimits();
+            context.board.pwm     = board::motor::getPWMParameters();
+            context.board.limits  = board::motor::getLimits();
+        });
 
     {
         AbsoluteCriticalSectionLocker locker;
@@ -90,32 +133,28 @@ void init(const Parameters& params)
     }
 
     DEBUG_LOG("FOC sizeof: %u %u %u %u\n",
-              sizeof(g_task_handler), sizeof(MotorIdentificationTask), sizeof(g_context), sizeof(g_context.params));
+              sizeof(g_task_handler), sizeof(MotorIdentificationTask), sizeof(g_context_store), sizeof(Parameters));
 }
 
 void setParameters(const Parameters& params)
 {
-    AbsoluteCriticalSectionLocker locker;
-    g_context.params = params;
-    g_task_handler.from<IdleTask>().to<IdleTask>(); // Cycling to reload new configuration and check it
+    // The idle task will be reloaded by the main IRQ in order to check the new configuration
+    g_context_store.update([&params](TaskContext& context) { context.params = params; });
 }
 
 Parameters getParameters()
 {
-    AbsoluteCriticalSectionLocker locker;
-    return g_context.params;
+    return g_context_store.read([](const TaskContext& c) { return c.params; });
 }
 
 MotorParameters getMotorParameters()
 {
-    AbsoluteCriticalSectionLocker locker;
-    return g_context.params.motor;
+    return g_context_store.read([](const TaskContext& c) { return c.params.motor; });
 }
 
 hw_test::Report getHardwareTestReport()
 {
-    AbsoluteCriticalSectionLocker locker;
-    return g_context.hw_test_report;
+    return g_context_store.read([](const TaskContext& c) { return c.hw_test_report; });
 }
 
 void beginMotorIdentification(motor_id::Mode mode)
@@ -123,9 +162,9 @@ void beginMotorIdentification(motor_id::Mode mode)
     g_task_handler.from<IdleTask, BeepingTask>().to<MotorIdentificationTask>(mode);
 }
 
-void beginHardwareTest()
+void beginHardwareTest(hw_test::Mode mode)
 {
-    g_task_handler.from<IdleTask, BeepingTask, FaultTask>().to<HardwareTestingTask>();
+    g_task_handler.from<IdleTask, BeepingTask, FaultTask>().to<HardwareTestingTask>(mode);
 }
 
 bool isMotorIdentificationInProgress(MotorIdentificationStateInfo* out_info)
@@ -156,24 +195,22 @@ bool isHardwareTestInProgress()
 bool isRunning(RunningStateInfo* out_info,
                bool* out_spinup_in_progress)
 {
-    AbsoluteCriticalSectionLocker locker;
-    if (auto task = g_task_handler.as<RunningTask>())
+    if (g_task_handler.is<RunningTask>())
     {
-        if (out_info != nullptr)
+        if ((out_info != nullptr) ||
+            (out_spinup_in_progress != nullptr))
         {
-            out_info->stall_count = task->getNumSuccessiveStalls();
-
-            const auto filt = task->getLowPassFilteredValues();
-            out_info->inverter_power_filtered = filt.inverter_power;
-            out_info->demand_factor_filtered = filt.demand_factor;
+            const auto snapshot = g_running_task_snapshot.read();
 
-            out_info->mechanical_rpm =
-                convertElectricalAngularVelocityToMechanicalRPM(task->getElectricalAngularVelocity());
-        }
+            if (out_info != nullptr)
+            {
+                *out_info = snapshot.info;
+            }
 
-        if (out_spinup_in_progress != nullptr)
-        {
-            *out_spinup_in_progress = task->isSpinupInProgress();
+            if (out_spinup_in_progress != nullptr)
+            {
+                *out_spinup_in_progress = snapshot.spinup_in_progress;
+            }
         }
         return true;
     }
@@ -210,25 +247,78 @@ ExtendedStatus getExtendedStatus()
     };
 }
 
+TaskPoolUsage getTaskPoolUsage()
+{
+    TaskPoolUsage out;
+    out.num_slots = TaskHandlerInstance::getNumPoolSlots();
+    out.slot_size = TaskHandlerInstance::getPoolSlotSize();
+    out.largest_task_size = TaskHandlerInstance::getLargestTaskSize();
+    out.subtask_pool_size = MotorIdentificationTask::getSubTaskPoolSize();
+    {
+        AbsoluteCriticalSectionLocker locker;
+        out.peak_task_size = g_task_handler.getPeakTaskSize();
+        out.peak_task_name = g_task_handler.getPeakTaskName();
+    }
+    return out;
+}
+
+IRQBudgetMonitor::Status getIRQBudgetStatus()
+{
+    AbsoluteCriticalSectionLocker locker;
+    return g_irq_budget_monitor.getStatus();
+}
+
+ThermalModel::Status getThermalStatus()
+{
+    AbsoluteCriticalSectionLocker locker;
+    return g_thermal_model.getStatus();
+}
+
 void setSetpoint(ControlMode control_mode,
                  Const value,
-                 Const request_ttl)
+                 Const request_ttl,
+                 const bool active_braking)
 {
-    AbsoluteCriticalSectionLocker locker;
-    if (auto task = g_task_handler.as<RunningTask>())
     {
-        task->setSetpoint(control_mode, value, request_ttl);
+        AbsoluteCriticalSectionLocker locker;
+        if (auto task = g_task_handler.as<RunningTask>())
+        {
+            task->setSetpoint(control_mode, value, request_ttl, active_braking);
+            return;
+        }
+    }
+
+    // Switching outside of the critical section, so that the new task is constructed with the IRQ enabled
+    if (os::float_eq::closeToZero(value))
+    {
+        g_task_handler.from<FaultTask, MotorIdentificationTask>().to<IdleTask>();
     }
     else
     {
-        if (os::float_eq::closeToZero(value))
-        {
-            g_task_handler.from<FaultTask, MotorIdentificationTask>().to<IdleTask>();
-        }
-        else
-        {
-            g_task_handler.from<IdleTask, BeepingTask>().to<RunningTask>(control_mode, value, request_ttl);
-        }
+        // The task switching logic passes the arguments by value, hence the reference wrapper
+        g_task_handler.from<IdleTask, BeepingTask>().to<RunningTask>(std::cref(g_setpoint_mailbox),
+                                                                     control_mode, value, request_ttl,
+                                                                     active_braking);
+    }
+}
+
+void postSetpoint(ControlMode control_mode,
+                  Const value,
+                  Const request_ttl,
+                  const std::uint32_t received_at,
+                  const bool active_braking)
+{
+    if (g_task_handler.is<RunningTask>())
+    {
+        /*
+         * If the running task terminates before it picks up the command, the command will be lost.
+         * This is fine, because the commands are expected to be sent at a high rate.
+         */
+        g_setpoint_mailbox.post(control_mode, value, request_ttl, active_braking, received_at);
+    }
+    else
+    {
+        setSetpoint(control_mode, value, request_ttl, active_braking);  // Slow path, may involve task switching
     }
 }
 
@@ -237,39 +327,60 @@ void beep(Const frequency, Const duration)
     g_task_handler.from<IdleTask>().to<BeepingTask>(frequency, duration);
 }
 
-void plotRealTimeValues()
+ITask::DebugVariableNames getDebugVariableNames(const TaskID task)
 {
-    g_debug_plotter.print();
-    IRQDebugOutputBuffer::printIfNeeded();
+    return TaskHandlerInstance::getDebugVariableNames(std::uint8_t(task));
 }
 
-std::array<DebugKeyValueType, NumDebugKeyValuePairs> getDebugKeyValuePairs()
+void plotRealTimeValues()
 {
-    bool match = false;
+    unsigned num_printed = 0;
+    debug_stream::Sample s;
 
+    while (debug_stream::read(s))
     {
-        Vector<2> Idq;
-        Vector<2> Udq;
-
+        // The cycle counter is extended assuming that the samples are read more often than it overflows
+        if (s.triggered)
         {
-            AbsoluteCriticalSectionLocker locker;
-            if (auto task = g_task_handler.as<RunningTask>())
-            {
-                match = true;
-                Idq = task->getIdq();
-                Udq = task->getUdq();
-            }
+            g_plot_time_cycles = 0;
         }
-
-        if (match)
+        else
         {
-            return {
-                DebugKeyValueType("Id", Idq[0]),
-                DebugKeyValueType("Iq", Idq[1]),
-                DebugKeyValueType("Ud", Udq[0]),
-                DebugKeyValueType("Uq", Udq[1])
-            };
+            g_plot_time_cycles += std::uint32_t(s.cycle_count - g_plot_previous_cycle_count);
         }
+        g_plot_previous_cycle_count = s.cycle_count;
+
+        std::printf("$%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                    double(g_plot_time_cycles) / double(STM32_SYSCLK),
+                    double(s.values[0]),
+                    double(s.values[1]),
+                    double(s.values[2]),
+                    double(s.values[3]),
+                    double(s.values[4]),
+                    double(s.values[5]),
+                    double(s.values[6]));
+        num_printed++;
+    }
+
+    IRQDebugOutputBuffer::printIfNeeded();
+
+    if (num_printed == 0)
+    {
+        ::usleep(1000);                 // The IRQ will produce more samples meanwhile
+    }
+}
+
+std::array<DebugKeyValueType, NumDebugKeyValuePairs> getDebugKeyValuePairs()
+{
+    if (g_task_handler.is<RunningTask>())
+    {
+        const auto snapshot = g_running_task_snapshot.read();
+        return {
+            DebugKeyValueType("Id", snapshot.info.Idq[0]),
+            DebugKeyValueType("Iq", snapshot.info.Idq[1]),
+            DebugKeyValueType("Ud", snapshot.info.Udq[0]),
+            DebugKeyValueType("Uq", snapshot.info.Udq[1])
+        };
     }
 
     // Getters for other tasks may be added later
@@ -288,10 +399,55 @@ namespace motor
 using namespace foc;
 
 
+BOARD_RAM_FUNCTION
 void handleMainIRQ(Const period)
 {
     const auto hw_status = board::motor::getStatus();
 
+    // We'd rather lose the telemetry than the commutation
+    {
+        const auto timing = board::motor::getMainIRQTiming();
+        g_irq_budget_monitor.update(period, timing.last_duration, timing.num_lost_periods);
+    }
+    const auto degradation_level = g_irq_budget_monitor.getDegradationLevel();
+
+    // The thermal model is updated also when the motor is not running, so that it keeps track of the cooling
+    // The currents of the motor identification and the hardware test are not accounted for, they are short
+    {
+        const auto& context = g_task_handler.getContext();
+
+        Scalar inverter_power = 0;
+        Vector<2> Idq = Vector<2>::Zero();
+        if (auto rt = g_task_handler.as<RunningTask>())
+        {
+            inverter_power = rt->getLowPassFilteredValues().inverter_power;
+            Idq = rt->getIdq();
+        }
+
+        g_thermal_model.update(period,
+                               context.params.thermal,
+                               context.params.motor.rs,
+                               context.board.limits.safe_operating_area.inverter_temperature.max,
+                               hw_status.inverter_temperature,
+                               inverter_power,
+                               Idq);
+    }
+
+    // The idle task validates the context once constructed, so it is reloaded when a new generation is published
+    // Other tasks may pick up the new generation on the fly, e.g. the running task accepts the tuning changes
+    if (g_task_handler.isContextStale())
+    {
+        if (g_task_handler.is<IdleTask>())
+        {
+            AbsoluteCriticalSectionLocker locker;
+            g_task_handler.select<IdleTask>();
+        }
+        else
+        {
+            (void) g_task_handler.updateContext();
+        }
+    }
+
     static TaskHandlerInstance::SwitchCounter last_task_switch_counter;
     const auto new_task_switch_counter = g_task_handler.getTaskSwitchCounter();
     if (new_task_switch_counter != last_task_switch_counter)
@@ -299,10 +455,11 @@ void handleMainIRQ(Const period)
         AbsoluteCriticalSectionLocker locker;
         last_task_switch_counter = new_task_switch_counter;
         // OK we just switched task, cool.
+        g_running_task_snapshot.write(RunningTaskSnapshot());     // Dropping the stale data of the previous run
         if (g_task_handler.get().isPreCalibrationRequired())
         {
             g_pwm_handle.release();
-            board::motor::beginCalibration();
+            board::motor::beginCalibration(board::motor::CalibrationMode::ReuseIfNotDrifted);
         }
     }
 
@@ -310,6 +467,13 @@ void handleMainIRQ(Const period)
     {
         auto& task = g_task_handler.get();
 
+        if (auto rt = g_task_handler.as<RunningTask>())
+        {
+            const bool decimate = degradation_level >= IRQBudgetMonitor::DegradationLevel::ObserverDecimated;
+            rt->setObserverDecimationRatio(decimate ? 2U : 1U);
+            rt->setCurrentDeratingFactor(g_thermal_model.getCurrentDeratingFactor());
+        }
+
         const auto result = task.onMainIRQ(period, hw_status);
 
         if (result.finished)
@@ -318,7 +482,7 @@ void handleMainIRQ(Const period)
 
             g_pwm_handle.release();
 
-            task.applyResultToGlobalContext(g_context);
+            g_context_store.update([&task](TaskContext& context) { task.applyResultToGlobalContext(context); });
 
             if (result.exit_code == result.ExitCodeOK)
             {
@@ -332,21 +496,57 @@ void handleMainIRQ(Const period)
                 const auto fault_code =
                     std::uint16_t((g_task_handler.getTaskID() << 12) | (result.exit_code & 0x0FFFU));
                 g_task_handler.select<FaultTask>(fault_code);
+                blackbox::trigger(blackbox::TriggerReason::Fault);
             }
         }
         else
         {
-            std::array<Scalar, ITask::NumDebugVariables> vars;
+            // The debug variables are not cheap to collect, so this is done only if someone is listening
+            // No critical section is needed, because the tasks exchange the state with the fast IRQ via seqlocks
+            if ((degradation_level == IRQBudgetMonitor::DegradationLevel::None) &&
+                (debug_stream::isSubscribed() || telemetry::isActive() || blackbox::isRecording()))
             {
-                AbsoluteCriticalSectionLocker locker;
-                vars = task.getDebugVariables();
+                const auto task_id = g_task_handler.getTaskID();
+                const auto vars = debug_stream::select(task_id, task.getDebugVariables());
+                debug_stream::onMainIRQ(task_id, vars);
+                telemetry::onMainIRQ(vars);
+                blackbox::onMainIRQ(task_id, vars);
+            }
+
+            // The threads never access the running task directly, the snapshot is used instead
+            if (auto rt = g_task_handler.as<RunningTask>())
+            {
+                RunningTaskSnapshot snapshot;
+
+                snapshot.info.cycle_count = board::irq_profiler::getCycleCount();
+                snapshot.info.stall_count = rt->getNumSuccessiveStalls();
+                snapshot.info.restart_count = rt->getNumRestarts();
+
+                const auto filt = rt->getLowPassFilteredValues();
+                snapshot.info.inverter_power_filtered = filt.inverter_power;
+                snapshot.info.demand_factor_filtered = filt.demand_factor;
+
+                snapshot.info.mechanical_rpm =
+                    convertElectricalAngularVelocityToMechanicalRPM(rt->getElectricalAngularVelocity());
+
+                const auto est = rt->getEstimatedMotorParameters();
+                snapshot.info.estimated_rs = est.rs;
+                snapshot.info.estimated_phi = est.phi;
+
+                snapshot.info.Idq = rt->getIdq();
+                snapshot.info.Udq = rt->getUdq();
+                snapshot.info.observer_current_residual = rt->getObserverCurrentResidual();
+
+                snapshot.spinup_in_progress = rt->isSpinupInProgress();
+
+                g_running_task_snapshot.write(snapshot);
             }
-            g_debug_plotter.set(vars);
         }
     }
 }
 
 
+BOARD_RAM_FUNCTION
 void handleFastIRQ(const Vector<2>& phase_currents_ab,
                    Const inverter_voltage)
 {
@@ -360,11 +560,16 @@ void handleFastIRQ(const Vector<2>& phase_currents_ab,
         if (out.second)
         {
             g_pwm_handle.setPWM(out.first);
+            latency_benchmark::onPWMUpdated();
         }
         else
         {
             g_pwm_handle.release();
         }
+
+        const Vector<3> pwm_setpoint = out.second ? out.first : Vector<3>(Vector<3>::Zero());
+        telemetry::onFastIRQ(phase_currents_ab, inverter_voltage, pwm_setpoint);
+        blackbox::onFastIRQ(phase_currents_ab, inverter_voltage, pwm_setpoint);
     }
 }
 
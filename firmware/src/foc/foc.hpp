@@ -26,8 +26,11 @@
 
 #include "parameters.hpp"
 #include "running_task.hpp"
+#include "irq_budget.hpp"
+#include "thermal_model.hpp"
 #include "hw_test/report.hpp"
 #include "motor_id/task.hpp"
+#include "debug_stream.hpp"
 #include <math/math.hpp>
 #include <cstdint>
 #include <utility>
@@ -44,7 +47,8 @@ void init(const Parameters& params);
 
 /**
  * Allows to change configuration parameters at runtime.
- * The new parameters will take effect on next state switch (e.g. motor start/stop, identification, etc).
+ * The new parameters will take effect on next state switch (e.g. motor start/stop, identification, etc),
+ * except the tuning parameters which are picked up by the running motor immediately, see @ref ParameterChanges.
  */
 void setParameters(const Parameters& params);
 Parameters getParameters();
@@ -72,8 +76,9 @@ void beginMotorIdentification(motor_id::Mode mode);
  * Completion of the process can be detected by means of monitoring the current state of the controller, see @ref State.
  * The result of the test can be obtained via @ref getLastHardwareTestReport().
  * A side effect of the test is that the HW driver will be recalibrated.
+ * The quick mode does not identify the dead time, see @ref hw_test::Mode.
  */
-void beginHardwareTest();
+void beginHardwareTest(hw_test::Mode mode = hw_test::Mode::Full);
 
 /**
  * @ref isMotorIdentificationInProgress().
@@ -100,10 +105,22 @@ bool isHardwareTestInProgress();
  */
 struct RunningStateInfo
 {
-    std::uint32_t stall_count       = 0;
+    std::uint32_t cycle_count       = 0;    ///< When the state was sampled, see board::irq_profiler::getCycleCount()
+    std::uint32_t stall_count       = 0;    ///< Successive stalls, reset once the motor has stopped normally
+    std::uint32_t restart_count     = 0;    ///< In-place restarts after stalls since the motor was started
     Scalar inverter_power_filtered  = 0;
     Scalar demand_factor_filtered   = 0;
     Scalar mechanical_rpm           = 0;
+
+    /// Online estimates of the motor parameters; equal to the configured values until the estimator has converged
+    Scalar estimated_rs             = 0;    ///< Ohm
+    Scalar estimated_phi            = 0;    ///< Weber
+
+    math::Vector<2> Idq             = math::Vector<2>::Zero();  ///< Filtered, Ampere
+    math::Vector<2> Udq             = math::Vector<2>::Zero();  ///< Reference, Volt
+
+    /// Difference between the measured Idq and the Idq estimated by the observer; grows if the observer loses track
+    Scalar observer_current_residual = 0;   ///< Ampere
 };
 
 /**
@@ -143,6 +160,33 @@ struct ExtendedStatus
  */
 ExtendedStatus getExtendedStatus();
 
+/**
+ * Static sizes of the task pools versus the largest tasks, and the largest task constructed since boot.
+ * The pool holds two tasks in order to switch them outside of the critical section, see TaskHandler.
+ */
+struct TaskPoolUsage
+{
+    unsigned num_slots = 0;
+    unsigned slot_size = 0;                 ///< Byte, the largest task rounded up to its alignment
+    unsigned largest_task_size = 0;         ///< Byte
+    unsigned peak_task_size = 0;            ///< Byte, since boot
+    const char* peak_task_name = "";
+    unsigned subtask_pool_size = 0;         ///< Byte, the pool of the motor identification task, included in its size
+};
+
+TaskPoolUsage getTaskPoolUsage();
+
+/**
+ * Returns the state of the main IRQ budget monitor, see @ref IRQBudgetMonitor.
+ * A nonzero degradation level means that some of the debugging and telemetry features have been suspended.
+ */
+IRQBudgetMonitor::Status getIRQBudgetStatus();
+
+/**
+ * Returns the predicted temperatures and the present derating of the current limit, see @ref ThermalModel.
+ */
+ThermalModel::Status getThermalStatus();
+
 /**
  * Assigns new setpoint; the units depend on the selected control mode.
  * The value of zero stops the motor and clears the fault state, which is equivalent to calling @ref stop().
@@ -151,10 +195,29 @@ ExtendedStatus getExtendedStatus();
  * @param control_mode          See @ref ControlMode.
  * @param value                 Value depending on the control mode.
  * @param request_ttl           After this timeout (in seconds) the motor will be stopped automatically.
+ * @param active_braking        Decelerate with the regenerative current instead of coasting when the setpoint is
+ *                              reduced; the current is limited by ctrl.brake_frac and reduced at high Vbus.
  */
 void setSetpoint(ControlMode control_mode,
                  Const value,
-                 Const request_ttl);
+                 Const request_ttl,
+                 bool active_braking = false);
+
+/**
+ * Same as @ref setSetpoint(), but lock-free if the motor is already running: the command is placed into
+ * a mailbox that is polled by the main IRQ, so that the command-to-PWM latency is bounded by one period of
+ * the main IRQ plus one period of the fast IRQ. The delivery latency is reported by the IRQ profiler.
+ * If the motor is not running, this function falls back to @ref setSetpoint().
+ * This function must be invoked from the same thread at all times.
+ *
+ * @param received_at           Cycle counter value when the command was received by the hardware, or zero;
+ *                              used by the latency benchmark, see latency_benchmark.hpp.
+ */
+void postSetpoint(ControlMode control_mode,
+                  Const value,
+                  Const request_ttl,
+                  std::uint32_t received_at = 0,
+                  bool active_braking = false);
 
 /**
  * Shortcut for setSetpoint(0, 0, 0).
@@ -174,9 +237,31 @@ inline void stop()
 void beep(Const frequency,
           Const duration);
 
+/**
+ * IDs of the tasks as reported in the fault codes, the blackbox records, and the debug stream.
+ */
+enum class TaskID : std::uint8_t
+{
+    Idle = 1,
+    Fault,
+    Beeping,
+    Running,
+    HardwareTest,
+    MotorIdentification
+};
+
+/**
+ * Variables the task offers to the debug stream, see @ref debug_stream::setSelection().
+ * Can be invoked from any context.
+ */
+ITask::DebugVariableNames getDebugVariableNames(TaskID task);
+
 /**
  * This command is intended for use with CLI plotting tool.
  * Refer to the project tools directory for more info.
+ * Prints the pending samples of the debug stream, which must be subscribed to beforehand, see
+ * @ref debug_stream::subscribe(); the time is reset to zero at every trigger. Sleeps briefly if there is nothing
+ * to print, so it can be invoked in a loop.
  */
 void plotRealTimeValues();
 
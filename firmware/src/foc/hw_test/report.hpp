@@ -32,6 +32,17 @@ namespace foc
 {
 namespace hw_test
 {
+/**
+ * The quick test checks the phases and the sensors with much shorter stabilization intervals and skips the
+ * dead time identification. It takes less than 100 milliseconds (excluding the calibration of the current sensors),
+ * so it can be executed every time before the motor is started, provided that the rotor is stationary.
+ */
+enum class Mode
+{
+    Full,
+    Quick
+};
+
 /**
  * Output of the hardware testing task.
  */
@@ -42,8 +53,20 @@ class Report
 public:
     using Mask = std::uint16_t;
 
+    /**
+     * Identified as a side product of the test; not available if the test failed or the currents were too low
+     * for a reliable identification. See @ref InverterParameters.
+     */
+    struct DeadTimeCalibration
+    {
+        float effective_dead_time_positive = 0;     ///< Second
+        float effective_dead_time_negative = 0;     ///< Second
+        bool available = false;
+    };
+
 private:
     Mask mask_ = 0;
+    DeadTimeCalibration dead_time_calibration_;
 
 public:
     enum class ErrorFlag
@@ -78,12 +101,18 @@ public:
 
     bool isSuccessful() const { return getErrorMask() == 0U; }
 
+    const DeadTimeCalibration& getDeadTimeCalibration() const { return dead_time_calibration_; }
+
     auto toString() const
     {
-        return os::heapless::format("NumErrors: %u, Code: 0x%04x 0b%s",
+        return os::heapless::format("NumErrors: %u, Code: 0x%04x 0b%s\n"
+                                    "Dead time: %.0f/%.0f ns (%s)",
                                     getNumberOfErrors(),
                                     unsigned(mask_),
-                                    os::heapless::intToString<2>(mask_).c_str());
+                                    os::heapless::intToString<2>(mask_).c_str(),
+                                    double(dead_time_calibration_.effective_dead_time_positive) * 1e9,
+                                    double(dead_time_calibration_.effective_dead_time_negative) * 1e9,
+                                    dead_time_calibration_.available ? "identified" : "not identified");
     }
 };
 
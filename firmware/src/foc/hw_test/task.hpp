@@ -34,6 +34,13 @@ namespace hw_test
 {
 /**
  * This class ensures that the power stage hardware, sensors, and the connected motor are functioning correctly.
+ *
+ * If the test is passing, the effective dead time is identified at the end. The phase A is switched against
+ * the phases B and C at two different voltages per polarity of the phase A current; the two points per polarity
+ * yield the resistance of the circuit and the voltage lost by the switching phases, which is converted to the
+ * effective dead time. Only the phases that are being switched contribute to the loss, hence the phases B and C
+ * are held at zero when sourcing (not switching), and at the middle of the range when sinking (switching with the
+ * positive current, whose loss is known from the first measurement).
  */
 class HardwareTestingTask : public ITask
 {
@@ -41,6 +48,13 @@ class HardwareTestingTask : public ITask
     static constexpr Scalar ThresholdCurrent    = 0.15F;
     static constexpr Scalar StabilizationTime   = 0.3F;
 
+    /// The current rises past the threshold much faster than that, the rest is for the current filter to settle
+    static constexpr Scalar QuickStabilizationTime = 0.015F;
+
+    static constexpr Scalar DeadTimeCalibrationMinCurrent       = 0.3F;
+    static constexpr Scalar DeadTimeCalibrationCommonModeDuty   = 0.5F;
+    static constexpr Scalar DeadTimeCalibrationMaxResistanceMismatch = 0.3F;
+
     using Range = math::Range<>;
 
     enum class State : unsigned
@@ -57,10 +71,26 @@ class HardwareTestingTask : public ITask
         PreTestC,
         TestC,
 
+        PreDeadTimeSourcingLow,
+        DeadTimeSourcingLow,
+
+        PreDeadTimeSourcingHigh,
+        DeadTimeSourcingHigh,
+
+        PreDeadTimeSinkingLow,
+        DeadTimeSinkingLow,
+
+        PreDeadTimeSinkingHigh,
+        DeadTimeSinkingHigh,
+
         Finished
     };
 
-    const TaskContext context_;
+    /// Indexed by the order of the measurement states above
+    std::array<Scalar, 4> dead_time_calibration_currents_{};
+
+    const TaskContext& context_;        ///< Kept alive by the task handler
+    const Mode mode_;
 
     State state_ = State::Initialization;
     Scalar time_ = 0;
@@ -94,12 +124,58 @@ class HardwareTestingTask : public ITask
 
     void switchToNextStateIfStabilizationTimeExpired()
     {
-        if (getTimeSinceStateSwitch() >= StabilizationTime)
+        if (getTimeSinceStateSwitch() >= ((mode_ == Mode::Quick) ? QuickStabilizationTime : StabilizationTime))
         {
             switchToNextState();
         }
     }
 
+    /**
+     * Relative voltage of the phase A for the given dead time calibration state, phases B and C are set separately.
+     */
+    static Scalar getDeadTimeCalibrationDuty(const unsigned index, Const relative_testing_voltage)
+    {
+        Const amplitude = relative_testing_voltage * (((index % 2U) == 0) ? 0.5F : 1.0F);
+        return (index < 2) ? amplitude : (DeadTimeCalibrationCommonModeDuty - amplitude);
+    }
+
+    void computeDeadTimeCalibration(Const inverter_voltage)
+    {
+        const auto& i = dead_time_calibration_currents_;
+        auto& out = report_.dead_time_calibration_;
+
+        Const relative_testing_voltage = TestingVoltage / inverter_voltage;
+        Const voltage_step = (getDeadTimeCalibrationDuty(1, relative_testing_voltage) -
+                              getDeadTimeCalibrationDuty(0, relative_testing_voltage)) * inverter_voltage;
+
+        const bool currents_ok = (i[0] > DeadTimeCalibrationMinCurrent) && (i[1] > i[0]) &&
+                                 (i[2] < -DeadTimeCalibrationMinCurrent) && (i[3] < i[2]);
+        if (!currents_ok)
+        {
+            return;
+        }
+
+        // Sourcing: I = (d Vinv - Upos) / R
+        Const resistance = voltage_step / (i[1] - i[0]);
+        Const drop_positive = getDeadTimeCalibrationDuty(0, relative_testing_voltage) * inverter_voltage -
+                              i[0] * resistance;
+
+        // Sinking: I = ((d - dcm) Vinv + Uneg + Upos) / R, the phases B and C are losing Upos
+        Const resistance_sinking = voltage_step / (i[2] - i[3]);
+        Const drop_negative = i[2] * resistance_sinking - drop_positive -
+                              (getDeadTimeCalibrationDuty(2, relative_testing_voltage) -
+                               DeadTimeCalibrationCommonModeDuty) * inverter_voltage;
+
+        // The drops are per PWM period, so they scale with the inverter voltage just like the dead time does
+        out.effective_dead_time_positive = (drop_positive / inverter_voltage) * context_.board.pwm.period;
+        out.effective_dead_time_negative = (drop_negative / inverter_voltage) * context_.board.pwm.period;
+
+        out.available =
+            (std::abs(resistance - resistance_sinking) < resistance * DeadTimeCalibrationMaxResistanceMismatch) &&
+            InverterParameters::getEffectiveDeadTimeLimits().contains(out.effective_dead_time_positive) &&
+            InverterParameters::getEffectiveDeadTimeLimits().contains(out.effective_dead_time_negative);
+    }
+
     void registerError(const Report::ErrorFlag f)
     {
         report_.mask_ = Report::Mask(report_.mask_ | Report::flag2mask(f));
@@ -117,8 +193,10 @@ class HardwareTestingTask : public ITask
     }
 
 public:
-    HardwareTestingTask(const TaskContext& context) :
+    HardwareTestingTask(const TaskContext& context,
+                        const Mode mode = Mode::Full) :
         context_(context),
+        mode_(mode),
         currents_filter_(Vector<2>::Zero())
     {
         assert(context_.board.limits.measurement_range.inverter_temperature.contains(
@@ -228,6 +306,43 @@ public:
             {
                 registerError(Report::ErrorFlag::PhaseCError);
             }
+
+            // Dead time calibration makes sense only if the power stage is working properly
+            if (report_.isSuccessful() && (mode_ == Mode::Full))
+            {
+                switchToNextState();
+            }
+            else
+            {
+                switchState(State::Finished);
+            }
+            break;
+        }
+
+        case State::PreDeadTimeSourcingLow:
+        case State::PreDeadTimeSourcingHigh:
+        case State::PreDeadTimeSinkingLow:
+        case State::PreDeadTimeSinkingHigh:
+        {
+            const auto index = (unsigned(state_) - unsigned(State::PreDeadTimeSourcingLow)) / 2U;
+            pwm_output_[0] = getDeadTimeCalibrationDuty(index, relative_testing_voltage);
+            pwm_output_[1] = pwm_output_[2] = (index < 2) ? 0.0F : DeadTimeCalibrationCommonModeDuty;
+            switchToNextStateIfStabilizationTimeExpired();
+            break;
+        }
+
+        case State::DeadTimeSourcingLow:
+        case State::DeadTimeSourcingHigh:
+        case State::DeadTimeSinkingLow:
+        case State::DeadTimeSinkingHigh:
+        {
+            const auto index = (unsigned(state_) - unsigned(State::DeadTimeSourcingLow)) / 2U;
+            dead_time_calibration_currents_[index] = currents[0];
+
+            if (state_ == State::DeadTimeSinkingHigh)
+            {
+                computeDeadTimeCalibration(hw_status.inverter_voltage);
+            }
             switchToNextState();
             break;
         }
@@ -263,17 +378,22 @@ public:
         return {pwm_output_, true};
     }
 
-    std::array<Scalar, NumDebugVariables> getDebugVariables() const override
+    DebugVariables getDebugVariables() const override
     {
         const auto currents = currents_filter_.getValue();
 
-        return {
+        return {{
             hardware_status_.inverter_voltage,
             math::convertKelvinToCelsius(hardware_status_.inverter_temperature),
             hardware_status_.current_sensor_gain,
             currents[0],
             currents[1]
-        };
+        }};
+    }
+
+    static DebugVariableNames getDebugVariableNames()
+    {
+        return {{ "vinv", "temp", "gain", "ia", "ib" }};
     }
 
     void applyResultToGlobalContext(TaskContext& inout_context) const override
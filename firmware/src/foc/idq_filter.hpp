@@ -0,0 +1,270 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <math/math.hpp>
+#include <zubax_chibios/util/float_eq.hpp>
+#include <cassert>
+#include <cmath>
+
+
+namespace foc
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+
+/**
+ * Filters of the estimated Idq inside the current loop, see @ref ThreePhaseVoltageModulator.
+ * Each filter adds some delay to the current loop, which limits the gains that can be used safely
+ * (see motor_id::CurrentLoopTask), so the choice is a trade-off between the delay and the noise rejection.
+ *
+ * All filters have the same interface, so that the modulator can take any of them as a template argument:
+ *  - configure(config, dt)                      - invoked before use; the default configuration is transparent,
+ *                                                except for the moving average, which is not configurable;
+ *  - setPhaseResistance(Rs)                      - invoked when the estimate of the resistance is updated;
+ *  - update(Idq, Udq, angular_velocity)          - invoked every fast IRQ with the new measurement
+ *                                                and the voltage that is applied during the current period;
+ *  - reset(Idq)                                  - start over from the given value;
+ *  - getValue()                                  - the filtered or estimated Idq.
+ * @{
+ */
+struct IdqFilterConfig
+{
+    Scalar cutoff_frequency = 0;        ///< First order filter, hertz; zero makes it transparent
+    Scalar notch_frequency = 0;         ///< Notch filter, hertz; zero selects the Nyquist frequency
+
+    /// Motor model for the delay compensation
+    Scalar ld = 0;
+    Scalar lq = 0;
+    Scalar rs = 0;
+    Scalar phi = 0;
+};
+
+/**
+ * The original filter; the delay is (Length - 1) / 2 periods.
+ */
+template <unsigned Length>
+class IdqMovingAverageFilter
+{
+    math::SimpleMovingAverageFilter<Length, Vector<2>> filter_;
+
+public:
+    IdqMovingAverageFilter() :
+        filter_(Vector<2>::Zero())
+    { }
+
+    void configure(const IdqFilterConfig&, Const) { }
+
+    void setPhaseResistance(Const) { }
+
+    void update(const Vector<2>& Idq,
+                const Vector<2>&,
+                Const)
+    {
+        filter_.update(Idq);
+    }
+
+    void reset(const Vector<2>& Idq) { filter_.reset(Idq); }
+
+    Vector<2> getValue() const { return filter_.getValue(); }
+};
+
+/**
+ * First order low-pass filter; the delay at low frequencies is (1 - a) / a periods, where a is the innovation weight.
+ */
+class IdqFirstOrderFilter
+{
+    Scalar innovation_weight_ = 1.0F;
+    Vector<2> value_ = Vector<2>::Zero();
+
+public:
+    void configure(const IdqFilterConfig& config,
+                   Const dt)
+    {
+        assert(dt > 0);
+        innovation_weight_ = os::float_eq::positive(config.cutoff_frequency) ?
+                             (1.0F - std::exp(-math::Pi2 * config.cutoff_frequency * dt)) : 1.0F;
+    }
+
+    void setPhaseResistance(Const) { }
+
+    void update(const Vector<2>& Idq,
+                const Vector<2>&,
+                Const)
+    {
+        value_ += innovation_weight_ * (Idq - value_);
+    }
+
+    void reset(const Vector<2>& Idq) { value_ = Idq; }
+
+    Vector<2> getValue() const { return value_; }
+};
+
+/**
+ * Second order notch filter with unity gain at DC. The ripple at the switching frequency is aliased by the sampling,
+ * so its residue shows up near the Nyquist frequency, which is the default; the delay at low frequencies is a small
+ * fraction of the period. The bandwidth of the notch is a fixed fraction of its frequency.
+ */
+class IdqNotchFilter
+{
+    static constexpr Scalar RelativeBandwidth = 0.5F;
+
+    // Direct form II transposed, the leading denominator coefficient is one
+    Scalar b0_ = 1;
+    Scalar b1_ = 0;
+    Scalar b2_ = 0;
+    Scalar a1_ = 0;
+    Scalar a2_ = 0;
+
+    Vector<2> z1_ = Vector<2>::Zero();
+    Vector<2> z2_ = Vector<2>::Zero();
+    Vector<2> value_ = Vector<2>::Zero();
+
+public:
+    void configure(const IdqFilterConfig& config,
+                   Const dt)
+    {
+        assert(dt > 0);
+        Const nyquist = 0.5F / dt;
+        Const frequency = os::float_eq::positive(config.notch_frequency) ?
+                          std::min(config.notch_frequency, nyquist) : nyquist;
+
+        Const cos_w0 = std::cos(math::Pi2 * frequency * dt);
+        Const r = math::Range<>(0.0F, 0.99F).constrain(1.0F - math::Pi * RelativeBandwidth * frequency * dt);
+
+        a1_ = -2.0F * r * cos_w0;
+        a2_ = r * r;
+
+        Const gain = (1.0F + a1_ + a2_) / (2.0F - 2.0F * cos_w0);
+        b0_ = gain;
+        b1_ = -2.0F * cos_w0 * gain;
+        b2_ = gain;
+
+        reset(value_);
+    }
+
+    void setPhaseResistance(Const) { }
+
+    void update(const Vector<2>& Idq,
+                const Vector<2>&,
+                Const)
+    {
+        value_ = b0_ * Idq + z1_;
+        z1_ = b1_ * Idq - a1_ * value_ + z2_;
+        z2_ = b2_ * Idq - a2_ * value_;
+    }
+
+    void reset(const Vector<2>& Idq)
+    {
+        // Steady state for the constant input
+        value_ = Idq;
+        z2_ = (b2_ - a2_) * Idq;
+        z1_ = (b1_ - a1_) * Idq + z2_;
+    }
+
+    Vector<2> getValue() const { return value_; }
+};
+
+/**
+ * Observer that predicts Idq at the next sampling instant, which is the middle of the period when the voltage
+ * computed from the estimate is applied; this compensates the computation delay of the current loop.
+ * The prediction follows the model of the motor in the rotating frame, with the voltage that is applied during
+ * the current period; the measurement corrects the previous prediction with a fixed gain, which also rejects
+ * some noise. Requires a valid motor model; if it is not configured, the filter is transparent.
+ * The model is projected onto the estimated frame, so an angle error of the sensorless observer, e.g. during
+ * the spinup, biases the prediction; with a sensor, or a well converged observer, it allows the highest gains.
+ *
+ * The modulator transforms the measurement with the angle extrapolated to the next sampling instant, where the output
+ * will be applied, so the measurement is rotated back into the frame of its own instant, where the applied voltage
+ * is defined. Otherwise, the back EMF would leak into the direct axis at high speed, biasing the estimate.
+ */
+class IdqDelayCompensatingObserver
+{
+    static constexpr Scalar CorrectionGain = 0.5F;
+
+    Scalar dt_ = 0;
+    Scalar ld_ = 0;
+    Scalar lq_ = 0;
+    Scalar rs_ = 0;
+    Scalar phi_ = 0;
+
+    Vector<2> predicted_ = Vector<2>::Zero();                   ///< For the next measurement
+    Vector<2> value_ = Vector<2>::Zero();
+
+    bool isConfigured() const { return os::float_eq::positive(ld_) && os::float_eq::positive(lq_); }
+
+public:
+    void configure(const IdqFilterConfig& config,
+                   Const dt)
+    {
+        assert(dt > 0);
+        dt_ = dt;
+        ld_ = config.ld;
+        lq_ = config.lq;
+        rs_ = config.rs;
+        phi_ = config.phi;
+    }
+
+    void update(const Vector<2>& Idq,
+                const Vector<2>& Udq,
+                Const angular_velocity)
+    {
+        if (!isConfigured())
+        {
+            value_ = predicted_ = Idq;
+            return;
+        }
+
+        // The angle is small, so the rotation is approximated with the Taylor series
+        Const angle = angular_velocity * dt_;
+        Const cos_angle = 1.0F - angle * angle * 0.5F;
+        Const sin_angle = angle * (1.0F - angle * angle * (1.0F / 6.0F));
+        const Vector<2> measured(cos_angle * Idq[0] - sin_angle * Idq[1],
+                                 sin_angle * Idq[0] + cos_angle * Idq[1]);
+
+        const Vector<2> corrected = predicted_ + CorrectionGain * (measured - predicted_);
+
+        Vector<2> derivative;
+        derivative[0] = (Udq[0] - rs_ * corrected[0] + angular_velocity * lq_ * corrected[1]) / ld_;
+        derivative[1] = (Udq[1] - rs_ * corrected[1] - angular_velocity * (ld_ * corrected[0] + phi_)) / lq_;
+
+        predicted_ = corrected + dt_ * derivative;
+        value_ = predicted_;
+    }
+
+    void setPhaseResistance(Const Rs) { rs_ = Rs; }
+
+    void reset(const Vector<2>& Idq) { value_ = predicted_ = Idq; }
+
+    Vector<2> getValue() const { return value_; }
+};
+/**
+ * @}
+ */
+
+}
@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <math/math.hpp>
+#include <zubax_chibios/util/heapless.hpp>
+#include <cstdint>
+#include <algorithm>
+
+
+namespace foc
+{
+/**
+ * Watches the timing of the main IRQ and sheds its least important work when the IRQ cannot keep up with its period.
+ * Commutation has the highest priority, so debugging and telemetry are sacrificed first, then the observer rate.
+ *
+ * Every period of the main IRQ is classified as either within or over the budget. A period is over the budget if
+ * the previous invocation took longer than the allowed fraction of the period (including the preemption by the fast
+ * IRQ), or if the fast IRQ has reported that a period has been lost. The degradation level is raised when the
+ * smoothed fraction of periods over the budget exceeds the threshold, and lowered by one step after the timing has
+ * stayed within the budget for a long uninterrupted time.
+ *
+ * The update method must be invoked from the main IRQ once per period.
+ */
+class IRQBudgetMonitor
+{
+public:
+    enum class DegradationLevel : std::uint8_t
+    {
+        None,
+        NoDebugVariables,           ///< Debug variables are not collected; no plotting, telemetry, blackbox
+        ObserverDecimated,          ///< Also, the observer runs every other period of the main IRQ
+        MaxLevel_ = ObserverDecimated
+    };
+
+    static constexpr float BudgetFraction = 0.9F;                   ///< Of the main IRQ period
+    static constexpr float OverrunFractionTimeConstant = 0.05F;     ///< Second
+    static constexpr float EscalationThreshold = 0.1F;              ///< Fraction of periods over the budget
+    static constexpr float RecoveryTime = 3.0F;                     ///< Second
+
+    struct Status
+    {
+        DegradationLevel degradation_level = DegradationLevel::None;
+        std::uint32_t num_periods_over_budget = 0;
+        std::uint32_t num_lost_periods = 0;                         ///< As reported by the fast IRQ
+        std::uint32_t num_escalations = 0;
+        float worst_load = 0;                                       ///< Duration divided by period
+
+        static const char* getDegradationLevelName(const DegradationLevel level)
+        {
+            switch (level)
+            {
+            case DegradationLevel::None:                return "none";
+            case DegradationLevel::NoDebugVariables:    return "no debug variables";
+            case DegradationLevel::ObserverDecimated:   return "observer decimated";
+            }
+            return "???";
+        }
+
+        auto toString() const
+        {
+            return os::heapless::format("Degradation: %s\n"
+                                        "Periods over budget: %lu, lost: %lu\n"
+                                        "Escalations: %lu\n"
+                                        "Worst load: %.0f %%",
+                                        getDegradationLevelName(degradation_level),
+                                        num_periods_over_budget,
+                                        num_lost_periods,
+                                        num_escalations,
+                                        double(worst_load) * 100.0);
+        }
+    };
+
+private:
+    Status status_;
+    std::uint32_t last_num_lost_periods_ = 0;
+    float overrun_fraction_ = 0;
+    float time_within_budget_ = 0;
+    bool initialized_ = false;
+
+public:
+    /**
+     * @param period                    Period of the main IRQ, second
+     * @param last_duration             Duration of the previous invocation of the main IRQ, second
+     * @param num_lost_periods          Cumulative number of periods lost, as reported by the fast IRQ
+     */
+    void update(const float period,
+                const float last_duration,
+                const std::uint32_t num_lost_periods)
+    {
+        if (!initialized_)
+        {
+            initialized_ = true;
+            last_num_lost_periods_ = num_lost_periods;      // Those that happened before the monitor was started
+        }
+
+        const float load = last_duration / period;
+        status_.worst_load = std::max(status_.worst_load, load);
+
+        const bool lost = num_lost_periods != last_num_lost_periods_;
+        status_.num_lost_periods += num_lost_periods - last_num_lost_periods_;
+        last_num_lost_periods_ = num_lost_periods;
+
+        const bool over_budget = lost || (load > BudgetFraction);
+        if (over_budget)
+        {
+            status_.num_periods_over_budget++;
+            time_within_budget_ = 0;
+        }
+        else
+        {
+            time_within_budget_ += period;
+        }
+
+        overrun_fraction_ += (period / OverrunFractionTimeConstant) * ((over_budget ? 1.0F : 0.0F) - overrun_fraction_);
+
+        const auto level = unsigned(status_.degradation_level);
+
+        if ((overrun_fraction_ > EscalationThreshold) &&
+            (level < unsigned(DegradationLevel::MaxLevel_)))
+        {
+            status_.degradation_level = DegradationLevel(level + 1U);
+            status_.num_escalations++;
+            overrun_fraction_ = 0;          // Giving the new level a chance to take effect
+        }
+        else if ((time_within_budget_ > RecoveryTime) &&
+                 (level > unsigned(DegradationLevel::None)))
+        {
+            status_.degradation_level = DegradationLevel(level - 1U);
+            time_within_budget_ = 0;
+        }
+    }
+
+    DegradationLevel getDegradationLevel() const { return status_.degradation_level; }
+
+    const Status& getStatus() const { return status_; }
+};
+
+}
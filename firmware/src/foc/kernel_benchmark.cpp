@@ -0,0 +1,256 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "kernel_benchmark.hpp"
+#include "transforms.hpp"
+#include "voltage_modulator.hpp"
+#include "fixed_point.hpp"
+#include "observer/observer.hpp"
+#include "observer/flux_observer.hpp"
+#include <board/irq_profiler.hpp>
+#include <zubax_chibios/config/config.hpp>
+#include <algorithm>
+#include <limits>
+
+
+namespace foc
+{
+namespace kernel_benchmark
+{
+namespace
+{
+
+os::config::Param<bool> g_param_run_at_boot             ("bench.at_boot",   false);
+os::config::Param<unsigned> g_param_num_iterations      ("bench.num_iter",   1000,   10,   10000);
+
+// Limits in cycles; zero disables the check
+os::config::Param<unsigned> g_param_limit_clarke_park   ("bench.max_park",      0,    0, 100000);
+os::config::Param<unsigned> g_param_limit_svt           ("bench.max_svt",       0,    0, 100000);
+os::config::Param<unsigned> g_param_limit_current_pi    ("bench.max_pi",        0,    0, 100000);
+os::config::Param<unsigned> g_param_limit_observer      ("bench.max_obs",       0,    0, 100000);
+os::config::Param<unsigned> g_param_limit_flux_observer ("bench.max_flux",      0,    0, 100000);
+os::config::Param<unsigned> g_param_limit_fixed_point   ("bench.max_q15",       0,    0, 100000);
+
+/**
+ * The synthetic inputs are precomputed, so that their generation is not measured.
+ * They describe a motor rotating at a constant speed with a constant Iq, slightly perturbed.
+ */
+constexpr unsigned NumInputSamples = 32;
+
+constexpr Scalar MotorPhi = 1.0e-3F;
+constexpr Scalar MotorRs  = 0.1F;
+constexpr Scalar MotorL   = 30e-6F;
+constexpr Scalar MaxCurrent = 20.0F;
+constexpr Scalar InverterVoltage = 14.8F;
+constexpr Scalar AngularVelocity = 1000.0F;
+constexpr Scalar Period = 50e-6F;
+
+// Current sensing model of the fixed point benchmark: two 12-bit samples per IRQ, 50 A/V, offset at mid scale
+constexpr Scalar ADCVoltsPerCount = 3.3F / 4095.0F / 2.0F;
+constexpr Scalar CurrentSensorAmperesPerVolt = 50.0F;
+constexpr Scalar CurrentSensorZeroOffset = 1.65F;
+constexpr std::uint16_t PWMTop = 2000;
+
+struct InputSample
+{
+    Vector<2> phase_currents_ab;
+    Scalar angular_position;
+    Vector<2> Idq;
+    Vector<2> Udq;
+    Vector<2> U_alpha_beta;
+    std::array<std::uint32_t, 2> adc_sums;
+    fixed_point::Q15x2 angle_sincos;
+};
+
+std::array<InputSample, NumInputSamples> generateInputs()
+{
+    std::array<InputSample, NumInputSamples> out;
+
+    for (unsigned i = 0; i < NumInputSamples; i++)
+    {
+        auto& s = out[i];
+        s.angular_position = math::normalizeAngle(AngularVelocity * Period * Scalar(i * 17U));
+
+        const Scalar perturbation = std::sin(Scalar(i) * 0.7F);
+        s.Idq = Vector<2>(0.2F * perturbation, 5.0F + perturbation);
+        s.Udq = Vector<2>(MotorRs * s.Idq[0] - AngularVelocity * MotorL * s.Idq[1],
+                          MotorRs * s.Idq[1] + AngularVelocity * MotorPhi);
+
+        const auto angle_sincos = math::sincos(s.angular_position);
+        const auto I_alpha_beta = performInverseParkTransform(s.Idq, angle_sincos);
+        s.phase_currents_ab = Vector<2>(I_alpha_beta[0],
+                                        (I_alpha_beta[1] * SquareRootOf3 - I_alpha_beta[0]) * 0.5F);
+        s.U_alpha_beta = performInverseParkTransform(s.Udq, angle_sincos);
+
+        for (unsigned k = 0; k < 2; k++)
+        {
+            Const volts = CurrentSensorZeroOffset + s.phase_currents_ab[k] / CurrentSensorAmperesPerVolt;
+            s.adc_sums[k] = std::uint32_t(volts / ADCVoltsPerCount);
+        }
+        s.angle_sincos = fixed_point::packSinCos(angle_sincos);
+    }
+
+    return out;
+}
+
+volatile Scalar g_sink;
+
+/**
+ * The first invocation is not accounted for, it warms up the caches.
+ */
+template <typename Callable>
+KernelStatistics measure(const unsigned num_iterations,
+                         const std::uint32_t overhead_cycles,
+                         Callable&& callable)
+{
+    KernelStatistics out;
+    out.min_cycles = std::numeric_limits<std::uint32_t>::max();
+    std::uint64_t total_cycles = 0;
+
+    for (unsigned i = 0; i <= num_iterations; i++)
+    {
+        const std::uint32_t started_at = board::irq_profiler::getCycleCount();
+        callable(i % NumInputSamples);
+        const std::uint32_t raw_cycles = board::irq_profiler::getCycleCount() - started_at;
+
+        if (i > 0)
+        {
+            const std::uint32_t cycles = (raw_cycles > overhead_cycles) ? (raw_cycles - overhead_cycles) : 0U;
+            out.min_cycles = std::min(out.min_cycles, cycles);
+            out.max_cycles = std::max(out.max_cycles, cycles);
+            total_cycles += cycles;
+        }
+    }
+
+    out.average_cycles = std::uint32_t(total_cycles / std::max(1U, num_iterations));
+    return out;
+}
+
+} // namespace
+
+const char* getKernelName(const Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Kernel::ClarkePark:            return "park";
+    case Kernel::SpaceVectorTransform:  return "svt";
+    case Kernel::CurrentPI:             return "pi";
+    case Kernel::Observer:              return "obs";
+    case Kernel::FluxObserver:          return "flux";
+    case Kernel::FixedPointCurrentLoop: return "q15";
+    case Kernel::NumKernels_:
+    default:                            return "?";
+    }
+}
+
+Result run(unsigned num_iterations)
+{
+    if (num_iterations == 0)
+    {
+        num_iterations = g_param_num_iterations.get();
+    }
+
+    static const auto inputs = generateInputs();
+
+    Result result;
+    result.num_iterations = num_iterations;
+
+    const auto overhead = measure(num_iterations, 0, [](unsigned) { g_sink = 0.0F; }).min_cycles;
+
+    result.kernels[unsigned(Kernel::ClarkePark)] = measure(num_iterations, overhead, [](unsigned i)
+        {
+            const auto& s = inputs[i];
+            const auto Idq = performParkTransform(performClarkeTransform(s.phase_currents_ab),
+                                                  math::sincos(s.angular_position));
+            g_sink = Idq[0] + Idq[1];
+        });
+
+    result.kernels[unsigned(Kernel::SpaceVectorTransform)] = measure(num_iterations, overhead, [](unsigned i)
+        {
+            const auto pwm = performSpaceVectorTransform(inputs[i].U_alpha_beta, InverterVoltage).first;
+            g_sink = pwm[0] + pwm[1] + pwm[2];
+        });
+
+    CurrentPIController pi_d(MotorL, MotorRs, MaxCurrent, Period);
+    CurrentPIController pi_q(MotorL, MotorRs, MaxCurrent, Period);
+    result.kernels[unsigned(Kernel::CurrentPI)] = measure(num_iterations, overhead, [&](unsigned i)
+        {
+            const auto& s = inputs[i];
+            g_sink = pi_d.computeVoltage(0.0F, s.Idq[0], InverterVoltage) +
+                     pi_q.computeVoltage(5.0F, s.Idq[1], InverterVoltage);
+        });
+
+    observer::Observer obs(observer::Parameters(), MotorPhi, MotorL, MotorL, MotorRs);
+    result.kernels[unsigned(Kernel::Observer)] = measure(num_iterations, overhead, [&](unsigned i)
+        {
+            const auto& s = inputs[i];
+            obs.update(Period, s.Idq, s.Udq);
+            g_sink = obs.getAngularPosition();
+        });
+
+    observer::FluxObserver flux_obs(observer::Parameters(), MotorPhi, MotorL, MotorL, MotorRs);
+    result.kernels[unsigned(Kernel::FluxObserver)] = measure(num_iterations, overhead, [&](unsigned i)
+        {
+            const auto& s = inputs[i];
+            flux_obs.update(Period, s.Idq, s.Udq);
+            g_sink = flux_obs.getAngularPosition();
+        });
+
+    fixed_point::CurrentLoop::Configuration fixed_point_config;
+    fixed_point_config.adc_volts_per_count = ADCVoltsPerCount;
+    fixed_point_config.current_sensor_zero_offsets = { CurrentSensorZeroOffset, CurrentSensorZeroOffset };
+    fixed_point_config.current_sensor_amperes_per_volt = CurrentSensorAmperesPerVolt;
+    fixed_point_config.full_scale_current = pi_q.getFullScaleCurrent();
+    fixed_point_config.proportional_gain = pi_q.getProportionalGain();
+    fixed_point_config.integral_gain = pi_q.getIntegralGain();
+    fixed_point_config.pwm_top = PWMTop;
+
+    fixed_point::CurrentLoop fixed_point_loop;
+    fixed_point_loop.configure(fixed_point_config, InverterVoltage);
+    fixed_point_loop.setReference(0.0F, 5.0F);
+    result.kernels[unsigned(Kernel::FixedPointCurrentLoop)] = measure(num_iterations, overhead, [&](unsigned i)
+        {
+            const auto& s = inputs[i];
+            const auto out = fixed_point_loop.update(s.adc_sums, s.angle_sincos);
+            g_sink = Scalar(out.ccr[0] + out.ccr[1] + out.ccr[2]);
+        });
+
+    result.kernels[unsigned(Kernel::ClarkePark)].limit_cycles           = g_param_limit_clarke_park.get();
+    result.kernels[unsigned(Kernel::SpaceVectorTransform)].limit_cycles = g_param_limit_svt.get();
+    result.kernels[unsigned(Kernel::CurrentPI)].limit_cycles            = g_param_limit_current_pi.get();
+    result.kernels[unsigned(Kernel::Observer)].limit_cycles             = g_param_limit_observer.get();
+    result.kernels[unsigned(Kernel::FluxObserver)].limit_cycles         = g_param_limit_flux_observer.get();
+    result.kernels[unsigned(Kernel::FixedPointCurrentLoop)].limit_cycles = g_param_limit_fixed_point.get();
+
+    return result;
+}
+
+bool isEnabledAtBoot()
+{
+    return g_param_run_at_boot.get();
+}
+
+}
+}
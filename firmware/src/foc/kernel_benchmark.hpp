@@ -0,0 +1,119 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <zubax_chibios/util/heapless.hpp>
+#include <cstdint>
+#include <array>
+
+
+namespace foc
+{
+/**
+ * Self-benchmark of the computational kernels of the motor control hot path, executed on synthetic inputs.
+ * The results are reported in cycles of the DWT counter and compared against the limits stored in the
+ * configuration (zero disables the check), so that every build can be qualified on the target.
+ * The benchmark is executed in the context of the calling thread; the motor control IRQs may preempt it, which
+ * inflates the average and the maximum, but never the minimum, so only the minimum is checked against the limit.
+ */
+namespace kernel_benchmark
+{
+
+enum class Kernel : std::uint8_t
+{
+    ClarkePark,             ///< Clarke transform, sin/cos, Park transform
+    SpaceVectorTransform,   ///< performSpaceVectorTransform()
+    CurrentPI,              ///< CurrentPIController::computeVoltage() for both axes
+    Observer,               ///< observer::Observer::update()
+    FluxObserver,           ///< observer::FluxObserver::update()
+    FixedPointCurrentLoop,  ///< fixed_point::CurrentLoop::update(), for comparison only, not used by the IRQs
+    NumKernels_
+};
+
+constexpr unsigned NumKernels = unsigned(Kernel::NumKernels_);
+
+/**
+ * Returns a short human-readable name of the kernel, no longer than 4 characters.
+ */
+const char* getKernelName(Kernel kernel);
+
+struct KernelStatistics
+{
+    std::uint32_t min_cycles = 0;
+    std::uint32_t average_cycles = 0;
+    std::uint32_t max_cycles = 0;
+    std::uint32_t limit_cycles = 0;     ///< Zero if not configured
+
+    bool isWithinLimit() const { return (limit_cycles == 0) || (min_cycles <= limit_cycles); }
+};
+
+struct Result
+{
+    std::array<KernelStatistics, NumKernels> kernels{};
+    unsigned num_iterations = 0;
+
+    bool isSuccessful() const
+    {
+        for (auto& k : kernels)
+        {
+            if (!k.isWithinLimit())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * One line per kernel.
+     */
+    auto toString(Kernel kernel) const
+    {
+        const auto& k = kernels[unsigned(kernel)];
+        return os::heapless::format("%-4s min %5u avg %5u max %6u cyc, limit %5u: %s",
+                                    getKernelName(kernel),
+                                    unsigned(k.min_cycles),
+                                    unsigned(k.average_cycles),
+                                    unsigned(k.max_cycles),
+                                    unsigned(k.limit_cycles),
+                                    (k.limit_cycles == 0) ? "not checked" : (k.isWithinLimit() ? "OK" : "FAILED"));
+    }
+};
+
+/**
+ * Runs the benchmark; this takes a few dozen milliseconds with the default number of iterations.
+ * Must be invoked from a thread. The motor control is not affected, so it can be executed at any time.
+ * @param num_iterations        Number of iterations per kernel; zero selects the configured value.
+ */
+Result run(unsigned num_iterations = 0);
+
+/**
+ * Whether the benchmark should be executed at boot, as configured.
+ */
+bool isEnabledAtBoot();
+
+}
+}
@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "latency_benchmark.hpp"
+#include "seqlock.hpp"
+#include <board/motor.hpp>
+#include <cmath>
+
+
+namespace foc
+{
+namespace latency_benchmark
+{
+namespace
+{
+
+volatile bool g_active = false;
+
+/// Cycle counter value of the reception of the pending command; zero if there is no pending command
+volatile std::uint32_t g_pending_received_at = 0;
+
+/// Updated by the fast IRQ; the readers retry instead of blocking the IRQs while copying the histogram
+SeqLock<Statistics> g_statistics;
+
+} // namespace
+
+void Statistics::registerSample(const float latency)
+{
+    if ((num_samples == 0) || (latency < min_latency))
+    {
+        min_latency = latency;
+    }
+    if ((num_samples == 0) || (latency > max_latency))
+    {
+        max_latency = latency;
+    }
+    num_samples++;
+    total_latency += latency;
+
+    const auto index = unsigned(latency / BucketWidth);
+    histogram[(index < NumHistogramBuckets) ? index : (NumHistogramBuckets - 1U)]++;
+}
+
+float Statistics::getPercentile(const float percentile) const
+{
+    const auto threshold = std::uint32_t(std::ceil(float(num_samples) * percentile * 0.01F));
+
+    std::uint32_t accumulated = 0;
+    for (unsigned i = 0; i < NumHistogramBuckets; i++)
+    {
+        accumulated += histogram[i];
+        if ((accumulated >= threshold) && (accumulated > 0))
+        {
+            // The overflow bucket is unbounded, so the maximum is reported instead
+            return (i < (NumHistogramBuckets - 1U)) ? (float(i + 1U) * BucketWidth) : max_latency;
+        }
+    }
+    return 0;
+}
+
+void start()
+{
+    board::motor::AbsoluteCriticalSectionLocker locker;
+    g_statistics.write(Statistics());
+    g_pending_received_at = 0;
+    g_active = true;
+}
+
+void stop()
+{
+    g_active = false;
+}
+
+bool isActive()
+{
+    return g_active;
+}
+
+Statistics getStatistics()
+{
+    return g_statistics.read();
+}
+
+void onCommandApplied(const std::uint32_t received_at)
+{
+    if (g_active && (received_at != 0))
+    {
+        g_pending_received_at = received_at;
+    }
+}
+
+BOARD_RAM_FUNCTION
+void onPWMUpdated()
+{
+    const std::uint32_t received_at = g_pending_received_at;
+    if (received_at != 0)
+    {
+        g_pending_received_at = 0;
+        const std::uint32_t cycles = DWT->CYCCNT - received_at;
+        g_statistics.modify([cycles](Statistics& stat) { stat.registerSample(float(cycles) / float(STM32_SYSCLK)); });
+    }
+}
+
+}
+}
@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <cstdint>
+#include <array>
+
+
+namespace foc
+{
+/**
+ * End-to-end command latency benchmark: from the reception of the command frame by the CAN hardware until
+ * the new PWM values are written to the timer registers by the fast IRQ.
+ * All timestamps are values of the DWT cycle counter, see board::irq_profiler::getCycleCount().
+ * The samples are collected only while the benchmark is active; the statistics are preserved when it is stopped.
+ */
+namespace latency_benchmark
+{
+/**
+ * Linear latency histogram with the overflow bucket at the end.
+ */
+struct Statistics
+{
+    static constexpr unsigned NumHistogramBuckets = 100;
+    static constexpr float BucketWidth = 2e-6F;                 ///< Seconds; the histogram covers 0..198 us
+
+    std::uint32_t num_samples = 0;
+    float min_latency = 0;
+    float max_latency = 0;
+    float total_latency = 0;
+    std::array<std::uint32_t, NumHistogramBuckets> histogram{};
+
+    void registerSample(float latency);
+
+    float getAverageLatency() const
+    {
+        return (num_samples > 0) ? (total_latency / float(num_samples)) : 0.0F;
+    }
+
+    /**
+     * Returns the upper bound of the bucket that contains the specified percentile, in seconds.
+     * @param percentile    In the range [0, 100]
+     */
+    float getPercentile(float percentile) const;
+};
+
+/**
+ * Starting resets the statistics. These functions can be invoked from any thread.
+ */
+void start();
+void stop();
+bool isActive();
+
+/**
+ * Returns a consistent copy of the statistics; can be invoked from any context.
+ */
+Statistics getStatistics();
+
+/**
+ * Invoked from the main IRQ once a command has been applied; the next PWM update will complete the sample.
+ * @param received_at   Cycle counter value when the command was received; zero if not available.
+ */
+void onCommandApplied(std::uint32_t received_at);
+
+/**
+ * Invoked from the fast IRQ after the PWM values are written.
+ */
+void onPWMUpdated();
+
+}
+}
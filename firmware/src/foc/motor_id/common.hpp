@@ -29,6 +29,7 @@
 #include <foc/irq_debug.hpp>
 #include <math/math.hpp>
 #include <cstdint>
+#include <cmath>
 
 
 namespace foc
@@ -39,9 +40,18 @@ namespace motor_id
  * Context of the whole identification process.
  * An object of this type is passed from task to task until the procedure is complete.
  * The virtual methods should be devirtualized by the optimizer.
+ * The parameters refer to the shared task context, which is kept alive by the task handler.
  */
-struct SubTaskContext : public TaskContext
+struct SubTaskContext
 {
+    const foc::Parameters& params;
+    const TaskContext::Board& board;
+
+    explicit SubTaskContext(const TaskContext& shared) :
+        params(shared.params),
+        board(shared.board)
+    { }
+
     virtual ~SubTaskContext() { }
 
     virtual void setPWM(const Vector<3>& pwm) = 0;
@@ -56,6 +66,80 @@ struct SubTaskContext : public TaskContext
 
 using SubTaskContextReference = SubTaskContext&;
 
+/**
+ * Whether the convergence of the average can be evaluated now, see @ref Parameters::convergence_tolerance.
+ * The check is due only when a batch is complete, so it can be invoked from the fast IRQ at every period.
+ * A few batches are required regardless, otherwise the spread of the batch means is meaningless.
+ */
+template <typename Averager>
+inline bool isConvergenceCheckDue(const Averager& averager,
+                                  Const tolerance)
+{
+    constexpr unsigned MinBatches = 16;
+
+    return (tolerance > 0) &&
+           averager.isBatchComplete() &&
+           (averager.getNumBatches() >= MinBatches);
+}
+
+/**
+ * Whether the standard error of the average is within the tolerance relative to the average.
+ */
+template <typename Averager>
+inline bool hasConverged(const Averager& averager,
+                         Const tolerance)
+{
+    return isConvergenceCheckDue(averager, tolerance) &&
+           (averager.getStandardError() <= tolerance * std::abs(Scalar(averager.getAverage())));
+}
+
+/**
+ * Synchronous demodulator of the response to a sinusoidal injection proportional to the cosine of the phase.
+ * Yields the amplitude and the phase of the response at the injection frequency.
+ */
+struct SynchronousDemodulator
+{
+    math::BatchedCumulativeAverageComputer<> in_phase;
+    math::BatchedCumulativeAverageComputer<> quadrature;
+
+    /**
+     * @param x         Response sample
+     * @param sincos    Sine and cosine of the injection phase, see @ref math::sincos()
+     */
+    void addSample(Const x, const Vector<2>& sincos)
+    {
+        in_phase.addSample(x * sincos[1]);
+        quadrature.addSample(x * sincos[0]);
+    }
+
+    /// Amplitude of the response at the injection frequency
+    Scalar getAmplitude() const
+    {
+        return 2.0F * Vector<2>(Scalar(in_phase.getAverage()), Scalar(quadrature.getAverage())).norm();
+    }
+
+    /// Phase of the response relative to the injection, radian in [-Pi, Pi]; negative if the response lags
+    Scalar getPhase() const
+    {
+        return std::atan2(-Scalar(quadrature.getAverage()), Scalar(in_phase.getAverage()));
+    }
+
+    unsigned getNumSamples() const { return unsigned(in_phase.getNumSamples()); }
+
+    /// The amplitude is within the tolerance if both components are, with some margin
+    bool hasConverged(Const tolerance) const
+    {
+        if (!isConvergenceCheckDue(in_phase, tolerance))
+        {
+            return false;
+        }
+
+        Const limit = tolerance * getAmplitude() * 0.35F;   // 0.5 / sqrt(2), rounded down
+        return (in_phase.getStandardError() <= limit) &&
+               (quadrature.getStandardError() <= limit);
+    }
+};
+
 /**
  * Interface of a motor ID task, e.g. resistance measurement.
  */
@@ -99,6 +183,15 @@ public:
      * i.e. it cannot be interrupted by the PWM IRQ.
      */
     virtual MotorParameters getEstimatedMotorParameters() const = 0;
+
+    /**
+     * Tasks that tune the controller write their results here; most tasks leave the parameters unchanged.
+     * Same invocation constraints as above.
+     */
+    virtual void updateControllerParameters(ControllerParameters& inout_params) const
+    {
+        (void) inout_params;
+    }
 };
 
 }
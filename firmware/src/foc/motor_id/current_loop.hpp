@@ -0,0 +1,479 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "common.hpp"
+#include <zubax_chibios/util/helpers.hpp>
+
+
+namespace foc
+{
+namespace motor_id
+{
+/**
+ * Current loop tuning task.
+ *
+ * The default gains of @ref CurrentPIController do not account for the delay of the current loop, which is defined
+ * by the board (sampling, computation, PWM update). This task measures the delay and picks the gains that yield the
+ * configured phase margin, see @ref Parameters::current_loop_phase_margin.
+ *
+ * The rotor is aligned with the alpha axis by a DC current as in @ref SaliencyTask, and all of the excitation is
+ * applied along the same (direct) axis, so that no torque is produced. The procedure is as follows:
+ *
+ *  1. A stepped chirp: a sinusoidal voltage is injected at a few frequencies approaching the PWM rate, and the phase
+ *     of the current response is demodulated synchronously. The phase in excess of the RL lag is the loop delay,
+ *     which is fitted over all frequencies. The delay defines the crossover frequency for the phase margin,
+ *     and the gains follow from the pole-zero cancellation, as in the default PI design:
+ *
+ *          PM = Pi/2 - Wc * Td,    Kp = Wc * Lq,    Ki = Wc * Rs
+ *
+ *  2. Step response: the loop is closed with the selected crossover frequency, and small current steps are applied
+ *     on top of the bias. If the average overshoot exceeds what is expected for the phase margin, the crossover
+ *     frequency is reduced and the test is repeated.
+ *
+ * The resulting gains are stored in @ref ControllerParameters. This measurement should be executed after
+ * @ref SaliencyTask, since the direct axis inductance defines the plant during the measurement.
+ */
+class CurrentLoopTask : public ISubTask
+{
+    static constexpr Scalar AlignmentDuration             = 1.0F;
+    static constexpr Scalar SettlingDuration              = 0.05F;
+    static constexpr Scalar FrequencyMeasurementDuration  = 1.0F;
+    static constexpr Scalar StepTestDuration              = 0.5F;
+    static constexpr Scalar BiasCurrentFraction           = 0.5F;     ///< Of the estimation current
+    static constexpr Scalar InjectionCurrentFraction      = 0.25F;    ///< Of the estimation current, also the step
+    static constexpr Scalar MinValidSampleRatio           = 0.99F;
+
+    static constexpr unsigned NumInjectionFrequencies     = 3;
+    static constexpr Scalar MaxInjectionFrequencyRatio    = 0.1F;     ///< Of the fast IRQ rate, halved for the others
+    static constexpr Scalar MaxCrossoverFrequencyRatio    = 0.1F;     ///< Of the fast IRQ rate
+    static constexpr Scalar MaxDelayInPeriods             = 10.0F;
+
+    static constexpr Scalar MinPhaseMargin                = 30.0F;    ///< Degrees
+    static constexpr Scalar OvershootTolerance            = 0.1F;     ///< Above the expected overshoot
+    static constexpr Scalar CrossoverBackoffFactor        = 0.7F;
+    static constexpr unsigned MaxStepTestAttempts         = 3;
+    static constexpr Scalar StepHalfPeriodCrossoverCycles = 10.0F;    ///< In units of 1/Wc
+
+    enum class State
+    {
+        Alignment,
+        FrequencyResponse,
+        StepResponse,
+        FinishedSuccessfully,
+        Failed
+    } state_ = State::Alignment;
+
+    /**
+     * Averages of the step response: the peak after the rising edge, and the settled values of both levels.
+     */
+    struct StepResponse
+    {
+        math::BatchedCumulativeAverageComputer<> peak;
+        math::BatchedCumulativeAverageComputer<> high;
+        math::BatchedCumulativeAverageComputer<> low;
+
+        Scalar getOvershoot() const
+        {
+            Const step = Scalar(high.getAverage() - low.getAverage());
+            return (Scalar(peak.getAverage()) - Scalar(high.getAverage())) / step;
+        }
+    };
+
+    SubTaskContextReference context_;
+    MotorParameters result_;
+
+    Const dt_;
+    Const inductance_;                  ///< Of the direct axis, which is excited
+    Const bias_current_;
+    Const injection_current_;
+    Const phase_margin_;                ///< Radian
+
+    Scalar state_switched_at_ = 0;
+    Scalar injection_phase_ = 0;
+    unsigned frequency_index_ = 0;
+    std::array<SynchronousDemodulator, NumInjectionFrequencies> responses_;
+
+    Scalar delay_ = 0;
+    Scalar crossover_angular_frequency_ = 0;
+    unsigned step_test_attempt_ = 0;
+    os::helpers::LazyConstructor<CurrentPIController> step_test_controller_;
+    StepResponse step_response_;
+    unsigned step_half_period_ = 1;     ///< In fast IRQ periods
+    unsigned step_counter_ = 0;
+    Scalar step_peak_ = 0;
+
+    Vector<2> last_voltage_ = Vector<2>::Zero();
+    Vector<2> last_current_ = Vector<2>::Zero();
+
+
+    void switchState(State new_state)
+    {
+        state_ = new_state;
+        state_switched_at_ = context_.getTime();
+    }
+
+    Scalar getTimeSinceStateSwitch() const
+    {
+        return context_.getTime() - state_switched_at_;
+    }
+
+    Scalar getInjectionAngularFrequency(const unsigned index) const
+    {
+        assert(index < NumInjectionFrequencies);
+        return (math::Pi2 * MaxInjectionFrequencyRatio / dt_) / Scalar(1U << (NumInjectionFrequencies - 1U - index));
+    }
+
+    Scalar getInjectionVoltage(const unsigned index) const
+    {
+        return injection_current_ * Vector<2>(result_.rs, getInjectionAngularFrequency(index) * inductance_).norm();
+    }
+
+    /**
+     * Approximation of the second order system with the damping ratio of PM/100 (in degrees).
+     */
+    Scalar computeExpectedOvershoot() const
+    {
+        Const damping = math::Range<>(0.1F, 0.9F).constrain(phase_margin_ * (180.0F / math::Pi) / 100.0F);
+        return std::exp(-math::Pi * damping / std::sqrt(1.0F - damping * damping));
+    }
+
+    /**
+     * Least squares fit of the delay to the phase in excess of the RL lag; zero if the responses are not valid.
+     */
+    Scalar computeDelay() const
+    {
+        const auto min_samples_needed =
+            unsigned(((FrequencyMeasurementDuration - SettlingDuration) / dt_) * MinValidSampleRatio);
+
+        Scalar numerator = 0;
+        Scalar denominator = 0;
+
+        for (unsigned i = 0; i < NumInjectionFrequencies; i++)
+        {
+            const auto& r = responses_[i];
+            if ((r.getNumSamples() < min_samples_needed) &&
+                !r.hasConverged(context_.params.motor_id.convergence_tolerance))
+            {
+                return 0;
+            }
+
+            Const w = getInjectionAngularFrequency(i);
+
+            Scalar phase = r.getPhase();
+            if (phase > 0)
+            {
+                phase -= math::Pi2;     // The response cannot lead, so this is a wrap-around
+            }
+
+            Const excess_phase = -phase - std::atan2(w * inductance_, result_.rs);
+
+            IRQDebugOutputBuffer::setVariableFromIRQ<0>(excess_phase / w);
+
+            numerator += w * excess_phase;
+            denominator += w * w;
+        }
+
+        return numerator / denominator;
+    }
+
+    void beginStepTest()
+    {
+        // The plant is the direct axis, so the gains are scaled accordingly to get the same crossover frequency
+        step_test_controller_.destroy();
+        step_test_controller_.construct(inductance_,
+                                        result_.rs,
+                                        result_.max_current,
+                                        dt_,
+                                        crossover_angular_frequency_ * inductance_,
+                                        crossover_angular_frequency_ * result_.rs);
+
+        step_response_ = StepResponse();
+        step_half_period_ =
+            std::max(4U, unsigned(StepHalfPeriodCrossoverCycles / (crossover_angular_frequency_ * dt_)));
+        step_counter_ = 0;
+        step_peak_ = 0;
+        step_test_attempt_++;
+
+        IRQDebugOutputBuffer::setVariableFromIRQ<2>(crossover_angular_frequency_ / math::Pi2);
+
+        switchState(State::StepResponse);
+    }
+
+    void finishStepTest()
+    {
+        if ((step_response_.peak.getNumSamples() == 0) ||
+            (step_response_.low.getNumSamples() == 0))
+        {
+            switchState(State::Failed);
+            return;
+        }
+
+        Const step = Scalar(step_response_.high.getAverage() - step_response_.low.getAverage());
+        Const overshoot = step_response_.getOvershoot();
+
+        IRQDebugOutputBuffer::setVariableFromIRQ<3>(overshoot);
+
+        if (step < (injection_current_ * 0.5F))
+        {
+            switchState(State::Failed);         // The loop does not track the reference
+        }
+        else if (overshoot <= (computeExpectedOvershoot() + OvershootTolerance))
+        {
+            switchState(State::FinishedSuccessfully);
+        }
+        else if (step_test_attempt_ < MaxStepTestAttempts)
+        {
+            crossover_angular_frequency_ *= CrossoverBackoffFactor;
+            beginStepTest();
+        }
+        else
+        {
+            switchState(State::Failed);
+        }
+    }
+
+    /**
+     * Square wave reference between the bias and the bias plus the step; returns the alpha axis voltage.
+     */
+    Scalar updateStepTest(Const current,
+                          Const inverter_voltage)
+    {
+        const unsigned position = step_counter_ % (step_half_period_ * 2U);
+        const bool high = position < step_half_period_;
+        const unsigned position_in_half_period = high ? position : (position - step_half_period_);
+
+        if (position_in_half_period == 0)
+        {
+            step_peak_ = current;
+        }
+
+        // The peak is looked for within the first half, the settled value is averaged over the last quarter
+        if (high && (position_in_half_period < (step_half_period_ / 2U)))
+        {
+            step_peak_ = std::max(step_peak_, current);
+        }
+
+        if (position_in_half_period >= ((step_half_period_ * 3U) / 4U))
+        {
+            (high ? step_response_.high : step_response_.low).addSample(current);
+        }
+
+        if (high && (position_in_half_period == (step_half_period_ - 1U)) && (step_counter_ >= step_half_period_))
+        {
+            step_response_.peak.addSample(step_peak_);  // The first edge is skipped, it starts from the bias
+        }
+
+        step_counter_++;
+
+        return step_test_controller_->computeVoltage(bias_current_ + (high ? injection_current_ : 0.0F),
+                                                     current,
+                                                     inverter_voltage);
+    }
+
+public:
+    CurrentLoopTask(SubTaskContextReference context,
+                    const MotorParameters& initial_parameters) :
+        context_(context),
+        result_(initial_parameters),
+        dt_(context.board.pwm.fast_irq_period),
+        inductance_(MotorParameters::getLqLimits().contains(initial_parameters.ld) ? initial_parameters.ld :
+                                                                                     initial_parameters.lq),
+        bias_current_(initial_parameters.max_current * context.params.motor_id.fraction_of_max_current *
+                      BiasCurrentFraction),
+        injection_current_(initial_parameters.max_current * context.params.motor_id.fraction_of_max_current *
+                           InjectionCurrentFraction),
+        phase_margin_(std::max(MinPhaseMargin, context.params.motor_id.current_loop_phase_margin) *
+                      (math::Pi / 180.0F))
+    {
+        if (!context_.params.motor_id.isCurrentLoopTuningEnabled())
+        {
+            state_ = State::FinishedSuccessfully;
+        }
+        else if (!context_.params.motor_id.isValid() ||
+                 !result_.getRsLimits().contains(result_.rs) ||
+                 !result_.getLqLimits().contains(result_.lq) ||
+                 !result_.getLqLimits().contains(inductance_) ||
+                 !os::float_eq::positive(result_.max_current))
+        {
+            state_ = State::Failed;
+        }
+    }
+
+    void onMainIRQ(Const period) override
+    {
+        (void) period;
+        AbsoluteCriticalSectionLocker locker;
+        context_.reportDebugVariables({
+            last_voltage_[0],
+            last_voltage_[1],
+            last_current_[0],
+            last_current_[1],
+            Scalar(state_)
+        });
+    }
+
+    void onNextPWMPeriod(const Vector<2>& phase_currents_ab,
+                         Const inverter_voltage) override
+    {
+        if ((state_ == State::FinishedSuccessfully) ||
+            (state_ == State::Failed))
+        {
+            context_.setPWM(Vector<3>::Zero());
+            return;
+        }
+
+        const Vector<2> I_alpha_beta = performClarkeTransform(phase_currents_ab);
+        const auto injection_sincos = math::sincos(injection_phase_);
+        const bool settled = getTimeSinceStateSwitch() > SettlingDuration;
+
+        // Same as in the saliency task, the bias is applied along the alpha axis, which is the direct axis
+        Vector<2> U_alpha_beta(bias_current_ * result_.rs, 0.0F);
+
+        switch (state_)
+        {
+        case State::Alignment:
+        {
+            if (getTimeSinceStateSwitch() > AlignmentDuration)
+            {
+                switchState(State::FrequencyResponse);
+            }
+            break;
+        }
+        case State::FrequencyResponse:
+        {
+            /*
+             * The voltage computed here is applied to the PWM at once, and the current is sampled at the next
+             * period; the phase is measured at the same point of the loop as the current controller operates.
+             */
+            auto& response = responses_[frequency_index_];
+            if (settled)
+            {
+                response.addSample(I_alpha_beta[0], injection_sincos);
+            }
+            U_alpha_beta[0] += getInjectionVoltage(frequency_index_) * injection_sincos[1];
+
+            if ((getTimeSinceStateSwitch() > FrequencyMeasurementDuration) ||
+                response.hasConverged(context_.params.motor_id.convergence_tolerance))
+            {
+                if (++frequency_index_ < NumInjectionFrequencies)
+                {
+                    switchState(State::FrequencyResponse);
+                    injection_phase_ = 0;
+                }
+                else
+                {
+                    delay_ = computeDelay();
+                    IRQDebugOutputBuffer::setVariableFromIRQ<1>(delay_);
+
+                    if ((delay_ > 0) && (delay_ < (MaxDelayInPeriods * dt_)))
+                    {
+                        crossover_angular_frequency_ =
+                            std::min((math::Pi / 2.0F - phase_margin_) / delay_,
+                                     math::Pi2 * MaxCrossoverFrequencyRatio / dt_);
+                        beginStepTest();
+                    }
+                    else
+                    {
+                        switchState(State::Failed);
+                    }
+                }
+            }
+            break;
+        }
+        case State::StepResponse:
+        {
+            U_alpha_beta[0] = updateStepTest(I_alpha_beta[0], inverter_voltage);
+
+            if (getTimeSinceStateSwitch() > StepTestDuration)
+            {
+                finishStepTest();
+            }
+            break;
+        }
+        default:
+        {
+            assert(false);
+            break;
+        }
+        }
+
+        if (U_alpha_beta.norm() > computeLineVoltageLimit(inverter_voltage, context_.board.pwm.upper_limit))
+        {
+            // Voltage is too high for this inverter
+            switchState(State::Failed);
+        }
+
+        if ((state_ == State::FinishedSuccessfully) ||
+            (state_ == State::Failed))
+        {
+            context_.setPWM(Vector<3>::Zero());
+            return;
+        }
+
+        context_.setPWM(performSpaceVectorTransform(U_alpha_beta, inverter_voltage).first);
+
+        if (state_ == State::FrequencyResponse)
+        {
+            injection_phase_ = math::normalizeAngle(injection_phase_ +
+                                                    getInjectionAngularFrequency(frequency_index_) * dt_);
+        }
+
+        last_voltage_ = U_alpha_beta;
+        last_current_ = I_alpha_beta;
+    }
+
+    Status getStatus() const override
+    {
+        if (state_ == State::FinishedSuccessfully)
+        {
+            return Status::Succeeded;
+        }
+        else if (state_ == State::Failed)
+        {
+            return Status::Failed;
+        }
+        else
+        {
+            return Status::InProgress;
+        }
+    }
+
+    MotorParameters getEstimatedMotorParameters() const override { return result_; }
+
+    void updateControllerParameters(ControllerParameters& inout_params) const override
+    {
+        if ((state_ == State::FinishedSuccessfully) &&
+            (crossover_angular_frequency_ > 0))
+        {
+            inout_params.current_loop_kp = crossover_angular_frequency_ * result_.lq;
+            inout_params.current_loop_ki = crossover_angular_frequency_ * result_.rs;
+        }
+    }
+};
+
+}
+}
@@ -55,7 +55,7 @@ class InductanceTask : public ISubTask
     static constexpr Scalar OneSizeFitsAllLq            = 50.0e-6F;
     static constexpr unsigned IdqMovingAverageLength    = 5;
 
-    using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageLength>;
+    using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageFilter<IdqMovingAverageLength>>;
 
     SubTaskContextReference context_;
     MotorParameters result_;
@@ -65,8 +65,9 @@ class InductanceTask : public ISubTask
 
     Scalar started_at_ = -1.0F;
     Status status_ = Status::InProgress;
+    bool converged_ = false;        ///< Fast mode only, see @ref Parameters::convergence_tolerance
 
-    std::array<math::CumulativeAverageComputer<>, 3> averagers_;
+    std::array<math::BatchedCumulativeAverageComputer<>, 3> averagers_;
 
     Modulator modulator_;
     Modulator::Output last_modulator_output_;
@@ -83,9 +84,7 @@ public:
        modulator_(OneSizeFitsAllLq,
                   result_.rs,
                   result_.max_current,
-                  context.board.pwm,
-                  Modulator::DeadTimeCompensationPolicy::Disabled,
-                  Modulator::CrossCouplingCompensationPolicy::Disabled)
+                  context.board.pwm)
     {
        result_.lq = 0;
 
@@ -126,18 +125,14 @@ public:
         Const duration = context_.getTime() - started_at_;
         assert(duration >= 0);
 
-        if (duration < MeasurementDuration)
+        if ((duration < MeasurementDuration) && !converged_)
         {
-            Modulator::Setpoint modulator_setpoint;
-            modulator_setpoint.mode = Modulator::Setpoint::Mode::Iq;
-            modulator_setpoint.value = estimation_current_;
-
             last_modulator_output_ =
-                modulator_.onNextPWMPeriod(phase_currents_ab,
-                                           inverter_voltage,
-                                           angular_velocity_,
-                                           angular_position_,
-                                           modulator_setpoint);
+                modulator_.onNextPWMPeriod<Modulator::Setpoint::Mode::Iq>(phase_currents_ab,
+                                                                          inverter_voltage,
+                                                                          angular_velocity_,
+                                                                          angular_position_,
+                                                                          estimation_current_);
             angular_position_ = last_modulator_output_.extrapolated_angular_position;
             context_.setPWM(last_modulator_output_.pwm_setpoint);
 
@@ -150,15 +145,20 @@ public:
                 averagers_[0].addSample(last_modulator_output_.reference_Udq[0] * dead_time_compensation_mult);
                 averagers_[1].addSample(last_modulator_output_.reference_Udq[1] * dead_time_compensation_mult);
                 averagers_[2].addSample(last_modulator_output_.estimated_Idq[1]);
+
+                // Uq is not checked, it is used only for the sanity check below
+                Const tolerance = context_.params.motor_id.convergence_tolerance;
+                converged_ = hasConverged(averagers_[0], tolerance) && hasConverged(averagers_[2], tolerance);
             }
         }
         else
         {
             const auto min_samples_needed =
-                unsigned((MeasurementDuration / context_.board.pwm.period) * MinValidSampleRatio);
+                unsigned((std::min(duration, MeasurementDuration) / context_.board.pwm.fast_irq_period) *
+                         MinValidSampleRatio);
             const auto num_samples_acquired = averagers_[0].getNumSamples();
 
-            assert(std::all_of(averagers_.begin(), averagers_.begin() + 3, [=](math::CumulativeAverageComputer<>& x) {
+            assert(std::all_of(averagers_.begin(), averagers_.begin() + 3, [=](const auto& x) {
                 return x.getNumSamples() == num_samples_acquired;
             }));
 
@@ -40,7 +40,7 @@ class MagneticFluxTask : public ISubTask
     static constexpr Scalar MinVoltage                  = 0.01F;
     static constexpr unsigned IdqMovingAverageLength    = 5;
 
-    using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageLength>;
+    using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageFilter<IdqMovingAverageLength>>;
 
     SubTaskContextReference context_;
     MotorParameters result_;
@@ -50,7 +50,7 @@ class MagneticFluxTask : public ISubTask
     Scalar started_at_ = -1.0F;
     Status status_ = Status::InProgress;
 
-    std::array<math::CumulativeAverageComputer<>, 3> averagers_;
+    std::array<math::BatchedCumulativeAverageComputer<>, 3> averagers_;
 
     Modulator modulator_;
 
@@ -76,9 +76,7 @@ public:
         modulator_(result_.lq,
                    result_.rs,
                    result_.max_current,
-                   context.board.pwm,
-                   Modulator::DeadTimeCompensationPolicy::Disabled,
-                   Modulator::CrossCouplingCompensationPolicy::Disabled),
+                   context.board.pwm),
         currents_filter_(Vector<2>::Zero()),
         voltage_filter_(Vector<2>::Zero()),
         Uq_(initial_Uq_)
@@ -119,7 +117,7 @@ public:
             started_at_ = context_.getTime();
         }
 
-        Const low_pass_filter_innovation = context_.board.pwm.period * 10.0F;
+        Const low_pass_filter_innovation = context_.board.pwm.fast_irq_period * 10.0F;
 
         Const prev_I = I_;
 
@@ -128,15 +126,11 @@ public:
          */
         if (Uq_ > MinVoltage)
         {
-            Modulator::Setpoint setpoint;
-            setpoint.mode = Modulator::Setpoint::Mode::Uq;
-            setpoint.value = Uq_;
-
-            const auto out = modulator_.onNextPWMPeriod(phase_currents_ab,
-                                                        inverter_voltage,
-                                                        angular_velocity_,
-                                                        angular_position_,
-                                                        setpoint);
+            const auto out = modulator_.onNextPWMPeriod<Modulator::Setpoint::Mode::Uq>(phase_currents_ab,
+                                                                                       inverter_voltage,
+                                                                                       angular_velocity_,
+                                                                                       angular_position_,
+                                                                                       Uq_);
             context_.setPWM(out.pwm_setpoint);
             angular_position_ = out.extrapolated_angular_position;
 
@@ -163,7 +157,7 @@ public:
         {
             // Acceleration
             angular_velocity_ += (context_.params.motor_id.phi_estimation_electrical_angular_velocity /
-                                  (VoltageSlopeLengthSec / 2.0F)) * context_.board.pwm.period;
+                                  (VoltageSlopeLengthSec / 2.0F)) * context_.board.pwm.fast_irq_period;
         }
         else
         {
@@ -194,7 +188,7 @@ public:
 
             if (result_.phi >= 0.0F)
             {
-                Const dIdt = (I_ - prev_I) / context_.board.pwm.period;
+                Const dIdt = (I_ - prev_I) / context_.board.pwm.fast_irq_period;
 
                 // TODO: we could automatically learn the worst case di/dt after the acceleration phase?
                 // 2 - triggers false positive
@@ -209,7 +203,7 @@ public:
                 else
                 {
                     // Minimum is not reached yet, continuing to reduce voltage
-                    Uq_ -= (initial_Uq_ / VoltageSlopeLengthSec) * context_.board.pwm.period;
+                    Uq_ -= (initial_Uq_ / VoltageSlopeLengthSec) * context_.board.pwm.fast_irq_period;
                 }
             }
             else
@@ -44,14 +44,14 @@ enum class Mode
 {
     /**
      * In this mode, the motor will not rotate, therefore it doesn't matter what load it is connected to.
-     * Estimated parameters: Rs, L.
+     * Estimated parameters: Rs, Lq, Ld.
      */
     Static,
 
     /**
      * In this mode, the motor WILL SPIN.
      * In order to achieve correct results, the motor MUST NOT BE CONNECTED TO ANY MECHANICAL LOAD.
-     * Estimated parameters: Rs, L, Phi.
+     * Estimated parameters: Rs, Lq, Ld, Phi.
      */
     RotationWithoutMechanicalLoad
 };
@@ -71,22 +71,44 @@ struct Parameters
     /// Electrical angular velocity used for magnetic flux linkage identification, radian/second
     Scalar phi_estimation_electrical_angular_velocity = 150.0F;
 
+    /**
+     * Fast identification: a measurement is finished as soon as the standard error of its averages drops below
+     * this fraction of the average, rather than after a fixed conservative duration; the latter becomes a timeout.
+     * Zero disables the fast mode.
+     */
+    Scalar convergence_tolerance = 0.0F;
+
+    /// Target phase margin of the current loop tuning, degrees, at least 30; zero disables, see @ref CurrentLoopTask
+    Scalar current_loop_phase_margin = 60.0F;
+
+    bool isFastModeEnabled() const { return convergence_tolerance > 0; }
+
+    bool isCurrentLoopTuningEnabled() const { return current_loop_phase_margin > 0; }
+
 
     bool isValid() const
     {
         return math::Range<>(0.01F, 1.0F).contains(fraction_of_max_current) &&
                math::Range<>(10.0F, 100000.0F).contains(current_injection_frequency) &&
-               math::Range<>(10.0F, 10000.0F).contains(phi_estimation_electrical_angular_velocity);
+               math::Range<>(10.0F, 10000.0F).contains(phi_estimation_electrical_angular_velocity) &&
+               math::Range<>(0.0F, 0.1F).contains(convergence_tolerance) &&
+               math::Range<>(0.0F, 80.0F).contains(current_loop_phase_margin);
     }
 
     auto toString() const
     {
         return os::heapless::format("FracI: %.0f %%\n"
                                     "Finj : %.1f Hz\n"
-                                    "Wphi : %.1f rad/s",
+                                    "Wphi : %.1f rad/s\n"
+                                    "Ctol : %.2f %%%s\n"
+                                    "CL PM: %.0f deg%s",
                                     double(fraction_of_max_current * 100.0F),
                                     double(current_injection_frequency),
-                                    double(phi_estimation_electrical_angular_velocity));
+                                    double(phi_estimation_electrical_angular_velocity),
+                                    double(convergence_tolerance * 100.0F),
+                                    isFastModeEnabled() ? " (fast)" : "",
+                                    double(current_loop_phase_margin),
+                                    isCurrentLoopTuningEnabled() ? "" : " (disabled)");
     }
 };
 
@@ -61,7 +61,8 @@ class ResistanceTask : public ISubTask
 
     Const estimation_current_;
 
-    std::array<math::CumulativeAverageComputer<>, 3> averagers_;
+    std::array<math::BatchedCumulativeAverageComputer<>, 3> averagers_;
+    std::array<bool, 3> converged_{};       ///< Fast mode only, see @ref Parameters::convergence_tolerance
 
     math::SimpleMovingAverageFilter<500, Vector<2>> currents_filter_;
 
@@ -97,14 +98,21 @@ class ResistanceTask : public ISubTask
 
     bool processOneMeasurement(Const current,
                                Const voltage,
-                               math::CumulativeAverageComputer<>& averager)
+                               const unsigned phase_index)
     {
         Const state_duration = getTimeSinceStateSwitch();
+        auto& averager = averagers_[phase_index];
 
         if ((state_duration > RotorStabilizationDuration) &&
             (current > ValidCurrentThreshold))
         {
             averager.addSample(voltage * (2.0F / 3.0F) / current);
+
+            if (hasConverged(averager, context_.params.motor_id.convergence_tolerance))
+            {
+                converged_[phase_index] = true;
+                return true;
+            }
         }
 
         return state_duration > (PhaseMeasurementDuration + RotorStabilizationDuration);
@@ -153,7 +161,7 @@ public:
             {
                 // Very coarse initial estimation
                 result_.rs = std::max(MotorParameters::getRsLimits().min,
-                                      result_.rs + OhmPerSec * context_.board.pwm.period);
+                                      result_.rs + OhmPerSec * context_.board.pwm.fast_irq_period);
             }
             else
             {
@@ -204,7 +212,7 @@ public:
                     0.0F
                 });
                 Const current = phase_currents_ab[0];
-                if (processOneMeasurement(current, voltage, averagers_[0]))
+                if (processOneMeasurement(current, voltage, 0))
                 {
                     switchState(State::PhaseB);
                 }
@@ -217,7 +225,7 @@ public:
                     0.0F
                 });
                 Const current = phase_currents_ab[1];
-                if (processOneMeasurement(current, voltage, averagers_[1]))
+                if (processOneMeasurement(current, voltage, 1))
                 {
                     switchState(State::PhaseC);
                 }
@@ -230,7 +238,7 @@ public:
                     pwm_channel_setpoint
                 });
                 Const current = -phase_currents_ab.sum();
-                if (processOneMeasurement(current, voltage, averagers_[2]))
+                if (processOneMeasurement(current, voltage, 2))
                 {
                     switchState(State::Computation);
                 }
@@ -249,10 +257,11 @@ public:
             context_.setPWM(Vector<3>::Zero());
 
             Scalar r_samples[3]{};
-            std::transform(averagers_.begin(), averagers_.begin() + 3, std::begin(r_samples),
-                           [](math::CumulativeAverageComputer<>& a) {
-                return (a.getNumSamples() > MinSamples) ? Scalar(a.getAverage()) : Scalar(0);
-            });
+            for (unsigned i = 0; i < 3; i++)
+            {
+                const auto& a = averagers_[i];
+                r_samples[i] = ((a.getNumSamples() > MinSamples) || converged_[i]) ? Scalar(a.getAverage()) : 0.0F;
+            }
             std::sort(std::begin(r_samples), std::end(r_samples));
 
             for (unsigned i = 0; i < 3; i++)
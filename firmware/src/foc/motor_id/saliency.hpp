@@ -0,0 +1,286 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "common.hpp"
+
+
+namespace foc
+{
+namespace motor_id
+{
+/**
+ * Direct axis inductance estimation task.
+ *
+ * The rotor is aligned with the alpha axis by a DC current, which is kept as a bias during the whole procedure.
+ * Then a pulsating high frequency voltage is injected first along the aligned (direct) axis, then across it
+ * (quadrature), while the rotor is held in place by the bias current. The response of each axis is demodulated
+ * synchronously; the reactance is found from the impedance magnitude and the known Rs, which makes the result
+ * insensitive to the control loop delay.
+ *
+ * This measurement should be executed after @ref InductanceTask. The Lq found by the latter is used to choose the
+ * injection voltage, and the resulting Ld is obtained by scaling that Lq by the measured saliency ratio Ld/Lq,
+ * so that the errors common to both axes (dead time, sensing chain) cancel out.
+ */
+class SaliencyTask : public ISubTask
+{
+    static constexpr Scalar AlignmentDuration           = 1.0F;
+    static constexpr Scalar SettlingDuration            = 0.1F;
+    static constexpr Scalar AxisMeasurementDuration     = 3.0F;
+    static constexpr Scalar BiasCurrentFraction         = 0.5F;     ///< Of the estimation current
+    static constexpr Scalar InjectionCurrentFraction    = 0.5F;     ///< Of the estimation current
+    static constexpr Scalar MinValidSampleRatio         = 0.99F;
+
+    enum class State
+    {
+        Alignment,
+        DirectAxis,
+        QuadratureAxis,
+        FinishedSuccessfully,
+        Failed
+    } state_ = State::Alignment;
+
+    SubTaskContextReference context_;
+    MotorParameters result_;
+
+    Const angular_velocity_;
+    Const bias_voltage_;
+    Const injection_voltage_;
+
+    Scalar state_switched_at_ = 0;
+    Scalar injection_phase_ = 0;
+    Scalar direct_axis_duration_ = 0;
+
+    std::array<SynchronousDemodulator, 2> responses_;     ///< Direct, quadrature
+
+    Vector<2> last_voltage_ = Vector<2>::Zero();
+    Vector<2> last_current_ = Vector<2>::Zero();
+
+
+    void switchState(State new_state)
+    {
+        state_ = new_state;
+        state_switched_at_ = context_.getTime();
+    }
+
+    Scalar getTimeSinceStateSwitch() const
+    {
+        return context_.getTime() - state_switched_at_;
+    }
+
+    /**
+     * Inductance from the response of one axis, or zero if it could not be determined.
+     * The axis may have been finished early, see @ref Parameters::convergence_tolerance.
+     */
+    Scalar computeInductance(const SynchronousDemodulator& response,
+                             Const axis_duration) const
+    {
+        Const measurement_duration = std::min(axis_duration, AxisMeasurementDuration) - SettlingDuration;
+        const auto min_samples_needed =
+            unsigned((measurement_duration / context_.board.pwm.fast_irq_period) * MinValidSampleRatio);
+
+        Const amplitude = response.getAmplitude();
+
+        if ((response.getNumSamples() < min_samples_needed) ||
+            !os::float_eq::positive(amplitude))
+        {
+            return 0;
+        }
+
+        Const impedance = injection_voltage_ / amplitude;
+        Const reactance_squared = impedance * impedance - result_.rs * result_.rs;
+
+        return (reactance_squared > 0) ? (std::sqrt(reactance_squared) / angular_velocity_) : 0.0F;
+    }
+
+    void computeResult()
+    {
+        Const ld = computeInductance(responses_[0], direct_axis_duration_);
+        Const lq = computeInductance(responses_[1], getTimeSinceStateSwitch());
+
+        IRQDebugOutputBuffer::setVariableFromIRQ<0>(ld);
+        IRQDebugOutputBuffer::setVariableFromIRQ<1>(lq);
+
+        if (MotorParameters::getLqLimits().contains(ld) &&
+            MotorParameters::getLqLimits().contains(lq))
+        {
+            result_.ld = result_.lq * (ld / lq);
+            if (MotorParameters::getLqLimits().contains(result_.ld))
+            {
+                switchState(State::FinishedSuccessfully);
+                return;
+            }
+        }
+
+        result_.ld = 0;
+        switchState(State::Failed);
+    }
+
+public:
+    SaliencyTask(SubTaskContextReference context,
+                 const MotorParameters& initial_parameters) :
+        context_(context),
+        result_(initial_parameters),
+        angular_velocity_(context.params.motor_id.current_injection_frequency * math::Pi2),
+        bias_voltage_(initial_parameters.max_current * context.params.motor_id.fraction_of_max_current *
+                      BiasCurrentFraction * initial_parameters.rs),
+        injection_voltage_(initial_parameters.max_current * context.params.motor_id.fraction_of_max_current *
+                           InjectionCurrentFraction *
+                           Vector<2>(initial_parameters.rs, angular_velocity_ * initial_parameters.lq).norm())
+    {
+        result_.ld = 0;
+
+        if (!context_.params.motor_id.isValid() ||
+            !result_.getRsLimits().contains(result_.rs) ||
+            !result_.getLqLimits().contains(result_.lq) ||
+            !os::float_eq::positive(result_.max_current))
+        {
+            state_ = State::Failed;
+        }
+    }
+
+    void onMainIRQ(Const period) override
+    {
+        (void) period;
+        AbsoluteCriticalSectionLocker locker;
+        context_.reportDebugVariables({
+            last_voltage_[0],
+            last_voltage_[1],
+            last_current_[0],
+            last_current_[1],
+            Scalar(state_)
+        });
+    }
+
+    void onNextPWMPeriod(const Vector<2>& phase_currents_ab,
+                         Const inverter_voltage) override
+    {
+        if ((state_ == State::FinishedSuccessfully) ||
+            (state_ == State::Failed))
+        {
+            context_.setPWM(Vector<3>::Zero());
+            return;
+        }
+
+        const Vector<2> I_alpha_beta = performClarkeTransform(phase_currents_ab);
+        const auto injection_sincos = math::sincos(injection_phase_);
+        const bool settled = getTimeSinceStateSwitch() > SettlingDuration;
+
+        /*
+         * The bias is always applied along the alpha axis, which becomes the direct axis once the rotor is aligned.
+         * Only the magnitude of the response is used, so the lag between the voltage and the sampled current
+         * does not matter.
+         */
+        Vector<2> U_alpha_beta(bias_voltage_, 0.0F);
+
+        switch (state_)
+        {
+        case State::Alignment:
+        {
+            if (getTimeSinceStateSwitch() > AlignmentDuration)
+            {
+                switchState(State::DirectAxis);
+            }
+            break;
+        }
+        case State::DirectAxis:
+        {
+            if (settled)
+            {
+                responses_[0].addSample(I_alpha_beta[0], injection_sincos);
+            }
+            U_alpha_beta[0] += injection_voltage_ * injection_sincos[1];
+            if ((getTimeSinceStateSwitch() > AxisMeasurementDuration) ||
+                responses_[0].hasConverged(context_.params.motor_id.convergence_tolerance))
+            {
+                direct_axis_duration_ = getTimeSinceStateSwitch();
+                switchState(State::QuadratureAxis);
+            }
+            break;
+        }
+        case State::QuadratureAxis:
+        {
+            if (settled)
+            {
+                responses_[1].addSample(I_alpha_beta[1], injection_sincos);
+            }
+            U_alpha_beta[1] += injection_voltage_ * injection_sincos[1];
+            if ((getTimeSinceStateSwitch() > AxisMeasurementDuration) ||
+                responses_[1].hasConverged(context_.params.motor_id.convergence_tolerance))
+            {
+                computeResult();
+            }
+            break;
+        }
+        default:
+        {
+            assert(false);
+            break;
+        }
+        }
+
+        if (U_alpha_beta.norm() > computeLineVoltageLimit(inverter_voltage, context_.board.pwm.upper_limit))
+        {
+            // Voltage is too high for this inverter
+            switchState(State::Failed);
+        }
+
+        if ((state_ == State::FinishedSuccessfully) ||
+            (state_ == State::Failed))
+        {
+            context_.setPWM(Vector<3>::Zero());
+            return;
+        }
+
+        context_.setPWM(performSpaceVectorTransform(U_alpha_beta, inverter_voltage).first);
+
+        injection_phase_ =
+            math::normalizeAngle(injection_phase_ + angular_velocity_ * context_.board.pwm.fast_irq_period);
+
+        last_voltage_ = U_alpha_beta;
+        last_current_ = I_alpha_beta;
+    }
+
+    Status getStatus() const override
+    {
+        if (state_ == State::FinishedSuccessfully)
+        {
+            return Status::Succeeded;
+        }
+        else if (state_ == State::Failed)
+        {
+            return Status::Failed;
+        }
+        else
+        {
+            return Status::InProgress;
+        }
+    }
+
+    MotorParameters getEstimatedMotorParameters() const override { return result_; }
+};
+
+}
+}
@@ -27,6 +27,8 @@
 #include "common.hpp"
 #include "resistance.hpp"
 #include "inductance.hpp"
+#include "saliency.hpp"
+#include "current_loop.hpp"
 #include "magnetic_flux.hpp"
 
 
@@ -92,6 +94,8 @@ public:
 
     ~SubTaskSequencer() { destroyCurrentTask(); }
 
+    static constexpr unsigned getPoolSize() { return sizeof(pool_); }
+
     template <typename... TaskTypes>
     void setSequence()
     {
@@ -145,10 +149,9 @@ class MotorIdentificationTask : public ITask
         Vector<3> pwm_output_vector = Vector<3>::Zero();
         std::array<Scalar, ITask::NumDebugVariables> debug_values{};
 
-        ContextImplementation(const TaskContext& cont)
-        {
-            static_cast<TaskContext&>(*this) = cont;
-        }
+        ContextImplementation(const TaskContext& cont) :
+            SubTaskContext(cont)
+        { }
 
         void setPWM(const Vector<3>& pwm) override
         {
@@ -167,7 +170,7 @@ class MotorIdentificationTask : public ITask
         Scalar getTime() const override
         {
             // Locking is not necessary because the read is atomic
-            return Scalar(pwm_period_counter) * board.pwm.period;
+            return Scalar(pwm_period_counter) * board.pwm.fast_irq_period;
         }
     } context_;
 
@@ -178,24 +181,36 @@ class MotorIdentificationTask : public ITask
     const Mode mode_;
 
     MotorParameters result_;
+    ControllerParameters controller_result_;
 
-    SubTaskSequencer
+    typedef SubTaskSequencer
     < ResistanceTask
     , InductanceTask
+    , SaliencyTask
+    , CurrentLoopTask
     , MagneticFluxTask
-    > sequencer_;
+    > Sequencer;
+
+    Sequencer sequencer_;
 
     bool started_ = false;
     bool processing_enabled_ = false;   ///< This is used instead of critical sections to gate PWM IRQ processing
 
 public:
+    static constexpr unsigned getSubTaskPoolSize() { return Sequencer::getPoolSize(); }
+
     MotorIdentificationTask(const TaskContext& context,
                             const Mode mode) :
         context_(context),
         mode_(mode),
         result_(context.params.motor),
+        controller_result_(context.params.controller),
         sequencer_(context_, result_)
-    { }
+    {
+        // The current loop gains are bound to the old motor parameters, so they are discarded unless re-tuned
+        controller_result_.current_loop_kp = 0;
+        controller_result_.current_loop_ki = 0;
+    }
 
     const char* getName() const override { return "motor_id"; }
 
@@ -208,12 +223,13 @@ public:
             {
             case Mode::Static:
             {
-                sequencer_.setSequence<ResistanceTask, InductanceTask>();
+                sequencer_.setSequence<ResistanceTask, InductanceTask, SaliencyTask, CurrentLoopTask>();
                 break;
             }
             case Mode::RotationWithoutMechanicalLoad:
             {
-                sequencer_.setSequence<ResistanceTask, InductanceTask, MagneticFluxTask>();
+                sequencer_.setSequence<ResistanceTask, InductanceTask, SaliencyTask, CurrentLoopTask,
+                                      MagneticFluxTask>();
                 break;
             }
             default:
@@ -255,6 +271,7 @@ public:
             {
                 AbsoluteCriticalSectionLocker locker;
                 result_ = sequencer_.getCurrentTask().getEstimatedMotorParameters();
+                sequencer_.getCurrentTask().updateControllerParameters(controller_result_);
                 // Pausing processing to prevent race conditions. Will be restored on the next call.
                 processing_enabled_ = false;
             }
@@ -308,11 +325,27 @@ public:
     void applyResultToGlobalContext(TaskContext& inout_context) const override
     {
         inout_context.params.motor = result_;
+        inout_context.params.controller.current_loop_kp = controller_result_.current_loop_kp;
+        inout_context.params.controller.current_loop_ki = controller_result_.current_loop_ki;
     }
 
     bool isPreCalibrationRequired() const override { return true; }
 
-    std::array<Scalar, NumDebugVariables> getDebugVariables() const override { return context_.debug_values; }
+    /**
+     * The meaning of the reported values depends on the current subtask.
+     */
+    DebugVariables getDebugVariables() const override
+    {
+        DebugVariables out{};
+        std::copy(context_.debug_values.begin(), context_.debug_values.end(), out.begin());
+        out[NumDebugVariables] = Scalar(sequencer_.getCurrentTaskIndex());
+        return out;
+    }
+
+    static DebugVariableNames getDebugVariableNames()
+    {
+        return {{ "v0", "v1", "v2", "v3", "v4", "v5", "v6", "subtask" }};
+    }
 
     Scalar getProgress() const
     {
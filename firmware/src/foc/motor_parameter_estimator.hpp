@@ -0,0 +1,195 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <math/math.hpp>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+
+
+namespace foc
+{
+
+using math::Scalar;
+using math::Const;
+using math::Vector;
+using math::Matrix;
+
+/**
+ * Online estimator of the phase resistance and the magnetic flux linkage.
+ * It uses the steady state voltage equations in the rotating reference frame:
+ *      Ud + w Lq Iq = Rs Id
+ *      Uq - w Ld Id = Rs Iq + w Phi
+ * The unknowns [Rs, Phi] are estimated using recursive least squares with exponential forgetting.
+ * The inputs are averaged over an interval before each update, which both rejects the noise and
+ * keeps the computational load negligible.
+ * The estimates are constrained to a range around the initial values, so that a poorly excited or
+ * diverging estimator cannot make the control loops unstable.
+ */
+class MotorParameterEstimator
+{
+    static constexpr Scalar UpdateInterval = 0.01F;                 ///< Second
+    static constexpr Scalar MeasurementNoiseVariance = 0.01F;       ///< Volt^2, of the averaged voltages
+    static constexpr Scalar InitialUncertaintyFraction = 0.5F;      ///< Of the initial values
+    static constexpr Scalar MinEstimateFraction = 0.5F;             ///< Of the initial values
+    static constexpr Scalar MaxEstimateFraction = 2.0F;             ///< Of the initial values
+
+    Const Ld_;
+    Const Lq_;
+    Const min_current_;
+    Const min_angular_velocity_;
+    Const forgetting_factor_;
+
+    const Vector<2> initial_estimate_;
+    const Vector<2> max_covariance_diagonal_;
+
+    Vector<2> estimate_;
+    Matrix<2, 2> P_;
+
+    // Averaging accumulators
+    Vector<2> Idq_sum_ = Vector<2>::Zero();
+    Vector<2> Udq_sum_ = Vector<2>::Zero();
+    Scalar angular_velocity_sum_ = 0;
+    Scalar accumulated_time_ = 0;
+    unsigned num_samples_ = 0;
+
+    std::uint32_t num_updates_ = 0;
+
+    void performUpdate(Const y, const Vector<2>& h)
+    {
+        const Vector<2> Ph = P_ * h;
+        Const innovation_variance = MeasurementNoiseVariance + h.dot(Ph);
+        const Vector<2> K = Ph / innovation_variance;
+
+        estimate_ += K * (y - h.dot(estimate_));
+        P_ -= K * Ph.transpose();
+    }
+
+    void runRecursiveLeastSquares(const Vector<2>& Idq,
+                                  const Vector<2>& Udq,
+                                  Const w)
+    {
+        // Forgetting is applied once per update, the two measurements are processed sequentially
+        P_ /= forgetting_factor_;
+
+        performUpdate(Udq[0] + w * Lq_ * Idq[1], Vector<2>(Idq[0], 0.0F));
+        performUpdate(Udq[1] - w * Ld_ * Idq[0], Vector<2>(Idq[1], w));
+
+        // Symmetrizing and bounding the covariance, otherwise it winds up while the excitation is poor
+        Const offdiag = (P_(0, 1) + P_(1, 0)) * 0.5F;
+        P_(0, 1) = offdiag;
+        P_(1, 0) = offdiag;
+        for (int i = 0; i < 2; i++)
+        {
+            P_(i, i) = math::Range<>(0.0F, max_covariance_diagonal_[i]).constrain(P_(i, i));
+        }
+
+        for (int i = 0; i < 2; i++)
+        {
+            estimate_[i] = math::Range<>(initial_estimate_[i] * MinEstimateFraction,
+                                         initial_estimate_[i] * MaxEstimateFraction).constrain(estimate_[i]);
+        }
+
+        num_updates_++;
+    }
+
+public:
+    /**
+     * @param time_constant     Time constant of the exponential forgetting, second; zero disables forgetting.
+     */
+    MotorParameterEstimator(Const initial_phase_resistance,
+                            Const initial_field_flux,
+                            Const phase_inductance_direct,
+                            Const phase_inductance_quadrature,
+                            Const min_current,
+                            Const min_angular_velocity,
+                            Const time_constant) :
+        Ld_(phase_inductance_direct),
+        Lq_(phase_inductance_quadrature),
+        min_current_(min_current),
+        min_angular_velocity_(min_angular_velocity),
+        forgetting_factor_((time_constant > 0) ? std::exp(-UpdateInterval / time_constant) : 1.0F),
+        initial_estimate_(initial_phase_resistance, initial_field_flux),
+        max_covariance_diagonal_((initial_estimate_ * Scalar(InitialUncertaintyFraction)).array().square().matrix()),
+        estimate_(initial_estimate_),
+        P_(max_covariance_diagonal_.asDiagonal())
+    {
+        assert(initial_phase_resistance > 0);
+        assert(initial_field_flux > 0);
+        assert(phase_inductance_direct > 0);
+        assert(phase_inductance_quadrature > 0);
+    }
+
+    /**
+     * Returns true if the estimate was updated during this invocation.
+     * The angular velocity is electrical, radian per second.
+     */
+    bool update(Const dt,
+                const Vector<2>& Idq,
+                const Vector<2>& Udq,
+                Const angular_velocity)
+    {
+        Idq_sum_ += Idq;
+        Udq_sum_ += Udq;
+        angular_velocity_sum_ += angular_velocity;
+        accumulated_time_ += dt;
+        num_samples_++;
+
+        if (accumulated_time_ < UpdateInterval)
+        {
+            return false;
+        }
+
+        Const inv_n = 1.0F / Scalar(num_samples_);
+        const Vector<2> avg_Idq = Idq_sum_ * inv_n;
+        const Vector<2> avg_Udq = Udq_sum_ * inv_n;
+        Const avg_w = angular_velocity_sum_ * inv_n;
+
+        Idq_sum_.setZero();
+        Udq_sum_.setZero();
+        angular_velocity_sum_ = 0;
+        accumulated_time_ = 0;
+        num_samples_ = 0;
+
+        // The equations are not informative at low current or low speed
+        if ((std::abs(avg_Idq[1]) < min_current_) ||
+            (std::abs(avg_w) < min_angular_velocity_))
+        {
+            return false;
+        }
+
+        runRecursiveLeastSquares(avg_Idq, avg_Udq, avg_w);
+        return true;
+    }
+
+    Scalar getPhaseResistance() const { return estimate_[0]; }
+
+    Scalar getFieldFlux() const { return estimate_[1]; }
+
+    std::uint32_t getNumberOfUpdates() const { return num_updates_; }
+};
+
+}
@@ -26,9 +26,14 @@
 
 #include "parameters.hpp"
 #include "voltage_modulator.hpp"
+#include "motor_parameter_estimator.hpp"
+#include "seqlock.hpp"
+#include "observer/flux_observer.hpp"
 #include <math/math.hpp>
 #include <board/motor.hpp>
+#include <board/irq_profiler.hpp>
 #include <cassert>
+#include <limits>
 
 
 namespace foc
@@ -46,16 +51,33 @@ using board::motor::AbsoluteCriticalSectionLocker;
  */
 class MotorRunner final
 {
-    static constexpr unsigned IdqMovingAverageLength = 5;
-
     static constexpr Scalar MaximumSpinupDurationFraction          = 1.5F;
     static constexpr Scalar SpinupAngularVelocityHysteresis        = 3.0F;
 
-    using Modulator = ThreePhaseVoltageModulator<IdqMovingAverageLength>;
+    /// Initial variance of the angular velocity when catching a spinning rotor, (rad/s)^2
+    static constexpr Scalar CatchingAngularVelocityVariance        = 1e6F;
+
+    /// Max spread of the angular velocity estimate during the second half of catching, relative to the estimate
+    static constexpr Scalar CatchingAngularVelocityTolerance       = 0.1F;
+
+    /// The speed is considered steady if, at the current acceleration, it wouldn't double within this time, seconds
+    static constexpr Scalar SteadySpeedTimeConstant                = 0.1F;
+    static constexpr Scalar AngularAccelerationFilterWeight        = 0.05F;
+    static constexpr Scalar ObserverDecimationVelocityHysteresis   = 0.8F;
+
+    /// Initial variances of the EKF when it takes over from the flux observer, which is assumed to be locked
+    static constexpr Scalar HandoverAngularVelocityVariance        = 100.0F;
+    static constexpr Scalar HandoverAngularPositionVariance        = 0.01F;
+
+    using Modulator = ThreePhaseVoltageModulator<IdqNotchFilter,
+                                                 DeadTimeCompensationPolicy::Enabled,
+                                                 CrossCouplingCompensationPolicy::Disabled,
+                                                 IdReferencePolicy::MTPAWithFieldWeakening>;
 
 public:
     enum class State
     {
+        Catching,   ///< Observing the rotor at zero current, it may be spinning already, e.g. windmilling
         Spinup,
         Running,
         Stopped,    ///< Normal stop, e.g. setpoint assigned zero
@@ -70,63 +92,311 @@ public:
 
     using Setpoint = Modulator::Setpoint;
 
-    using DebugVariables = std::array<Scalar, 6>;
+    static constexpr unsigned NumDebugVariables = 16;
+    using DebugVariables = std::array<Scalar, NumDebugVariables>;
+    using DebugVariableNames = std::array<const char*, NumDebugVariables>;
+
+    /**
+     * @ref getEstimatedMotorParameters().
+     */
+    struct EstimatedMotorParameters
+    {
+        Scalar rs = 0;
+        Scalar phi = 0;
+        std::uint32_t num_updates = 0;      ///< Zero means that the configured values are still in use
+    };
 
 private:
+    /**
+     * Published by the main IRQ for the fast IRQ.
+     */
+    struct ModulationInput
+    {
+        Setpoint setpoint;
+        Scalar angular_velocity = 0;
+        Scalar angular_position = 0;
+        Scalar phase_resistance = 0;            ///< For the current controllers
+        std::uint32_t estimation_counter = 0;   ///< Incremented when the angular estimates are updated
+        std::uint32_t parameter_estimation_counter = 0;     ///< Incremented when the phase resistance is updated
+        bool active = true;                     ///< False if PWM outputs should be zero
+    };
+
+    /**
+     * Published by the fast IRQ for the main IRQ and the threads.
+     */
+    struct ModulationOutput
+    {
+        Vector<2> estimated_Idq = Vector<2>::Zero();
+        Vector<2> reference_Udq = Vector<2>::Zero();
+        Vector<2> integral_Udq = Vector<2>::Zero();         ///< Integral terms of the current controllers
+        std::uint32_t Udq_normalization_count = 0;          ///< See Modulator::getUdqNormalizationCounter()
+    };
+
     const ControllerParameters controller_params_;
     const MotorParameters motor_params_;
 
     const Direction direction_;
 
-    State state_ = State::Spinup;
+    State state_;
 
+    const math::DiagonalMatrix<4> spinup_observer_P0_;
     observer::Observer observer_;
 
+    const bool flux_observer_at_cruise_;
+    observer::FluxObserver flux_observer_;
+    bool flux_observer_active_ = false;         ///< The EKF is idle meanwhile
+
+    const bool parameter_estimation_enabled_;
+    MotorParameterEstimator parameter_estimator_;
+
     Setpoint regular_setpoint_;
     Setpoint spinup_setpoint_;
 
     Scalar angular_velocity_ = 0;
+    Scalar angular_position_ = 0;
+    std::uint32_t estimation_counter_ = 0;
+    Scalar observer_current_residual_ = 0;
 
     Scalar remaining_time_before_stall_detection_enabled_ = 0;
     Scalar spinup_time_ = 0;
+    Scalar catching_time_ = 0;
+    Scalar catching_min_angular_velocity_ = std::numeric_limits<Scalar>::max();
+    Scalar catching_max_angular_velocity_ = std::numeric_limits<Scalar>::lowest();
+    Scalar last_good_angular_velocity_ = 0;
+
+    unsigned observer_decimation_ratio_ = 1;
+    bool cruising_ = false;
+    unsigned observer_decimation_counter_ = 0;
+    Scalar filtered_angular_acceleration_ = 0;
+    Scalar estimation_period_accumulator_ = 0;
+
+    /*
+     * The state above is owned by the main IRQ; the state below is exchanged with the fast IRQ without locking.
+     * Mutable entities can be modified from the PWM modulation method.
+     */
+    DoubleBuffer<ModulationInput> modulation_input_;
+    mutable SeqLock<ModulationOutput> modulation_output_;
 
-    // Mutable entities can be modified from the PWM modulation method
+    // Owned by the fast IRQ
     mutable Modulator modulator_;
-    mutable Scalar angular_position_ = 0;
-    mutable Vector<2> estimated_Idq_ = Vector<2>::Zero();
-    mutable Vector<2> reference_Udq_ = Vector<2>::Zero();
+    mutable Scalar extrapolated_angular_position_ = 0;
+    mutable std::uint32_t last_estimation_counter_ = 0;
+    mutable std::uint32_t last_parameter_estimation_counter_ = 0;
 
 
     bool isReversed() const { return direction_ == Direction::Reverse; }
 
+    /**
+     * Multi-rate scheduling: at high steady speed (cruise) the angle extrapolation in the fast IRQ is accurate
+     * enough to run the observer less often; during spinup, at low speed, and during transients it runs at full rate.
+     * If configured so, the EKF is replaced with the flux observer at cruise, which is cheap enough to run at
+     * full rate; the EKF takes over again once the cruise is over, because it handles the transients better.
+     */
+    void updateObserverSchedule(Const estimation_period,
+                                Const previous_angular_velocity,
+                                const Vector<2>& Idq)
+    {
+        Const angular_acceleration = (angular_velocity_ - previous_angular_velocity) / estimation_period;
+        filtered_angular_acceleration_ +=
+            AngularAccelerationFilterWeight * (angular_acceleration - filtered_angular_acceleration_);
+
+        Const abs_angular_velocity = std::abs(angular_velocity_);
+        Const threshold = motor_params_.min_electrical_ang_vel * controller_params_.observer_decimation_velocity_ratio;
+        const bool steady = std::abs(filtered_angular_acceleration_) * SteadySpeedTimeConstant < abs_angular_velocity;
+
+        if (cruising_)
+        {
+            if (!steady || (abs_angular_velocity < threshold * ObserverDecimationVelocityHysteresis))
+            {
+                cruising_ = false;
+            }
+        }
+        else
+        {
+            if (steady && (abs_angular_velocity > threshold))
+            {
+                cruising_ = true;
+            }
+        }
+
+        if (cruising_ && flux_observer_at_cruise_ && !flux_observer_active_)
+        {
+            flux_observer_.reset(observer_.getAngularVelocity(), observer_.getAngularPosition(), Idq);
+            flux_observer_active_ = true;
+        }
+
+        if (!cruising_ && flux_observer_active_)
+        {
+            auto P0 = spinup_observer_P0_;
+            P0.diagonal()[2] = HandoverAngularVelocityVariance;
+            P0.diagonal()[3] = HandoverAngularPositionVariance;
+            observer_.reset(P0,
+                            flux_observer_.getAngularVelocity(),
+                            flux_observer_.getAngularPosition(),
+                            Idq);
+            flux_observer_active_ = false;
+        }
+    }
+
+    Scalar getActiveObserverAngularVelocity() const
+    {
+        return flux_observer_active_ ? flux_observer_.getAngularVelocity() : observer_.getAngularVelocity();
+    }
+
+    Scalar getActiveObserverAngularPosition() const
+    {
+        return flux_observer_active_ ? flux_observer_.getAngularPosition() : observer_.getAngularPosition();
+    }
+
+    Vector<2> getActiveObserverIdq() const
+    {
+        return flux_observer_active_ ? flux_observer_.getIdq() : observer_.getIdq();
+    }
+
+    void publishModulationInput()
+    {
+        ModulationInput inp;
+        switch (state_)
+        {
+        case State::Catching:
+        {
+            inp.setpoint = Setpoint();      // Zero Iq, the current controllers follow the back EMF
+            break;
+        }
+        case State::Spinup:
+        {
+            inp.setpoint = spinup_setpoint_;
+            break;
+        }
+        default:
+        {
+            inp.setpoint = regular_setpoint_;
+            break;
+        }
+        }
+        inp.angular_velocity = angular_velocity_;
+        inp.angular_position = angular_position_;
+        inp.phase_resistance = parameter_estimator_.getPhaseResistance();
+        inp.estimation_counter = estimation_counter_;
+        inp.parameter_estimation_counter = parameter_estimator_.getNumberOfUpdates();
+        inp.active = (state_ == State::Catching) || (state_ == State::Spinup) || (state_ == State::Running);
+        modulation_input_.write(inp);
+    }
+
 public:
+    /**
+     * @param angular_velocity_hint     Prior estimate of the electrical angular velocity of the rotor, e.g. the last
+     *                                  good estimate before a stall; it's only used to seed the observer for catching.
+     */
     MotorRunner(const ControllerParameters& controller_params,
                 const MotorParameters& motor_params,
                 const observer::Parameters& observer_params,
+                const InverterParameters& inverter_params,
                 const board::motor::PWMParameters& pwm_params,
-                const Direction dir) :
+                const Direction dir,
+                Const angular_velocity_hint = 0.0F) :
         controller_params_(controller_params),
         motor_params_(motor_params),
         direction_(dir),
 
+        state_((controller_params.catching_duration > 0) ? State::Catching : State::Spinup),
+
+        spinup_observer_P0_(observer_params.P0),
         observer_(observer_params,
                   motor_params.phi,
-                  motor_params.lq,      // TODO: MOVE THE ASSUMPTION THAT Lq = Ld INTO THE OBSERVER
+                  motor_params.ld,
                   motor_params.lq,
                   motor_params.rs),
 
+        flux_observer_at_cruise_(observer_params.flux_observer_at_cruise),
+        flux_observer_(observer_params,
+                       motor_params.phi,
+                       motor_params.ld,
+                       motor_params.lq,
+                       motor_params.rs),
+
+        parameter_estimation_enabled_(controller_params.motor_parameter_estimation_time_constant > 0),
+        parameter_estimator_(motor_params.rs,
+                             motor_params.phi,
+                             motor_params.ld,
+                             motor_params.lq,
+                             motor_params.min_current,
+                             motor_params.min_electrical_ang_vel,
+                             controller_params.motor_parameter_estimation_time_constant),
+
         modulator_(motor_params.lq,
                    motor_params.rs,
                    motor_params.max_current,
                    pwm_params,
-                   modulator_.DeadTimeCompensationPolicy::Disabled,
-                   modulator_.CrossCouplingCompensationPolicy::Disabled)
-    { }
+                   controller_params.current_loop_kp,
+                   controller_params.current_loop_ki)
+    {
+        modulator_.configureIdReference(motor_params.ld,
+                                        motor_params.lq,
+                                        motor_params.phi,
+                                        motor_params.max_current * controller_params.field_weakening_current_fraction);
+        modulator_.configureSpaceVectorModulation(controller_params.discontinuous_pwm_threshold,
+                                                  controller_params.max_modulation_ratio);
+        modulator_.configureDeadTimeCompensation(inverter_params.effective_dead_time_positive,
+                                                 inverter_params.effective_dead_time_negative,
+                                                 inverter_params.dead_time_compensation_transition_current);
+        modulator_.configureInverterVoltageFeedForward(inverter_params.vbus_feedforward,
+                                                       inverter_params.vbus_prediction_horizon);
+        {
+            IdqFilterConfig idq_filter_config;
+            idq_filter_config.cutoff_frequency = controller_params.idq_filter_cutoff_frequency;
+            idq_filter_config.notch_frequency = controller_params.idq_notch_frequency;
+            idq_filter_config.ld = motor_params.ld;
+            idq_filter_config.lq = motor_params.lq;
+            idq_filter_config.rs = motor_params.rs;
+            idq_filter_config.phi = motor_params.phi;
+            modulator_.configureIdqFilter(idq_filter_config);
+        }
+        if (state_ == State::Catching)
+        {
+            // The rotor may be spinning in either direction at any speed
+            auto P0 = spinup_observer_P0_;
+            P0.diagonal()[2] = CatchingAngularVelocityVariance;
+            observer_.reset(P0, angular_velocity_hint);
+        }
+        publishModulationInput();
+    }
+
+    /**
+     * Retunes the EKF on the fly. Must be invoked from the main IRQ.
+     */
+    void setObserverParameters(const observer::Parameters& observer_params)
+    {
+        observer_.setNoiseCovariances(observer_params);
+    }
 
     /**
-     * This is the only method that can be preempted by a higher priority IRQ!
+     * Makes the observer run at most every N-th period of the main IRQ, N >= 1, e.g. to shed the load.
+     * The ratio scheduled by the runner itself at cruise applies if it is greater.
+     * Must be invoked from the main IRQ.
      */
-    void updateStateEstimation(Const period,
+    void setObserverDecimationRatio(const unsigned ratio)
+    {
+        observer_decimation_ratio_ = std::max(1U, ratio);
+    }
+
+    /**
+     * Must be invoked from the main IRQ.
+     */
+    unsigned getObserverDecimationRatio() const
+    {
+        const unsigned scheduled = (cruising_ && !flux_observer_active_) ?
+                                   controller_params_.high_speed_observer_decimation_ratio : 1U;
+        return std::max(observer_decimation_ratio_, scheduled);
+    }
+
+    /**
+     * This method must be invoked from the main IRQ; it will be preempted by the fast IRQ.
+     * No critical sections are used, the data is exchanged with the fast IRQ using lock-free primitives.
+     * @return  True if the observer has been updated, false if the update was skipped due to decimation.
+     */
+    BOARD_RAM_INLINE_FUNCTION
+    bool updateStateEstimation(Const period,
                                const board::motor::Status& hw_status)
     {
         (void) hw_status;       // We don't need it, but keep it anyway for future proofness
@@ -134,42 +404,130 @@ public:
         AbsoluteCriticalSectionLocker::assertNotLocked();
 
         /*
-         * Making a local copy of state variables ASAP, before the next fast IRQ fires.
+         * Making a consistent local copy of the outputs of the fast IRQ.
          */
-        const auto Idq = estimated_Idq_;
-        const auto Udq = reference_Udq_;
+        const auto modulation_output = modulation_output_.read();
+        const auto& Idq = modulation_output.estimated_Idq;
+        const auto& Udq = modulation_output.reference_Udq;
 
-        if (state_ != State::Spinup &&
+        if (state_ != State::Catching &&
+            state_ != State::Spinup &&
             state_ != State::Running)
         {
-            return;     // Nothing to do really
+            return false;   // Nothing to do really
         }
 
+        /*
+         * If the main IRQ is running out of time or the speed is high, the observer is updated only every N-th
+         * period; the skipped periods are accounted for by the next update.
+         * The fast IRQ keeps extrapolating the angle meanwhile.
+         */
+        estimation_period_accumulator_ += period;
+        observer_decimation_counter_++;
+        if (observer_decimation_counter_ < getObserverDecimationRatio())
+        {
+            return false;
+        }
+        observer_decimation_counter_ = 0;
+
+        Const estimation_period = estimation_period_accumulator_;
+        estimation_period_accumulator_ = 0;
+
         /*
          * Running the observer, this takes forever.
          * By the time the observer has finished, the rotor has moved some angle forward, which we compensate.
          */
-        observer_.update(period, Idq, Udq);     // A very long call
+        {
+            board::irq_profiler::ScopedStageMeasurer<board::irq_profiler::Stage::Observer> measurer;
+            if (flux_observer_active_)
+            {
+                flux_observer_.update(estimation_period, Idq, Udq);
+            }
+            else
+            {
+                observer_.update(estimation_period, Idq, Udq);     // A very long call
+            }
+        }
 
         /*
-         * Once the observer has finished, a state mutation intensive part begins, so we acquire the expensive lock.
+         * Once the observer has finished, a state mutation intensive part begins.
+         * The results are published for the fast IRQ at the end.
          */
-        AbsoluteCriticalSectionLocker locker;
+        board::irq_profiler::ScopedStageMeasurer<board::irq_profiler::Stage::StateUpdate> measurer;
 
-        angular_velocity_ = observer_.getAngularVelocity();
+        Const previous_angular_velocity = angular_velocity_;
+        angular_velocity_ = getActiveObserverAngularVelocity();
+        observer_current_residual_ = (Idq - getActiveObserverIdq()).norm();
 
         // Correcting the angle estimation latency, assuming that the observer runs for about half period.
-        angular_position_ = math::normalizeAngle(observer_.getAngularPosition() + angular_velocity_ * (period * 0.5F));
+        angular_position_ = math::normalizeAngle(getActiveObserverAngularPosition() +
+                                                 angular_velocity_ * (period * 0.5F));
+        estimation_counter_++;
+
+        // The estimator is not fed during spinup, because the observer has not converged yet
+        if (parameter_estimation_enabled_ && (state_ == State::Running))
+        {
+            if (parameter_estimator_.update(estimation_period, Idq, Udq, angular_velocity_))
+            {
+                observer_.setMotorParameters(parameter_estimator_.getFieldFlux(),
+                                             parameter_estimator_.getPhaseResistance());
+                flux_observer_.setMotorParameters(parameter_estimator_.getFieldFlux(),
+                                                  parameter_estimator_.getPhaseResistance());
+            }
+        }
 
-        if (state_ != State::Spinup)
+        if (state_ == State::Catching)
         {
             observer_.setDirectionConstraint(observer::DirectionConstraint::None);
 
+            catching_time_ += estimation_period;
+
+            // The observer may take a few false turns before it locks on, so we make sure the estimate has settled
+            if (catching_time_ >= controller_params_.catching_duration * 0.5F)
+            {
+                catching_min_angular_velocity_ = std::min(catching_min_angular_velocity_, angular_velocity_);
+                catching_max_angular_velocity_ = std::max(catching_max_angular_velocity_, angular_velocity_);
+            }
+
+            if (catching_time_ >= controller_params_.catching_duration)
+            {
+                Const ang_vel_threshold = motor_params_.min_electrical_ang_vel * SpinupAngularVelocityHysteresis;
+                Const ang_vel_spread = catching_max_angular_velocity_ - catching_min_angular_velocity_;
+
+                if (((isReversed() ? -angular_velocity_ : angular_velocity_) > ang_vel_threshold) &&
+                    (ang_vel_spread < std::abs(angular_velocity_) * CatchingAngularVelocityTolerance))
+                {
+                    // Already spinning in the right direction fast enough, skipping the spinup altogether
+                    state_ = State::Running;
+                    remaining_time_before_stall_detection_enabled_ = catching_time_;
+                }
+                else
+                {
+                    // Stationary, too slow, or spinning the wrong way; starting over from the standstill assumption
+                    state_ = State::Spinup;
+                    observer_.reset(spinup_observer_P0_);
+                    angular_velocity_ = observer_.getAngularVelocity();
+                    angular_position_ = observer_.getAngularPosition();
+                    estimation_counter_++;
+                }
+            }
+        }
+        else if (state_ == State::Running)
+        {
+            observer_.setDirectionConstraint(observer::DirectionConstraint::None);
+
+            if (std::abs(angular_velocity_) > motor_params_.min_electrical_ang_vel * SpinupAngularVelocityHysteresis)
+            {
+                last_good_angular_velocity_ = angular_velocity_;
+            }
+
+            updateObserverSchedule(estimation_period, previous_angular_velocity, Idq);
+
             // Rotor stall detection
             if (remaining_time_before_stall_detection_enabled_ > 0)
             {
                 // We've just entered the running mode, stall detection is temporarily suppressed
-                remaining_time_before_stall_detection_enabled_ -= period;
+                remaining_time_before_stall_detection_enabled_ -= estimation_period;
             }
             else
             {
@@ -197,7 +555,7 @@ public:
                                              observer::DirectionConstraint::Reverse :
                                              observer::DirectionConstraint::Forward);
 
-            spinup_time_ += period;
+            spinup_time_ += estimation_period;
 
             Const spinup_fraction = spinup_time_ / controller_params_.nominal_spinup_duration;
 
@@ -224,28 +582,50 @@ public:
                 state_ = State::Stalled;
             }
         }
+
+        publishModulationInput();
+        return true;
     }
 
     /**
-     * This method may be invoked concurrently with the state estimation update method from an IRQ (possibly nested).
+     * This method is invoked from the fast IRQ, preempting the state estimation update method.
      * Critical section is not used here.
      */
+    BOARD_RAM_INLINE_FUNCTION
     Vector<3> updatePWMOutputsFromIRQ(const Vector<2>& phase_currents_ab,
                                       Const inverter_voltage) const
     {
-        if (state_ == State::Spinup ||
-            state_ == State::Running)
+        const auto inp = modulation_input_.read();
+
+        if (inp.active)
         {
-            const auto sp = (state_ == State::Spinup) ? spinup_setpoint_ : regular_setpoint_;
+            if (inp.estimation_counter != last_estimation_counter_)
+            {
+                // New estimate from the main IRQ, dropping the angle extrapolated since the previous one
+                last_estimation_counter_ = inp.estimation_counter;
+                extrapolated_angular_position_ = inp.angular_position;
+            }
+
+            if (inp.parameter_estimation_counter != last_parameter_estimation_counter_)
+            {
+                last_parameter_estimation_counter_ = inp.parameter_estimation_counter;
+                modulator_.setPhaseResistance(inp.phase_resistance);
+            }
 
             const auto output = modulator_.onNextPWMPeriod(phase_currents_ab,
                                                            inverter_voltage,
-                                                           angular_velocity_,
-                                                           angular_position_,
-                                                           sp);
-            estimated_Idq_ = output.estimated_Idq;
-            reference_Udq_ = output.reference_Udq;
-            angular_position_ = output.extrapolated_angular_position;
+                                                           inp.angular_velocity,
+                                                           extrapolated_angular_position_,
+                                                           inp.setpoint);
+
+            extrapolated_angular_position_ = output.extrapolated_angular_position;
+
+            ModulationOutput mo;
+            mo.estimated_Idq = output.estimated_Idq;
+            mo.reference_Udq = output.reference_Udq;
+            mo.integral_Udq = modulator_.getCurrentControllerIntegralVoltages();
+            mo.Udq_normalization_count = std::uint32_t(modulator_.getUdqNormalizationCounter());
+            modulation_output_.write(mo);
 
             return output.pwm_setpoint;
         }
@@ -256,33 +636,40 @@ public:
     }
 
     /**
-     * Updating setpoint during spinup is meaningless, because the inner logic will overwrite it anyway.
+     * Updating setpoint during catching or spinup is meaningless, because the inner logic will overwrite it anyway.
      * Calling this method only makes sense if the state is Running.
+     * Must be invoked from the main IRQ.
      */
     void setSetpoint(const Setpoint& sp)
     {
-        AbsoluteCriticalSectionLocker locker;
         regular_setpoint_ = sp;
+        publishModulationInput();
     }
 
+    /**
+     * Must be invoked from the main IRQ.
+     */
     Setpoint getSetpoint() const
     {
-        AbsoluteCriticalSectionLocker locker;
         return regular_setpoint_;
     }
 
     State getState() const { return state_; }
 
+    /**
+     * Lock-free, can be invoked from any context except the fast IRQ.
+     */
     Vector<2> getUdq() const
     {
-        AbsoluteCriticalSectionLocker locker;
-        return reference_Udq_;
+        return modulation_output_.read().reference_Udq;
     }
 
+    /**
+     * Lock-free, can be invoked from any context except the fast IRQ.
+     */
     Vector<2> getIdq() const
     {
-        AbsoluteCriticalSectionLocker locker;
-        return estimated_Idq_;
+        return modulation_output_.read().estimated_Idq;
     }
 
     Scalar getElectricalAngularVelocity() const
@@ -290,25 +677,96 @@ public:
         return angular_velocity_;   // No locking needed
     }
 
+    /**
+     * Latency compensated estimate as published for the fast IRQ. Must be invoked from the main IRQ.
+     */
+    Scalar getElectricalAngularPosition() const
+    {
+        return angular_position_;
+    }
+
     Scalar computeInverterPower() const
     {
-        AbsoluteCriticalSectionLocker locker;
-        return (reference_Udq_.transpose() * estimated_Idq_)[0] * 1.5F;
+        const auto mo = modulation_output_.read();
+        return (mo.reference_Udq.transpose() * mo.estimated_Idq)[0] * 1.5F;
     }
 
     Direction getDirection() const { return direction_; }
 
+    /**
+     * The last estimate of the angular velocity that was well above the stall threshold; zero if there was none.
+     * Must be invoked from the main IRQ.
+     */
+    Scalar getLastGoodElectricalAngularVelocity() const { return last_good_angular_velocity_; }
+
+    /**
+     * Must be invoked from the main IRQ.
+     */
+    Scalar getObserverCurrentResidual() const { return observer_current_residual_; }
+
+    /**
+     * Must be invoked from the main IRQ.
+     */
+    EstimatedMotorParameters getEstimatedMotorParameters() const
+    {
+        EstimatedMotorParameters out;
+        out.rs = parameter_estimator_.getPhaseResistance();
+        out.phi = parameter_estimator_.getFieldFlux();
+        out.num_updates = parameter_estimator_.getNumberOfUpdates();
+        return out;
+    }
+
+    /**
+     * The covariance is that of the EKF; it is not updated while the flux observer is active.
+     * Must be invoked from the main IRQ.
+     */
     DebugVariables getDebugVariables() const
     {
-        AbsoluteCriticalSectionLocker locker;
-        return {
-            reference_Udq_[0],
-            reference_Udq_[1],
-            estimated_Idq_[0],
-            estimated_Idq_[1],
+        const auto mo = modulation_output_.read();
+        const auto P = observer_.getCovarianceDiagonal();
+        return {{
+            mo.reference_Udq[0],
+            mo.reference_Udq[1],
+            mo.estimated_Idq[0],
+            mo.estimated_Idq[1],
             regular_setpoint_.value,
-            observer_.getAngularVelocity()
-        };
+            getActiveObserverAngularVelocity(),
+            getActiveObserverAngularPosition(),
+            mo.integral_Udq[0],
+            mo.integral_Udq[1],
+            Scalar(mo.Udq_normalization_count),
+            P[0],
+            P[1],
+            P[2],
+            P[3],
+            observer_current_residual_,
+            parameter_estimator_.getPhaseResistance()
+        }};
+    }
+
+    /**
+     * Same order as @ref getDebugVariables().
+     */
+    static DebugVariableNames getDebugVariableNames()
+    {
+        return {{
+            "ud",
+            "uq",
+            "id",
+            "iq",
+            "setpoint",
+            "w",
+            "theta",
+            "ui_d",
+            "ui_q",
+            "udq_sat",
+            "p_id",
+            "p_iq",
+            "p_w",
+            "p_theta",
+            "residual",
+            "rs"
+        }};
     }
 };
 
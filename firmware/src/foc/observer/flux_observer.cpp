@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "flux_observer.hpp"
+#include <board/ram_function.hpp>
+
+
+namespace foc
+{
+namespace observer
+{
+
+FluxObserver::FluxObserver(const Parameters& parameters,
+                           Const field_flux,
+                           Const stator_phase_inductance_direct,
+                           Const stator_phase_inductance_quadrature,
+                           Const stator_phase_resistance) :
+    phi_(field_flux),
+    ld_(stator_phase_inductance_direct),
+    lq_(stator_phase_inductance_quadrature),
+    r_(stator_phase_resistance),
+    flux_gain_(parameters.flux_observer_gain),
+    gamma_(flux_gain_ / (phi_ * phi_)),
+    kp_(2.0F * parameters.flux_observer_pll_bandwidth),
+    ki_(parameters.flux_observer_pll_bandwidth * parameters.flux_observer_pll_bandwidth)
+{
+    assert(std::isfinite(phi_));
+    assert(std::isfinite(ld_));
+    assert(std::isfinite(lq_));
+    assert(std::isfinite(r_));
+    assert(std::isfinite(gamma_));
+    assert(std::isfinite(kp_));
+
+    psi_d_ = phi_;
+}
+
+
+BOARD_RAM_FUNCTION
+void FluxObserver::update(Const dt,
+                          const Vector<2>& idq,
+                          const Vector<2>& udq)
+{
+    Const Id = idq[0];
+    Const Iq = idq[1];
+
+    /*
+     * Rotor flux, i.e. the stator flux minus the armature reaction.
+     */
+    Const eta_d = psi_d_ - ld_ * Id;
+    Const eta_q = psi_q_ - lq_ * Iq;
+    Const eta_sq = eta_d * eta_d + eta_q * eta_q;
+
+    /*
+     * PLL. The phase error is the angle of the rotor flux in the estimated frame, the sine of which is used.
+     * The magnitude is floored in order to avoid division by zero, the PLL will catch up in a few periods.
+     */
+    Const eta_abs = std::sqrt(std::max(eta_sq, phi_ * phi_ * 0.01F));
+    Const phase_error = eta_q / eta_abs;
+
+    w_ += ki_ * phase_error * dt;
+
+    if (((direction_constraint_ == DirectionConstraint::Forward) && (w_ < 0)) ||
+        ((direction_constraint_ == DirectionConstraint::Reverse) && (w_ > 0)))
+    {
+        w_ = 0.0F;
+    }
+
+    Const frame_angular_velocity = w_ + kp_ * phase_error;
+
+    /*
+     * Voltage model integration with the magnitude correction: dpsi/dt = u - R*i + gamma/2 * eta * (phi^2 - |eta|^2)
+     */
+    Const correction = 0.5F * gamma_ * (phi_ * phi_ - eta_sq);
+
+    Const psi_d = psi_d_ + (udq[0] - r_ * Id + correction * eta_d) * dt;
+    Const psi_q = psi_q_ + (udq[1] - r_ * Iq + correction * eta_q) * dt;
+
+    /*
+     * Moving the flux into the new estimated frame. The angle increment is small,
+     * so the sine and the cosine are approximated with the Taylor series.
+     */
+    Const dtheta = frame_angular_velocity * dt;
+    Const dtheta_sq = dtheta * dtheta;
+    Const c = 1.0F - dtheta_sq * 0.5F;
+    Const s = dtheta * (1.0F - dtheta_sq * (1.0F / 6.0F));
+
+    psi_d_ =  c * psi_d + s * psi_q;
+    psi_q_ = -s * psi_d + c * psi_q;
+
+    theta_ = math::normalizeAngle(theta_ + dtheta);
+}
+
+}
+}
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "observer.hpp"
+
+
+namespace foc
+{
+namespace observer
+{
+/**
+ * Nonlinear flux observer (Ortega et al., with the magnitude correction proposed by Lee et al.)
+ * followed by a PLL that extracts the angle and the angular velocity.
+ * The stator flux is integrated from the voltage model; its drift is cancelled by pulling the magnitude of
+ * the rotor flux estimate towards the known field flux. The update takes a few dozen flops and no covariance
+ * propagation, unlike the EKF, but the observer does not work at low speed, because the back EMF
+ * vanishes; hence the EKF is still used for spinup.
+ * The state is kept in the rotating frame of the estimated angle, like the inputs. The flux estimate
+ * in this frame is expected to be aligned with the d axis, which also makes the model valid for IPMSM.
+ * All units are SI units (Weber, Henry, Ohm, Volt, Second, Radian).
+ */
+class FluxObserver
+{
+    Scalar phi_;
+    Const ld_;
+    Const lq_;
+    Scalar r_;
+
+    Const flux_gain_;
+    Scalar gamma_;      ///< Ortega's gain, normalized by the field flux
+
+    // PLL gains, critically damped
+    Const kp_;
+    Const ki_;
+
+    DirectionConstraint direction_constraint_ = DirectionConstraint::None;
+
+    // Stator flux linkage in the estimated frame
+    Scalar psi_d_ = 0.0F;
+    Scalar psi_q_ = 0.0F;
+
+    Scalar w_     = 0.0F;       ///< Output of the PLL integrator
+    Scalar theta_ = 0.0F;
+
+public:
+    FluxObserver(const Parameters& parameters,
+                 Const field_flux,
+                 Const stator_phase_inductance_direct,
+                 Const stator_phase_inductance_quadrature,
+                 Const stator_phase_resistance);
+
+    void update(Const dt,
+                const Vector<2>& idq,
+                const Vector<2>& udq);
+
+    void setDirectionConstraint(DirectionConstraint dc) { direction_constraint_ = dc; }
+
+    /**
+     * Allows to update the motor model at run time, e.g. from an online parameter estimator.
+     */
+    void setMotorParameters(Const field_flux,
+                            Const stator_phase_resistance)
+    {
+        assert(os::float_eq::positive(field_flux));
+        assert(os::float_eq::positive(stator_phase_resistance));
+        phi_ = field_flux;
+        r_ = stator_phase_resistance;
+        gamma_ = flux_gain_ / (phi_ * phi_);
+    }
+
+    /**
+     * Initializes the state from a prior estimate, e.g. from the EKF.
+     * The observer converges from an arbitrary state as well, provided that the speed is sufficiently high.
+     */
+    void reset(Const angular_velocity,
+               Const angular_position,
+               const Vector<2>& idq)
+    {
+        psi_d_ = phi_ + ld_ * idq[0];
+        psi_q_ = lq_ * idq[1];
+        w_     = angular_velocity;
+        theta_ = math::normalizeAngle(angular_position);
+    }
+
+    /**
+     * The currents are derived from the flux, assuming that the estimated frame is aligned with the rotor.
+     */
+    Vector<2> getIdq() const { return Vector<2>((psi_d_ - phi_) / ld_, psi_q_ / lq_); }
+
+    Scalar getAngularVelocity() const { return w_; }
+
+    Scalar getAngularPosition() const { return theta_; }
+};
+
+}
+}
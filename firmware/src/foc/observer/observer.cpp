@@ -23,6 +23,7 @@
  */
 
 #include "observer.hpp"
+#include <board/ram_function.hpp>
 
 
 namespace foc
@@ -35,11 +36,11 @@ using math::makeDiagonalMatrix;
 using math::makeRow;
 
 
-Observer::Observer(const Parameters& parameters,
-                   Const field_flux,
-                   Const stator_phase_inductance_direct,
-                   Const stator_phase_inductance_quadrature,
-                   Const stator_phase_resistance) :
+ReferenceObserver::ReferenceObserver(const Parameters& parameters,
+                                     Const field_flux,
+                                     Const stator_phase_inductance_direct,
+                                     Const stator_phase_inductance_quadrature,
+                                     Const stator_phase_resistance) :
     // Motor model
     phi_(field_flux),
     ld_(stator_phase_inductance_direct),
@@ -64,9 +65,9 @@ Observer::Observer(const Parameters& parameters,
 }
 
 
-void Observer::update(Const dt,
-                      const Vector<2>& idq,
-                      const Vector<2>& udq)
+void ReferenceObserver::update(Const dt,
+                               const Vector<2>& idq,
+                               const Vector<2>& udq)
 {
     /*
      * Creating aliases for the sake of better compatibility with the Matlab source.
@@ -133,5 +134,164 @@ void Observer::update(Const dt,
     }
 }
 
+
+Observer::Observer(const Parameters& parameters,
+                   Const field_flux,
+                   Const stator_phase_inductance_direct,
+                   Const stator_phase_inductance_quadrature,
+                   Const stator_phase_resistance) :
+    // Motor model
+    phi_(field_flux),
+    ld_(stator_phase_inductance_direct),
+    lq_(stator_phase_inductance_quadrature),
+    r_(stator_phase_resistance),
+
+    // Filter constants
+    cross_coupling_comp_(parameters.cross_coupling_compensation),
+    q0_(parameters.Q.diagonal()[0]),
+    q1_(parameters.Q.diagonal()[1]),
+    q2_(parameters.Q.diagonal()[2]),
+    q3_(parameters.Q.diagonal()[3]),
+    r0_(parameters.R.diagonal()[0]),
+    r1_(parameters.R.diagonal()[1]),
+
+    // Filter state
+    p00_(parameters.P0.diagonal()[0]),
+    p01_(0.0F),
+    p02_(0.0F),
+    p03_(0.0F),
+    p11_(parameters.P0.diagonal()[1]),
+    p12_(0.0F),
+    p13_(0.0F),
+    p22_(parameters.P0.diagonal()[2]),
+    p23_(0.0F),
+    p33_(parameters.P0.diagonal()[3])
+{
+    assert(std::isfinite(phi_));
+    assert(std::isfinite(ld_));
+    assert(std::isfinite(lq_));
+    assert(std::isfinite(r_));
+    assert(std::isfinite(cross_coupling_comp_));
+}
+
+
+BOARD_RAM_FUNCTION
+void Observer::update(Const dt,
+                      const Vector<2>& idq,
+                      const Vector<2>& udq)
+{
+    Const Ts = dt;
+    Const Id = idq[0];
+    Const Iq = idq[1];
+    Const w = w_;
+
+    /*
+     * Non-trivial elements of the state transition matrix F. The rest is:
+     *      F(0, 3) = F(1, 3) = 0
+     *      F(2, :) = [0 0 1 0]
+     *      F(3, :) = [0 0 Ts 1]
+     * Note that the model uses the measured currents rather than the estimated ones, same as the reference.
+     */
+    Const Ts_Ld = Ts / ld_;
+    Const Ts_Lq = Ts / lq_;
+
+    Const f00 = 1.0F - Ts_Ld * r_;
+    Const f01 = Ts_Ld * lq_ * w;
+    Const f02 = Ts_Ld * lq_ * Iq;
+    Const f10 = -Ts_Lq * ld_ * w;
+    Const f11 = 1.0F - Ts_Lq * r_ * (1.0F + cross_coupling_comp_);
+    Const f12 = -Ts_Lq * (ld_ * Id + phi_);
+
+    /*
+     * State prediction. Angular velocity is not changed by the model.
+     */
+    Const x0 = Id + (udq[0] - r_ * Id + w * lq_ * Iq) * Ts_Ld;
+    Const x1 = Iq + (udq[1] - r_ * Iq - w * ld_ * Id - phi_ * w) * Ts_Lq;
+    Const x3 = theta_ + w * Ts;
+
+    /*
+     * Covariance prediction: Pout = F * P * F' + Q
+     * First two rows of M = F * P are computed explicitly; the last two are trivial:
+     *      M(2, :) = P(2, :)
+     *      M(3, :) = Ts * P(2, :) + P(3, :)
+     */
+    Const m00 = f00 * p00_ + f01 * p01_ + f02 * p02_;
+    Const m01 = f00 * p01_ + f01 * p11_ + f02 * p12_;
+    Const m02 = f00 * p02_ + f01 * p12_ + f02 * p22_;
+    Const m03 = f00 * p03_ + f01 * p13_ + f02 * p23_;
+
+    Const m11 = f10 * p01_ + f11 * p11_ + f12 * p12_;
+    Const m12 = f10 * p02_ + f11 * p12_ + f12 * p22_;
+    Const m13 = f10 * p03_ + f11 * p13_ + f12 * p23_;
+
+    Const o00 = f00 * m00 + f01 * m01 + f02 * m02 + q0_;
+    Const o01 = f10 * m00 + f11 * m01 + f12 * m02;
+    Const o02 = m02;
+    Const o03 = Ts * m02 + m03;
+    Const o11 = f11 * m11 + f12 * m12 + f10 * (f10 * p00_ + f11 * p01_ + f12 * p02_) + q1_;
+    Const o12 = m12;
+    Const o13 = Ts * m12 + m13;
+    Const o22 = p22_ + q2_;
+    Const o23 = Ts * p22_ + p23_;
+    Const o33 = Ts * (o23 + p23_) + p33_ + q3_;
+
+    /*
+     * Kalman gain: K = Pout * C' * inv(C * Pout * C' + R)
+     * The matrix being inverted is the upper left 2x2 block of Pout plus diagonal R.
+     */
+    Const s00 = o00 + r0_;
+    Const s01 = o01;
+    Const s11 = o11 + r1_;
+
+    Const inv_det = 1.0F / (s00 * s11 - s01 * s01);
+
+    Const i00 =  s11 * inv_det;
+    Const i01 = -s01 * inv_det;
+    Const i11 =  s00 * inv_det;
+
+    Const k00 = o00 * i00 + o01 * i01;
+    Const k01 = o00 * i01 + o01 * i11;
+    Const k10 = o01 * i00 + o11 * i01;
+    Const k11 = o01 * i01 + o11 * i11;
+    Const k20 = o02 * i00 + o12 * i01;
+    Const k21 = o02 * i01 + o12 * i11;
+    Const k30 = o03 * i00 + o13 * i01;
+    Const k31 = o03 * i01 + o13 * i11;
+
+    /*
+     * State correction: x = Xout + K * (y - C * Xout)
+     */
+    Const e0 = Id - x0;
+    Const e1 = Iq - x1;
+
+    Id_    = x0 + k00 * e0 + k01 * e1;
+    Iq_    = x1 + k10 * e0 + k11 * e1;
+    w_     = w  + k20 * e0 + k21 * e1;
+    theta_ = math::normalizeAngle(x3 + k30 * e0 + k31 * e1);
+
+    /*
+     * Covariance correction: P = (I - K * C) * Pout = Pout - K * Pout(0:1, :)
+     */
+    p00_ = o00 - (k00 * o00 + k01 * o01);
+    p01_ = o01 - (k00 * o01 + k01 * o11);
+    p02_ = o02 - (k00 * o02 + k01 * o12);
+    p03_ = o03 - (k00 * o03 + k01 * o13);
+    p11_ = o11 - (k10 * o01 + k11 * o11);
+    p12_ = o12 - (k10 * o02 + k11 * o12);
+    p13_ = o13 - (k10 * o03 + k11 * o13);
+    p22_ = o22 - (k20 * o02 + k21 * o12);
+    p23_ = o23 - (k20 * o03 + k21 * o13);
+    p33_ = o33 - (k30 * o03 + k31 * o13);
+
+    /*
+     * Constraint check
+     */
+    if (((direction_constraint_ == DirectionConstraint::Forward) && (w_ < 0)) ||
+        ((direction_constraint_ == DirectionConstraint::Reverse) && (w_ > 0)))
+    {
+        w_ = 0.0F;
+    }
+}
+
 }
 }
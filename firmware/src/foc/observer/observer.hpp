@@ -63,6 +63,15 @@ struct Parameters
 
     Scalar cross_coupling_compensation = 0.8F;
 
+    /// Use the @ref FluxObserver instead of the EKF at cruise, see @ref MotorRunner
+    bool flux_observer_at_cruise = false;
+
+    /// Convergence rate of the flux magnitude error of the @ref FluxObserver, 1/second
+    Scalar flux_observer_gain = 2000.0F;
+
+    /// Natural frequency of the critically damped PLL of the @ref FluxObserver, radian/second
+    Scalar flux_observer_pll_bandwidth = 500.0F;
+
 
     bool isValid() const
     {
@@ -82,7 +91,9 @@ struct Parameters
         return check_positive(Q)        &&
                check_positive(R)        &&
                check_positive(P0)       &&
-               math::Range<>(0.0F, 1.0F).contains(cross_coupling_compensation);
+               math::Range<>(0.0F, 1.0F).contains(cross_coupling_compensation) &&
+               math::Range<>(10.0F, 100000.0F).contains(flux_observer_gain) &&
+               math::Range<>(10.0F, 10000.0F).contains(flux_observer_pll_bandwidth);
     }
 
     auto toString() const
@@ -90,11 +101,15 @@ struct Parameters
         return os::heapless::format("Q diag : %s\n"
                                     "R diag : %s\n"
                                     "P0 diag: %s\n"
-                                    "CC Comp: %.3f",
+                                    "CC Comp: %.3f\n"
+                                    "FluxObs: %s, gain %.0f 1/s, PLL %.0f rad/s",
                                     math::toString(Q.diagonal()).c_str(),
                                     math::toString(R.diagonal()).c_str(),
                                     math::toString(P0.diagonal()).c_str(),
-                                    double(cross_coupling_compensation));
+                                    double(cross_coupling_compensation),
+                                    flux_observer_at_cruise ? "at cruise" : "disabled",
+                                    double(flux_observer_gain),
+                                    double(flux_observer_pll_bandwidth));
     }
 };
 
@@ -109,11 +124,13 @@ enum class DirectionConstraint
 };
 
 /**
- * Dmitry's ingenious observer.
+ * Dmitry's ingenious observer, straightforward dense implementation.
+ * It matches the Matlab source almost line by line, which makes it easy to verify, but it is too slow for the
+ * main IRQ. It is not used by the firmware and is kept only as the reference for the optimized version below.
  * Refer to the Simulink model for derivations.
  * All units are SI units (Weber, Henry, Ohm, Volt, Second, Radian).
  */
-class Observer
+class ReferenceObserver
 {
     Const phi_;
     Const ld_;
@@ -136,6 +153,74 @@ class Observer
     Vector<4> x_ = Vector<4>::Zero();
     Matrix<4, 4> P_;
 
+public:
+    ReferenceObserver(const Parameters& parameters,
+                      Const field_flux,
+                      Const stator_phase_inductance_direct,
+                      Const stator_phase_inductance_quadrature,
+                      Const stator_phase_resistance);
+
+    void update(Const dt,
+                const Vector<2>& idq,
+                const Vector<2>& udq);
+
+    void setDirectionConstraint(DirectionConstraint dc) { direction_constraint_ = dc; }
+
+    Vector<2> getIdq() const { return x_.block<2, 1>(0, 0); }
+
+    Scalar getAngularVelocity() const { return x_[StateIndexAngularVelocity]; }
+
+    Scalar getAngularPosition() const { return x_[StateIndexAngularPosition]; }
+};
+
+
+/**
+ * Same observer as ReferenceObserver, optimized for speed.
+ * The update is hand-unrolled using the known structure of the model:
+ *  - Only the upper triangle of the symmetric covariance matrix P is stored and updated;
+ *  - The known zeros of the state transition matrix F are skipped;
+ *  - C = [I 0], so the innovation covariance is just the upper left 2x2 block of P plus R,
+ *    and it is inverted in closed form;
+ *  - Q and R are diagonal.
+ * The results are identical to the reference implementation within floating point error margins.
+ */
+class Observer
+{
+    Scalar phi_;
+    Const ld_;
+    Const lq_;
+    Scalar r_;
+
+    Const cross_coupling_comp_;
+
+    // Diagonals of the noise covariance matrices
+    Scalar q0_;
+    Scalar q1_;
+    Scalar q2_;
+    Scalar q3_;
+    Scalar r0_;
+    Scalar r1_;
+
+    DirectionConstraint direction_constraint_ = DirectionConstraint::None;
+
+    // Filter states
+    Scalar Id_    = 0.0F;
+    Scalar Iq_    = 0.0F;
+    Scalar w_     = 0.0F;
+    Scalar theta_ = 0.0F;
+
+    // Upper triangle of the covariance matrix, row-major
+    Scalar p00_;
+    Scalar p01_;
+    Scalar p02_;
+    Scalar p03_;
+    Scalar p11_;
+    Scalar p12_;
+    Scalar p13_;
+    Scalar p22_;
+    Scalar p23_;
+    Scalar p33_;
+
 public:
     Observer(const Parameters& parameters,
              Const field_flux,
@@ -149,11 +234,68 @@ public:
 
     void setDirectionConstraint(DirectionConstraint dc) { direction_constraint_ = dc; }
 
-    Vector<2> getIdq() const { return x_.block<2, 1>(0, 0); }
+    /**
+     * Allows to update the motor model at run time, e.g. from an online parameter estimator.
+     */
+    void setMotorParameters(Const field_flux,
+                            Const stator_phase_resistance)
+    {
+        assert(os::float_eq::positive(field_flux));
+        assert(os::float_eq::positive(stator_phase_resistance));
+        phi_ = field_flux;
+        r_ = stator_phase_resistance;
+    }
 
-    Scalar getAngularVelocity() const { return x_[StateIndexAngularVelocity]; }
+    /**
+     * Allows to retune the filter at run time; the state and its covariance are not affected.
+     */
+    void setNoiseCovariances(const Parameters& parameters)
+    {
+        q0_ = parameters.Q.diagonal()[0];
+        q1_ = parameters.Q.diagonal()[1];
+        q2_ = parameters.Q.diagonal()[2];
+        q3_ = parameters.Q.diagonal()[3];
+        r0_ = parameters.R.diagonal()[0];
+        r1_ = parameters.R.diagonal()[1];
+    }
 
-    Scalar getAngularPosition() const { return x_[StateIndexAngularPosition]; }
+    /**
+     * Reinitializes the state and its covariance; the motor model and the noise covariances are retained.
+     * The state can be seeded with a prior estimate, e.g. from another observer; its uncertainty should be
+     * reflected in P0.
+     */
+    void reset(const DiagonalMatrix<4>& P0,
+               Const angular_velocity = 0.0F,
+               Const angular_position = 0.0F,
+               const Vector<2>& idq = Vector<2>::Zero())
+    {
+        Id_    = idq[0];
+        Iq_    = idq[1];
+        w_     = angular_velocity;
+        theta_ = angular_position;
+
+        p00_ = P0.diagonal()[0];
+        p01_ = 0.0F;
+        p02_ = 0.0F;
+        p03_ = 0.0F;
+        p11_ = P0.diagonal()[1];
+        p12_ = 0.0F;
+        p13_ = 0.0F;
+        p22_ = P0.diagonal()[2];
+        p23_ = 0.0F;
+        p33_ = P0.diagonal()[3];
+    }
+
+    Vector<2> getIdq() const { return Vector<2>(Id_, Iq_); }
+
+    Scalar getAngularVelocity() const { return w_; }
+
+    Scalar getAngularPosition() const { return theta_; }
+
+    /**
+     * Variances of Id, Iq, angular velocity and angular position.
+     */
+    Vector<4> getCovarianceDiagonal() const { return Vector<4>(p00_, p11_, p22_, p33_); }
 };
 
 }
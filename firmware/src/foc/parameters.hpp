@@ -92,6 +92,13 @@ struct MotorParameters
      */
     Scalar lq = 0;
 
+    /**
+     * Phase inductance in the direct axis. [henry]
+     * If not specified, the motor is assumed to be non-salient, i.e. Ld = Lq; @ref deduceMissingParameters().
+     * It can be estimated using the motor identification procedure.
+     */
+    Scalar ld = 0;
+
     /**
      * Min electric angular velocity for stable operation. [radian/second]
      * Default value is provided, so this parameter is optional.
@@ -130,19 +137,29 @@ struct MotorParameters
     }
 
 
-    void deduceMissingParameters()
+    /**
+     * This function is constexpr in order to allow the motor database to be constructed at compile time,
+     * hence the plain comparisons instead of os::float_eq.
+     */
+    constexpr void deduceMissingParameters()
     {
-        if (!os::float_eq::positive(min_current) &&
-            os::float_eq::positive(max_current))
+        if (!(min_current > 0) &&
+            (max_current > 0))
         {
             min_current = max_current * 0.02F;
         }
 
-        if (!os::float_eq::positive(spinup_current) &&
-            os::float_eq::positive(max_current))
+        if (!(spinup_current > 0) &&
+            (max_current > 0))
         {
             spinup_current = max_current * 0.85F;
         }
+
+        if (!(ld > 0) &&
+            (lq > 0))
+        {
+            ld = lq;
+        }
     }
 
     Scalar computeMinVoltage() const
@@ -178,6 +195,7 @@ struct MotorParameters
             getPhiLimits().contains(phi)             &&
             getRsLimits().contains(rs)               &&
             getLqLimits().contains(lq)               &&
+            getLqLimits().contains(ld)               &&
             is_positive(min_electrical_ang_vel)      &&
             is_positive(current_ramp_amp_per_s)      &&
             is_positive(voltage_ramp_volt_per_s);
@@ -200,7 +218,7 @@ struct MotorParameters
                                                                  num_poles);
         }
 
-        return os::heapless::String<240>(
+        return os::heapless::String<256>(
             "Npols: %u\n"
             "Imax : %-7.1f A\n"
             "Imin : %-7.1f A\n"
@@ -208,6 +226,7 @@ struct MotorParameters
             "Phi  : %-7.3f mWb, %.1f MRPM/V\n"
             "Rs   : %-7.3f Ohm\n"
             "Lq   : %-7.3f uH\n"
+            "Ld   : %-7.3f uH\n"
             "Wmin : %-7.1f rad/s, %.1f MRPM\n"
             "Iramp: %-7.1f A/s\n"
             "Vramp: %-7.1f V/s\n"
@@ -219,6 +238,7 @@ struct MotorParameters
             double(phi) * 1e3, double(kv),
             double(rs),
             double(lq) * 1e6,
+            double(ld) * 1e6,
             double(min_electrical_ang_vel), double(min_mrpm),
             double(current_ramp_amp_per_s),
             double(voltage_ramp_volt_per_s),
@@ -234,19 +254,335 @@ struct ControllerParameters
     /// If the rotor stalled this many times in a row, latch into FAULT state
     std::uint32_t num_stalls_to_latch = 100;
 
+    /// Delay before the restart after a stall, doubled with every successive stall up to the max, seconds
+    Scalar restart_delay = 0.01F;
+    Scalar max_restart_delay = 1.0F;
+
+    /// How long to observe a possibly spinning rotor at zero current before spinup, seconds; zero disables
+    Scalar catching_duration = 0.05F;
+
+    /// Speed loop proportional gain, normalized by the flux linkage, dimensionless
+    Scalar speed_kp = 0.5F;
+
+    /// Speed loop integral gain, normalized by the flux linkage, 1/second
+    Scalar speed_ki = 5.0F;
+
+    /// Time constant of the online estimator of Rs and Phi, seconds; zero disables the online estimation.
+    /// Disabled by default because the estimates drift when the operating point does not excite both parameters.
+    Scalar motor_parameter_estimation_time_constant = 0.0F;
+
+    /// Max negative Id for field weakening, as a fraction of the max phase current; zero disables field weakening
+    Scalar field_weakening_current_fraction = 0.0F;
+
+    /// The observer runs every N-th main IRQ at high steady speed; one disables the decimation
+    unsigned high_speed_observer_decimation_ratio = 2;
+
+    /// Angular velocity above which the observer is decimated, as a multiple of the min angular velocity
+    Scalar observer_decimation_velocity_ratio = 10.0F;
+
+    /// The setpoint controller and other background work run every N-th main IRQ, or at once on a new command
+    unsigned background_decimation_ratio = 2;
+
+    /// Max regenerative current of the active braking, as a fraction of the max phase current
+    Scalar braking_current_fraction = 0.5F;
+
+    /// Inverter voltage at which the regenerative current is reduced to zero; zero selects the board limit, volt
+    Scalar max_regenerative_voltage = 0.0F;
+
+    /// Modulation ratio above which the discontinuous PWM is used; zero disables discontinuous PWM
+    Scalar discontinuous_pwm_threshold = 0.0F;
+
+    /// Max voltage relative to the linear modulation limit; above one enables overmodulation, 1.25 is six-step
+    Scalar max_modulation_ratio = 1.0F;
+
+    /// Current loop gains found by the motor identification, volt/ampere and volt/(ampere*second); zero is default
+    Scalar current_loop_kp = 0.0F;
+    Scalar current_loop_ki = 0.0F;
+
+    /// Idq filters of the current loop, hertz, see idq_filter.hpp; the filter is selected at compile time
+    Scalar idq_filter_cutoff_frequency = 5000.0F;   ///< First order filter; zero makes it transparent
+    Scalar idq_notch_frequency = 0.0F;              ///< Notch filter; zero selects the Nyquist frequency
+
+
+    static math::Range<> getSpeedGainLimits()
+    {
+        return { 0.0F,
+                 1000.0F };
+    }
+
+    static math::Range<> getMaxModulationRatioLimits()
+    {
+        return { 1.0F,
+                 OvermodulationSixStepRatio };
+    }
+
+    static math::Range<> getMotorParameterEstimationTimeConstantLimits()
+    {
+        return { 0.0F,
+                 1000.0F };
+    }
+
+    static math::Range<> getCurrentLoopProportionalGainLimits()
+    {
+        return { 0.0F,
+                 1000.0F };
+    }
+
+    static math::Range<> getCurrentLoopIntegralGainLimits()
+    {
+        return { 0.0F,
+                 1e7F };
+    }
+
+    static math::Range<> getIdqFilterFrequencyLimits()
+    {
+        return { 0.0F,
+                 50000.0F };
+    }
 
     bool isValid() const
     {
         return math::Range<>(0.1F, 60.0F).contains(nominal_spinup_duration) &&
-               num_stalls_to_latch > 0;
+               num_stalls_to_latch > 0 &&
+               math::Range<>(0.0F, 10.0F).contains(restart_delay) &&
+               (restart_delay <= max_restart_delay) && (max_restart_delay <= 10.0F) &&
+               math::Range<>(0.0F, 1.0F).contains(catching_duration) &&
+               getSpeedGainLimits().contains(speed_kp) &&
+               getSpeedGainLimits().contains(speed_ki) &&
+               getMotorParameterEstimationTimeConstantLimits().contains(motor_parameter_estimation_time_constant) &&
+               math::Range<>(0.0F, 0.9F).contains(field_weakening_current_fraction) &&
+               (high_speed_observer_decimation_ratio >= 1) && (high_speed_observer_decimation_ratio <= 4) &&
+               math::Range<>(1.0F, 1000.0F).contains(observer_decimation_velocity_ratio) &&
+               (background_decimation_ratio >= 1) && (background_decimation_ratio <= 8) &&
+               math::Range<>(0.0F, 1.0F).contains(braking_current_fraction) &&
+               math::Range<>(0.0F, 100.0F).contains(max_regenerative_voltage) &&
+               math::Range<>(0.0F, 1.0F).contains(discontinuous_pwm_threshold) &&
+               getMaxModulationRatioLimits().contains(max_modulation_ratio) &&
+               getCurrentLoopProportionalGainLimits().contains(current_loop_kp) &&
+               getCurrentLoopIntegralGainLimits().contains(current_loop_ki) &&
+               getIdqFilterFrequencyLimits().contains(idq_filter_cutoff_frequency) &&
+               getIdqFilterFrequencyLimits().contains(idq_notch_frequency);
     }
 
     auto toString() const
     {
-        return os::heapless::format("Tspinup: %.1f sec\n"
-                                    "Nslatch: %u",
+        return os::heapless::String<400>("Tspinup: %.1f sec\n"
+                                    "Nslatch: %u\n"
+                                    "Trstart: %.0f...%.0f ms\n"
+                                    "Tcatch : %.0f ms\n"
+                                    "SpdKp  : %.3f\n"
+                                    "SpdKi  : %.3f 1/s\n"
+                                    "MPETau : %.1f sec\n"
+                                    "FWFrac : %.0f %%\n"
+                                    "ObsDec : %u above %.0f x Wmin\n"
+                                    "BgDec  : %u\n"
+                                    "BrkFrac: %.0f %%\n"
+                                    "RegenV : %.1f V\n"
+                                    "DPWMThr: %.2f\n"
+                                    "MaxMod : %.3f\n"
+                                    "CurKp  : %.3f V/A%s\n"
+                                    "CurKi  : %.0f V/As\n"
+                                    "IdqLPF : %.0f Hz\n"
+                                    "IdqNtch: %.0f Hz").format(
                                     double(nominal_spinup_duration),
-                                    unsigned(num_stalls_to_latch));
+                                    unsigned(num_stalls_to_latch),
+                                    double(restart_delay) * 1e3,
+                                    double(max_restart_delay) * 1e3,
+                                    double(catching_duration) * 1e3,
+                                    double(speed_kp),
+                                    double(speed_ki),
+                                    double(motor_parameter_estimation_time_constant),
+                                    double(field_weakening_current_fraction * 100.0F),
+                                    high_speed_observer_decimation_ratio,
+                                    double(observer_decimation_velocity_ratio),
+                                    background_decimation_ratio,
+                                    double(braking_current_fraction * 100.0F),
+                                    double(max_regenerative_voltage),
+                                    double(discontinuous_pwm_threshold),
+                                    double(max_modulation_ratio),
+                                    double(current_loop_kp),
+                                    (current_loop_kp > 0) ? "" : " (default)",
+                                    double(current_loop_ki),
+                                    double(idq_filter_cutoff_frequency),
+                                    double(idq_notch_frequency));
+    }
+};
+
+/**
+ * Properties of the power stage that affect the control.
+ * These can be identified by the hardware test, see @ref hw_test::Report.
+ */
+struct InverterParameters
+{
+    /**
+     * Effective dead time for the positive (sourcing) and negative (sinking) phase current. [second]
+     * This is the duty cycle lost or gained per PWM period, converted to time, which includes the switching
+     * delays of the power stage. Zero disables the compensation for the given polarity.
+     */
+    Scalar effective_dead_time_positive = 0;
+    Scalar effective_dead_time_negative = 0;
+
+    /**
+     * The compensation is blended linearly between the polarities within this band around zero current, because
+     * the polarity of the measured current is not reliable there. [ampere]
+     */
+    Scalar dead_time_compensation_transition_current = 0.5F;
+
+    /**
+     * The output voltage is normalized by the per-period sample of the inverter voltage, which compensates its ripple;
+     * otherwise a low-pass filtered value is used. See @ref InverterVoltageFeedForward.
+     */
+    bool vbus_feedforward = true;
+
+    /**
+     * Linear extrapolation horizon of the inverter voltage, in fast IRQ periods; zero disables the prediction.
+     * The output is applied during the next period, so values up to one make sense.
+     */
+    Scalar vbus_prediction_horizon = 0.5F;
+
+
+    static math::Range<> getEffectiveDeadTimeLimits()
+    {
+        return { 0.0F,
+                 5e-6F };
+    }
+
+    static math::Range<> getVbusPredictionHorizonLimits()
+    {
+        return { 0.0F,
+                 2.0F };
+    }
+
+    bool isValid() const
+    {
+        return getEffectiveDeadTimeLimits().contains(effective_dead_time_positive) &&
+               getEffectiveDeadTimeLimits().contains(effective_dead_time_negative) &&
+               math::Range<>(0.01F, 10.0F).contains(dead_time_compensation_transition_current) &&
+               getVbusPredictionHorizonLimits().contains(vbus_prediction_horizon);
+    }
+
+    auto toString() const
+    {
+        return os::heapless::format("DTpos : %.0f ns\n"
+                                    "DTneg : %.0f ns\n"
+                                    "DTItr : %.2f A\n"
+                                    "VbusFF: %s, horizon %.2f",
+                                    double(effective_dead_time_positive) * 1e9,
+                                    double(effective_dead_time_negative) * 1e9,
+                                    double(dead_time_compensation_transition_current),
+                                    vbus_feedforward ? "on" : "off",
+                                    double(vbus_prediction_horizon));
+    }
+};
+
+/**
+ * Parameters of the lumped thermal model of the inverter and the motor windings, see @ref ThermalModel.
+ * Each of the two is modeled as a single first order node heated by its losses above the temperature
+ * measured by the inverter temperature sensor.
+ */
+struct ThermalParameters
+{
+    /// Thermal resistance from the power switches to the inverter temperature sensor, kelvin/watt; zero disables
+    Scalar inverter_thermal_resistance = 0.5F;
+
+    /// Thermal time constant of the power switches relative to the sensor, seconds
+    Scalar inverter_time_constant = 2.0F;
+
+    /// Effective resistance of the switches per phase, which defines the conduction losses, ohm
+    Scalar inverter_resistance = 0.005F;
+
+    /// Switching and other losses of the inverter as a fraction of its output power
+    Scalar inverter_loss_fraction = 0.02F;
+
+    /// Thermal resistance from the windings to the ambient, kelvin/watt; zero disables the motor model
+    Scalar motor_thermal_resistance = 0.0F;
+
+    /// Thermal time constant of the windings, seconds
+    Scalar motor_time_constant = 60.0F;
+
+    /// Max temperature of the windings, kelvin
+    Scalar max_motor_temperature = math::convertCelsiusToKelvin(120.0F);
+
+    /// The limits are enforced on the temperature predicted this far ahead at the present losses, seconds
+    Scalar prediction_horizon = 5.0F;
+
+    /// The current limit is reduced linearly within this band below the max temperature; zero disables, kelvin
+    Scalar derating_band = 15.0F;
+
+
+    static math::Range<> getTimeConstantLimits()
+    {
+        return { 0.1F,
+                 3600.0F };
+    }
+
+    bool isValid() const
+    {
+        return math::Range<>(0.0F, 100.0F).contains(inverter_thermal_resistance) &&
+               getTimeConstantLimits().contains(inverter_time_constant) &&
+               math::Range<>(0.0F, 1.0F).contains(inverter_resistance) &&
+               math::Range<>(0.0F, 0.5F).contains(inverter_loss_fraction) &&
+               math::Range<>(0.0F, 100.0F).contains(motor_thermal_resistance) &&
+               getTimeConstantLimits().contains(motor_time_constant) &&
+               math::Range<>(math::convertCelsiusToKelvin(0.0F),
+                             math::convertCelsiusToKelvin(250.0F)).contains(max_motor_temperature) &&
+               math::Range<>(0.0F, 600.0F).contains(prediction_horizon) &&
+               math::Range<>(0.0F, 100.0F).contains(derating_band);
+    }
+
+    auto toString() const
+    {
+        return os::heapless::format("InvRth : %.2f K/W\n"
+                                    "InvTau : %.1f sec\n"
+                                    "InvRes : %.1f mOhm\n"
+                                    "InvLoss: %.1f %%\n"
+                                    "MotRth : %.2f K/W\n"
+                                    "MotTau : %.0f sec\n"
+                                    "MotTmax: %.0f C\n"
+                                    "Horizon: %.1f sec\n"
+                                    "Band   : %.1f K",
+                                    double(inverter_thermal_resistance),
+                                    double(inverter_time_constant),
+                                    double(inverter_resistance) * 1e3,
+                                    double(inverter_loss_fraction * 100.0F),
+                                    double(motor_thermal_resistance),
+                                    double(motor_time_constant),
+                                    double(math::convertKelvinToCelsius(max_motor_temperature)),
+                                    double(prediction_horizon),
+                                    double(derating_band));
+    }
+};
+
+/**
+ * Set of groups of parameters that differ between two instances of @ref Parameters.
+ * Allows to apply only the affected subsystems instead of restarting everything.
+ */
+struct ParameterChanges
+{
+    bool controller_gains       = false;        ///< Speed loop gains
+    bool motor_limits           = false;        ///< Current limits and ramps, number of stalls to latch, thermal
+    bool observer_noise         = false;        ///< Observer Q and R
+    bool motor_identification   = false;        ///< Used only by the motor identification task
+    bool other                  = false;        ///< Everything else, e.g. the motor model
+
+    bool any() const
+    {
+        return controller_gains || motor_limits || observer_noise || motor_identification || other;
+    }
+
+    /**
+     * True if the running motor can pick up the changes without being stopped.
+     */
+    bool canBeAppliedAtRunTime() const { return !other; }
+
+    auto toString() const
+    {
+        return os::heapless::format("%s%s%s%s%s",
+                                    controller_gains     ? "gains " : "",
+                                    motor_limits         ? "limits " : "",
+                                    observer_noise       ? "observer " : "",
+                                    motor_identification ? "motor_id " : "",
+                                    other                ? "other" : "");
     }
 };
 
@@ -258,7 +594,9 @@ struct ControllerParameters
 struct Parameters
 {
     ControllerParameters controller;
+    InverterParameters inverter;
     MotorParameters motor;
+    ThermalParameters thermal;
     motor_id::Parameters motor_id;
     observer::Parameters observer;
 
@@ -266,28 +604,123 @@ struct Parameters
     bool isValid() const
     {
         return controller.isValid() &&
+               inverter.isValid()   &&
                motor.isValid()      &&
+               thermal.isValid()    &&
                motor_id.isValid()   &&
                observer.isValid();
     }
 
-    auto toString() const
+    /**
+     * Tells which groups of parameters of this instance differ from the other one.
+     * Every field must be listed here, otherwise its changes will go unnoticed.
+     */
+    ParameterChanges findChanges(const Parameters& other) const
     {
-        static const auto append = [](auto& s, const char* name, const auto& src)
+        // Comparison operators are not used in order to keep -Wfloat-equal happy
+        static const auto differ = [](Const a, Const b) { return (a < b) || (a > b); };
+        static const auto differ_diagonal = [](const auto& a, const auto& b)
         {
-            s.concatenate(name, ":\n", src.toString(), "\n--\n");
+            for (int i = 0; i < a.diagonal().size(); i++)
+            {
+                if (differ(a.diagonal()[i], b.diagonal()[i]))
+                {
+                    return true;
+                }
+            }
+            return false;
         };
 
-        os::heapless::String<400> s;
-
-        append(s, "Controller", controller);
-        append(s, "Motor",      motor);
-        append(s, "Motor ID",   motor_id);
-        append(s, "Observer",   observer);
-
-        s.concatenate("Valid: ", isValid() ? "YES" : "NO");
+        ParameterChanges out;
+
+        out.controller_gains =
+            differ(controller.speed_kp, other.controller.speed_kp) ||
+            differ(controller.speed_ki, other.controller.speed_ki);
+
+        out.motor_limits =
+            (controller.num_stalls_to_latch != other.controller.num_stalls_to_latch) ||
+            differ(controller.restart_delay, other.controller.restart_delay) ||
+            differ(controller.max_restart_delay, other.controller.max_restart_delay) ||
+            differ(controller.braking_current_fraction, other.controller.braking_current_fraction) ||
+            (controller.background_decimation_ratio != other.controller.background_decimation_ratio) ||
+            differ(controller.max_regenerative_voltage, other.controller.max_regenerative_voltage) ||
+            differ(motor.max_current, other.motor.max_current) ||
+            differ(motor.min_current, other.motor.min_current) ||
+            differ(motor.current_ramp_amp_per_s, other.motor.current_ramp_amp_per_s) ||
+            differ(motor.voltage_ramp_volt_per_s, other.motor.voltage_ramp_volt_per_s) ||
+            differ(thermal.inverter_thermal_resistance, other.thermal.inverter_thermal_resistance) ||
+            differ(thermal.inverter_time_constant, other.thermal.inverter_time_constant) ||
+            differ(thermal.inverter_resistance, other.thermal.inverter_resistance) ||
+            differ(thermal.inverter_loss_fraction, other.thermal.inverter_loss_fraction) ||
+            differ(thermal.motor_thermal_resistance, other.thermal.motor_thermal_resistance) ||
+            differ(thermal.motor_time_constant, other.thermal.motor_time_constant) ||
+            differ(thermal.max_motor_temperature, other.thermal.max_motor_temperature) ||
+            differ(thermal.prediction_horizon, other.thermal.prediction_horizon) ||
+            differ(thermal.derating_band, other.thermal.derating_band);
+
+        out.observer_noise =
+            differ_diagonal(observer.Q, other.observer.Q) ||
+            differ_diagonal(observer.R, other.observer.R);
+
+        out.motor_identification =
+            differ(motor_id.fraction_of_max_current, other.motor_id.fraction_of_max_current) ||
+            differ(motor_id.current_injection_frequency, other.motor_id.current_injection_frequency) ||
+            differ(motor_id.phi_estimation_electrical_angular_velocity,
+                   other.motor_id.phi_estimation_electrical_angular_velocity) ||
+            differ(motor_id.convergence_tolerance, other.motor_id.convergence_tolerance) ||
+            differ(motor_id.current_loop_phase_margin, other.motor_id.current_loop_phase_margin);
+
+        out.other =
+            differ(controller.nominal_spinup_duration, other.controller.nominal_spinup_duration) ||
+            differ(controller.catching_duration, other.controller.catching_duration) ||
+            differ(controller.motor_parameter_estimation_time_constant,
+                   other.controller.motor_parameter_estimation_time_constant) ||
+            differ(controller.field_weakening_current_fraction, other.controller.field_weakening_current_fraction) ||
+            differ(controller.discontinuous_pwm_threshold, other.controller.discontinuous_pwm_threshold) ||
+            differ(controller.max_modulation_ratio, other.controller.max_modulation_ratio) ||
+            differ(controller.current_loop_kp, other.controller.current_loop_kp) ||
+            differ(controller.current_loop_ki, other.controller.current_loop_ki) ||
+            differ(controller.idq_filter_cutoff_frequency, other.controller.idq_filter_cutoff_frequency) ||
+            differ(controller.idq_notch_frequency, other.controller.idq_notch_frequency) ||
+            (controller.high_speed_observer_decimation_ratio != other.controller.high_speed_observer_decimation_ratio) ||
+            differ(controller.observer_decimation_velocity_ratio, other.controller.observer_decimation_velocity_ratio) ||
+            differ(inverter.effective_dead_time_positive, other.inverter.effective_dead_time_positive) ||
+            differ(inverter.effective_dead_time_negative, other.inverter.effective_dead_time_negative) ||
+            differ(inverter.dead_time_compensation_transition_current,
+                   other.inverter.dead_time_compensation_transition_current) ||
+            (inverter.vbus_feedforward != other.inverter.vbus_feedforward) ||
+            differ(inverter.vbus_prediction_horizon, other.inverter.vbus_prediction_horizon) ||
+            (motor.num_poles != other.motor.num_poles) ||
+            differ(motor.spinup_current, other.motor.spinup_current) ||
+            differ(motor.phi, other.motor.phi) ||
+            differ(motor.rs, other.motor.rs) ||
+            differ(motor.lq, other.motor.lq) ||
+            differ(motor.ld, other.motor.ld) ||
+            differ(motor.min_electrical_ang_vel, other.motor.min_electrical_ang_vel) ||
+            differ_diagonal(observer.P0, other.observer.P0) ||
+            differ(observer.cross_coupling_compensation, other.observer.cross_coupling_compensation) ||
+            (observer.flux_observer_at_cruise != other.observer.flux_observer_at_cruise) ||
+            differ(observer.flux_observer_gain, other.observer.flux_observer_gain) ||
+            differ(observer.flux_observer_pll_bandwidth, other.observer.flux_observer_pll_bandwidth);
+
+        return out;
+    }
 
-        return s;
+    /**
+     * Invokes the printer with the name and the string representation of each group in turn.
+     * The groups are not concatenated, because a buffer large enough for all of them would not fit in the stack
+     * of the CLI thread.
+     */
+    template <typename Printer>
+    void print(Printer printer) const
+    {
+        printer("Controller", controller.toString().c_str());
+        printer("Inverter",   inverter.toString().c_str());
+        printer("Motor",      motor.toString().c_str());
+        printer("Thermal",    thermal.toString().c_str());
+        printer("Motor ID",   motor_id.toString().c_str());
+        printer("Observer",   observer.toString().c_str());
+        printer("Valid",      isValid() ? "YES" : "NO");
     }
 };
 
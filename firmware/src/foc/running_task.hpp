@@ -26,7 +26,11 @@
 
 #include "task.hpp"
 #include "motor_runner.hpp"
+#include "seqlock.hpp"
+#include "latency_benchmark.hpp"
+#include "blackbox.hpp"
 #include <zubax_chibios/util/helpers.hpp>
+#include <limits>
 
 
 namespace foc
@@ -54,6 +58,122 @@ static_assert(FirstRatiometricControlMode < LastRatiometricControlMode,
               "Ford, you're turning into a penguin. Stop it.");
 
 
+/**
+ * Speed PI controller that runs in the main IRQ on top of the observer's angular velocity estimate.
+ * The output is the Uq reference voltage, the back EMF of the reference angular velocity is fed forward:
+ *
+ *      Uq = phi * (Wref + Kp * e + Ki * integral(e))
+ *
+ * Thus the gains are normalized by the flux linkage and are dimensionless (Ki is in 1/second),
+ * so that the same values fit most motors.
+ * The output is constrained by the inverter voltage and by the maximum phase current; the integrator stops
+ * when the output is saturated (conditional integration anti-windup).
+ * All angular velocities are electrical.
+ */
+class SpeedController
+{
+    Const phi_;
+    Const rs_;
+    Scalar max_current_;
+    Scalar kp_;
+    Scalar ki_;
+
+    Scalar reference_angular_velocity_ = 0;
+    Scalar integrator_ = 0;
+    bool active_ = false;
+
+public:
+    SpeedController(Const phi,
+                    Const rs,
+                    Const max_current,
+                    Const kp,
+                    Const ki) :
+        phi_(phi),
+        rs_(rs),
+        max_current_(max_current),
+        kp_(kp),
+        ki_(ki)
+    {
+        assert(phi_ > 0);
+    }
+
+    /**
+     * The next update will be bumpless, i.e. it will start from the current state of the motor.
+     */
+    void reset() { active_ = false; }
+
+    /**
+     * Retunes the controller on the fly; the integrator is kept, so the output stays continuous.
+     */
+    void setLimitsAndGains(Const max_current,
+                           Const kp,
+                           Const ki)
+    {
+        max_current_ = max_current;
+        kp_ = kp;
+        ki_ = ki;
+    }
+
+    void setMaxCurrent(Const max_current) { max_current_ = max_current; }
+
+    /**
+     * @param period                    Update interval in seconds
+     * @param target_angular_velocity   Target angular velocity, the reference will be ramped towards it
+     * @param angular_acceleration      Ramp of the reference angular velocity, radian/second^2
+     * @param angular_velocity          Estimated angular velocity
+     * @param reference_voltage         Current Uq reference; used to initialize the integrator
+     * @param max_voltage               Maximum achievable axis voltage
+     * @param max_regen_current         Limit of the current that opposes the rotation, at most the max current
+     * @return                          New Uq reference
+     */
+    Scalar update(Const period,
+                  Const target_angular_velocity,
+                  Const angular_acceleration,
+                  Const angular_velocity,
+                  Const reference_voltage,
+                  Const max_voltage,
+                  Const max_regen_current)
+    {
+        if (!active_)
+        {
+            active_ = true;
+            reference_angular_velocity_ = angular_velocity;
+            integrator_ = reference_voltage / phi_ - angular_velocity;
+        }
+
+        // Not using math::Range here because the bounds may coincide, e.g. when the acceleration is zero
+        Const max_step = angular_acceleration * period;
+        reference_angular_velocity_ +=
+            std::max(-max_step, std::min(max_step, target_angular_velocity - reference_angular_velocity_));
+
+        Const error = reference_angular_velocity_ - angular_velocity;
+
+        Const output = phi_ * (reference_angular_velocity_ + kp_ * error + integrator_);
+
+        /*
+         * Current limiting: in a steady state the phase current is defined by the difference between
+         * the applied voltage and the back EMF, so we keep the voltage within Rs * Imax from the back EMF.
+         * The current that opposes the rotation is regenerative, it has a separate limit.
+         */
+        Const back_emf = phi_ * angular_velocity;
+        Const regen_current = std::min(max_current_, max_regen_current);
+        Const forward_current = (angular_velocity >= 0) ? max_current_ : regen_current;
+        Const reverse_current = (angular_velocity >= 0) ? regen_current : max_current_;
+        Const upper = std::min(max_voltage, back_emf + rs_ * forward_current);
+        Const lower = std::min(upper, std::max(-max_voltage, back_emf - rs_ * reverse_current));
+
+        const bool saturated_high = (output >= upper) && (error > 0);
+        const bool saturated_low  = (output <= lower) && (error < 0);
+
+        if (!saturated_high && !saturated_low)
+        {
+            integrator_ += ki_ * error * period;
+        }
+
+        return std::max(lower, std::min(upper, output));         // The bounds may coincide, see above
+    }
+};
+
 /**
  * This class encapsulates the transfer function from the input setpoint value in different units
  * (where units are encoded using @ref ControlMode) to the Iq reference current setpoint.
@@ -62,25 +182,67 @@ static_assert(FirstRatiometricControlMode < LastRatiometricControlMode,
  */
 class SetpointController
 {
-    Const max_current_;
-    Const min_current_;
+    Scalar max_current_;
+    Scalar min_current_;
     Const min_voltage_;
-    Const current_ramp_amp_s_;
-    Const voltage_ramp_volt_s_;
+    Scalar current_ramp_amp_s_;
+    Scalar voltage_ramp_volt_s_;
+    Const phi_;
+    Const rs_;
+    const unsigned num_poles_;
+    Scalar current_derating_factor_ = 1.0F;
+
+    SpeedController speed_controller_;
+
+    /// The thermal derating never goes below the min current, stopping the motor is up to the protection
+    Scalar computeMaxCurrent() const
+    {
+        return std::max(min_current_, max_current_ * current_derating_factor_);
+    }
 
 public:
-    SetpointController(Const max_current,
-                       Const min_current,
-                       Const min_voltage,
-                       Const current_ramp_amp_s,
-                       Const voltage_ramp_volt_s) :
-        max_current_(max_current),
-        min_current_(min_current),
-        min_voltage_(min_voltage),
-        current_ramp_amp_s_(current_ramp_amp_s),
-        voltage_ramp_volt_s_(voltage_ramp_volt_s)
+    SetpointController(const MotorParameters& motor_params,
+                       const ControllerParameters& controller_params) :
+        max_current_(motor_params.max_current),
+        min_current_(motor_params.min_current),
+        min_voltage_(motor_params.computeMinVoltage()),
+        current_ramp_amp_s_(motor_params.current_ramp_amp_per_s),
+        voltage_ramp_volt_s_(motor_params.voltage_ramp_volt_per_s),
+        phi_(motor_params.phi),
+        rs_(motor_params.rs),
+        num_poles_(motor_params.num_poles),
+        speed_controller_(motor_params.phi,
+                          motor_params.rs,
+                          motor_params.max_current,
+                          controller_params.speed_kp,
+                          controller_params.speed_ki)
     { }
 
+    /**
+     * Applies the parameters that are safe to change while the motor is running, see @ref ParameterChanges.
+     */
+    void setLimitsAndGains(const MotorParameters& motor_params,
+                           const ControllerParameters& controller_params)
+    {
+        max_current_         = motor_params.max_current;
+        min_current_         = motor_params.min_current;
+        current_ramp_amp_s_  = motor_params.current_ramp_amp_per_s;
+        voltage_ramp_volt_s_ = motor_params.voltage_ramp_volt_per_s;
+
+        speed_controller_.setLimitsAndGains(computeMaxCurrent(),
+                                            controller_params.speed_kp,
+                                            controller_params.speed_ki);
+    }
+
+    /**
+     * Scales the max current, see @ref ThermalModel. Applies to the current and speed control modes.
+     */
+    void setCurrentDeratingFactor(Const factor)
+    {
+        current_derating_factor_ = math::Range<>(0.0F, 1.0F).constrain(factor);
+        speed_controller_.setMaxCurrent(computeMaxCurrent());
+    }
+
     /**
      * Discrete transfer function from input setpoint to current/voltage setpoint.
      *
@@ -90,6 +252,8 @@ public:
      * @param reference                         Iq reference current or Uq reference voltage, depending on the mode
      * @param max_voltage                       Maximum achievable axis voltage
      * @param electrical_angular_velocity       Electrical angular velocity of the rotor in radian/second
+     * @param active_braking                    Decelerate with the regenerative current instead of coasting
+     * @param max_regen_current                 Limit of the regenerative current, e.g. reduced at high Vbus
      * @return                                  New Iq/Uq reference, depending on the mode
      */
     Scalar update(Const period,
@@ -97,9 +261,19 @@ public:
                   const ControlMode control_mode,
                   Const reference,
                   Const max_voltage,
-                  Const electrical_angular_velocity) const
+                  Const electrical_angular_velocity,
+                  const bool active_braking,
+                  Const max_regen_current)
     {
         const bool zero_setpoint = os::float_eq::closeToZero(target_setpoint);
+        const bool forward_rotation = electrical_angular_velocity >= 0;
+        Const max_current = computeMaxCurrent();
+
+        if ((control_mode != ControlMode::RatiometricMRPM) &&
+            (control_mode != ControlMode::MRPM))
+        {
+            speed_controller_.reset();
+        }
 
         switch (control_mode)
         {
@@ -112,7 +286,13 @@ public:
             {
                 new_current *= max_current_;
             }
-            new_current = math::Range<>(-max_current_, max_current_).constrain(new_current);
+            new_current = math::Range<>(-max_current, max_current).constrain(new_current);
+
+            // Active braking: the current opposes the rotation until the rotor has stopped, see MotorRunner
+            if (active_braking && zero_setpoint)
+            {
+                new_current = std::min(max_current, max_regen_current) * (forward_rotation ? -1.0F : 1.0F);
+            }
 
             // Applying the ramp
             if (new_current > reference)
@@ -137,10 +317,38 @@ public:
         case ControlMode::RatiometricMRPM:
         case ControlMode::MRPM:
         {
-            (void) electrical_angular_velocity;
-            assert(false);              // TODO: Implement
-            return 0;
-            break;
+            if (zero_setpoint)
+            {
+                // Ramping the voltage down as in the voltage control mode, which also takes care of active braking
+                speed_controller_.reset();
+                return update(period, 0, ControlMode::Voltage, reference, max_voltage, electrical_angular_velocity,
+                              active_braking, max_regen_current);
+            }
+
+            Scalar target_angular_velocity = 0;
+            if (control_mode == ControlMode::RatiometricMRPM)
+            {
+                // Relative to the maximum angular velocity achievable with no load
+                target_angular_velocity = target_setpoint * (max_voltage / phi_);
+            }
+            else
+            {
+                target_angular_velocity =
+                    convertRotationRateMechanicalToElectrical(convertRPMToAngularVelocity(target_setpoint),
+                                                              num_poles_);
+            }
+
+            // The voltage ramp defines the maximum angular acceleration of the reference, unless braking actively
+            const bool decelerating = forward_rotation ? (target_angular_velocity < electrical_angular_velocity) :
+                                                         (target_angular_velocity > electrical_angular_velocity);
+            return speed_controller_.update(period,
+                                            target_angular_velocity,
+                                            (active_braking && decelerating) ? std::numeric_limits<Scalar>::max() :
+                                                                               voltage_ramp_volt_s_ / phi_,
+                                            electrical_angular_velocity,
+                                            reference,
+                                            max_voltage,
+                                            active_braking ? max_regen_current : max_current);
         }
 
         case ControlMode::RatiometricVoltage:
@@ -154,8 +362,22 @@ public:
             }
             new_voltage = math::Range<>(-max_voltage, max_voltage).constrain(new_voltage);
 
+            const bool decelerating = forward_rotation ? (new_voltage < reference) : (new_voltage > reference);
+
             // Applying the ramp
-            if (new_voltage > reference)
+            if (active_braking && decelerating)
+            {
+                /*
+                 * Active braking: skipping the ramp, keeping the voltage within Rs * Iregen from the back EMF,
+                 * same as the speed controller does. The limit is enforced also if the reference exceeds it.
+                 */
+                Const braking_voltage = phi_ * electrical_angular_velocity +
+                                        rs_ * std::min(max_current, max_regen_current) *
+                                        (forward_rotation ? -1.0F : 1.0F);
+                new_voltage = forward_rotation ? std::max(new_voltage, braking_voltage) :
+                                                 std::min(new_voltage, braking_voltage);
+            }
+            else if (new_voltage > reference)
             {
                 new_voltage = reference + voltage_ramp_volt_s_ * period;
             }
@@ -184,6 +406,63 @@ public:
     }
 };
 
+/**
+ * Lock-free single-producer mailbox for setpoint commands, polled by the running task from the main IRQ.
+ * Only the latest command is kept, older unconsumed commands are overwritten, which is the right thing to do
+ * with setpoints. The producer never blocks the IRQs.
+ */
+class SetpointMailbox
+{
+public:
+    struct Command
+    {
+        ControlMode control_mode = ControlMode(0);
+        Scalar value = 0;
+        Scalar ttl = 0;
+        bool active_braking = false;
+        std::uint32_t sequence = 0;             ///< Incremented with every new command
+        std::uint32_t posted_at = 0;            ///< Cycle counter value, used to measure the delivery latency
+        std::uint32_t received_at = 0;          ///< Cycle counter value at the reception, zero if unknown
+    };
+
+private:
+    DoubleBuffer<Command> buffer_;
+    std::uint32_t sequence_ = 0;
+
+public:
+    SetpointMailbox() { }
+
+    /// The tasks keep references to the mailbox, a copy would be a bug
+    SetpointMailbox(const SetpointMailbox&) = delete;
+    SetpointMailbox& operator=(const SetpointMailbox&) = delete;
+
+    /**
+     * Must be invoked from the same thread at all times.
+     */
+    void post(ControlMode control_mode,
+              Const value,
+              Const ttl,
+              const bool active_braking,
+              const std::uint32_t received_at)
+    {
+        Command cmd;
+        cmd.control_mode = control_mode;
+        cmd.value = value;
+        cmd.ttl = ttl;
+        cmd.active_braking = active_braking;
+        cmd.sequence = ++sequence_;
+        cmd.posted_at = board::irq_profiler::getCycleCount();
+        cmd.received_at = received_at;
+        buffer_.write(cmd);
+    }
+
+    /**
+     * Returns the latest command; it is new if its sequence number differs from the previously seen one.
+     * Must be invoked from the IRQ context.
+     */
+    Command peek() const { return buffer_.read(); }
+};
+
 /**
  * Main motor control logic.
  */
@@ -191,24 +470,39 @@ class RunningTask : public ITask
 {
     static constexpr Result::ExitCode ExitCodeTooManyStalls = 1;
 
-    const TaskContext context_;
+    /// The regenerative current is reduced linearly to zero within this band below the voltage limit, volt
+    static constexpr Scalar RegenerativeVoltageBand = 2.0F;
 
-    const SetpointController setpoint_controller_;
+    const TaskContext* context_;        ///< Kept alive by the task handler, may be replaced on the fly
+
+    const SetpointMailbox& mailbox_;
+    std::uint32_t last_mailbox_sequence_;
+
+    SetpointController setpoint_controller_;
     os::helpers::LazyConstructor<MotorRunner, os::helpers::MemoryInitializationPolicy::NoInit> runner_;
 
     std::uint32_t num_successive_stalls_ = 0;
+    std::uint32_t num_restarts_ = 0;
+    Scalar remaining_time_before_restart_ = 0;
+    Scalar restart_angular_velocity_hint_ = 0;
+
+    unsigned observer_decimation_ratio_ = 1;
+
+    unsigned background_counter_ = 0;
+    Scalar background_period_accumulator_ = 0;
 
     ControlMode requested_control_mode_ = ControlMode(0);
     Scalar raw_setpoint_ = 0;
     Scalar remaining_setpoint_timeout_ = 0;
+    bool active_braking_ = false;
 
     struct LowPassFilteredValues
     {
         static constexpr Scalar InnovationWeight = 0.05F;
 
-        static void update(Scalar& value, const Scalar& new_value)
+        static void update(Scalar& value, const Scalar& new_value, const Scalar& weight)
         {
-            value += InnovationWeight * (new_value - value);
+            value += weight * (new_value - value);
         }
 
         Scalar inverter_power = 0;
@@ -216,12 +510,15 @@ class RunningTask : public ITask
     } low_pass_filtered_values_;
 
 
-    MotorRunner::Setpoint computeSetpoint(Const period, const board::motor::Status& hw_status) const
+    MotorRunner::Setpoint computeSetpoint(Const period, const board::motor::Status& hw_status)
     {
         MotorRunner::Setpoint new_sp;
 
+        // The speed controller outputs the voltage
         if (requested_control_mode_ == ControlMode::RatiometricVoltage ||
-            requested_control_mode_ == ControlMode::Voltage)
+            requested_control_mode_ == ControlMode::Voltage ||
+            requested_control_mode_ == ControlMode::RatiometricMRPM ||
+            requested_control_mode_ == ControlMode::MRPM)
         {
             new_sp.mode = MotorRunner::Setpoint::Mode::Uq;
         }
@@ -245,66 +542,176 @@ class RunningTask : public ITask
             }
         }
 
-        const auto max_voltage = computeLineVoltageLimit(hw_status.inverter_voltage, context_.board.pwm.upper_limit);
+        const auto max_voltage = computeLineVoltageLimit(hw_status.inverter_voltage, context_->board.pwm.upper_limit);
 
         new_sp.value = setpoint_controller_.update(period,
                                                    raw_setpoint_,
                                                    requested_control_mode_,
                                                    old_sp.value,
                                                    max_voltage,
-                                                   runner_->getElectricalAngularVelocity());
+                                                   runner_->getElectricalAngularVelocity(),
+                                                   active_braking_,
+                                                   computeRegenerativeCurrentLimit(hw_status.inverter_voltage));
         return new_sp;
     }
 
+    /**
+     * The energy recovered by braking charges the DC link capacitors, so the regenerative current is reduced
+     * as the inverter voltage approaches the limit, protecting the power stage if the source cannot sink the power.
+     */
+    Scalar computeRegenerativeCurrentLimit(Const inverter_voltage) const
+    {
+        const auto& ctl = context_->params.controller;
+
+        Const voltage_limit = (ctl.max_regenerative_voltage > 0) ?
+                              ctl.max_regenerative_voltage :
+                              context_->board.limits.safe_operating_area.inverter_voltage.max;
+
+        Const headroom = math::Range<>(0.0F, 1.0F).constrain((voltage_limit - inverter_voltage) /
+                                                             RegenerativeVoltageBand);
+
+        return context_->params.motor.max_current * ctl.braking_current_fraction * headroom;
+    }
+
+    /**
+     * Exponential backoff: the configured delay is doubled with every successive stall, up to the configured max.
+     * No delay if the stall counter has been reset, e.g. because the direction of rotation was flipped.
+     */
+    Scalar computeRestartDelay() const
+    {
+        if (num_successive_stalls_ == 0)
+        {
+            return 0.0F;
+        }
+
+        const auto& params = context_->params.controller;
+
+        Scalar delay = params.restart_delay;
+        for (std::uint32_t i = 1; (i < num_successive_stalls_) && (delay < params.max_restart_delay); i++)
+        {
+            delay *= 2.0F;
+        }
+
+        return std::min(delay, params.max_restart_delay);
+    }
+
 public:
     RunningTask(const TaskContext& context,
+                const SetpointMailbox& mailbox,
                 ControlMode control_mode,
                 Const initial_setpoint,
-                Const initial_setpoint_ttl) :
-        context_(context),
-        setpoint_controller_(context_.params.motor.max_current,
-                             context_.params.motor.min_current,
-                             context_.params.motor.computeMinVoltage(),
-                             context_.params.motor.current_ramp_amp_per_s,
-                             context_.params.motor.voltage_ramp_volt_per_s)
+                Const initial_setpoint_ttl,
+                const bool active_braking) :
+        context_(&context),
+        mailbox_(mailbox),
+        last_mailbox_sequence_(mailbox.peek().sequence),     // Commands posted before we started are stale
+        setpoint_controller_(context.params.motor,
+                             context.params.controller)
     {
-        assert(context_.params.isValid());
+        assert(context_->params.isValid());
 
-        setSetpoint(control_mode, initial_setpoint, initial_setpoint_ttl);
+        setSetpoint(control_mode, initial_setpoint, initial_setpoint_ttl, active_braking);
     }
 
     const char* getName() const override { return "running"; }
 
     void setSetpoint(ControlMode control_mode,
                      Const value,
-                     Const request_ttl)
+                     Const request_ttl,
+                     const bool active_braking)
     {
         AbsoluteCriticalSectionLocker locker;
         requested_control_mode_     = control_mode;
         raw_setpoint_               = value;
         remaining_setpoint_timeout_ = request_ttl;
+        active_braking_             = active_braking;
     }
 
+    BOARD_RAM_INLINE_FUNCTION
     Result onMainIRQ(Const period, const board::motor::Status& hw_status) override
     {
+        /*
+         * Picking up the new command from the mailbox, if any.
+         * The fields may also be updated by setSetpoint() from a thread, but it always holds the critical section.
+         */
+        std::uint32_t command_received_at = 0;
+        bool new_command = false;
+        {
+            const auto cmd = mailbox_.peek();
+            if (cmd.sequence != last_mailbox_sequence_)
+            {
+                new_command                 = true;
+                command_received_at         = cmd.received_at;
+                last_mailbox_sequence_      = cmd.sequence;
+                requested_control_mode_     = cmd.control_mode;
+                raw_setpoint_               = cmd.value;
+                remaining_setpoint_timeout_ = cmd.ttl;
+                active_braking_             = cmd.active_braking;
+
+                board::irq_profiler::registerInterval(board::irq_profiler::Stage::Command, cmd.posted_at);
+            }
+        }
+
+        {
+            AbsoluteCriticalSectionLocker locker;
+
+            remaining_setpoint_timeout_ -= period;
+            if (remaining_setpoint_timeout_ < 0)
+            {
+                remaining_setpoint_timeout_ = 0;
+                raw_setpoint_ = 0;
+            }
+        }
+
+        if (remaining_time_before_restart_ > 0)
+        {
+            // Backing off after a stall; the PWM outputs stay disabled because the runner is not constructed
+            remaining_time_before_restart_ -= period;
+            return os::float_eq::closeToZero(raw_setpoint_) ? Result::success() : Result::inProgress();
+        }
+
         if (!runner_.isConstructed())
         {
             AbsoluteCriticalSectionLocker locker;
-            runner_.construct(context_.params.controller,
-                              context_.params.motor,
-                              context_.params.observer,
-                              context_.board.pwm,
-                              (raw_setpoint_ > 0) ? MotorRunner::Direction::Forward : MotorRunner::Direction::Reverse);
+            runner_.construct(context_->params.controller,
+                              context_->params.motor,
+                              context_->params.observer,
+                              context_->params.inverter,
+                              context_->board.pwm,
+                              (raw_setpoint_ > 0) ? MotorRunner::Direction::Forward : MotorRunner::Direction::Reverse,
+                              restart_angular_velocity_hint_);
+            restart_angular_velocity_hint_ = 0;
         }
 
         AbsoluteCriticalSectionLocker::assertNotLocked();
-        runner_->updateStateEstimation(period, hw_status);
+        runner_->setObserverDecimationRatio(observer_decimation_ratio_);
+        const bool observer_updated = runner_->updateStateEstimation(period, hw_status);
+
+        /*
+         * The background work runs at a lower rate, except that new commands are applied at once.
+         * While the observer is decimated, the background work is moved to the periods where the observer is
+         * skipped, so that the worst case execution time of the main IRQ is reduced as well.
+         */
+        background_period_accumulator_ += period;
+        background_counter_++;
+        const bool background_due =
+            new_command ||
+            ((background_counter_ >= context_->params.controller.background_decimation_ratio) &&
+             !(observer_updated && (runner_->getObserverDecimationRatio() > 1)));
+
+        Const background_period = background_period_accumulator_;
+        if (background_due)
+        {
+            background_counter_ = 0;
+            background_period_accumulator_ = 0;
+        }
 
         {
             AbsoluteCriticalSectionLocker locker;
 
             switch (runner_->getState())
             {
+            case MotorRunner::State::Catching:
             case MotorRunner::State::Spinup:
             {
                 /*
@@ -317,7 +724,12 @@ public:
 
             case MotorRunner::State::Running:
             {
-                runner_->setSetpoint(computeSetpoint(period, hw_status));
+                if (background_due)
+                {
+                    board::irq_profiler::ScopedStageMeasurer<board::irq_profiler::Stage::Setpoint> measurer;
+                    runner_->setSetpoint(computeSetpoint(background_period, hw_status));
+                    latency_benchmark::onCommandApplied(command_received_at);
+                }
                 break;
             }
 
@@ -325,6 +737,7 @@ public:
             {
                 runner_.destroy();
                 num_successive_stalls_ = 0;
+                restart_angular_velocity_hint_ = 0;
                 if (os::float_eq::closeToZero(raw_setpoint_))
                 {
                     return Result::success();
@@ -334,8 +747,13 @@ public:
 
             case MotorRunner::State::Stalled:
             {
+                blackbox::trigger(blackbox::TriggerReason::Stall);
+
                 const auto direction = runner_->getDirection();
 
+                // The rotor may be still spinning, e.g. if the observer lost track, so this helps to catch it
+                restart_angular_velocity_hint_ = runner_->getLastGoodElectricalAngularVelocity();
+
                 runner_.destroy();
 
                 if (((direction == MotorRunner::Direction::Forward) && (raw_setpoint_ < 0)) ||
@@ -348,7 +766,7 @@ public:
                     num_successive_stalls_++;
                 }
 
-                if (num_successive_stalls_ > context_.params.controller.num_stalls_to_latch)
+                if (num_successive_stalls_ > context_->params.controller.num_stalls_to_latch)
                 {
                     return Result::failure(ExitCodeTooManyStalls);
                 }
@@ -358,38 +776,35 @@ public:
                 }
                 else
                 {
-                    ;   // No change, keep running
+                    // Restarting in place, no recalibration; the runner is reconstructed once the delay expires
+                    remaining_time_before_restart_ = computeRestartDelay();
+                    num_restarts_++;
                 }
                 break;
             }
             }
         }
 
-        {
-            AbsoluteCriticalSectionLocker locker;
-
-            remaining_setpoint_timeout_ -= period;
-            if (remaining_setpoint_timeout_ < 0)
-            {
-                remaining_setpoint_timeout_ = 0;
-                raw_setpoint_ = 0;
-            }
-        }
-
         AbsoluteCriticalSectionLocker::assertNotLocked();
 
-        if (runner_.isConstructed())
+        if (runner_.isConstructed() && background_due)
         {
+            // The weight is scaled so that the time constant does not depend on the update rate
+            Const weight = std::min(1.0F, LowPassFilteredValues::InnovationWeight * (background_period / period));
+
             LowPassFilteredValues::update(low_pass_filtered_values_.inverter_power,
-                                          runner_->computeInverterPower());
+                                          runner_->computeInverterPower(),
+                                          weight);
 
             LowPassFilteredValues::update(low_pass_filtered_values_.demand_factor,
-                                          std::abs(runner_->getIdq()[1]) / context_.params.motor.max_current);
+                                          std::abs(runner_->getIdq()[1]) / context_->params.motor.max_current,
+                                          weight);
         }
 
         return Result::inProgress();
     }
 
+    BOARD_RAM_INLINE_FUNCTION
     std::pair<Vector<3>, bool> onNextPWMPeriod(const Vector<2>& phase_currents_ab,
                                                Const inverter_voltage) override
     {
@@ -406,27 +821,87 @@ public:
         }
     }
 
-    std::array<Scalar, NumDebugVariables> getDebugVariables() const override
+    /**
+     * Tuning changes are applied on the fly. Changes of the motor model and such are deferred until the next start.
+     * The motor runner keeps its own copy of the limits it was constructed with for the current controllers and
+     * the spinup; those are updated when the runner is restarted.
+     */
+    bool updateContext(const TaskContext& new_context) override
     {
-        std::array<Scalar, NumDebugVariables> out{};
+        const auto changes = new_context.params.findChanges(context_->params);
+        if (!changes.canBeAppliedAtRunTime() ||
+            !new_context.params.isValid())
+        {
+            return false;
+        }
 
+        if (changes.controller_gains || changes.motor_limits)
         {
-            AbsoluteCriticalSectionLocker locker;
-            if (runner_.isConstructed())
-            {
-                const auto vals = runner_->getDebugVariables();
-                std::copy(vals.begin(), vals.end(), out.begin());
-            }
+            setpoint_controller_.setLimitsAndGains(new_context.params.motor,
+                                                   new_context.params.controller);
+        }
+
+        if (changes.observer_noise && runner_.isConstructed())
+        {
+            runner_->setObserverParameters(new_context.params.observer);
+        }
+
+        context_ = &new_context;
+        return true;
+    }
+
+    DebugVariables getDebugVariables() const override
+    {
+        static_assert(MotorRunner::NumDebugVariables <= MaxDebugVariables, "Too many debug variables");
+
+        DebugVariables out{};
+
+        if (runner_.isConstructed())
+        {
+            const auto vals = runner_->getDebugVariables();
+            std::copy(vals.begin(), vals.end(), out.begin());
         }
 
-        // TODO: Return Dmitry's formula back
         return out;
     }
 
+    static DebugVariableNames getDebugVariableNames()
+    {
+        DebugVariableNames out{};
+        const auto names = MotorRunner::getDebugVariableNames();
+        std::copy(names.begin(), names.end(), out.begin());
+        return out;
+    }
+
+    /**
+     * Used to shed the load of the main IRQ, see @ref MotorRunner::setObserverDecimationRatio().
+     * Must be invoked from the main IRQ.
+     */
+    void setObserverDecimationRatio(const unsigned ratio)
+    {
+        observer_decimation_ratio_ = ratio;
+    }
+
+    /**
+     * See @ref ThermalModel. Must be invoked from the main IRQ.
+     */
+    void setCurrentDeratingFactor(Const factor)
+    {
+        setpoint_controller_.setCurrentDeratingFactor(factor);
+    }
+
+    /*
+     * The getters below must be invoked either from the main IRQ or from a critical section.
+     * The threads should use the snapshot published from the main IRQ instead, see foc.cpp.
+     */
     bool isSpinupInProgress() const
     {
-        AbsoluteCriticalSectionLocker locker;
-        return runner_.isConstructed() ? (runner_->getState() == MotorRunner::State::Spinup) : false;
+        if (runner_.isConstructed())
+        {
+            const auto state = runner_->getState();
+            return (state == MotorRunner::State::Catching) || (state == MotorRunner::State::Spinup);
+        }
+        return false;
     }
 
     std::uint32_t getNumSuccessiveStalls() const
@@ -434,27 +909,39 @@ public:
         return num_successive_stalls_;  // Atomic read, no locking
     }
 
+    std::uint32_t getNumRestarts() const
+    {
+        return num_restarts_;           // Atomic read, no locking
+    }
+
     Vector<2> getUdq() const
     {
-        AbsoluteCriticalSectionLocker locker;
         return runner_.isConstructed() ? runner_->getUdq() : Vector<2>::Zero();
     }
 
     Vector<2> getIdq() const
     {
-        AbsoluteCriticalSectionLocker locker;
         return runner_.isConstructed() ? runner_->getIdq() : Vector<2>::Zero();
     }
 
     Scalar getElectricalAngularVelocity() const
     {
-        AbsoluteCriticalSectionLocker locker;
         return runner_.isConstructed() ? runner_->getElectricalAngularVelocity() : 0.0F;
     }
 
+    Scalar getObserverCurrentResidual() const
+    {
+        return runner_.isConstructed() ? runner_->getObserverCurrentResidual() : 0.0F;
+    }
+
+    MotorRunner::EstimatedMotorParameters getEstimatedMotorParameters() const
+    {
+        return runner_.isConstructed() ? runner_->getEstimatedMotorParameters() :
+                                         MotorRunner::EstimatedMotorParameters();
+    }
+
     LowPassFilteredValues getLowPassFilteredValues() const
     {
-        AbsoluteCriticalSectionLocker locker;
         return low_pass_filtered_values_;
     }
 };
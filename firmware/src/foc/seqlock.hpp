@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+
+
+namespace foc
+{
+/**
+ * Lock-free primitives for exchanging state between the IRQ contexts and the threads.
+ * Both rely on the fact that the firmware runs on a single core with strict priority-based preemption:
+ * a context can only be preempted by a context of higher priority, and a preempting context always runs to
+ * completion before the preempted one resumes.
+ * Only one context may be writing; the number of readers is not limited.
+ * The compiler fences are sufficient because Cortex-M4 does not reorder memory accesses visible to the same core.
+ * The stored type must be copyable without side effects (Eigen's fixed-size types are fine).
+ */
+
+/**
+ * Sequence lock: the writer must have the same or higher priority than every reader.
+ * E.g. the fast IRQ writes, the main IRQ and the threads read.
+ * The writer never waits. A reader retries if it was preempted by the writer while copying the data;
+ * this can happen at most a couple of times in a row, because the writer is periodic and short.
+ */
+template <typename T>
+class SeqLock
+{
+    volatile std::uint32_t sequence_ = 0;
+    T data_{};
+
+public:
+    SeqLock() { }
+
+    explicit SeqLock(const T& init) : data_(init) { }
+
+    void write(const T& value)
+    {
+        sequence_ = sequence_ + 1U;                                 // Odd - write in progress
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        data_ = value;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        sequence_ = sequence_ + 1U;                                 // Even - consistent
+    }
+
+    /**
+     * Same as @ref write(), but modifies the data in place, which is cheaper for large objects.
+     */
+    template <typename Modifier>
+    void modify(Modifier modifier)
+    {
+        sequence_ = sequence_ + 1U;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        modifier(data_);
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        sequence_ = sequence_ + 1U;
+    }
+
+    T read() const
+    {
+        while (true)
+        {
+            const std::uint32_t seq = sequence_;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            const T copy = data_;
+            std::atomic_signal_fence(std::memory_order_seq_cst);
+            if (((seq & 1U) == 0) && (seq == sequence_))
+            {
+                return copy;
+            }
+        }
+    }
+};
+
+/**
+ * Double buffer: the writer must have the same or lower priority than every reader.
+ * E.g. the main IRQ writes, the fast IRQ reads.
+ * Neither side ever waits. The writer fills the inactive buffer and then atomically swaps the buffers; a reader
+ * cannot be preempted by the writer, so it always observes a consistent buffer.
+ */
+template <typename T>
+class DoubleBuffer
+{
+    T buffers_[2] = {};
+    volatile std::uint8_t active_index_ = 0;
+
+public:
+    DoubleBuffer() { }
+
+    explicit DoubleBuffer(const T& init) : buffers_{init, init} { }
+
+    void write(const T& value)
+    {
+        const std::uint8_t next_index = std::uint8_t(active_index_ ^ 1U);
+        buffers_[next_index] = value;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        active_index_ = next_index;
+    }
+
+    T read() const
+    {
+        return buffers_[active_index_];
+    }
+};
+
+/**
+ * Bounded single-producer single-consumer FIFO queue; the producer and the consumer may have any priorities.
+ * Neither side ever waits; if the queue is full, the new item is rejected and the producer is notified.
+ * The capacity must be a power of two.
+ */
+template <typename T, unsigned Capacity>
+class SPSCQueue
+{
+    static_assert((Capacity > 0) && ((Capacity & (Capacity - 1U)) == 0), "Capacity must be a power of two");
+
+    T items_[Capacity];
+    volatile std::uint32_t head_ = 0;       ///< Modified only by the producer
+    volatile std::uint32_t tail_ = 0;       ///< Modified only by the consumer
+
+public:
+    /**
+     * Invoked by the producer. Returns false if the queue is full.
+     */
+    bool push(const T& value)
+    {
+        const std::uint32_t head = head_;
+        if ((head - tail_) >= Capacity)
+        {
+            return false;
+        }
+        items_[head % Capacity] = value;
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        head_ = head + 1U;
+        return true;
+    }
+
+    /**
+     * Invoked by the consumer. Returns false if the queue is empty.
+     */
+    bool pop(T& out_value)
+    {
+        const std::uint32_t tail = tail_;
+        if (tail == head_)
+        {
+            return false;
+        }
+        out_value = items_[tail % Capacity];
+        std::atomic_signal_fence(std::memory_order_seq_cst);
+        tail_ = tail + 1U;
+        return true;
+    }
+
+    /**
+     * Invoked by the consumer. Drops all items.
+     */
+    void clear() { tail_ = head_; }
+};
+
+}
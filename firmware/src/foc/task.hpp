@@ -32,6 +32,7 @@
 #include <array>
 #include <functional>
 #include <algorithm>
+#include <utility>
 
 
 namespace foc
@@ -58,6 +59,153 @@ struct TaskContext
     } board;
 };
 
+/**
+ * Holds immutable generations of the task context, so that the tasks can refer to a shared snapshot instead of
+ * keeping their own copies.
+ * A generation is never modified once published; an update publishes a new generation in a slot that is not
+ * referenced by anyone. Since at most two tasks can exist at the same time (the active one and the staged one,
+ * see @ref TaskHandler), three slots are always enough.
+ * All methods can be invoked from any context.
+ */
+class TaskContextStore
+{
+public:
+    using Generation = std::uint32_t;
+
+private:
+    static constexpr unsigned NumSlots = 3;
+
+    struct Slot
+    {
+        TaskContext context;
+        Generation generation = 0;
+        unsigned num_references = 0;
+    };
+
+    Slot slots_[NumSlots];
+    Slot* current_ = &slots_[0];
+
+public:
+    /**
+     * Keeps the referenced generation alive. Movable, but not copyable.
+     */
+    class Reference
+    {
+        friend class TaskContextStore;
+
+        Slot* slot_ = nullptr;
+
+        explicit Reference(Slot* slot) :
+            slot_(slot)
+        {
+            AbsoluteCriticalSectionLocker::assertLocked();
+            slot_->num_references++;
+        }
+
+    public:
+        Reference() { }
+
+        Reference(const Reference&) = delete;
+        Reference& operator=(const Reference&) = delete;
+
+        Reference(Reference&& other) :
+            slot_(other.slot_)
+        {
+            other.slot_ = nullptr;
+        }
+
+        Reference& operator=(Reference&& other)
+        {
+            if (this != &other)
+            {
+                reset();
+                slot_ = other.slot_;
+                other.slot_ = nullptr;
+            }
+            return *this;
+        }
+
+        ~Reference() { reset(); }
+
+        void reset()
+        {
+            if (slot_ != nullptr)
+            {
+                AbsoluteCriticalSectionLocker locker;
+                assert(slot_->num_references > 0);
+                slot_->num_references--;
+                slot_ = nullptr;
+            }
+        }
+
+        const TaskContext& get() const
+        {
+            assert(slot_ != nullptr);
+            return slot_->context;
+        }
+
+        Generation getGeneration() const
+        {
+            assert(slot_ != nullptr);
+            return slot_->generation;
+        }
+    };
+
+    Reference acquire()
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return Reference(current_);
+    }
+
+    /**
+     * Publishes a new generation: the current context is copied into a free slot, then the modifier is
+     * applied to the copy. The modifier is invoked from a critical section, so it must be quick.
+     */
+    template <typename Modifier>
+    void update(Modifier modifier)
+    {
+        AbsoluteCriticalSectionLocker locker;
+
+        Slot* target = (current_->num_references == 0) ? current_ : nullptr;
+        for (unsigned i = 0; (i < NumSlots) && (target == nullptr); i++)
+        {
+            if (slots_[i].num_references == 0)
+            {
+                target = &slots_[i];
+            }
+        }
+        assert(target != nullptr);          // Guaranteed by the number of slots
+
+        if (target != current_)
+        {
+            target->context = current_->context;
+        }
+
+        modifier(target->context);
+
+        target->generation = current_->generation + 1U;
+        current_ = target;
+    }
+
+    /**
+     * Invokes the projection on the current generation from a critical section and returns a copy of its result.
+     * The projection should select only the fields the caller needs, e.g. [](auto& c) { return c.params.motor; },
+     * because the whole context is large and the time spent in the critical section is limited.
+     */
+    template <typename Projection>
+    auto read(Projection&& projection) const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return projection(static_cast<const TaskContext&>(current_->context));
+    }
+
+    Generation getGeneration() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return current_->generation;
+    }
+};
+
 /**
  * State specific task generalization.
  */
@@ -72,8 +220,15 @@ protected:
     ITask() { }
 
 public:
+    /// Number of the debug variables in a sample of the debug stream, see debug_stream.hpp
     static constexpr unsigned NumDebugVariables = 7;
 
+    /// Max number of the debug variables a task can offer; the stream carries a selection of them
+    static constexpr unsigned MaxDebugVariables = 16;
+
+    using DebugVariables = std::array<Scalar, MaxDebugVariables>;
+    using DebugVariableNames = std::array<const char*, MaxDebugVariables>;
+
     /**
      * Task update result.
      * When finished, the exit code may be set to a non-zero value to indicate failure and its cause.
@@ -145,10 +300,36 @@ public:
         (void) inout_context;
     }
 
+    /**
+     * Invoked from the main IRQ when a newer generation of the context has been published while the task is active.
+     * It is not invoked from a critical section, so the fast IRQ may preempt it.
+     * If the task can pick up the new context without being restarted, it should switch over to it and return true;
+     * the handler will then keep the new generation alive instead of the old one.
+     * By default, the task keeps running with the generation it was constructed with.
+     */
+    virtual bool updateContext(const TaskContext& new_context)
+    {
+        (void) new_context;
+        return false;
+    }
+
     /**
      * Returned values will be transferred over to the real time plotting logic.
+     * The order matches @ref getDebugVariableNames(); the entries without a name are ignored.
+     * The main IRQ invokes this method only if the debug stream has consumers, and not from a critical section,
+     * so the values shared with the fast IRQ must be read consistently, e.g. via a seqlock.
      */
-    virtual std::array<Scalar, NumDebugVariables> getDebugVariables() const
+    virtual DebugVariables getDebugVariables() const
+    {
+        return {};
+    }
+
+    /**
+     * Names of the values returned by @ref getDebugVariables(); unused entries are null.
+     * The method is static so that the variables can be listed while the task is not active;
+     * the tasks that offer debug variables hide it with their own.
+     */
+    static DebugVariableNames getDebugVariableNames()
     {
         return {};
     }
@@ -270,6 +451,13 @@ struct TypeEnumeration
 /**
  * Helper class used for switching ITasks.
  * It is guaranteed that some task is always selected.
+ *
+ * The pool contains two slots: one holds the active task, the other is used for staging.
+ * Each slot also keeps a reference to the context generation its task was constructed with.
+ * Conditional switches (see @ref from()) construct the new task in the staging slot outside of the critical section,
+ * because construction of some tasks may take a long time, and then swap the slots under the lock.
+ * Unconditional switches (see @ref select()) construct the new task in place under the lock; they are intended for
+ * the IRQ context, where only trivial tasks should be selected.
  */
 template <typename... TaskList>
 class TaskHandler
@@ -285,17 +473,46 @@ class TaskHandler
     typedef TypeEnumeration<NullPlaceholderTask, TaskList...> Tasks;
     static_assert(Tasks::Length < 256, "Too many tasks");
 
-    using ContextCloner = std::function<TaskContext ()>;
-
 public:
     using SwitchCounter = std::uint64_t;
 
 private:
-    alignas(Tasks::LargestAlignment) std::uint8_t vinnie_the_pool_[Tasks::LargestSize]{};
+    static constexpr unsigned NumPoolSlots = 2;
+
+    /// Rounded up so that the second slot is aligned as well
+    static constexpr unsigned PoolSlotSize =
+        ((Tasks::LargestSize + Tasks::LargestAlignment - 1U) / Tasks::LargestAlignment) * Tasks::LargestAlignment;
+
+    alignas(Tasks::LargestAlignment) std::uint8_t vinnie_the_pool_[NumPoolSlots][PoolSlotSize]{};
     ITask* ptr_ = nullptr;
     std::uint8_t task_id_ = 0;
-    ContextCloner context_cloner_;
+    std::uint8_t active_slot_index_ = 0;
+    bool staging_slot_taken_ = false;
+    TaskContextStore& context_store_;
+    TaskContextStore::Reference context_references_[2];
+    TaskContextStore::Generation rejected_generation_ = 0;
     SwitchCounter switch_counter_ = 0;
+    unsigned peak_task_size_ = 0;
+    const char* peak_task_name_ = "";
+
+    struct DebugVariableNameResolver
+    {
+        template <typename T>
+        ITask::DebugVariableNames onTypeResolutionSuccess() const { return T::getDebugVariableNames(); }
+
+        ITask::DebugVariableNames onTypeResolutionFailure() const { return {}; }
+    };
+
+    /// Must be invoked from the IRQ context or from a critical section
+    template <typename T>
+    void updatePeakTaskSize()
+    {
+        if (sizeof(T) > peak_task_size_)
+        {
+            peak_task_size_ = sizeof(T);
+            peak_task_name_ = ptr_->getName();
+        }
+    }
 
     void destroy()
     {
@@ -314,40 +531,88 @@ private:
 
         explicit ConditionalSwitchHelper(TaskHandler* pwner) : owner_(pwner) { }
 
+        /**
+         * If the staging slot is taken by a concurrent switch, falls back to the in-place construction.
+         * The condition is checked again before the slots are swapped; if it no longer holds, the staged task
+         * is discarded.
+         */
         template <typename SwitchTo, typename... Args>
         void to(Args... args)
         {
-            AbsoluteCriticalSectionLocker locker;
-            if (owner_->either<SwitchFrom...>())
+            static_assert(sizeof(SwitchTo) <= PoolSlotSize,
+                          "Pool is not large enough, probably this type is not registered");
+            std::uint8_t staging_slot_index = 0;
             {
-                owner_->select<SwitchTo>(std::forward<Args>(args)...);
+                AbsoluteCriticalSectionLocker locker;
+                if (!owner_->either<SwitchFrom...>())
+                {
+                    return;
+                }
+                if (owner_->staging_slot_taken_)
+                {
+                    owner_->select<SwitchTo>(std::forward<Args>(args)...);
+                    return;
+                }
+                owner_->staging_slot_taken_ = true;
+                staging_slot_index = std::uint8_t(owner_->active_slot_index_ ^ 1U);
             }
+
+            // This is the slow part, the IRQ are enabled
+            auto& context_reference = owner_->context_references_[staging_slot_index];
+            context_reference = owner_->context_store_.acquire();
+
+            ITask* staged = new (owner_->vinnie_the_pool_[staging_slot_index])
+                SwitchTo(context_reference.get(), std::forward<Args>(args)...);
+
+            {
+                AbsoluteCriticalSectionLocker locker;
+                if (owner_->either<SwitchFrom...>())
+                {
+                    std::swap(staged, owner_->ptr_);
+                    owner_->active_slot_index_ = staging_slot_index;
+                    owner_->task_id_ = Tasks::template getID<SwitchTo>();
+                    owner_->switch_counter_++;
+                    owner_->template updatePeakTaskSize<SwitchTo>();
+                }
+            }
+
+            // Either the replaced task or the discarded one; the staging slot is still ours, so no lock is needed
+            staged->~ITask();
+            owner_->context_references_[owner_->active_slot_index_ ^ 1U].reset();
+
+            AbsoluteCriticalSectionLocker locker;
+            owner_->staging_slot_taken_ = false;
         }
     };
 
 public:
-    TaskHandler(ContextCloner context_cloner) :
-        context_cloner_(context_cloner)
+    explicit TaskHandler(TaskContextStore& context_store) :
+        context_store_(context_store)
     {
-        assert(context_cloner_);
         select<NullPlaceholderTask>();
     }
 
     ~TaskHandler() { destroy(); }
 
+    /**
+     * Replaces the active task in place; must be invoked from a critical section.
+     */
     template <typename T, typename... Args>
     void select(Args... args)
     {
         AbsoluteCriticalSectionLocker::assertLocked();
-        static_assert(sizeof(T) <= sizeof(vinnie_the_pool_),
+        static_assert(sizeof(T) <= PoolSlotSize,
                       "Pool is not large enough, probably this type is not registered");
         destroy();
         assert(ptr_ == nullptr);
+        auto& context_reference = context_references_[active_slot_index_];
+        context_reference = context_store_.acquire();
         // And now you are my handler
-        ptr_ = new (vinnie_the_pool_) T(context_cloner_(), std::forward<Args>(args)...);
+        ptr_ = new (vinnie_the_pool_[active_slot_index_]) T(context_reference.get(), std::forward<Args>(args)...);
         // And I, I will execute your demands
         task_id_ = Tasks::template getID<T>();
         switch_counter_++;
+        updatePeakTaskSize<T>();
     }
 
     template <typename... SwitchFrom>
@@ -383,6 +648,81 @@ public:
 
     std::uint8_t getTaskID() const { return task_id_; }
 
+    template <typename T>
+    static constexpr std::uint8_t getTaskIDOf() { return std::uint8_t(Tasks::template getID<T>()); }
+
+    static constexpr unsigned getNumTaskTypes() { return Tasks::Length; }
+
+    /**
+     * Debug variables of the task with the specified ID, see @ref ITask::getDebugVariableNames().
+     * Can be invoked from any context; unknown IDs yield no names.
+     */
+    static ITask::DebugVariableNames getDebugVariableNames(const std::uint8_t task_id)
+    {
+        const DebugVariableNameResolver resolver;
+        return Tasks::findTypeByID(resolver, task_id);
+    }
+
+    /**
+     * Static size of the pool versus the largest task, and the largest task constructed since boot,
+     * which allows to tell how much memory would be saved by reducing the largest task.
+     * The peak values must be read from the IRQ context or from a critical section.
+     */
+    static constexpr unsigned getNumPoolSlots() { return NumPoolSlots; }
+    static constexpr unsigned getPoolSlotSize() { return PoolSlotSize; }
+    static constexpr unsigned getLargestTaskSize() { return Tasks::LargestSize; }
+    unsigned getPeakTaskSize() const { return peak_task_size_; }
+    const char* getPeakTaskName() const { return peak_task_name_; }
+
+    /**
+     * Context generation the active task was constructed with.
+     * Must be invoked from the IRQ context or from a critical section.
+     */
+    const TaskContext& getContext() const
+    {
+        return context_references_[active_slot_index_].get();
+    }
+
+    /**
+     * True if a newer context generation has been published since the active task was constructed.
+     */
+    bool isContextStale() const
+    {
+        AbsoluteCriticalSectionLocker locker;
+        return context_references_[active_slot_index_].getGeneration() != context_store_.getGeneration();
+    }
+
+    /**
+     * Offers the current context generation to the active task, see @ref ITask::updateContext().
+     * A generation rejected by the task is not offered again.
+     * Must be invoked from the main IRQ. Returns true if the task has switched over to the new generation.
+     * The task switching and the publishing of new generations are never done from the fast IRQ, so they can't
+     * happen while this method is running; only the swap of the reference is done from a critical section.
+     */
+    bool updateContext()
+    {
+        const auto generation = context_store_.getGeneration();
+        if ((generation == context_references_[active_slot_index_].getGeneration()) ||
+            (generation == rejected_generation_))
+        {
+            return false;
+        }
+
+        auto new_reference = context_store_.acquire();
+        const bool accepted = ptr_->updateContext(new_reference.get());
+
+        AbsoluteCriticalSectionLocker locker;
+
+        if (accepted)
+        {
+            context_references_[active_slot_index_] = std::move(new_reference);   // The old generation is released
+            return true;
+        }
+
+        rejected_generation_ = new_reference.getGeneration();
+        return false;
+    }
+
     SwitchCounter getTaskSwitchCounter() const
     {
         AbsoluteCriticalSectionLocker locker;
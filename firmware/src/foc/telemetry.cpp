@@ -0,0 +1,322 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "telemetry.hpp"
+#include "seqlock.hpp"
+#include <board/motor.hpp>
+#include <cstring>
+
+
+namespace foc
+{
+namespace telemetry
+{
+namespace
+{
+/**
+ * Largest raw frame: header, seven floats of the main IRQ payload, CRC.
+ */
+constexpr unsigned MaxRawFrameSize = 1 + 2 + 4 + 4 * ITask::NumDebugVariables + 2;
+constexpr unsigned MaxEncodedFrameSize = MaxRawFrameSize + MaxRawFrameSize / 254 + 2;
+
+template <unsigned NumValues>
+struct Sample
+{
+    std::uint32_t timestamp = 0;
+    std::uint16_t sequence = 0;
+    std::array<float, NumValues> values{};
+};
+
+using FastIRQSample = Sample<6>;
+using MainIRQSample = Sample<ITask::NumDebugVariables>;
+
+/*
+ * At 40 kHz, the fast IRQ queue covers a continuous burst of 6.4 milliseconds.
+ */
+constexpr unsigned FastIRQQueueCapacity = 256;
+
+SPSCQueue<FastIRQSample, FastIRQQueueCapacity> g_fast_irq_queue;
+SPSCQueue<MainIRQSample, 32>  g_main_irq_queue;
+
+/*
+ * The cycle counter overflows every 23 seconds at 180 MHz, so the receiver should see a sync frame more often.
+ */
+constexpr std::uint32_t TimeSyncFrameIntervalCycles = STM32_SYSCLK;
+
+volatile bool g_active = false;
+bool g_info_frame_pending = false;
+
+SynchronizedTimeSource g_time_source = nullptr;
+std::uint32_t g_last_time_sync_frame_at = 0;
+std::uint16_t g_time_sync_sequence = 0;
+
+unsigned g_fast_irq_decimation = 1;
+unsigned g_fast_irq_decimation_counter = 0;
+std::uint16_t g_fast_irq_sequence = 0;
+std::uint16_t g_main_irq_sequence = 0;
+
+
+std::uint16_t computeCRC(const std::uint8_t* data, unsigned size)
+{
+    std::uint16_t crc = 0xFFFFU;
+    while (size --> 0)
+    {
+        crc = std::uint16_t(crc ^ (std::uint16_t(*data++) << 8));
+        for (unsigned i = 0; i < 8; i++)
+        {
+            crc = ((crc & 0x8000U) != 0) ? std::uint16_t((crc << 1) ^ 0x1021U) : std::uint16_t(crc << 1);
+        }
+    }
+    return crc;
+}
+
+/**
+ * Consistent Overhead Byte Stuffing; appends the zero delimiter.
+ * The output buffer must be at least size + size / 254 + 2 bytes large.
+ * @return      Number of bytes written into the output buffer.
+ */
+unsigned encodeCOBS(const std::uint8_t* in, const unsigned size, std::uint8_t* const out)
+{
+    unsigned code_index = 0;
+    unsigned out_index = 1;
+    std::uint8_t code = 1;
+
+    for (unsigned i = 0; i < size; i++)
+    {
+        if (in[i] == 0)
+        {
+            out[code_index] = code;
+            code_index = out_index++;
+            code = 1;
+        }
+        else
+        {
+            out[out_index++] = in[i];
+            code++;
+            if (code == 0xFF)
+            {
+                out[code_index] = code;
+                code_index = out_index++;
+                code = 1;
+            }
+        }
+    }
+
+    out[code_index] = code;
+    out[out_index++] = 0;
+    return out_index;
+}
+
+class FrameBuilder
+{
+    std::uint8_t buffer_[MaxRawFrameSize] = {};
+    unsigned size_ = 0;
+
+    template <typename T>
+    void append(const T& x)
+    {
+        assert((size_ + sizeof(x)) <= sizeof(buffer_));
+        std::memcpy(&buffer_[size_], &x, sizeof(x));           // Cortex-M4 is little endian
+        size_ += sizeof(x);
+    }
+
+public:
+    FrameBuilder(const FrameType type,
+                 const std::uint16_t sequence,
+                 const std::uint32_t timestamp)
+    {
+        append(std::uint8_t(type));
+        append(sequence);
+        append(timestamp);
+    }
+
+    template <typename Container>
+    void appendValues(const Container& values)
+    {
+        for (auto x : values)
+        {
+            append(float(x));
+        }
+    }
+
+    void appendValue(const float x)           { append(x); }
+    void appendValue(const std::uint16_t x)   { append(x); }
+    void appendValue(const std::uint64_t x)   { append(x); }
+
+    bool write(BaseChannel* const channel)
+    {
+        append(computeCRC(buffer_, size_));
+
+        std::uint8_t encoded[MaxEncodedFrameSize];
+        const unsigned encoded_size = encodeCOBS(buffer_, size_, encoded);
+
+        return chnWriteTimeout(channel, encoded, encoded_size, TIME_INFINITE) == encoded_size;
+    }
+};
+
+template <typename T>
+void writeSample(BaseChannel* const channel, const FrameType type, const T& sample)
+{
+    FrameBuilder fb(type, sample.sequence, sample.timestamp);
+    fb.appendValues(sample.values);
+    (void) fb.write(channel);
+}
+
+} // namespace
+
+void start(const unsigned fast_irq_decimation,
+           const SynchronizedTimeSource time_source)
+{
+    {
+        board::motor::AbsoluteCriticalSectionLocker locker;
+        g_fast_irq_decimation = (fast_irq_decimation > 0) ? fast_irq_decimation : 1U;
+        g_fast_irq_decimation_counter = 0;
+        g_fast_irq_sequence = 0;
+        g_main_irq_sequence = 0;
+        g_fast_irq_queue.clear();
+        g_main_irq_queue.clear();
+    }
+    g_time_source = time_source;
+    g_time_sync_sequence = 0;
+    g_info_frame_pending = true;
+    g_active = true;
+}
+
+void stop()
+{
+    g_active = false;
+    g_fast_irq_queue.clear();
+    g_main_irq_queue.clear();
+}
+
+bool isActive()
+{
+    return g_active;
+}
+
+unsigned flush(BaseChannel* const channel)
+{
+    unsigned num_frames = 0;
+
+    if (g_info_frame_pending)
+    {
+        g_info_frame_pending = false;
+
+        FrameBuilder fb(FrameType::Info, 0, DWT->CYCCNT);
+        fb.appendValue(float(STM32_SYSCLK));
+        fb.appendValue(float(board::motor::getPWMParameters().fast_irq_period));
+        fb.appendValue(std::uint16_t(g_fast_irq_decimation));
+        (void) fb.write(channel);
+        num_frames++;
+
+        g_last_time_sync_frame_at = DWT->CYCCNT - TimeSyncFrameIntervalCycles;     // Sending the first one now
+    }
+
+    if ((g_time_source != nullptr) &&
+        ((DWT->CYCCNT - g_last_time_sync_frame_at) >= TimeSyncFrameIntervalCycles))
+    {
+        g_last_time_sync_frame_at = DWT->CYCCNT;
+
+        FrameBuilder fb(FrameType::TimeSync, g_time_sync_sequence++, g_last_time_sync_frame_at);
+        fb.appendValue(g_time_source(g_last_time_sync_frame_at));
+        (void) fb.write(channel);
+        num_frames++;
+    }
+
+    /*
+     * The main IRQ samples are infrequent, so they are served first in order to not get stuck behind
+     * the fast IRQ samples.
+     */
+    MainIRQSample main_sample;
+    while (g_main_irq_queue.pop(main_sample))
+    {
+        writeSample(channel, FrameType::MainIRQ, main_sample);
+        num_frames++;
+    }
+
+    // The number of iterations is limited, otherwise we may never return if the IRQ is faster than the channel
+    FastIRQSample fast_sample;
+    for (unsigned i = 0; (i < FastIRQQueueCapacity) && g_fast_irq_queue.pop(fast_sample); i++)
+    {
+        writeSample(channel, FrameType::FastIRQ, fast_sample);
+        num_frames++;
+
+        if (g_main_irq_queue.pop(main_sample))
+        {
+            writeSample(channel, FrameType::MainIRQ, main_sample);
+            num_frames++;
+        }
+    }
+
+    return num_frames;
+}
+
+BOARD_RAM_FUNCTION
+void onFastIRQ(const math::Vector<2>& phase_currents_ab,
+               const Scalar inverter_voltage,
+               const math::Vector<3>& pwm_setpoint)
+{
+    if (!g_active)
+    {
+        return;
+    }
+
+    if (++g_fast_irq_decimation_counter < g_fast_irq_decimation)
+    {
+        return;
+    }
+    g_fast_irq_decimation_counter = 0;
+
+    FastIRQSample s;
+    s.timestamp = DWT->CYCCNT;
+    s.sequence = g_fast_irq_sequence++;
+    s.values = {
+        phase_currents_ab[0],
+        phase_currents_ab[1],
+        inverter_voltage,
+        pwm_setpoint[0],
+        pwm_setpoint[1],
+        pwm_setpoint[2]
+    };
+    (void) g_fast_irq_queue.push(s);            // Dropped samples are detected via the sequence number
+}
+
+BOARD_RAM_FUNCTION
+void onMainIRQ(const std::array<Scalar, ITask::NumDebugVariables>& debug_variables)
+{
+    if (!g_active)
+    {
+        return;
+    }
+
+    MainIRQSample s;
+    s.timestamp = DWT->CYCCNT;
+    s.sequence = g_main_irq_sequence++;
+    std::copy(debug_variables.begin(), debug_variables.end(), s.values.begin());
+    (void) g_main_irq_queue.push(s);
+}
+
+}
+}
@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "task.hpp"
+#include <hal.h>
+#include <cstdint>
+#include <array>
+
+
+namespace foc
+{
+/**
+ * Binary telemetry streaming from the IRQs.
+ * The IRQs push raw samples into lock-free queues; a thread drains the queues, encodes the samples into frames
+ * and writes them into a serial channel. If the channel is too slow, the samples that did not fit into the queues
+ * are dropped; the losses are visible via the sequence numbers.
+ *
+ * Frame layout before encoding, all fields are little endian:
+ *      uint8           frame type, see @ref FrameType
+ *      uint16          sequence number, incremented per frame type, including the dropped ones
+ *      uint32          DWT cycle counter at the moment the sample was taken
+ *      payload         depends on the frame type, see below
+ *      uint16          CRC-16-CCITT of the above (polynomial 0x1021, initial value 0xFFFF)
+ *
+ * The frame is then COBS encoded and terminated with a zero byte, so the receiver can resynchronize at any time.
+ * See tools/serial_plot for the decoder.
+ */
+namespace telemetry
+{
+
+enum class FrameType : std::uint8_t
+{
+    Info,           ///< float32 cycles per second, float32 fast IRQ period, uint16 fast IRQ sample decimation
+    FastIRQ,        ///< float32 phase currents A and B, inverter voltage, PWM setpoints A, B, C
+    MainIRQ,        ///< float32 selected debug variables of the current task, see debug_stream.hpp
+    TimeSync        ///< uint64 synchronized UTC time in microseconds at the cycle counter value of the frame, or 0
+};
+
+/**
+ * Converts a cycle counter value into the synchronized (e.g. network-wide) time in microseconds.
+ * Returns zero if the time is not synchronized.
+ */
+using SynchronizedTimeSource = std::uint64_t (*)(std::uint32_t cycle_count);
+
+/**
+ * Starts collecting the samples. Must be invoked from a thread.
+ * @param fast_irq_decimation   Every Nth fast IRQ will be sampled; 1 samples every PWM period.
+ * @param time_source           If provided, the time sync frames will be emitted periodically, so that the
+ *                              receiver can convert the cycle counter timestamps into the synchronized time.
+ */
+void start(unsigned fast_irq_decimation,
+           SynchronizedTimeSource time_source = nullptr);
+
+/**
+ * Stops collecting the samples; the queued samples are discarded. Must be invoked from a thread.
+ */
+void stop();
+
+bool isActive();
+
+/**
+ * Encodes the pending samples and writes them into the channel; blocks until they are written.
+ * The info frame is sent first after every start.
+ * Must be invoked from the same thread that invoked @ref start().
+ * @return      Number of frames written.
+ */
+unsigned flush(BaseChannel* channel);
+
+/**
+ * Invoked from the fast IRQ; does nothing unless active.
+ */
+void onFastIRQ(const math::Vector<2>& phase_currents_ab,
+               Scalar inverter_voltage,
+               const math::Vector<3>& pwm_setpoint);
+
+/**
+ * Invoked from the main IRQ; does nothing unless active.
+ */
+void onMainIRQ(const std::array<Scalar, ITask::NumDebugVariables>& debug_variables);
+
+}
+}
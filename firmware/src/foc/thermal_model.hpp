@@ -0,0 +1,175 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "parameters.hpp"
+#include <math/math.hpp>
+#include <zubax_chibios/util/heapless.hpp>
+#include <algorithm>
+#include <cmath>
+
+
+namespace foc
+{
+/**
+ * Lumped thermal model of the power switches and the motor windings, which predicts the temperatures from the
+ * losses and derates the current limit smoothly before the temperature limits are reached.
+ *
+ * Each of the two is a single first order node heated above the temperature measured by the inverter temperature
+ * sensor; the sensor is also used as the ambient temperature of the motor, which is conservative. The losses are:
+ *
+ *      Pinv = 1.5 * Rinv * |Idq|^2 + k * |P|
+ *      Pmot = 1.5 * Rs * (1 + alpha * dTmot) * |Idq|^2
+ *
+ * Where P is the power of the inverter and alpha is the temperature coefficient of copper.
+ * The limits are checked against the temperature predicted at the configured horizon assuming that the losses
+ * stay the same, or against the present temperature if it is higher (i.e. while cooling down). The derating
+ * factor is reduced linearly from one to zero within the configured band below the lesser of the limits.
+ * The prediction responds to the changes of the current at once, so the factor is low-pass filtered in order
+ * to keep the loop formed by the derating and the prediction stable.
+ *
+ * The update method must be invoked from the main IRQ once per period, also when the motor is not running,
+ * so that the model keeps track of the cooling.
+ */
+class ThermalModel
+{
+public:
+    static constexpr Scalar UpdateInterval = 0.01F;                     ///< Second
+    static constexpr Scalar CopperTemperatureCoefficient = 0.00393F;    ///< 1/kelvin
+    static constexpr Scalar DeratingTimeConstant = 0.5F;                ///< Second
+
+    struct Status
+    {
+        Scalar inverter_temperature = 0;        ///< Predicted temperature of the switches, kelvin
+        Scalar motor_temperature = 0;           ///< Predicted temperature of the windings, kelvin; zero if disabled
+        Scalar headroom = 0;                    ///< Least predicted margin below the limits, kelvin
+        Scalar current_derating_factor = 1;     ///< [0, 1]
+
+        auto toString() const
+        {
+            return os::heapless::format("Inverter: %.1f C\n"
+                                        "Motor   : %.1f C\n"
+                                        "Headroom: %.1f K\n"
+                                        "Derating: %.0f %%",
+                                        double(math::convertKelvinToCelsius(inverter_temperature)),
+                                        double((motor_temperature > 0) ?
+                                               math::convertKelvinToCelsius(motor_temperature) : 0.0F),
+                                        double(headroom),
+                                        double(current_derating_factor) * 100.0);
+        }
+    };
+
+private:
+    struct Node
+    {
+        Scalar rise = 0;                        ///< Present temperature above the sensor, kelvin
+        Scalar predicted_rise = 0;              ///< At the prediction horizon, not lower than the present rise
+
+        void update(Const dt,
+                    Const power,
+                    Const thermal_resistance,
+                    Const time_constant,
+                    Const horizon)
+        {
+            Const steady_state_rise = power * thermal_resistance;
+            rise += (steady_state_rise - rise) * (1.0F - std::exp(-dt / time_constant));
+            predicted_rise = steady_state_rise + (rise - steady_state_rise) * std::exp(-horizon / time_constant);
+            predicted_rise = std::max(predicted_rise, rise);
+        }
+    };
+
+    Node inverter_;
+    Node motor_;
+    Scalar inverter_energy_ = 0;                ///< Joule, accumulated since the last update of the nodes
+    Scalar motor_energy_ = 0;
+    Scalar elapsed_ = 0;
+    Status status_;
+
+public:
+    /**
+     * @param period                    Period of the main IRQ, second
+     * @param params                    Thermal parameters
+     * @param motor_rs                  Phase resistance of the motor at the ambient temperature, ohm
+     * @param max_inverter_temperature  Upper limit of the safe operating area of the inverter, kelvin
+     * @param sensor_temperature        Inverter temperature sensor, kelvin
+     * @param inverter_power            Power of the inverter, negative when regenerating, watt
+     * @param Idq                       Phase current, zero if the motor is not running, ampere
+     */
+    void update(Const period,
+                const ThermalParameters& params,
+                Const motor_rs,
+                Const max_inverter_temperature,
+                Const sensor_temperature,
+                Const inverter_power,
+                const math::Vector<2>& Idq)
+    {
+        Const current_squared = Idq.squaredNorm();
+
+        inverter_energy_ += period * (1.5F * params.inverter_resistance * current_squared +
+                                      params.inverter_loss_fraction * std::abs(inverter_power));
+
+        motor_energy_ += period * 1.5F * motor_rs * (1.0F + CopperTemperatureCoefficient * motor_.rise) *
+                         current_squared;
+
+        elapsed_ += period;
+        if (elapsed_ < UpdateInterval)
+        {
+            return;
+        }
+
+        inverter_.update(elapsed_, inverter_energy_ / elapsed_, params.inverter_thermal_resistance,
+                         params.inverter_time_constant, params.prediction_horizon);
+
+        motor_.update(elapsed_, motor_energy_ / elapsed_, params.motor_thermal_resistance,
+                      params.motor_time_constant, params.prediction_horizon);
+
+        inverter_energy_ = 0;
+        motor_energy_ = 0;
+        elapsed_ = 0;
+
+        const bool motor_model_enabled = params.motor_thermal_resistance > 0;
+
+        status_.inverter_temperature = sensor_temperature + inverter_.predicted_rise;
+        status_.motor_temperature = motor_model_enabled ? (sensor_temperature + motor_.predicted_rise) : 0.0F;
+
+        status_.headroom = max_inverter_temperature - status_.inverter_temperature;
+        if (motor_model_enabled)
+        {
+            status_.headroom = std::min(status_.headroom, params.max_motor_temperature - status_.motor_temperature);
+        }
+
+        Const target_factor = (params.derating_band > 0) ?
+            math::Range<>(0.0F, 1.0F).constrain(status_.headroom / params.derating_band) : 1.0F;
+
+        status_.current_derating_factor += (UpdateInterval / DeratingTimeConstant) *
+                                           (target_factor - status_.current_derating_factor);
+    }
+
+    Scalar getCurrentDeratingFactor() const { return status_.current_derating_factor; }
+
+    const Status& getStatus() const { return status_; }
+};
+
+}
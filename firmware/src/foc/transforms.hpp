@@ -136,27 +136,133 @@ performSpaceVectorTransform(const Vector<2>& alpha_beta_voltage,
 }
 
 /**
- * Accepts a PWM setpoint vector in [0, 1], returns corrected PWM setpoint.
+ * Zero sequence selection for @ref shapeSpaceVectorModulation().
  */
-inline Vector<3> performDeadTimeCompensation(Vector<3> pwm_setpoint,
-                                             const Vector<2>& phase_currents_ab,
-                                             Const pwm_period,
-                                             Const pwm_dead_time)
+enum class SpaceVectorModulationMode : std::uint8_t
+{
+    Centered,           ///< Continuous SVM, all phases are switched every period
+    BottomClamped       ///< Discontinuous SVM (DPWMMIN), the lowest phase is clamped to zero, one third less switching
+};
+
+/**
+ * Modulation ratios relative to @ref computeLineVoltageLimit().
+ * The first one is the ratio of the radius of the circle circumscribed around the voltage hexagon to that of
+ * the inscribed circle. The second one is the ratio at which the overmodulation reaches the six-step mode.
+ */
+constexpr Scalar OvermodulationHexagonRatio = 2.0F / SquareRootOf3;
+constexpr Scalar OvermodulationSixStepRatio = 1.25F;
+
+/**
+ * Applies the zero sequence and the overmodulation to the output of @ref performSpaceVectorTransform().
+ * The overmodulation is defined by the magnitude of the reference voltage vector relative to
+ * @ref computeLineVoltageLimit():
+ *  - Up to one, the modulation is linear and the output is not changed except for the zero sequence;
+ *  - Up to @ref OvermodulationHexagonRatio, the vector is clipped to the hexagon while keeping its angle;
+ *  - Up to @ref OvermodulationSixStepRatio, the middle phase is progressively pulled to the rails, so that the
+ *    vector dwells at the vertices of the hexagon, until pure six-step is reached.
+ * The output is always within [0, max_pwm_value]. The bottom clamped mode is better for the low-side
+ * current shunts, because the clamped phase is always available for sampling.
+ */
+inline Vector<3> shapeSpaceVectorModulation(const Vector<3>& pwm_setpoint,
+                                            const SpaceVectorModulationMode mode,
+                                            Const modulation_ratio,
+                                            Const max_pwm_value)
 {
-    static constexpr math::Range<> PWMRange(0.0F, 1.0F);
+    Vector<3>::Index max_index = 0;
+    Vector<3>::Index min_index = 0;
+    Const max = pwm_setpoint.maxCoeff(&max_index);
+    Const min = pwm_setpoint.minCoeff(&min_index);
+
+    Vector<3> out = pwm_setpoint.array() - (max + min) * 0.5F;
+    Scalar span = max - min;
+
+    if (span > max_pwm_value)
+    {
+        out *= max_pwm_value / span;
+        span = max_pwm_value;
+    }
 
-    Const currents[3] =
+    if ((modulation_ratio > OvermodulationHexagonRatio) &&
+        (max_index != min_index))
     {
-        phase_currents_ab[0],
-        phase_currents_ab[1],
-       -phase_currents_ab.sum(),
+        static constexpr math::Range<> UnityRange(0.0F, 1.0F);
+
+        Const hold = UnityRange.constrain((modulation_ratio - OvermodulationHexagonRatio) /
+                                          (OvermodulationSixStepRatio - OvermodulationHexagonRatio));
+        const auto middle_index = 3 - max_index - min_index;
+
+        Const x = (out[middle_index] - out[min_index]) / span;
+        Const pulled = (hold < 1.0F) ? UnityRange.constrain((x - hold * 0.5F) / (1.0F - hold)) :
+                                       ((x < 0.5F) ? 0.0F : 1.0F);
+
+        out[middle_index] = out[min_index] + pulled * span;
+    }
+
+    if (mode == SpaceVectorModulationMode::BottomClamped)
+    {
+        return out.array() - out[min_index];
+    }
+    else
+    {
+        // Centered within [0, max_pwm_value] rather than at 0.5, otherwise the top would exceed the limit
+        return out.array() + (max_pwm_value - out[max_index] - out[min_index]) * 0.5F;
+    }
+}
+
+/**
+ * Voltage vector in the stationary reference frame that is generated by the given PWM setpoint.
+ * This is the inverse of @ref performSpaceVectorTransform() up to the zero sequence.
+ */
+inline Vector<2> computeVoltageFromPWMSetpoint(const Vector<3>& pwm_setpoint,
+                                               Const inverter_voltage)
+{
+    return {
+        (pwm_setpoint[0] - (pwm_setpoint[1] + pwm_setpoint[2]) * 0.5F) * (inverter_voltage * (2.0F / 3.0F)),
+        (pwm_setpoint[1] - pwm_setpoint[2]) * (inverter_voltage / SquareRootOf3)
     };
+}
+
+/**
+ * Accepts a PWM setpoint vector in [0, max_pwm_value], returns corrected PWM setpoint in the same range.
+ * The effective dead time is the mean time per PWM period the phase voltage is lost for the given current polarity,
+ * i.e. it includes the switching delays of the transistors; it can be measured by @ref hw_test::HardwareTestingTask.
+ * The phase currents should be filtered, because near zero the polarity of the raw measurements is meaningless;
+ * the sign change is smoothed linearly within the transition current, which also accounts for the fact that a
+ * small current is unable to fully recharge the output capacitance of the switches during the dead time.
+ * In the bottom clamped mode the lowest phase is not switched, hence it has no dead time and is left at zero.
+ */
+inline Vector<3> performDeadTimeCompensation(Vector<3> pwm_setpoint,
+                                             const SpaceVectorModulationMode mode,
+                                             const Vector<3>& phase_currents,
+                                             Const pwm_period,
+                                             Const effective_dead_time_positive,
+                                             Const effective_dead_time_negative,
+                                             Const transition_current,
+                                             Const max_pwm_value)
+{
+    static constexpr math::Range<> WeightRange(-1.0F, 1.0F);
 
-    Const correction = (pwm_dead_time / pwm_period) * 0.5F;
+    const math::Range<> pwm_range(0.0F, max_pwm_value);
+
+    Const correction_positive = effective_dead_time_positive / pwm_period;
+    Const correction_negative = effective_dead_time_negative / pwm_period;
+
+    Vector<3>::Index clamped_index = 3;
+    if (mode == SpaceVectorModulationMode::BottomClamped)
+    {
+        (void) pwm_setpoint.minCoeff(&clamped_index);
+    }
 
-    for (unsigned i = 0; i < 3; i++)
+    for (Vector<3>::Index i = 0; i < 3; i++)
     {
-        pwm_setpoint[i] = PWMRange.constrain(pwm_setpoint[i] + std::copysign(correction, currents[i]));
+        if (i == clamped_index)
+        {
+            continue;
+        }
+
+        Const weight = WeightRange.constrain(phase_currents[i] / transition_current);
+        Const correction = weight * ((weight > 0.0F) ? correction_positive : correction_negative);
+        pwm_setpoint[i] = pwm_range.constrain(pwm_setpoint[i] + correction);
     }
 
     return pwm_setpoint;
@@ -319,4 +425,35 @@ inline Scalar convertRotationRateElectricalToMechanical(Const rate,
     }
 }
 
+/**
+ * Inverse of @ref convertAngularVelocityToRPM().
+ * @param rpm           Revolutions per minute
+ * @return              Angular velocity in Rad/sec
+ */
+constexpr inline Scalar convertRPMToAngularVelocity(Const rpm)
+{
+    return rpm * (math::Pi2 / 60.0F);
+}
+
+/**
+ * Inverse of @ref convertRotationRateElectricalToMechanical().
+ * @param rate          Rotation rate in any unit, e.g. Radian/sec, RPM, Hertz, etc.
+ * @param num_poles     Number of magnetic poles in the rotor; positive, even.
+ * @return              Scaled rotation rate in the same units.
+ */
+inline Scalar convertRotationRateMechanicalToElectrical(Const rate,
+                                                        const unsigned num_poles)
+{
+    if ((num_poles >= 2) &&
+        (num_poles % 2 == 0))
+    {
+        return rate * Scalar(num_poles / 2U);
+    }
+    else
+    {
+        assert(false);
+        return 0;
+    }
+}
+
 }
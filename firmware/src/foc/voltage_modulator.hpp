@@ -25,8 +25,11 @@
 #pragma once
 
 #include "transforms.hpp"
+#include "idq_filter.hpp"
 #include <math/math.hpp>
+#include <zubax_chibios/util/float_eq.hpp>
 #include <board/motor.hpp>
+#include <board/irq_profiler.hpp>
 #include <cassert>
 
 
@@ -39,30 +42,42 @@ using math::Vector;
 
 /**
  * Serial PI controller, Idq Current --> Udq Voltage.
+ * The gains can be specified explicitly in volt/ampere and volt/(ampere*second), e.g. as found by the current loop
+ * tuning (see motor_id::CurrentLoopTask); otherwise they are derived from Lq and the update interval.
  */
 class CurrentPIController
 {
     Const full_scale_current_;
     Const kp_;
-    Const ki_;
+    Const ki_per_ohm_;
+    Scalar ki_;
     Const voltage_limit_mult_;
 
     Scalar ui_ = 0;
 
 public:
+    /**
+     * @param tuned_kp      Proportional gain, volt/ampere; zero selects the default
+     * @param tuned_ki      Integral gain at the given Rs, volt/(ampere*second); ignored if tuned_kp is zero
+     */
     CurrentPIController(Const Lq,
                         Const Rs,
                         Const max_current,
-                        Const dt) :
+                        Const dt,
+                        Const tuned_kp = 0.0F,
+                        Const tuned_ki = 0.0F) :
         full_scale_current_(max_current * 3.0F),
-        kp_((math::Pi2 * Lq) / (20.0F * dt)),
-        ki_(dt * Rs / Lq),
+        kp_((tuned_kp > 0) ? (tuned_kp * full_scale_current_) : ((math::Pi2 * Lq) / (20.0F * dt))),
+        ki_per_ohm_((tuned_kp > 0) ? ((tuned_ki * dt) / (tuned_kp * Rs)) : (dt / Lq)),
+        ki_(ki_per_ohm_ * Rs),
         voltage_limit_mult_((SquareRootOf3 / 2.0F) / kp_)
     {
         assert(Lq > 0);
         assert(Rs > 0);
         assert(max_current > 0);
         assert(dt > 0);
+        assert(tuned_kp >= 0);
+        assert(tuned_ki >= 0);
     }
 
     Scalar computeVoltage(Const target_current,
@@ -84,31 +99,182 @@ public:
     {
         ui_ = 0;
     }
+
+    Scalar getFullScaleCurrent() const { return full_scale_current_; }
+    Scalar getProportionalGain() const { return kp_; }
+    Scalar getIntegralGain() const { return ki_; }
+
+    /// Volt, the output of the integral term
+    Scalar getIntegralVoltage() const { return kp_ * ui_; }
+
+    /**
+     * The integral gain depends on the phase resistance, which may be updated at run time.
+     */
+    void setPhaseResistance(Const Rs)
+    {
+        assert(Rs > 0);
+        ki_ = ki_per_ohm_ * Rs;
+    }
 };
 
 /**
- * Generates rotating three phase voltage vector using measured and estimated parameters of the motor and Iq reference.
+ * Generates the Id reference for the current controller.
+ * For salient motors (Ld != Lq) the reference follows the maximum torque per ampere trajectory,
+ * which makes use of the reluctance torque; for non-salient motors it is zero.
+ * Field weakening adds negative Id when the voltage vector approaches the saturation limit; the field weakening
+ * current is integrated from the voltage margin and is bounded by the configured maximum.
+ * Must be updated every PWM period.
  */
-template <unsigned IdqMovingAverageLength>
-class ThreePhaseVoltageModulator
+class IdReferenceGenerator
 {
+    static constexpr Scalar VoltageMargin = 0.95F;          ///< Field weakening engages above this fraction of limit
+    static constexpr Scalar FieldWeakeningRate = 500.0F;    ///< Per second, per unit of the relative voltage error
+
+    Scalar saliency_ = 0;                   ///< Ld - Lq, henry
+    Scalar phi_ = 0;
+    Scalar max_field_weakening_current_ = 0;
+    Scalar field_weakening_gain_ = 0;       ///< Ampere per period
+
+    Scalar field_weakening_current_ = 0;
+    Scalar reference_ = 0;
+
 public:
-    enum class DeadTimeCompensationPolicy
+    /**
+     * If not configured, the reference is always zero.
+     */
+    void configure(Const Ld,
+                   Const Lq,
+                   Const phi,
+                   Const max_field_weakening_current,
+                   Const dt)
     {
-        Disabled,
-        Enabled
-    };
+        assert(Ld > 0);
+        assert(Lq > 0);
+        assert(phi > 0);
+        assert(max_field_weakening_current >= 0);
+
+        saliency_ = Ld - Lq;
+        phi_ = phi;
+        max_field_weakening_current_ = max_field_weakening_current;
+        field_weakening_gain_ = dt * FieldWeakeningRate * max_field_weakening_current;
+        field_weakening_current_ = 0;
+    }
 
-    enum class CrossCouplingCompensationPolicy
+    /**
+     * @param Udq_magnitude         Magnitude of the reference voltage vector before it was limited
+     * @param Udq_magnitude_limit   Max magnitude of the voltage vector
+     * @param Iq                    Estimated Iq
+     */
+    void update(Const Udq_magnitude,
+                Const Udq_magnitude_limit,
+                Const Iq)
     {
-        Disabled,
-        Enabled
-    };
+        if (!os::float_eq::positive(phi_) ||
+            !os::float_eq::positive(Udq_magnitude_limit))
+        {
+            return;     // Not configured, or the inverter is not powered
+        }
+
+        Const relative_error = (VoltageMargin * Udq_magnitude_limit - Udq_magnitude) / Udq_magnitude_limit;
+        // Not using math::Range here because the range is empty when field weakening is disabled
+        field_weakening_current_ = std::max(-max_field_weakening_current_,
+                                            std::min(0.0F, field_weakening_current_ +
+                                                           field_weakening_gain_ * relative_error));
+
+        // MTPA: Id = (sqrt(phi^2 + 4 dL^2 Iq^2) - phi) / (2 dL), rearranged to stay well-conditioned at dL -> 0
+        Const saliency_iq = 2.0F * saliency_ * Iq;
+        Const mtpa_current = (saliency_iq * Iq) / (phi_ + std::sqrt(phi_ * phi_ + saliency_iq * saliency_iq));
+
+        reference_ = mtpa_current + field_weakening_current_;
+    }
+
+    Scalar getReference() const { return reference_; }
+};
+
+/**
+ * Inverter voltage used to convert the reference voltage into the PWM setpoint.
+ * The board samples the inverter voltage once per period at the same point as the phase currents; using the fresh
+ * sample directly compensates the VBUS ripple (feed-forward), which otherwise shows up in the phase currents,
+ * since the current loop is far too slow to reject it. The output is applied during the next period, so the sample
+ * can be extrapolated linearly towards its middle; this reduces the phase lag of the compensation at the cost of
+ * some noise amplification.
+ * If the feed-forward is disabled, the voltage is low-pass filtered instead.
+ * Must be updated every PWM period.
+ */
+class InverterVoltageFeedForward
+{
+    static constexpr Scalar FilterInnovationWeight = 0.1F;
+
+    bool enabled_ = false;
+    Scalar prediction_horizon_ = 0;         ///< Fast IRQ periods
 
-private:
-    const DeadTimeCompensationPolicy dead_time_compensation_policy_;
-    const CrossCouplingCompensationPolicy cross_coupling_compensation_policy_;
+    Scalar filtered_ = 0;
+    Scalar last_sample_ = 0;
+
+public:
+    void configure(const bool enabled,
+                   Const prediction_horizon)
+    {
+        assert(prediction_horizon >= 0);
+        enabled_ = enabled;
+        prediction_horizon_ = enabled ? prediction_horizon : 0.0F;
+    }
 
+    Scalar update(Const sample)
+    {
+        if (!os::float_eq::positive(filtered_))
+        {
+            filtered_ = last_sample_ = sample;  // First sample, or the inverter was not powered
+        }
+
+        filtered_ += FilterInnovationWeight * (sample - filtered_);
+
+        Const output = enabled_ ? (sample + prediction_horizon_ * (sample - last_sample_)) : filtered_;
+        last_sample_ = sample;
+
+        // The prediction is noisy, so it is not allowed to go far from the average
+        // Not using math::Range here because the range is empty while the inverter is not powered
+        return std::max(filtered_ * 0.5F, std::min(filtered_ * 1.5F, output));
+    }
+};
+
+/**
+ * Compile-time policies of @ref ThreePhaseVoltageModulator.
+ * @{
+ */
+enum class DeadTimeCompensationPolicy
+{
+    Disabled,
+    Enabled
+};
+
+enum class CrossCouplingCompensationPolicy
+{
+    Disabled,
+    Enabled
+};
+
+enum class IdReferencePolicy
+{
+    Zero,
+    MTPAWithFieldWeakening          ///< See @ref IdReferenceGenerator
+};
+/**
+ * @}
+ */
+
+/**
+ * Generates rotating three phase voltage vector using measured and estimated parameters of the motor and Iq reference.
+ * The Idq filter and the compensation policies are template parameters, and the setpoint mode can be fixed at
+ * compile time as well, so that the fast IRQ code contains no branches that are never taken.
+ * The Idq filter is one of the classes defined in idq_filter.hpp.
+ */
+template <typename IdqFilter,
+          DeadTimeCompensationPolicy DeadTimeCompensation          = DeadTimeCompensationPolicy::Disabled,
+          CrossCouplingCompensationPolicy CrossCouplingCompensation = CrossCouplingCompensationPolicy::Disabled,
+          IdReferencePolicy IdReference                             = IdReferencePolicy::Zero>
+class ThreePhaseVoltageModulator
+{
     board::motor::PWMParameters pwm_params_;
 
     Const Lq_;
@@ -116,11 +282,35 @@ private:
     CurrentPIController pid_Id_;
     CurrentPIController pid_Iq_;
 
-    math::SimpleMovingAverageFilter<IdqMovingAverageLength, Vector<2>> estimated_Idq_filter_;
+    IdReferenceGenerator Id_reference_generator_;
+
+    // Discontinuous modulation is used above this modulation ratio; zero disables it
+    Scalar discontinuous_modulation_threshold_ = 0;
+    Scalar max_modulation_ratio_ = 1.0F;
+    SpaceVectorModulationMode space_vector_modulation_mode_ = SpaceVectorModulationMode::Centered;
+
+    // Zero disables the compensation, see @ref InverterParameters
+    Scalar effective_dead_time_positive_ = 0;
+    Scalar effective_dead_time_negative_ = 0;
+    Scalar dead_time_compensation_transition_current_ = 1.0F;
+
+    IdqFilter loop_Idq_filter_;
+    Vector<2> applied_Udq_ = Vector<2>::Zero();     ///< Computed in the previous period, applied in the current one
+
+    /*
+     * The state observers and the dead time compensation are tuned for the moving average, so it is kept for the
+     * reported Idq regardless of the filter in the current loop.
+     */
+    static constexpr unsigned ReportedIdqMovingAverageLength = 5;
+    math::SimpleMovingAverageFilter<ReportedIdqMovingAverageLength, Vector<2>> reported_Idq_filter_;
+
+    InverterVoltageFeedForward inverter_voltage_feedforward_;
 
     std::uint64_t Udq_normalization_count_ = 0;
 
 public:
+    static constexpr Scalar DiscontinuousModulationHysteresis = 0.05F;
+
     struct Output
     {
         Scalar extrapolated_angular_position = 0;
@@ -141,81 +331,120 @@ public:
         } mode = Mode::Iq;
     };
 
+    /**
+     * The current loop gains are optional, see @ref CurrentPIController.
+     */
     ThreePhaseVoltageModulator(Const Lq,
                                Const Rs,
                                Const max_current,
                                const board::motor::PWMParameters& pwm_params,
-                               const DeadTimeCompensationPolicy dtcomp_policy,
-                               const CrossCouplingCompensationPolicy cccomp_policy) :
-        dead_time_compensation_policy_(dtcomp_policy),
-        cross_coupling_compensation_policy_(cccomp_policy),
+                               Const current_loop_kp = 0.0F,
+                               Const current_loop_ki = 0.0F) :
         pwm_params_(pwm_params),
         Lq_(Lq),
-        pid_Id_(Lq, Rs, max_current, pwm_params_.period),
-        pid_Iq_(Lq, Rs, max_current, pwm_params_.period),
-        estimated_Idq_filter_(Vector<2>::Zero())
-    { }
+        pid_Id_(Lq, Rs, max_current, pwm_params_.fast_irq_period, current_loop_kp, current_loop_ki),
+        pid_Iq_(Lq, Rs, max_current, pwm_params_.fast_irq_period, current_loop_kp, current_loop_ki),
+        reported_Idq_filter_(Vector<2>::Zero())
+    {
+        loop_Idq_filter_.setPhaseResistance(Rs);
+    }
 
+    /**
+     * Specialized version for the case when the setpoint mode is known at compile time.
+     */
+    template <typename Setpoint::Mode SetpointMode>
     Output onNextPWMPeriod(const Vector<2>& phase_currents_ab,
-                           Const inverter_voltage,
+                           Const inverter_voltage_sample,
                            Const angular_velocity,
                            Const angular_position,
-                           const Setpoint setpoint)
+                           Const setpoint_value)
     {
         Output out;
 
+        board::irq_profiler::StageMeasurer measurer;
+
+        Const inverter_voltage = inverter_voltage_feedforward_.update(inverter_voltage_sample);
+
         /*
          * Computing Idq, Udq
          */
         out.extrapolated_angular_position =
-            math::normalizeAngle(angular_position + angular_velocity * pwm_params_.period);
+            math::normalizeAngle(angular_position + angular_velocity * pwm_params_.fast_irq_period);
 
         const auto angle_sincos = math::sincos(out.extrapolated_angular_position);
 
         const auto estimated_I_alpha_beta = performClarkeTransform(phase_currents_ab);
 
         const Vector<2> new_Idq = performParkTransform(estimated_I_alpha_beta, angle_sincos);
-        estimated_Idq_filter_.update(new_Idq);
-        out.estimated_Idq = estimated_Idq_filter_.getValue();
+        loop_Idq_filter_.update(new_Idq, applied_Udq_, angular_velocity);
+        const Vector<2> loop_Idq = loop_Idq_filter_.getValue();
+
+        reported_Idq_filter_.update(new_Idq);
+        out.estimated_Idq = reported_Idq_filter_.getValue();
+
+        measurer.mark(board::irq_profiler::Stage::ClarkePark);
 
         /*
          * Running PIDs, estimating reference voltage in the rotating reference frame
          */
-        out.reference_Udq[0] = pid_Id_.computeVoltage(0.0F,
-                                                      out.estimated_Idq[0],
+        Const Id_reference = (IdReference == IdReferencePolicy::Zero) ? 0.0F : Id_reference_generator_.getReference();
+
+        out.reference_Udq[0] = pid_Id_.computeVoltage(Id_reference,
+                                                      loop_Idq[0],
                                                       inverter_voltage);
 
-        if (setpoint.mode == Setpoint::Mode::Iq)
+        if (SetpointMode == Setpoint::Mode::Iq)
         {
-            out.reference_Udq[1] = pid_Iq_.computeVoltage(setpoint.value,
-                                                          out.estimated_Idq[1],
+            out.reference_Udq[1] = pid_Iq_.computeVoltage(setpoint_value,
+                                                          loop_Idq[1],
                                                           inverter_voltage);
         }
-        else if (setpoint.mode == Setpoint::Mode::Uq)
+        else
         {
-            out.reference_Udq[1] = setpoint.value;
+            out.reference_Udq[1] = setpoint_value;
             pid_Iq_.resetIntegrator();
         }
-        else
+
+        if (CrossCouplingCompensation == CrossCouplingCompensationPolicy::Enabled)
         {
-            assert(false);
+            out.reference_Udq[0] -= angular_velocity * Lq_ * loop_Idq[1];
+            out.reference_Udq[1] += angular_velocity * Lq_ * loop_Idq[0];
         }
 
-        if (cross_coupling_compensation_policy_ == CrossCouplingCompensationPolicy::Enabled)
+        // Beyond the linear limit the modulation extends into the overmodulation region, if allowed
+        Const linear_Udq_magnitude_limit = computeLineVoltageLimit(inverter_voltage, pwm_params_.upper_limit);
+        Const Udq_magnitude_limit = linear_Udq_magnitude_limit * max_modulation_ratio_;
+        Const Udq_magnitude = out.reference_Udq.norm();
+
+        if (IdReference == IdReferencePolicy::MTPAWithFieldWeakening)
         {
-            out.reference_Udq[0] -= angular_velocity * Lq_ * out.estimated_Idq[1];
-            out.reference_Udq[1] += angular_velocity * Lq_ * out.estimated_Idq[0];
+            Id_reference_generator_.update(Udq_magnitude, Udq_magnitude_limit, loop_Idq[1]);
         }
 
-        Const Udq_magnitude_limit = computeLineVoltageLimit(inverter_voltage, pwm_params_.upper_limit);
-
-        if (out.reference_Udq.norm() > Udq_magnitude_limit)
+        if (Udq_magnitude > Udq_magnitude_limit)
         {
             out.reference_Udq = out.reference_Udq.normalized() * Udq_magnitude_limit;
             out.Udq_was_limited = true;
             Udq_normalization_count_++;
         }
 
+        Const modulation_ratio = os::float_eq::positive(linear_Udq_magnitude_limit) ?
+                                 (std::min(Udq_magnitude, Udq_magnitude_limit) / linear_Udq_magnitude_limit) : 0.0F;
+
+        if (modulation_ratio > discontinuous_modulation_threshold_)
+        {
+            if (os::float_eq::positive(discontinuous_modulation_threshold_))
+            {
+                space_vector_modulation_mode_ = SpaceVectorModulationMode::BottomClamped;
+            }
+        }
+        else if (modulation_ratio < (discontinuous_modulation_threshold_ - DiscontinuousModulationHysteresis))
+        {
+            space_vector_modulation_mode_ = SpaceVectorModulationMode::Centered;
+        }
+
+        measurer.mark(board::irq_profiler::Stage::CurrentPI);
+
         /*
          * Transforming back to the stationary reference frame, updating the PWM outputs
          */
@@ -224,22 +453,153 @@ public:
         const auto pwm_setpoint_and_sector_number = performSpaceVectorTransform(reference_U_alpha_beta,
                                                                                 inverter_voltage);
         // Sector number is not used
-        if (dead_time_compensation_policy_ == DeadTimeCompensationPolicy::Enabled)
+        const auto shaped_pwm_setpoint = shapeSpaceVectorModulation(pwm_setpoint_and_sector_number.first,
+                                                                    space_vector_modulation_mode_,
+                                                                    modulation_ratio,
+                                                                    pwm_params_.upper_limit);
+        if (modulation_ratio > 1.0F)
+        {
+            // The voltage vector is distorted by the overmodulation, reporting what is actually generated
+            out.reference_Udq =
+                performParkTransform(computeVoltageFromPWMSetpoint(shaped_pwm_setpoint, inverter_voltage),
+                                     angle_sincos);
+        }
+
+        if (DeadTimeCompensation == DeadTimeCompensationPolicy::Enabled)
         {
-            out.pwm_setpoint = performDeadTimeCompensation(pwm_setpoint_and_sector_number.first,
-                                                           phase_currents_ab,
+            // The estimated Idq are filtered, so their polarity is less noisy than that of the raw measurements
+            const auto filtered_I_alpha_beta = performInverseParkTransform(out.estimated_Idq, angle_sincos);
+
+            Vector<3> filtered_phase_currents;
+            filtered_phase_currents[0] = filtered_I_alpha_beta[0];
+            filtered_phase_currents[1] = -0.5F * filtered_I_alpha_beta[0] +
+                                         (SquareRootOf3 * 0.5F) * filtered_I_alpha_beta[1];
+            filtered_phase_currents[2] = -filtered_phase_currents[0] - filtered_phase_currents[1];
+
+            out.pwm_setpoint = performDeadTimeCompensation(shaped_pwm_setpoint,
+                                                           space_vector_modulation_mode_,
+                                                           filtered_phase_currents,
                                                            pwm_params_.period,
-                                                           pwm_params_.dead_time);
+                                                           effective_dead_time_positive_,
+                                                           effective_dead_time_negative_,
+                                                           dead_time_compensation_transition_current_,
+                                                           pwm_params_.upper_limit);
         }
         else
         {
-            out.pwm_setpoint = pwm_setpoint_and_sector_number.first;
+            out.pwm_setpoint = shaped_pwm_setpoint;
         }
 
+        applied_Udq_ = out.reference_Udq;
+
+        measurer.mark(board::irq_profiler::Stage::SVM);
+
         return out;
     }
 
+    /**
+     * Runtime selector between the specialized versions, for the case when the setpoint mode may change.
+     */
+    Output onNextPWMPeriod(const Vector<2>& phase_currents_ab,
+                           Const inverter_voltage,
+                           Const angular_velocity,
+                           Const angular_position,
+                           const Setpoint setpoint)
+    {
+        if (setpoint.mode == Setpoint::Mode::Uq)
+        {
+            return onNextPWMPeriod<Setpoint::Mode::Uq>(phase_currents_ab,
+                                                       inverter_voltage,
+                                                       angular_velocity,
+                                                       angular_position,
+                                                       setpoint.value);
+        }
+        else
+        {
+            assert(setpoint.mode == Setpoint::Mode::Iq);
+            return onNextPWMPeriod<Setpoint::Mode::Iq>(phase_currents_ab,
+                                                       inverter_voltage,
+                                                       angular_velocity,
+                                                       angular_position,
+                                                       setpoint.value);
+        }
+    }
+
+    void setPhaseResistance(Const Rs)
+    {
+        pid_Id_.setPhaseResistance(Rs);
+        pid_Iq_.setPhaseResistance(Rs);
+        loop_Idq_filter_.setPhaseResistance(Rs);
+    }
+
+    /**
+     * By default, the filter is transparent, unless it is not configurable. See idq_filter.hpp.
+     */
+    void configureIdqFilter(const IdqFilterConfig& config)
+    {
+        loop_Idq_filter_.configure(config, pwm_params_.fast_irq_period);
+    }
+
+    /**
+     * By default, the modulation is continuous and linear.
+     * @param discontinuous_modulation_threshold    Modulation ratio above which the bottom clamped discontinuous
+     *                                              modulation is used; zero disables it.
+     * @param max_modulation_ratio                  Relative to the linear limit; values above one allow
+     *                                              overmodulation. @ref shapeSpaceVectorModulation().
+     */
+    void configureSpaceVectorModulation(Const discontinuous_modulation_threshold,
+                                        Const max_modulation_ratio)
+    {
+        assert(discontinuous_modulation_threshold >= 0);
+        assert(max_modulation_ratio >= 1.0F);
+        discontinuous_modulation_threshold_ = discontinuous_modulation_threshold;
+        max_modulation_ratio_ = std::min(max_modulation_ratio, OvermodulationSixStepRatio);
+    }
+
+    SpaceVectorModulationMode getSpaceVectorModulationMode() const { return space_vector_modulation_mode_; }
+
+    /**
+     * Only meaningful if the dead time compensation policy is Enabled. @ref performDeadTimeCompensation().
+     */
+    void configureDeadTimeCompensation(Const effective_dead_time_positive,
+                                       Const effective_dead_time_negative,
+                                       Const transition_current)
+    {
+        assert(effective_dead_time_positive >= 0);
+        assert(effective_dead_time_negative >= 0);
+        assert(transition_current > 0);
+        effective_dead_time_positive_ = effective_dead_time_positive;
+        effective_dead_time_negative_ = effective_dead_time_negative;
+        dead_time_compensation_transition_current_ = transition_current;
+    }
+
+    /**
+     * By default, the feed-forward is disabled. @ref InverterVoltageFeedForward.
+     */
+    void configureInverterVoltageFeedForward(const bool enabled,
+                                             Const prediction_horizon)
+    {
+        inverter_voltage_feedforward_.configure(enabled, prediction_horizon);
+    }
+
+    /**
+     * Only meaningful if the Id reference policy is not Zero. @ref IdReferenceGenerator.
+     */
+    void configureIdReference(Const Ld,
+                              Const Lq,
+                              Const phi,
+                              Const max_field_weakening_current)
+    {
+        Id_reference_generator_.configure(Ld, Lq, phi, max_field_weakening_current, pwm_params_.fast_irq_period);
+    }
+
     std::uint64_t getUdqNormalizationCounter() const { return Udq_normalization_count_; }
+
+    /// Volt, the integral terms of the Id and Iq controllers
+    Vector<2> getCurrentControllerIntegralVoltages() const
+    {
+        return Vector<2>(pid_Id_.getIntegralVoltage(), pid_Iq_.getIntegralVoltage());
+    }
 };
 
 }
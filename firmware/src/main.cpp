@@ -33,9 +33,11 @@
 
 #include "board/board.hpp"
 #include "bootloader_interface/bootloader_interface.hpp"
+#include "config_storage/config_storage.hpp"
 #include "uavcan_node/uavcan_node.hpp"
 #include "cli/cli.hpp"
 #include "foc/foc.hpp"
+#include "foc/kernel_benchmark.hpp"
 #include "motor_database/motor_database.hpp"
 #include "params.hpp"
 #include "aux_cmd_iface.hpp"
@@ -45,6 +47,11 @@
 # error "GCC version 5.x or newer is required"
 #endif
 
+/// Provided by linker; the initialized data are stored in flash right after the code
+const extern std::uint8_t _textdata_start[];
+const extern std::uint8_t _data_start[];
+const extern std::uint8_t _data_end[];
+
 
 namespace app
 {
@@ -53,8 +60,21 @@ namespace
 
 constexpr unsigned WatchdogTimeoutMSec = 1500;
 
+constexpr std::size_t ConfigStorageAddress = 0x08008000;
+constexpr std::size_t ConfigStorageSize    = 0x4000;
+
+/// Holds a copy of the configuration while the above is being compacted; it is used only if the firmware image
+/// does not reach into it. The bootloader erases it on firmware updates, which is harmless, as the copy is temporary.
+constexpr std::size_t ConfigScratchStorageAddress = 0x08040000;
+constexpr std::size_t ConfigScratchStorageSize    = 0x20000;
+
+/// The last flash sector of the application area; it is used only if the firmware image does not reach into it
+constexpr std::size_t MotorDatabaseStorageAddress = 0x08060000;
+constexpr std::size_t MotorDatabaseStorageSize    = 0x20000;
+
 /**
  * This wrapper prohibits flash access when normal operation cannot be interrupted.
+ * It is used for the configuration storage, its scratch region, and the user section of the motor database.
  */
 class CustomConfigStorageBackend : public os::stm32::ConfigStorageBackend
 {
@@ -68,7 +88,11 @@ class CustomConfigStorageBackend : public os::stm32::ConfigStorageBackend
         if (canModifyStorageNow() &&
             board::motor::suspend())
         {
-            const int res = os::stm32::ConfigStorageBackend::write(offset, data, len);
+            int res = 0;
+            {
+                board::WatchdogTimeoutExtender watchdog_timeout_extender;     // The CPU is stalled until done
+                res = os::stm32::ConfigStorageBackend::write(offset, data, len);
+            }
             board::motor::unsuspend();
             if (res < 0)
             {
@@ -90,7 +114,11 @@ class CustomConfigStorageBackend : public os::stm32::ConfigStorageBackend
         if (canModifyStorageNow() &&
             board::motor::suspend())
         {
-            const int res = os::stm32::ConfigStorageBackend::erase();
+            int res = 0;
+            {
+                board::WatchdogTimeoutExtender watchdog_timeout_extender;     // The CPU is stalled until done
+                res = os::stm32::ConfigStorageBackend::erase();
+            }
             board::motor::unsuspend();
             if (res < 0)
             {
@@ -106,9 +134,9 @@ class CustomConfigStorageBackend : public os::stm32::ConfigStorageBackend
     }
 
 public:
-    CustomConfigStorageBackend() :
-        os::stm32::ConfigStorageBackend(reinterpret_cast<void*>(0x08008000),
-                                        0x4000)
+    CustomConfigStorageBackend(std::size_t address,
+                               std::size_t size) :
+        os::stm32::ConfigStorageBackend(reinterpret_cast<void*>(address), size)
     { }
 
     static bool canModifyStorageNow()
@@ -117,7 +145,16 @@ public:
                (board::motor::PWMHandle::getTotalNumberOfActiveHandles() == 0) &&
                !board::motor::isCalibrationInProgress();
     }
-} g_config_storage_backend;
+};
+
+CustomConfigStorageBackend g_config_storage_backend(ConfigStorageAddress, ConfigStorageSize);
+CustomConfigStorageBackend g_config_scratch_storage_backend(ConfigScratchStorageAddress, ConfigScratchStorageSize);
+CustomConfigStorageBackend g_motor_database_storage_backend(MotorDatabaseStorageAddress, MotorDatabaseStorageSize);
+
+/**
+ * The configuration core talks to this one; it writes only the changed bytes into the backend defined above.
+ */
+config_storage::LogStructuredStorage g_config_storage(g_config_storage_backend, ConfigStorageSize);
 
 os::Logger g_logger("Main");
 
@@ -189,15 +226,56 @@ auto onFirmwareUpdateRequestedFromUAVCAN(
     return uavcan::protocol::file::BeginFirmwareUpdate::Response::ERROR_OK;
 }
 
+/**
+ * Tasks without debug variables have no selection parameters; their selection is left at the default.
+ */
+void applyDebugVariableSelections()
+{
+    for (unsigned id = 0; id < foc::debug_stream::MaxTaskTypes; id++)
+    {
+        foc::debug_stream::setSelection(std::uint8_t(id), params::readDebugVariableSelection(foc::TaskID(id)));
+    }
+}
+
+/**
+ * Logs the duration of every boot phase, so that the time to readiness can be tracked.
+ */
+class BootPhaseTimer
+{
+    ::systime_t phase_started_at_ = chVTGetSystemTimeX();
+
+public:
+    void completePhase(const char* const name)
+    {
+        const auto now = chVTGetSystemTimeX();
+        g_logger.println("Boot phase '%s' took %u ms, %u ms since boot",
+                         name, unsigned(ST2MS(::systime_t(now - phase_started_at_))), unsigned(ST2MS(now)));
+        phase_started_at_ = now;
+    }
+};
+
 /**
  * This is invoked once immediately after boot.
+ * The interfaces are started while the power on self test is in progress, so that the CAN bitrate detection and
+ * the node ID allocation, which are performed by the UAVCAN node thread, run in parallel with it.
+ * The self test is started before the interfaces, because the test can't be interrupted by setpoint commands,
+ * while a command received from the idle state would start the motor and the self test would be skipped.
  */
 os::watchdog::Timer init()
 {
+    BootPhaseTimer boot_phase_timer;
+
+    const std::size_t image_end = reinterpret_cast<std::size_t>(&_textdata_start[0]) +
+                                  std::size_t(&_data_end[0] - &_data_start[0]);
+    if (image_end <= ConfigScratchStorageAddress)
+    {
+        g_config_storage.setScratchRegion(g_config_scratch_storage_backend, ConfigScratchStorageSize);
+    }
+
     /*
      * Board initialization
      */
-    auto watchdog = board::init(WatchdogTimeoutMSec, g_config_storage_backend);
+    auto watchdog = board::init(WatchdogTimeoutMSec, g_config_storage);
 
     board::setRGBLED(board::RGB::Ones());
 
@@ -217,32 +295,49 @@ os::watchdog::Timer init()
         g_logger.puts("Bootloader struct is NOT present");
     }
 
+    boot_phase_timer.completePhase("board");
+
     /*
-     * Motor initialization
+     * Motor initialization; the current sensor calibration proceeds in the background
      */
     board::motor::init();
     foc::init(params::readFOCParameters());
-
-    // Power on self test
-    g_logger.puts("Testing hardware...");
-
-    foc::beginHardwareTest();
-
-    while (foc::isHardwareTestInProgress())
+    applyDebugVariableSelections();
     {
-        ::sleep(1);
+        const auto blackbox_config = params::readBlackboxConfig();
+        if (blackbox_config.arm_at_boot)
+        {
+            foc::blackbox::arm(blackbox_config);
+        }
     }
 
-    g_logger.puts(foc::getHardwareTestReport().toString().c_str());
+    boot_phase_timer.completePhase("motor");
 
-    board::motor::printStatus();
+    // Power on self test; it runs in the background while the interfaces are being started
+    g_logger.puts("Testing hardware...");
 
-    // Clearing faults
-    foc::stop();
+    foc::beginHardwareTest();
 
     /*
      * Interfaces
      */
+    if (image_end > ConfigScratchStorageAddress)
+    {
+        g_logger.println("CONFIG SCRATCH REGION DISABLED: IMAGE ENDS AT 0x%08x", unsigned(image_end));
+    }
+
+    if (image_end <= MotorDatabaseStorageAddress)
+    {
+        motor_database::init(g_motor_database_storage_backend,
+                             reinterpret_cast<const void*>(MotorDatabaseStorageAddress),
+                             MotorDatabaseStorageSize);
+        g_logger.println("Motor database user entries: %u", motor_database::getNumberOfUserEntries());
+    }
+    else
+    {
+        g_logger.println("MOTOR DATABASE USER SECTION DISABLED: IMAGE ENDS AT 0x%08x", unsigned(image_end));
+    }
+
     cli::init(&onRebootRequested);
 
     uavcan_node::init(app_shared_available ? app_shared.can_bus_speed : 0,
@@ -253,6 +348,35 @@ os::watchdog::Timer init()
                       &onFirmwareUpdateRequestedFromUAVCAN,
                       &onRebootRequested);
 
+    boot_phase_timer.completePhase("interfaces");
+
+    while (foc::isHardwareTestInProgress())
+    {
+        watchdog.reset();
+        ::usleep(10000);
+    }
+
+    g_logger.puts(foc::getHardwareTestReport().toString().c_str());
+
+    board::motor::printStatus();
+
+    // Clearing faults
+    foc::stop();
+
+    if (foc::kernel_benchmark::isEnabledAtBoot())
+    {
+        const auto result = foc::kernel_benchmark::run();
+        g_logger.println("Kernel benchmark, %u iterations:", result.num_iterations);
+        for (unsigned i = 0; i < foc::kernel_benchmark::NumKernels; i++)
+        {
+            g_logger.puts(result.toString(foc::kernel_benchmark::Kernel(i)).c_str());
+        }
+        g_logger.puts(result.isSuccessful() ? "Kernel benchmark OK" : "KERNEL BENCHMARK FAILED");
+    }
+
+    boot_phase_timer.completePhase("self test");
+
+    // The auxiliary commands may start the motor, so they are accepted only after the self test
     aux_cmd_iface::init();
 
     return watchdog;
@@ -293,9 +417,22 @@ class BackgroundConfigManager
         return false;
     }
 
-    static void doReload()
+    void doReload()
     {
-        foc::setParameters(params::readFOCParameters());
+        /*
+         * The modification counter doesn't tell which parameters have been changed, so we compare the results.
+         * Publishing a new context generation is not free - the idle task gets restarted, the running task has
+         * to check the changes - so this is done only if something has actually changed.
+         */
+        const auto new_params = params::readFOCParameters();
+        const auto changes = new_params.findChanges(foc::getParameters());
+        if (changes.any())
+        {
+            logger.println("FOC changes: %s%s", changes.toString().c_str(),
+                           changes.canBeAppliedAtRunTime() ? "" : "(not applicable to the running motor)");
+            foc::setParameters(new_params);
+        }
+        applyDebugVariableSelections();
         // TODO: Reload some other parameters, e.g. UAVCAN
     }
 
@@ -330,12 +467,20 @@ public:
                 g_config_storage_backend.canModifyStorageNow())
             {
                 logger.println("Saving [modcnt=%u]", modification_counter_);
-                const int res = os::config::save();
+                int res = os::config::save();
+                if (res >= 0)
+                {
+                    res = g_config_storage.flush();
+                }
                 if (res >= 0)
                 {
                     pending_save_ = false;
                     last_save_failed_ = false;
                     just_saved_ = true;
+
+                    const auto stat = g_config_storage.getStatistics();
+                    logger.println("Log usage %u/%u bytes, %u erasures", unsigned(stat.log_bytes_used),
+                                   unsigned(stat.log_bytes_total), unsigned(stat.num_erasures));
                 }
                 else
                 {
@@ -344,6 +489,19 @@ public:
                 }
             }
         }
+        else if (g_config_storage.hasPendingChanges() &&
+                 g_config_storage_backend.canModifyStorageNow())
+        {
+            // E.g. the config was erased from the CLI, or a write was denied while the motor was running
+            const int res = g_config_storage.flush();
+            if (res < 0)
+            {
+                logger.println("FLUSH ERROR %d '%s'", res, std::strerror(std::abs(res)));
+                pending_save_ = true;               // Will be retried after the error delay
+                last_save_failed_ = true;
+                last_modification_ts_ = chVTGetSystemTimeX();
+            }
+        }
     }
 
     bool hasBeenReloaded() { return doDestructiveTruthTest(just_reloaded_); }
@@ -389,7 +547,12 @@ public:
 void updateUAVCANNodeStatus(const bool board_ok,
                             const std::uint8_t board_health_mask)
 {
-    uavcan_node::setNodeHealth(board_ok ? uavcan_node::NodeHealth::OK : uavcan_node::NodeHealth::Warning);
+    // The motor control IRQs shedding their load is not a fault, but the node is not fully functional either
+    const bool irq_budget_ok =
+        foc::getIRQBudgetStatus().degradation_level == foc::IRQBudgetMonitor::DegradationLevel::None;
+
+    uavcan_node::setNodeHealth((board_ok && irq_budget_ok) ? uavcan_node::NodeHealth::OK :
+                                                             uavcan_node::NodeHealth::Warning);
 
     std::uint16_t vssc = std::uint16_t(board_health_mask << 8);
 
@@ -531,6 +694,9 @@ int main()
 
         integrity_checker.check();
 
+        // Erasing the flash stalls the CPU for about 2 s, the backend extends the watchdog timeout meanwhile
+        motor_database::commitUserSection();
+
         config_manager.poll();
         if (config_manager.hasBeenSaved())
         {
@@ -31,6 +31,7 @@
 #include <type_traits>
 #include <cmath>
 #include <cstdint>
+#include <limits>
 #include <zubax_chibios/util/heapless.hpp>
 
 
@@ -210,8 +211,98 @@ public:
     auto getNumSamples() const { return num_samples_; }
 };
 
+/**
+ * Same as @ref CumulativeAverageComputer, but avoids wide arithmetic on every sample:
+ * the samples are summed up in batches of the native precision, which are then folded into the wide accumulator.
+ * This is meant for the fast IRQ, where software-emulated double precision additions are too expensive.
+ * The rounding error is bounded by the batch size rather than by the total number of samples.
+ * The spread of the batch means yields the standard error of the average (the method of batch means), which stays
+ * valid for correlated samples, as long as the correlation time is well below the duration of one batch.
+ */
+template <typename T = Scalar, typename Wide = double, unsigned BatchSize = 256>
+class BatchedCumulativeAverageComputer
+{
+    static_assert(BatchSize > 0, "Invalid batch size");
 
-inline Vector<2> sincos(Scalar x)
+    std::uint32_t num_samples_ = 0;
+    std::uint32_t batch_num_samples_ = 0;
+    std::uint32_t num_batches_ = 0;
+    T batch_accumulator_{};
+    Wide accumulator_{};
+    Wide batch_means_sum_{};
+    Wide batch_means_squares_sum_{};
+
+public:
+    void addSample(const T& x)
+    {
+        num_samples_++;
+        batch_accumulator_ += x;
+
+        if (++batch_num_samples_ >= BatchSize)
+        {
+            const Wide batch_sum = Wide(batch_accumulator_);
+            const Wide batch_mean = batch_sum / Wide(BatchSize);
+
+            accumulator_ += batch_sum;
+            batch_means_sum_ += batch_mean;
+            batch_means_squares_sum_ += batch_mean * batch_mean;
+            num_batches_++;
+
+            batch_accumulator_ = T();
+            batch_num_samples_ = 0;
+        }
+    }
+
+    T getAverage() const
+    {
+        if (num_samples_ > 0)
+        {
+            return T((accumulator_ + Wide(batch_accumulator_)) / Wide(num_samples_));
+        }
+        else
+        {
+            assert(false);
+            return T();
+        }
+    }
+
+    auto getNumSamples() const { return num_samples_; }
+
+    /**
+     * Number of complete batches, which the standard error is computed from.
+     */
+    auto getNumBatches() const { return num_batches_; }
+
+    /**
+     * True right after a batch has been folded, until the next sample is added.
+     * Lets the caller evaluate the standard error, which requires wide arithmetic, once per batch.
+     */
+    bool isBatchComplete() const { return (num_batches_ > 0) && (batch_num_samples_ == 0); }
+
+    /**
+     * Standard error of the average, in the same units as the samples.
+     * Returns the max value of the type if there are not enough batches yet.
+     */
+    T getStandardError() const
+    {
+        if (num_batches_ < 2)
+        {
+            return std::numeric_limits<T>::max();
+        }
+
+        const Wide n = Wide(num_batches_);
+        const Wide mean = batch_means_sum_ / n;
+        const Wide variance = std::max(Wide(0), (batch_means_squares_sum_ - n * mean * mean) / (n - Wide(1)));
+
+        return T(std::sqrt(variance / n));
+    }
+};
+
+
+/**
+ * Returns {sin(x), cos(x)} computed by the standard library.
+ */
+inline Vector<2> preciseSincos(Scalar x)
 {
     // Normally this should be replaced with a call to sincos(), but this is not a part of C++ standard library.
     // However, the compiler should be able to replace the two separate but localized calls to
@@ -219,6 +310,102 @@ inline Vector<2> sincos(Scalar x)
     return { std::sin(x), std::cos(x) };
 }
 
+/**
+ * Implementation details, do not use directly.
+ */
+namespace impl_
+{
+/**
+ * Taylor series, used to generate the lookup table at compile time. Valid in the range [0, Pi/2].
+ */
+constexpr double computeSineAtCompileTime(const double x)
+{
+    double term = x;
+    double sum = x;
+    for (int i = 1; i < 12; i++)
+    {
+        term *= -(x * x) / double((2 * i) * (2 * i + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+/**
+ * Quarter-wave sine table, the last entry duplicates sin(Pi/2) in order to avoid bound checks during interpolation.
+ */
+template <unsigned Size>
+struct QuarterSineTable
+{
+    static_assert((Size & (Size - 1U)) == 0, "Size must be a power of two");
+
+    float values[Size + 1] = {};
+
+    constexpr QuarterSineTable()
+    {
+        for (unsigned i = 0; i <= Size; i++)
+        {
+            values[i] = float(computeSineAtCompileTime((3.141592653589793 / 2.0) * double(i) / double(Size)));
+        }
+    }
+};
+
+}
+
+/**
+ * Returns {sin(x), cos(x)} using a compile-time generated quarter-wave lookup table with linear interpolation.
+ * The argument must be non-negative; arbitrarily large values are wrapped for free.
+ * The absolute error does not exceed 5e-6, which is on par with the single precision libm routines within the
+ * range of interest.
+ */
+inline Vector<2> fastSincos(Scalar x)
+{
+    constexpr unsigned QuarterSize = 256;
+    constexpr unsigned FullSize = QuarterSize * 4U;
+
+    static constexpr impl_::QuarterSineTable<QuarterSize> Table;
+
+    assert(x >= 0);
+
+    Const position = x * (Scalar(FullSize) / Pi2);
+    const auto integral = std::uint32_t(position);
+    Const fraction = position - Scalar(integral);
+
+    static const auto sample = [](const std::uint32_t index, Const frac)
+    {
+        const std::uint32_t quadrant = (index / QuarterSize) % 4U;
+        const std::uint32_t offset = index % QuarterSize;
+
+        Scalar y = 0;
+        if ((quadrant & 1U) == 0)
+        {
+            y = Table.values[offset] + (Table.values[offset + 1U] - Table.values[offset]) * frac;
+        }
+        else
+        {
+            y = Table.values[QuarterSize - offset] +
+                (Table.values[QuarterSize - offset - 1U] - Table.values[QuarterSize - offset]) * frac;
+        }
+        return (quadrant < 2U) ? y : -y;
+    };
+
+    return { sample(integral, fraction),
+             sample(integral + QuarterSize, fraction) };
+}
+
+/**
+ * Returns {sin(x), cos(x)}.
+ * The implementation is selected at build time via MATH_USE_TABULATED_SINCOS: the lookup table is much faster,
+ * and the standard library is slightly more accurate. The argument must be non-negative.
+ */
+inline Vector<2> sincos(Scalar x)
+{
+#if defined(MATH_USE_TABULATED_SINCOS) && MATH_USE_TABULATED_SINCOS
+    return fastSincos(x);
+#else
+    return preciseSincos(x);
+#endif
+}
+
 /**
  * Implementation details, do not use directly.
  */
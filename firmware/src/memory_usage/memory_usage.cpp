@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "memory_usage.hpp"
+
+/*
+ * Defined in the linker script
+ */
+extern const std::uint8_t __main_stack_base__[];
+extern const std::uint8_t __main_stack_end__[];
+extern const std::uint8_t __main_thread_stack_base__[];
+extern const std::uint8_t __main_thread_stack_end__[];
+
+
+namespace memory_usage
+{
+namespace
+{
+
+unsigned countPaintedBytes(const std::uint8_t* bottom, const std::uint8_t* top)
+{
+    const std::uint8_t* p = bottom;
+    while ((p < top) && (*p == CH_DBG_STACK_FILL_VALUE))
+    {
+        p++;
+    }
+    return unsigned(p - bottom);
+}
+
+}
+
+StackUsage getIRQStackUsage()
+{
+    StackUsage out;
+    out.name = "irq";
+    out.size = unsigned(__main_stack_end__ - __main_stack_base__);
+    out.free = countPaintedBytes(__main_stack_base__, __main_stack_end__);
+    return out;
+}
+
+
+StackUsage getThreadStackUsage(const ::thread_t* tp)
+{
+    const auto bottom = reinterpret_cast<const std::uint8_t*>(tp->p_stklimit);
+
+    // The scan stops at the stack pointer; the one saved in the context is stale for the calling thread
+    const std::uint8_t marker = 0;
+    const auto top = (tp == chThdGetSelfX()) ? &marker : reinterpret_cast<const std::uint8_t*>(tp->p_ctx.r13);
+
+    StackUsage out;
+    out.name = (tp->p_name != nullptr) ? tp->p_name : "";
+    out.free = countPaintedBytes(bottom, top);
+
+    if (bottom == __main_thread_stack_base__)
+    {
+        out.size = unsigned(__main_thread_stack_end__ - __main_thread_stack_base__);
+    }
+
+    return out;
+}
+
+
+unsigned getThreadStackUsage(StackUsage* out, unsigned capacity)
+{
+    unsigned num_threads = 0;
+
+    // The walk must be completed, because the registry holds a reference to the returned thread until the next one
+    ::thread_t* tp = chRegFirstThread();
+    do
+    {
+        if (num_threads < capacity)
+        {
+            out[num_threads] = getThreadStackUsage(tp);
+        }
+        num_threads++;
+        tp = chRegNextThread(tp);
+    }
+    while (tp != nullptr);
+
+    return num_threads;
+}
+
+}
@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <ch.hpp>
+#include <cstdint>
+
+
+namespace memory_usage
+{
+/**
+ * Stack usage is measured by stack painting. The stacks are filled with a known pattern before use: the thread stacks
+ * by the kernel (CH_DBG_FILL_THREADS), the IRQ stack and the stack of the main thread by the startup code; so the
+ * bytes that still contain the pattern have never been used since boot. The free space may be overestimated by a few
+ * bytes if the deepest used bytes happen to contain the pattern value.
+ */
+struct StackUsage
+{
+    const char* name = "";
+    unsigned size = 0;          ///< Byte; zero if unknown
+    unsigned free = 0;          ///< Byte, never used since boot
+
+    /// Zero if the size is unknown
+    unsigned getPeakUsage() const { return (size > free) ? (size - free) : 0; }
+};
+
+/**
+ * The IRQ stack is the main stack of the core (MSP), reserved in the linker script.
+ */
+StackUsage getIRQStackUsage();
+
+/**
+ * The size of the thread stack is known only for the main thread.
+ */
+StackUsage getThreadStackUsage(const ::thread_t* tp);
+
+/**
+ * Walks the thread registry, writing at most the specified number of entries.
+ * @return The number of threads, which may exceed the capacity of the output.
+ */
+unsigned getThreadStackUsage(StackUsage* out, unsigned capacity);
+
+}
@@ -23,6 +23,12 @@
  */
 
 #include "motor_database.hpp"
+#include <zubax_chibios/os.hpp>
+#include <algorithm>
+#include <iterator>
+#include <array>
+#include <cstring>
+#include <cerrno>
 
 
 namespace motor_database
@@ -33,79 +39,549 @@ namespace
 using foc::MotorParameters;
 using math::Scalar;
 
+os::Logger g_logger("MotorDatabase");
+
+constexpr Entry makeEntry(const char* name,
+                          unsigned num_poles,
+                          Scalar max_current,
+                          Scalar phi,
+                          Scalar rs,
+                          Scalar lq,
+                          Scalar ld = 0)
+{
+    MotorParameters p;
+    p.num_poles   = std::uint_fast8_t(num_poles);
+    p.max_current = max_current;
+    p.phi         = phi;
+    p.rs          = rs;
+    p.lq          = lq;
+    p.ld          = ld;
+    return Entry(name, p);
+}
+
 /**
  * Motor database entries go here.
+ * The missing parameters are deduced at compile time; the whole table resides in flash.
  */
-static const Entry g_entries[] =
+constexpr Entry BuiltinEntries[] =
 {
-    Entry("T-Motor MT2216-12", []()
+    //        Name                     Poles  Imax    Phi [Wb]    Rs [Ohm]  Lq [H]
+    makeEntry("T-Motor MT2216-12",     14,    18.0F,  1.06e-3F,   0.11F,    23e-6F),
+    makeEntry("T-Motor U8-16",         28,    24.0F,  3.938e-3F,  0.11F,    78.7e-6F),
+    makeEntry("Maxon 339285",          16,    3.5F,   1.814e-3F,  0.232F,   161e-6F)
+};
+
+constexpr unsigned NumBuiltinEntries = sizeof(BuiltinEntries) / sizeof(BuiltinEntries[0]);
+
+/*
+ * Name hashing, shared by the compile time table and the runtime index of the user section.
+ */
+constexpr char toLowerCase(char c)
+{
+    return (c >= 'A' && c <= 'Z') ? char(c - 'A' + 'a') : c;
+}
+
+constexpr std::uint32_t hashName(const char* name, std::uint32_t seed)
+{
+    std::uint32_t hash = 2166136261U ^ seed;                            // FNV-1a
+    for (unsigned i = 0; (i < Entry::MaxNameLength) && (name[i] != '\0'); i++)
     {
-        MotorParameters p;
-        p.num_poles               = 14;
-        p.max_current             = 18.0F;
-        p.phi                     = 1.06e-3F;
-        p.rs                      = 0.11F;
-        p.lq                      = 23e-6F;
-        return p;
-    }),
+        hash = (hash ^ std::uint8_t(toLowerCase(name[i]))) * 16777619U;
+    }
+    // The low bits of FNV-1a depend only on the low bits of the input, so they are mixed with the high bits
+    hash ^= hash >> 16;
+    hash *= 0x45D9F3BU;
+    hash ^= hash >> 16;
+    return hash;
+}
 
-    Entry("T-Motor U8-16", []()
+constexpr bool namesMatch(const char* a, const char* b)
+{
+    for (unsigned i = 0; i < Entry::MaxNameLength; i++)
     {
-        MotorParameters p;
-        p.num_poles               = 28;
-        p.max_current             = 24.0F;
-        p.phi                     = 3.938e-3F;
-        p.rs                      = 0.11F;
-        p.lq                      = 78.7e-6F;
-        return p;
-    }),
+        if (toLowerCase(a[i]) != toLowerCase(b[i]))
+        {
+            return false;
+        }
+        if (a[i] == '\0')
+        {
+            return true;
+        }
+    }
+    return true;
+}
 
-    Entry("Maxon 339285", []()
+constexpr bool isNameValid(const char* name)
+{
+    for (unsigned i = 0; i < Entry::MaxNameLength; i++)
     {
-        MotorParameters p;
-        p.num_poles               = 16;
-        p.max_current             = 3.5F;
-        p.phi                     = 1.814e-3F;
-        p.rs                      = 0.232F;
-        p.lq                      = 161e-6F;
-        return p;
-    })
+        if (name[i] == '\0')
+        {
+            return i > 0;
+        }
+    }
+    return false;
+}
+
+constexpr unsigned roundUpToPowerOfTwo(unsigned x)
+{
+    unsigned y = 1;
+    while (y < x)
+    {
+        y *= 2;
+    }
+    return y;
+}
+
+/**
+ * Perfect hash of the built-in names, constructed at compile time with the hash-and-displace method.
+ * The first hash splits the names into small buckets; then each bucket is assigned a seed of the second hash
+ * such that all names of the bucket land in free slots. Larger buckets are placed first, while the table is emptier.
+ * The table is at least twice larger than the number of entries, so the search is short.
+ */
+struct PerfectHashTable
+{
+    static constexpr std::uint8_t EmptySlot = 0xFF;
+    static constexpr std::uint16_t MaxSeed = 0xFFFF;
+
+    static constexpr unsigned Size       = roundUpToPowerOfTwo(NumBuiltinEntries * 2);
+    static constexpr unsigned NumBuckets = roundUpToPowerOfTwo((NumBuiltinEntries + 1) / 2);
+
+    std::uint16_t seeds[NumBuckets] = {};
+    std::uint8_t slots[Size] = {};
+    bool valid = false;
+
+    static constexpr unsigned getBucket(const char* name)
+    {
+        return hashName(name, 0) % NumBuckets;
+    }
+
+    static constexpr unsigned getSlot(const char* name, std::uint16_t seed)
+    {
+        return hashName(name, seed + 1U) % Size;
+    }
+
+    constexpr bool placeBucket(unsigned bucket)
+    {
+        for (std::uint16_t seed = 0; seed < MaxSeed; seed++)
+        {
+            bool fits = true;
+            for (unsigned i = 0; (i < NumBuiltinEntries) && fits; i++)
+            {
+                if (getBucket(BuiltinEntries[i].name) == bucket)
+                {
+                    auto& slot = slots[getSlot(BuiltinEntries[i].name, seed)];
+                    fits = slot == EmptySlot;
+                    if (fits)
+                    {
+                        slot = std::uint8_t(i);
+                    }
+                }
+            }
+
+            if (fits)
+            {
+                seeds[bucket] = seed;
+                return true;
+            }
+
+            for (unsigned i = 0; i < NumBuiltinEntries; i++)        // Roll back the partially placed bucket
+            {
+                auto& slot = slots[getSlot(BuiltinEntries[i].name, seed)];
+                if ((getBucket(BuiltinEntries[i].name) == bucket) && (slot == i))
+                {
+                    slot = EmptySlot;
+                }
+            }
+        }
+        return false;
+    }
+
+    static constexpr PerfectHashTable build()
+    {
+        PerfectHashTable table;
+        for (auto& slot : table.slots)
+        {
+            slot = EmptySlot;
+        }
+
+        unsigned bucket_sizes[NumBuckets] = {};
+        for (const auto& e : BuiltinEntries)
+        {
+            bucket_sizes[getBucket(e.name)]++;
+        }
+
+        for (unsigned size = NumBuiltinEntries; size > 0; size--)
+        {
+            for (unsigned bucket = 0; bucket < NumBuckets; bucket++)
+            {
+                if ((bucket_sizes[bucket] == size) && !table.placeBucket(bucket))
+                {
+                    return table;
+                }
+            }
+        }
+
+        table.valid = true;
+        return table;
+    }
+
+    int find(const char* name) const
+    {
+        const unsigned index = slots[getSlot(name, seeds[getBucket(name)])];
+        if ((index != EmptySlot) && namesMatch(BuiltinEntries[index].name, name))
+        {
+            return int(index);
+        }
+        return -1;
+    }
+};
+
+constexpr bool areBuiltinNamesValid()
+{
+    for (const auto& e : BuiltinEntries)
+    {
+        if (!isNameValid(e.name))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(NumBuiltinEntries > 0, "Empty motor database");
+static_assert(NumBuiltinEntries < PerfectHashTable::EmptySlot, "Too many motor database entries");
+static_assert(areBuiltinNamesValid(), "Motor database name is empty or too long");
+
+constexpr PerfectHashTable BuiltinNameTable = PerfectHashTable::build();
+
+static_assert(BuiltinNameTable.valid, "Could not construct the perfect hash of the names");
+
+/**
+ * See the format description in the header.
+ */
+struct UserSectionHeader
+{
+    std::uint32_t magic;
+    std::uint32_t num_records;
+};
+
+struct UserRecord
+{
+    char name[Entry::MaxNameLength];
+    std::uint8_t num_poles;
+    std::uint8_t reserved[3];
+    float max_current;
+    float phi;
+    float rs;
+    float lq;
+    float ld;
 };
 
+static_assert(sizeof(UserSectionHeader) == 8, "Unexpected header layout");
+static_assert(sizeof(UserRecord) == UserRecordSize, "Unexpected record layout");
+
+constexpr unsigned UserSectionMaxSize = sizeof(UserSectionHeader) + MaxUserEntries * sizeof(UserRecord);
+
+/**
+ * The valid records of the user section are indexed in RAM once the section is loaded; the name index is
+ * an open addressing hash table with linear probing, which is short because the table is at least half empty.
+ * The entries are constructed from the records on lookup.
+ * The file is received into RAM, and committed into flash from the main thread once it is complete, because
+ * erasing the sector takes about 2 s, which is too long for the thread that serves the file transfer.
+ */
+class UserSection
+{
+    static constexpr unsigned IndexSize = MaxUserEntries * 2;
+    static constexpr std::uint8_t EmptySlot = 0xFF;
+
+    static_assert(MaxUserEntries < EmptySlot, "Index type is too small");
+
+    mutable chibios_rt::Mutex mutex_;
+
+    os::config::IStorageBackend* storage_ = nullptr;
+    const std::uint8_t* base_ = nullptr;
+    std::size_t size_ = 0;
+
+    std::uint8_t records_[MaxUserEntries] = {};     ///< Entry index --> record index
+    unsigned num_entries_ = 0;
+    std::uint8_t name_index_[IndexSize];            ///< Name hash --> entry index
+
+    std::array<std::uint8_t, UserSectionMaxSize> staging_{};   ///< The file being received
+    std::size_t staged_size_ = 0;
+    bool commit_pending_ = false;
+
+    const UserRecord& getRecord(unsigned record_index) const
+    {
+        return static_cast<const UserRecord*>(static_cast<const void*>(base_ + sizeof(UserSectionHeader)))
+            [record_index];
+    }
+
+    Entry makeEntryUnlocked(unsigned entry_index) const
+    {
+        const auto& rec = getRecord(records_[entry_index]);
+
+        MotorParameters p;
+        p.num_poles   = rec.num_poles;
+        p.max_current = rec.max_current;
+        p.phi         = rec.phi;
+        p.rs          = rec.rs;
+        p.lq          = rec.lq;
+        p.ld          = rec.ld;
+        return Entry(rec.name, p);
+    }
+
+    int findUnlocked(const char* name) const
+    {
+        for (unsigned slot = hashName(name, 0) % IndexSize;
+             name_index_[slot] != EmptySlot;
+             slot = (slot + 1) % IndexSize)
+        {
+            if (namesMatch(getRecord(records_[name_index_[slot]]).name, name))
+            {
+                return name_index_[slot];
+            }
+        }
+        return -1;
+    }
+
+    void load()
+    {
+        num_entries_ = 0;
+        std::fill(std::begin(name_index_), std::end(name_index_), EmptySlot);
+
+        if (base_ == nullptr)
+        {
+            return;
+        }
+
+        const auto& header = *static_cast<const UserSectionHeader*>(static_cast<const void*>(base_));
+        if (header.magic != UserSectionMagic)
+        {
+            return;
+        }
+
+        const unsigned num_records = unsigned(std::min<std::size_t>(header.num_records,
+                                                                    (size_ - sizeof(UserSectionHeader)) /
+                                                                    sizeof(UserRecord)));
+        for (unsigned i = 0; i < num_records; i++)
+        {
+            const auto& rec = getRecord(i);
+            if (!isNameValid(rec.name) ||
+                (findUnlocked(rec.name) >= 0))
+            {
+                continue;
+            }
 
-constexpr unsigned NumEntries = sizeof(g_entries) / sizeof(g_entries[0]);
+            records_[num_entries_] = std::uint8_t(i);
+            if (!makeEntryUnlocked(num_entries_).parameters.isValid())
+            {
+                continue;
+            }
+
+            unsigned slot = hashName(rec.name, 0) % IndexSize;
+            while (name_index_[slot] != EmptySlot)
+            {
+                slot = (slot + 1) % IndexSize;
+            }
+            name_index_[slot] = std::uint8_t(num_entries_);
+            num_entries_++;
+        }
+    }
+
+public:
+    UserSection()
+    {
+        std::fill(std::begin(name_index_), std::end(name_index_), EmptySlot);
+    }
+
+    void init(os::config::IStorageBackend& storage,
+              const void* address,
+              std::size_t size)
+    {
+        os::MutexLocker locker(mutex_);
+        storage_ = &storage;
+        base_ = static_cast<const std::uint8_t*>(address);
+        size_ = std::min<std::size_t>(size, UserSectionMaxSize);
+        load();
+    }
+
+    int write(std::uint32_t offset, const std::uint8_t* data, std::size_t size)
+    {
+        os::MutexLocker locker(mutex_);
+
+        if (storage_ == nullptr)
+        {
+            return -ENODEV;
+        }
+        if (commit_pending_)
+        {
+            return -EBUSY;
+        }
+
+        if (offset == 0)
+        {
+            staged_size_ = 0;               // A new transfer, the previous one is discarded if incomplete
+        }
+        if (std::size_t(offset) != staged_size_)
+        {
+            return -EINVAL;                 // The file must be written sequentially
+        }
+        if ((std::size_t(offset) + size) > size_)
+        {
+            return -EFBIG;
+        }
+
+        std::copy_n(data, size, staging_.begin() + offset);
+        staged_size_ += size;
+
+        if (staged_size_ >= sizeof(UserSectionHeader))
+        {
+            UserSectionHeader header;
+            std::memcpy(&header, staging_.data(), sizeof(header));
+            if (header.magic != UserSectionMagic)
+            {
+                staged_size_ = 0;
+                return -EINVAL;
+            }
+
+            const std::size_t file_size = sizeof(UserSectionHeader) +
+                                          std::size_t(header.num_records) * sizeof(UserRecord);
+            if ((header.num_records > MaxUserEntries) ||
+                (file_size > size_))
+            {
+                staged_size_ = 0;
+                return -EFBIG;
+            }
+
+            if (staged_size_ >= file_size)
+            {
+                staged_size_ = file_size;
+                commit_pending_ = true;
+            }
+        }
+
+        return 0;
+    }
+
+    void commit()
+    {
+        os::MutexLocker locker(mutex_);
+
+        if (!commit_pending_)
+        {
+            return;
+        }
+
+        int res = storage_->erase();
+        if (res >= 0)
+        {
+            res = storage_->write(0, staging_.data(), staged_size_);
+        }
+
+        if (res == -EACCES)
+        {
+            return;                         // The motor is running, will retry later
+        }
+
+        commit_pending_ = false;
+        staged_size_ = 0;
+        load();
+
+        if (res < 0)
+        {
+            g_logger.println("COMMIT FAILED: ERROR %d", res);
+        }
+        else
+        {
+            g_logger.println("Committed, %u user entries", num_entries_);
+        }
+    }
+
+    Entry getByIndex(unsigned index) const
+    {
+        os::MutexLocker locker(mutex_);
+        return (index < num_entries_) ? makeEntryUnlocked(index) : Entry();
+    }
+
+    Entry getByName(const char* name) const
+    {
+        os::MutexLocker locker(mutex_);
+        const int index = findUnlocked(name);
+        return (index >= 0) ? makeEntryUnlocked(unsigned(index)) : Entry();
+    }
+
+    unsigned getNumEntries() const
+    {
+        os::MutexLocker locker(mutex_);
+        return num_entries_;
+    }
+} g_user_section;
+
+constexpr std::uint8_t UserSection::EmptySlot;
 
 }
 
+void init(os::config::IStorageBackend& user_section_storage,
+          const void* user_section_address,
+          std::size_t user_section_size)
+{
+    g_user_section.init(user_section_storage, user_section_address, user_section_size);
+}
+
+
+int writeUserSection(std::uint32_t offset, const std::uint8_t* data, std::size_t size)
+{
+    return g_user_section.write(offset, data, size);
+}
+
+
+void commitUserSection()
+{
+    g_user_section.commit();
+}
+
+
 Entry getByIndex(unsigned index)
 {
-    if (index < NumEntries)
+    if (index < NumBuiltinEntries)
     {
-        return g_entries[index];
+        return BuiltinEntries[index];
     }
     else
     {
-        return Entry();
+        return g_user_section.getByIndex(index - NumBuiltinEntries);
     }
 }
 
 
-Entry getByName(const Entry::Name& name)
+Entry getByName(const char* name)
 {
-    for (const auto& e : g_entries)
+    const auto user_entry = g_user_section.getByName(name);
+    if (!user_entry.isEmpty())
     {
-        if (e.name.toLowerCase() == name.toLowerCase())
-        {
-            return e;
-        }
+        return user_entry;
+    }
+
+    const int builtin_index = BuiltinNameTable.find(name);
+    if (builtin_index >= 0)
+    {
+        return BuiltinEntries[builtin_index];
     }
+
     return Entry();
 }
 
 
 unsigned getMaxIndex()
 {
-    return NumEntries - 1U;
+    return NumBuiltinEntries + g_user_section.getNumEntries() - 1U;
+}
+
+
+unsigned getNumberOfUserEntries()
+{
+    return g_user_section.getNumEntries();
 }
 
 }
@@ -25,41 +25,37 @@
 #pragma once
 
 #include <foc/foc.hpp>
+#include <zubax_chibios/config/config.hpp>
 #include <zubax_chibios/util/heapless.hpp>
-#include <utility>
-#include <functional>
+#include <cstdint>
+#include <cstddef>
 
 
 namespace motor_database
 {
 /**
  * One named motor model.
+ * The built-in entries are constructed at compile time and reside in flash; the entries of the user section
+ * refer to their records in flash directly, so they are valid only until the user section is rewritten.
  */
 struct Entry
 {
     static constexpr unsigned MaxNameLength = 40;
 
-    using Name = os::heapless::String<MaxNameLength>;
-
-    Name name;
+    const char* name = "";
     foc::MotorParameters parameters;
 
-    Entry() { }
+    constexpr Entry() { }
 
-    Entry(const Name& arg_name,
-          const foc::MotorParameters& arg_parameters) :
+    constexpr Entry(const char* arg_name,
+                    const foc::MotorParameters& arg_parameters) :
         name(arg_name),
         parameters(arg_parameters)
     {
         parameters.deduceMissingParameters();
     }
 
-    Entry(const Name& arg_name,
-          const std::function<foc::MotorParameters()> factory) :
-        Entry(arg_name, factory())
-    { }
-
-    bool isEmpty() const { return name.empty(); }
+    bool isEmpty() const { return name[0] == '\0'; }
 
     auto toString() const
     {
@@ -72,13 +68,70 @@ struct Entry
     }
 };
 
+/**
+ * The user section extends the built-in entries at runtime; it is written over UAVCAN file transfer as a file
+ * with the following layout, little-endian, no padding:
+ *
+ *      uint32          magic, @ref UserSectionMagic
+ *      uint32          number of records, at most @ref MaxUserEntries
+ *      record[]        each record is @ref UserRecordSize bytes:
+ *          char[40]        name, zero-padded; at least one terminating zero is required
+ *          uint8           number of poles
+ *          uint8[3]        reserved, zero
+ *          float32         max current, ampere
+ *          float32         phi, weber
+ *          float32         rs, ohm
+ *          float32         lq, henry
+ *          float32         ld, henry; zero assumes a non-salient motor
+ *
+ * The missing parameters are deduced the same way as for the built-in entries. Invalid records are ignored;
+ * a file that was not transferred completely is not committed. The user entries follow the built-in ones
+ * in the index order, and take precedence over them in the name based lookup.
+ * The section is erased by the bootloader when the firmware is updated.
+ */
+constexpr std::uint32_t UserSectionMagic = 0x3142444DU;      // "MDB1"
+constexpr unsigned UserRecordSize = 64;
+constexpr unsigned MaxUserEntries = 64;
+
+/**
+ * Path of the user section for the UAVCAN file write requests.
+ */
+constexpr const char* UserSectionFilePath = "motor_db.bin";
+
+/**
+ * Invoked once at startup; the storage must be memory mapped at the specified address.
+ * Until this function is invoked, only the built-in entries are available.
+ */
+void init(os::config::IStorageBackend& user_section_storage,
+          const void* user_section_address,
+          std::size_t user_section_size);
+
+/**
+ * Writes a chunk of the user section file into the RAM buffer; writing at zero offset starts a new file.
+ * The chunks must be written sequentially. Once the file is complete, it is committed into flash by
+ * @ref commitUserSection(), until then further writes are rejected with -EBUSY.
+ * @return Negative errno on failure, e.g. if the file is malformed, or the section is not initialized.
+ */
+int writeUserSection(std::uint32_t offset, const std::uint8_t* data, std::size_t size);
+
+/**
+ * Erases the section and writes the received file into it, then reloads the entries; does nothing if there is
+ * no complete file pending. The commit is deferred while the motor is running.
+ * Erasing the sector stalls the CPU for about 2 s, up to 4 s at the worst case, which is longer than the watchdog
+ * timeout; the storage backend is expected to extend the timeout (see board::WatchdogTimeoutExtender).
+ * This must be invoked from the main thread, because the other threads are stalled as well.
+ */
+void commitUserSection();
+
 /**
  * Return the requested entry, or an empty entry if the requested one could not be located.
- * Note that the name based lookup is case-insensitive.
+ * Both lookups take constant time. Note that the name based lookup is case-insensitive.
  */
 Entry getByIndex(unsigned index);
-Entry getByName(const Entry::Name& name);
+Entry getByName(const char* name);
 
 unsigned getMaxIndex();
 
+unsigned getNumberOfUserEntries();
+
 }
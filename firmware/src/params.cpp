@@ -25,6 +25,7 @@
 #include "params.hpp"
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/util/heapless.hpp>
+#include <algorithm>
 #include <initializer_list>
 
 
@@ -44,6 +45,55 @@ using Default = foc::ControllerParameters;
 
 Real g_spinup_duration    ("ctrl.spinup_sec",     Default().nominal_spinup_duration,       0.1F,    10.0F);
 Natural g_num_attempts    ("ctrl.num_attempt",    Default().num_stalls_to_latch,              1, 10000000);
+Real g_catching_duration  ("ctrl.catch_sec",      Default().catching_duration,             0.0F,     1.0F);
+Real g_restart_delay      ("ctrl.rst_dly_sec",    Default().restart_delay,                 0.0F,    10.0F);
+Real g_max_restart_delay  ("ctrl.rst_max_sec",    Default().max_restart_delay,             0.0F,    10.0F);
+Real g_speed_kp           ("ctrl.speed_kp",       Default().speed_kp,      Default::getSpeedGainLimits().min,
+                                                                           Default::getSpeedGainLimits().max);
+Real g_speed_ki           ("ctrl.speed_ki",       Default().speed_ki,      Default::getSpeedGainLimits().min,
+                                                                           Default::getSpeedGainLimits().max);
+Real g_mpe_time_constant  ("ctrl.mpe_tau_sec",    Default().motor_parameter_estimation_time_constant,
+                           Default::getMotorParameterEstimationTimeConstantLimits().min,
+                           Default::getMotorParameterEstimationTimeConstantLimits().max);
+Real g_fw_current_frac    ("ctrl.fw_cur_frac",    Default().field_weakening_current_fraction, 0.0F,    0.9F);
+Natural g_obs_decimation  ("ctrl.obs_decim",      Default().high_speed_observer_decimation_ratio, 1,        4);
+Real g_obs_decimation_w   ("ctrl.obs_decim_w",    Default().observer_decimation_velocity_ratio, 1.0F, 1000.0F);
+Natural g_bg_decimation   ("ctrl.bg_decim",       Default().background_decimation_ratio,      1,        8);
+Real g_brake_current_frac ("ctrl.brake_frac",     Default().braking_current_fraction,      0.0F,     1.0F);
+Real g_max_regen_voltage  ("ctrl.regen_max_v",    Default().max_regenerative_voltage,      0.0F,   100.0F);
+Real g_dpwm_threshold     ("ctrl.dpwm_thresh",    Default().discontinuous_pwm_threshold,      0.0F,    1.0F);
+Real g_max_mod_ratio      ("ctrl.max_mod",        Default().max_modulation_ratio,
+                           Default::getMaxModulationRatioLimits().min,
+                           Default::getMaxModulationRatioLimits().max);
+Real g_current_loop_kp    ("ctrl.cur_kp",         Default().current_loop_kp,
+                           Default::getCurrentLoopProportionalGainLimits().min,
+                           Default::getCurrentLoopProportionalGainLimits().max);
+Real g_current_loop_ki    ("ctrl.cur_ki",         Default().current_loop_ki,
+                           Default::getCurrentLoopIntegralGainLimits().min,
+                           Default::getCurrentLoopIntegralGainLimits().max);
+Real g_idq_lpf_frequency  ("ctrl.idq_lpf_hz",     Default().idq_filter_cutoff_frequency,
+                           Default::getIdqFilterFrequencyLimits().min,
+                           Default::getIdqFilterFrequencyLimits().max);
+Real g_idq_notch_frequency("ctrl.idq_ntch_hz",    Default().idq_notch_frequency,
+                           Default::getIdqFilterFrequencyLimits().min,
+                           Default::getIdqFilterFrequencyLimits().max);
+
+}
+
+namespace inverter
+{
+
+using Default = foc::InverterParameters;
+
+Real g_dead_time_positive ("inv.dt_pos_ns",     Default().effective_dead_time_positive * 1e9F,
+                           0.0F, Default::getEffectiveDeadTimeLimits().max * 1e9F);
+Real g_dead_time_negative ("inv.dt_neg_ns",     Default().effective_dead_time_negative * 1e9F,
+                           0.0F, Default::getEffectiveDeadTimeLimits().max * 1e9F);
+Real g_transition_current ("inv.dt_trans_amp",  Default().dead_time_compensation_transition_current, 0.01F, 10.0F);
+os::config::Param<bool> g_vbus_feedforward("inv.vbus_ff", Default().vbus_feedforward);
+Real g_vbus_prediction    ("inv.vbus_pred",     Default().vbus_prediction_horizon,
+                           Default::getVbusPredictionHorizonLimits().min,
+                           Default::getVbusPredictionHorizonLimits().max);
 
 }
 
@@ -59,6 +109,7 @@ Real g_spinup_current     ("m.spinup_ampere",   0.0F,                         0.
 Real g_field_flux         ("m.phi_milliweber",  0.0F,                         0.0F, D::getPhiLimits().max * 1e3F);
 Real g_phase_resistance   ("m.rs_ohm",          0.0F,                         0.0F, D::getRsLimits().max);
 Real g_inductance_quadr   ("m.lq_microhenry",   0.0F,                         0.0F, D::getLqLimits().max * 1e6F);
+Real g_inductance_direct  ("m.ld_microhenry",   0.0F,                         0.0F, D::getLqLimits().max * 1e6F);
 Real g_min_electr_ang_vel ("m.min_eradsec",     D().min_electrical_ang_vel,  10.0F,     1000.0F);
 Real g_current_ramp       ("m.ampere_per_sec",  D().current_ramp_amp_per_s,   0.1F,    10000.0F);
 Real g_voltage_ramp       ("m.volt_per_sec",    D().voltage_ramp_volt_per_s, 0.01F,     1000.0F);
@@ -73,6 +124,8 @@ using Default = foc::motor_id::Parameters;
 Real g_frac_of_max_current("mid.max_cur_frac",  Default().fraction_of_max_current,                     0.1F,    1.0F);
 Real g_high_frequency     ("mid.hifreq_hertz",  Default().current_injection_frequency,               100.0F, 5000.0F);
 Real g_phi_eradsec        ("mid.phi_eradsec",   Default().phi_estimation_electrical_angular_velocity, 50.0F,  900.0F);
+Real g_convergence_tol    ("mid.conv_tol",      Default().convergence_tolerance,                       0.0F,    0.1F);
+Real g_cl_phase_margin    ("mid.cl_pm_deg",     Default().current_loop_phase_margin,                   0.0F,   80.0F);
 
 }
 
@@ -96,6 +149,73 @@ Real g_P0_44   ("obs.p0_44",    Default().P0.diagonal()[3], 1e-6F,  1e+6F);
 
 Real g_cross_coupling_comp("obs.crosscp_comp", Default().cross_coupling_compensation, 0.0F, 1.0F);
 
+os::config::Param<bool> g_flux_at_cruise("obs.flux_cruise", Default().flux_observer_at_cruise);
+Real g_flux_gain       ("obs.flux_gain",    Default().flux_observer_gain,           10.0F, 100000.0F);
+Real g_pll_bandwidth   ("obs.pll_bw",       Default().flux_observer_pll_bandwidth,  10.0F,  10000.0F);
+
+}
+
+namespace blackbox
+{
+
+using Default = foc::blackbox::Config;
+
+Natural g_trigger_mask    ("bb.trig_mask",      Default().trigger_mask,                              0,     255);
+Real g_overcurrent        ("bb.trig_ampere",    Default().overcurrent_threshold,                  0.0F,  200.0F);
+Natural g_fast_decimation ("bb.fast_decim",     Default().fast_irq_decimation,                       1,    1000);
+os::config::Param<bool> g_arm_at_boot("bb.arm_at_boot", Default().arm_at_boot);
+
+}
+
+namespace debug_stream
+{
+
+using Default = foc::debug_stream::Config;
+constexpr unsigned MaxSelection = (1U << foc::ITask::MaxDebugVariables) - 1U;
+
+Natural g_decimation      ("dbg.decimation",    Default().decimation,                                1,   65535);
+Natural g_trigger_edge    ("dbg.trig_edge",     unsigned(Default().trigger_edge),                    0,       3);
+Natural g_trigger_channel ("dbg.trig_chan",     Default().trigger_channel,
+                           0, foc::debug_stream::NumChannels - 1);
+Real g_trigger_level      ("dbg.trig_level",    Default().trigger_level,                      -1e6F,    1e6F);
+Natural g_trigger_samples ("dbg.trig_samples",  Default().samples_per_trigger,                       0,   65535);
+
+// Bit masks, see foc::debug_stream::Selection
+Natural g_select_running  ("dbg.sel_running",   0,                                                   0, MaxSelection);
+Natural g_select_hw_test  ("dbg.sel_hw_test",   0,                                                   0, MaxSelection);
+Natural g_select_motor_id ("dbg.sel_motor_id",  0,                                                   0, MaxSelection);
+
+Natural* findSelectionParam(const foc::TaskID task)
+{
+    switch (task)
+    {
+    case foc::TaskID::Running:             return &g_select_running;
+    case foc::TaskID::HardwareTest:        return &g_select_hw_test;
+    case foc::TaskID::MotorIdentification: return &g_select_motor_id;
+    default:                               return nullptr;
+    }
+}
+
+}
+
+namespace thermal
+{
+
+using Default = foc::ThermalParameters;
+
+Real g_inverter_rth       ("th.inv_k_per_w",    Default().inverter_thermal_resistance,           0.0F,  100.0F);
+Real g_inverter_tau       ("th.inv_tau_sec",    Default().inverter_time_constant,
+                           Default::getTimeConstantLimits().min, Default::getTimeConstantLimits().max);
+Real g_inverter_resistance("th.inv_mohm",       Default().inverter_resistance * 1e3F,            0.0F, 1000.0F);
+Real g_inverter_loss_frac ("th.inv_loss_frac",  Default().inverter_loss_fraction,                0.0F,    0.5F);
+Real g_motor_rth          ("th.mot_k_per_w",    Default().motor_thermal_resistance,              0.0F,  100.0F);
+Real g_motor_tau          ("th.mot_tau_sec",    Default().motor_time_constant,
+                           Default::getTimeConstantLimits().min, Default::getTimeConstantLimits().max);
+Real g_motor_max_temp     ("th.mot_max_degc",
+                           math::convertKelvinToCelsius(Default().max_motor_temperature),  0.0F,  250.0F);
+Real g_horizon            ("th.horizon_sec",    Default().prediction_horizon,                    0.0F,  600.0F);
+Real g_derating_band      ("th.derate_band_k",  Default().derating_band,                         0.0F,  100.0F);
+
 }
 
 
@@ -129,8 +249,35 @@ foc::Parameters readFOCParameters()
         using namespace controller;
         out.controller.nominal_spinup_duration = g_spinup_duration.get();
         out.controller.num_stalls_to_latch = g_num_attempts.get();
+        out.controller.catching_duration = g_catching_duration.get();
+        out.controller.restart_delay = g_restart_delay.get();
+        out.controller.max_restart_delay = std::max(g_restart_delay.get(), g_max_restart_delay.get());
+        out.controller.speed_kp = g_speed_kp.get();
+        out.controller.speed_ki = g_speed_ki.get();
+        out.controller.motor_parameter_estimation_time_constant = g_mpe_time_constant.get();
+        out.controller.field_weakening_current_fraction = g_fw_current_frac.get();
+        out.controller.high_speed_observer_decimation_ratio = g_obs_decimation.get();
+        out.controller.observer_decimation_velocity_ratio = g_obs_decimation_w.get();
+        out.controller.background_decimation_ratio = g_bg_decimation.get();
+        out.controller.braking_current_fraction = g_brake_current_frac.get();
+        out.controller.max_regenerative_voltage = g_max_regen_voltage.get();
+        out.controller.discontinuous_pwm_threshold = g_dpwm_threshold.get();
+        out.controller.max_modulation_ratio = g_max_mod_ratio.get();
+        out.controller.current_loop_kp = g_current_loop_kp.get();
+        out.controller.current_loop_ki = g_current_loop_ki.get();
+        out.controller.idq_filter_cutoff_frequency = g_idq_lpf_frequency.get();
+        out.controller.idq_notch_frequency = g_idq_notch_frequency.get();
         assert(out.controller.isValid());
     }
+    {
+        using namespace inverter;
+        out.inverter.effective_dead_time_positive = g_dead_time_positive.get() * 1e-9F;
+        out.inverter.effective_dead_time_negative = g_dead_time_negative.get() * 1e-9F;
+        out.inverter.dead_time_compensation_transition_current = g_transition_current.get();
+        out.inverter.vbus_feedforward = g_vbus_feedforward.get();
+        out.inverter.vbus_prediction_horizon = g_vbus_prediction.get();
+        assert(out.inverter.isValid());
+    }
     {
         using namespace motor;
         out.motor.num_poles               = g_num_poles.get();
@@ -140,17 +287,33 @@ foc::Parameters readFOCParameters()
         out.motor.phi                     = g_field_flux.get() * 1e-3F;
         out.motor.rs                      = g_phase_resistance.get();
         out.motor.lq                      = g_inductance_quadr.get() * 1e-6F;
+        out.motor.ld                      = g_inductance_direct.get() * 1e-6F;
         out.motor.min_electrical_ang_vel  = g_min_electr_ang_vel.get();
         out.motor.current_ramp_amp_per_s  = g_current_ramp.get();
         out.motor.voltage_ramp_volt_per_s = g_voltage_ramp.get();
         out.motor.deduceMissingParameters();
         // May be invalid
     }
+    {
+        using namespace thermal;
+        out.thermal.inverter_thermal_resistance = g_inverter_rth.get();
+        out.thermal.inverter_time_constant = g_inverter_tau.get();
+        out.thermal.inverter_resistance = g_inverter_resistance.get() * 1e-3F;
+        out.thermal.inverter_loss_fraction = g_inverter_loss_frac.get();
+        out.thermal.motor_thermal_resistance = g_motor_rth.get();
+        out.thermal.motor_time_constant = g_motor_tau.get();
+        out.thermal.max_motor_temperature = math::convertCelsiusToKelvin(g_motor_max_temp.get());
+        out.thermal.prediction_horizon = g_horizon.get();
+        out.thermal.derating_band = g_derating_band.get();
+        assert(out.thermal.isValid());
+    }
     {
         using namespace motor_id;
         out.motor_id.fraction_of_max_current = g_frac_of_max_current.get();
         out.motor_id.current_injection_frequency = g_high_frequency.get();
         out.motor_id.phi_estimation_electrical_angular_velocity = g_phi_eradsec.get();
+        out.motor_id.convergence_tolerance = g_convergence_tol.get();
+        out.motor_id.current_loop_phase_margin = g_cl_phase_margin.get();
         assert(out.motor_id.isValid());
     }
     {
@@ -166,28 +329,91 @@ foc::Parameters readFOCParameters()
                                                    g_P0_33.get(),
                                                    g_P0_44.get());
         out.observer.cross_coupling_compensation = g_cross_coupling_comp.get();
+        out.observer.flux_observer_at_cruise = g_flux_at_cruise.get();
+        out.observer.flux_observer_gain = g_flux_gain.get();
+        out.observer.flux_observer_pll_bandwidth = g_pll_bandwidth.get();
         assert(out.observer.isValid());
     }
     return out;
 }
 
-void writeFOCParameters(const foc::Parameters& obj)
+foc::blackbox::Config readBlackboxConfig()
+{
+    os::MutexLocker locker(g_mutex);
+
+    using namespace blackbox;
+
+    foc::blackbox::Config out;
+    out.trigger_mask          = std::uint8_t(g_trigger_mask.get());
+    out.overcurrent_threshold = g_overcurrent.get();
+    out.fast_irq_decimation   = std::uint16_t(g_fast_decimation.get());
+    out.arm_at_boot           = g_arm_at_boot.get();
+    return out;
+}
+
+foc::debug_stream::Config readDebugStreamConfig()
 {
     os::MutexLocker locker(g_mutex);
 
+    using namespace debug_stream;
+
+    foc::debug_stream::Config out;
+    out.decimation          = std::uint16_t(g_decimation.get());
+    out.trigger_edge        = foc::debug_stream::TriggerEdge(g_trigger_edge.get());
+    out.trigger_channel     = std::uint8_t(g_trigger_channel.get());
+    out.trigger_level       = g_trigger_level.get();
+    out.samples_per_trigger = std::uint16_t(g_trigger_samples.get());
+    assert(out.isValid());
+    return out;
+}
+
+foc::debug_stream::Selection readDebugVariableSelection(const foc::TaskID task)
+{
+    os::MutexLocker locker(g_mutex);
+
+    const auto param = debug_stream::findSelectionParam(task);
+    return (param != nullptr) ? foc::debug_stream::Selection(param->get()) : foc::debug_stream::Selection(0);
+}
+
+void writeDebugVariableSelection(const foc::TaskID task, const foc::debug_stream::Selection selection)
+{
+    os::MutexLocker locker(g_mutex);
+
+    const auto param = debug_stream::findSelectionParam(task);
+    if (param != nullptr)
     {
-        using namespace controller;
-        assign(g_spinup_duration,           obj.controller.nominal_spinup_duration);
-        assign(g_num_attempts,              obj.controller.num_stalls_to_latch);
+        assign(*param, selection);
     }
+}
 
+void writeFOCParameters(const foc::Parameters& obj)
+{
+    os::MutexLocker locker(g_mutex);
+
+    writeControllerParameters(obj.controller);
+    writeInverterParameters(obj.inverter);
     writeMotorParameters(obj.motor);
 
+    {
+        using namespace thermal;
+        assign(g_inverter_rth,              obj.thermal.inverter_thermal_resistance);
+        assign(g_inverter_tau,              obj.thermal.inverter_time_constant);
+        assign(g_inverter_resistance,       obj.thermal.inverter_resistance * 1e3F);
+        assign(g_inverter_loss_frac,        obj.thermal.inverter_loss_fraction);
+        assign(g_motor_rth,                 obj.thermal.motor_thermal_resistance);
+        assign(g_motor_tau,                 obj.thermal.motor_time_constant);
+        assign(g_motor_max_temp,            math::convertKelvinToCelsius(obj.thermal.max_motor_temperature));
+        assign(g_horizon,                   obj.thermal.prediction_horizon);
+        assign(g_derating_band,             obj.thermal.derating_band);
+    }
+
     {
         using namespace motor_id;
         assign(g_frac_of_max_current,       obj.motor_id.fraction_of_max_current);
         assign(g_high_frequency,            obj.motor_id.current_injection_frequency);
         assign(g_phi_eradsec,               obj.motor_id.phi_estimation_electrical_angular_velocity);
+        assign(g_convergence_tol,           obj.motor_id.convergence_tolerance);
+        assign(g_cl_phase_margin,           obj.motor_id.current_loop_phase_margin);
     }
 
     {
@@ -216,9 +442,53 @@ void writeFOCParameters(const foc::Parameters& obj)
                                    &g_P0_33,
                                    &g_P0_44});
         assign(g_cross_coupling_comp, obj.observer.cross_coupling_compensation);
+        assign(g_flux_at_cruise,      obj.observer.flux_observer_at_cruise);
+        assign(g_flux_gain,           obj.observer.flux_observer_gain);
+        assign(g_pll_bandwidth,       obj.observer.flux_observer_pll_bandwidth);
     }
 }
 
+void writeControllerParameters(const foc::ControllerParameters& obj)
+{
+    os::MutexLocker locker(g_mutex);
+
+    using namespace controller;
+
+    assign(g_spinup_duration,           obj.nominal_spinup_duration);
+    assign(g_num_attempts,              obj.num_stalls_to_latch);
+    assign(g_catching_duration,         obj.catching_duration);
+    assign(g_restart_delay,             obj.restart_delay);
+    assign(g_max_restart_delay,         obj.max_restart_delay);
+    assign(g_speed_kp,                  obj.speed_kp);
+    assign(g_speed_ki,                  obj.speed_ki);
+    assign(g_mpe_time_constant,         obj.motor_parameter_estimation_time_constant);
+    assign(g_fw_current_frac,           obj.field_weakening_current_fraction);
+    assign(g_obs_decimation,            obj.high_speed_observer_decimation_ratio);
+    assign(g_obs_decimation_w,          obj.observer_decimation_velocity_ratio);
+    assign(g_bg_decimation,             obj.background_decimation_ratio);
+    assign(g_brake_current_frac,        obj.braking_current_fraction);
+    assign(g_max_regen_voltage,         obj.max_regenerative_voltage);
+    assign(g_dpwm_threshold,            obj.discontinuous_pwm_threshold);
+    assign(g_max_mod_ratio,             obj.max_modulation_ratio);
+    assign(g_current_loop_kp,           obj.current_loop_kp);
+    assign(g_current_loop_ki,           obj.current_loop_ki);
+    assign(g_idq_lpf_frequency,         obj.idq_filter_cutoff_frequency);
+    assign(g_idq_notch_frequency,       obj.idq_notch_frequency);
+}
+
+void writeInverterParameters(const foc::InverterParameters& obj)
+{
+    os::MutexLocker locker(g_mutex);
+
+    using namespace inverter;
+
+    assign(g_dead_time_positive, obj.effective_dead_time_positive * 1e9F);
+    assign(g_dead_time_negative, obj.effective_dead_time_negative * 1e9F);
+    assign(g_transition_current, obj.dead_time_compensation_transition_current);
+    assign(g_vbus_feedforward,   obj.vbus_feedforward);
+    assign(g_vbus_prediction,    obj.vbus_prediction_horizon);
+}
+
 void writeMotorParameters(const foc::MotorParameters& obj)
 {
     os::MutexLocker locker(g_mutex);
@@ -232,6 +502,7 @@ void writeMotorParameters(const foc::MotorParameters& obj)
     assign(g_field_flux,         obj.phi * 1e3F);
     assign(g_phase_resistance,   obj.rs);
     assign(g_inductance_quadr,   obj.lq * 1e6F);
+    assign(g_inductance_direct,  obj.ld * 1e6F);
     assign(g_min_electr_ang_vel, obj.min_electrical_ang_vel);
     assign(g_current_ramp,       obj.current_ramp_amp_per_s);
     assign(g_voltage_ramp,       obj.voltage_ramp_volt_per_s);
@@ -25,6 +25,7 @@
 #pragma once
 
 #include <foc/foc.hpp>
+#include <foc/blackbox.hpp>
 
 
 namespace params
@@ -34,8 +35,28 @@ foc::Parameters readFOCParameters();
 void writeFOCParameters(const foc::Parameters& obj);
 
 /**
- * A subset of @ref writeFOCParameters().
+ * Subsets of @ref writeFOCParameters().
  */
+void writeControllerParameters(const foc::ControllerParameters& obj);
+void writeInverterParameters(const foc::InverterParameters& obj);
 void writeMotorParameters(const foc::MotorParameters& obj);
 
+/**
+ * Configuration of the blackbox capture; the capture is armed at boot and by the CLI.
+ */
+foc::blackbox::Config readBlackboxConfig();
+
+/**
+ * Configuration of the debug stream subscribed to by the CLI plotting commands.
+ */
+foc::debug_stream::Config readDebugStreamConfig();
+
+/**
+ * Debug variables selected for the task, see foc::debug_stream::Selection.
+ * The selection is applied at boot and whenever the parameters are reloaded; tasks without debug variables
+ * have no parameters, for them zero is returned and the writes are ignored.
+ */
+foc::debug_stream::Selection readDebugVariableSelection(foc::TaskID task);
+void writeDebugVariableSelection(foc::TaskID task, foc::debug_stream::Selection selection);
+
 }
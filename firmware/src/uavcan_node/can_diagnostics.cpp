@@ -0,0 +1,330 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "can_diagnostics.hpp"
+#include <cstdio>
+
+
+namespace uavcan_node
+{
+namespace
+{
+/**
+ * A frame that has missed its TX deadline may still be in a TX mailbox until the driver gets to aborting it,
+ * so it is considered lost only after this additional delay.
+ */
+constexpr unsigned LostFrameGracePeriodMSec = 100;
+
+unsigned getPriorityClass(const uavcan::CanFrame& frame)
+{
+    const unsigned priority = unsigned((frame.id & uavcan::CanFrame::MaskExtID) >> 24U);
+    return priority / (32U / InstrumentedCanDriver::NumPriorityClasses);
+}
+
+}
+
+constexpr std::uint32_t DurationStatistics::BinUpperBoundsUSec[];
+
+void DurationStatistics::print(const char* const prefix) const
+{
+    const std::uint32_t mean = (num_samples_ > 0) ? std::uint32_t(sum_usec_ / num_samples_) : 0;
+
+    std::printf("%s%llu samples, mean %lu us, max %lu us\n", prefix, num_samples_, mean, max_usec_);
+    std::printf("%s", prefix);
+    for (unsigned i = 0; i < NumBins; i++)
+    {
+        if (i < (NumBins - 1))
+        {
+            std::printf("<%lu:%lu ", BinUpperBoundsUSec[i], bins_[i]);
+        }
+        else
+        {
+            std::printf(">=%lu:%lu\n", BinUpperBoundsUSec[i - 1], bins_[i]);
+        }
+    }
+}
+
+unsigned InstrumentedCanDriver::Iface::getNumFramesInFlight() const
+{
+    unsigned out = 0;
+    for (auto& x : in_flight_)
+    {
+        out += x.used ? 1U : 0U;
+    }
+    return out;
+}
+
+bool InstrumentedCanDriver::Iface::handleLoopback(const uavcan::CanFrame& frame,
+                                                  const uavcan::MonotonicTime ts_monotonic,
+                                                  uavcan::CanIOFlags& inout_flags)
+{
+    for (auto& x : in_flight_)
+    {
+        if (x.used && (x.frame == frame))
+        {
+            x.used = false;
+
+            const auto latency = (ts_monotonic - x.handed_over_at).toUSec();
+            statistics_.tx_latency[getPriorityClass(frame)].add((latency > 0) ? std::uint32_t(latency) : 0);
+
+            inout_flags = x.flags;
+            return (x.flags & uavcan::CanIOFlagLoopback) != 0;
+        }
+    }
+
+    return true;        // Not ours - requested by the library
+}
+
+void InstrumentedCanDriver::Iface::discardExpiredFrames(const uavcan::MonotonicTime current_time)
+{
+    for (auto& x : in_flight_)
+    {
+        if (x.used && (current_time > (x.deadline + uavcan::MonotonicDuration::fromMSec(LostFrameGracePeriodMSec))))
+        {
+            x.used = false;
+            statistics_.tx_dropped++;
+        }
+    }
+}
+
+bool InstrumentedCanDriver::Iface::prefetch()
+{
+    if (lookahead_.used)
+    {
+        return true;
+    }
+
+    if (target_ == nullptr)
+    {
+        return false;
+    }
+
+    while (true)
+    {
+        auto& f = lookahead_;
+
+        f.result = target_->receive(f.frame, f.ts_monotonic, f.ts_utc, f.flags);
+        if (f.result == 0)
+        {
+            return false;
+        }
+
+        if (f.result > 0)
+        {
+            if ((f.flags & uavcan::CanIOFlagLoopback) != 0)
+            {
+                if (!handleLoopback(f.frame, f.ts_monotonic, f.flags))
+                {
+                    continue;
+                }
+            }
+            else
+            {
+                statistics_.rx_frames++;
+            }
+        }
+
+        f.used = true;
+        return true;
+    }
+}
+
+std::int16_t InstrumentedCanDriver::Iface::send(const uavcan::CanFrame& frame,
+                                                const uavcan::MonotonicTime tx_deadline,
+                                                const uavcan::CanIOFlags flags)
+{
+    if (target_ == nullptr)
+    {
+        return -1;
+    }
+
+    InFlightFrame* slot = nullptr;
+    for (auto& x : in_flight_)
+    {
+        if (!x.used)
+        {
+            slot = &x;
+            break;
+        }
+    }
+
+    const unsigned depth = getNumFramesInFlight();
+    statistics_.tx_depth_histogram[depth]++;
+    statistics_.interval_max_tx_depth = (depth > statistics_.interval_max_tx_depth) ?
+                                        depth : statistics_.interval_max_tx_depth;
+
+    const auto handed_over_at = clock_->getMonotonic();
+    const auto flags_with_loopback = uavcan::CanIOFlags(flags | uavcan::CanIOFlagLoopback);
+
+    const std::int16_t res = target_->send(frame, tx_deadline, (slot != nullptr) ? flags_with_loopback : flags);
+    if (res > 0)
+    {
+        statistics_.tx_frames++;
+        if (slot != nullptr)
+        {
+            slot->frame = frame;
+            slot->handed_over_at = handed_over_at;
+            slot->deadline = tx_deadline;
+            slot->flags = flags;
+            slot->used = true;
+        }
+        else
+        {
+            statistics_.tx_untracked++;
+        }
+    }
+    else if (res < 0)
+    {
+        statistics_.tx_dropped++;
+    }
+
+    return res;
+}
+
+std::int16_t InstrumentedCanDriver::Iface::receive(uavcan::CanFrame& out_frame,
+                                                   uavcan::MonotonicTime& out_ts_monotonic,
+                                                   uavcan::UtcTime& out_ts_utc,
+                                                   uavcan::CanIOFlags& out_flags)
+{
+    if (!prefetch())
+    {
+        return 0;
+    }
+
+    out_frame        = lookahead_.frame;
+    out_ts_monotonic = lookahead_.ts_monotonic;
+    out_ts_utc       = lookahead_.ts_utc;
+    out_flags        = lookahead_.flags;
+
+    lookahead_.used = false;
+    return lookahead_.result;
+}
+
+std::int16_t InstrumentedCanDriver::Iface::configureFilters(const uavcan::CanFilterConfig* filter_configs,
+                                                            const std::uint16_t num_configs)
+{
+    return (target_ == nullptr) ? std::int16_t(-1) : target_->configureFilters(filter_configs, num_configs);
+}
+
+std::uint16_t InstrumentedCanDriver::Iface::getNumFilters() const
+{
+    return (target_ == nullptr) ? std::uint16_t(0) : target_->getNumFilters();
+}
+
+std::uint64_t InstrumentedCanDriver::Iface::getErrorCount() const
+{
+    return (target_ == nullptr) ? 0 : target_->getErrorCount();
+}
+
+
+InstrumentedCanDriver::InstrumentedCanDriver(uavcan::ICanDriver& target, const uavcan::ISystemClock& clock) :
+    target_(target),
+    clock_(clock)
+{
+    for (std::uint8_t i = 0; i < uavcan::MaxCanIfaces; i++)
+    {
+        ifaces_[i].init(target_.getIface(i), clock_);
+    }
+}
+
+const InstrumentedCanDriver::IfaceStatistics* InstrumentedCanDriver::getIfaceStatistics(std::uint8_t iface_index) const
+{
+    return (iface_index < getNumIfaces()) ? &ifaces_[iface_index].getStatistics() : nullptr;
+}
+
+void InstrumentedCanDriver::startNewInterval()
+{
+    for (auto& x : ifaces_)
+    {
+        x.startNewInterval();
+    }
+}
+
+uavcan::ICanIface* InstrumentedCanDriver::getIface(std::uint8_t iface_index)
+{
+    return (iface_index < getNumIfaces()) ? &ifaces_[iface_index] : nullptr;
+}
+
+std::uint8_t InstrumentedCanDriver::getNumIfaces() const
+{
+    return target_.getNumIfaces();
+}
+
+std::int16_t InstrumentedCanDriver::select(uavcan::CanSelectMasks& inout_masks,
+                                           const uavcan::CanFrame* (& pending_tx)[uavcan::MaxCanIfaces],
+                                           const uavcan::MonotonicTime blocking_deadline)
+{
+    const auto num_ifaces = getNumIfaces();
+
+    while (true)
+    {
+        // Frames that were prefetched earlier must be reported without blocking
+        bool have_prefetched_frames = false;
+        for (std::uint8_t i = 0; i < num_ifaces; i++)
+        {
+            have_prefetched_frames = have_prefetched_frames ||
+                                     (((inout_masks.read & (1U << i)) != 0) && ifaces_[i].hasPendingRxFrame());
+        }
+
+        uavcan::CanSelectMasks masks = inout_masks;
+        const std::int16_t res = target_.select(masks, pending_tx,
+                                                have_prefetched_frames ? uavcan::MonotonicTime() : blocking_deadline);
+        if (res < 0)
+        {
+            return res;
+        }
+
+        const auto current_time = clock_.getMonotonic();
+
+        // The target may report RX readiness only because of the loopback frames that will be consumed here
+        std::uint8_t read_mask = 0;
+        for (std::uint8_t i = 0; i < num_ifaces; i++)
+        {
+            ifaces_[i].discardExpiredFrames(current_time);
+
+            const std::uint8_t bit = std::uint8_t(1U << i);
+            if ((inout_masks.read & bit) != 0)
+            {
+                const bool readable = ((masks.read & bit) != 0) ? ifaces_[i].prefetch() :
+                                                                  ifaces_[i].hasPendingRxFrame();
+                read_mask = std::uint8_t(read_mask | (readable ? bit : 0U));
+            }
+        }
+        masks.read = read_mask;
+
+        if ((masks.read != 0) || (masks.write != 0) || (current_time >= blocking_deadline))
+        {
+            inout_masks = masks;
+
+            std::int16_t num_events = 0;
+            for (std::uint8_t i = 0; i < num_ifaces; i++)
+            {
+                num_events = std::int16_t(num_events + (((masks.read | masks.write) & (1U << i)) != 0 ? 1 : 0));
+            }
+            return num_events;
+        }
+    }
+}
+
+}
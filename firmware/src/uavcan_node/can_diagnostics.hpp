@@ -0,0 +1,213 @@
+/**
+ * Copyright (c) 2016  Zubax Robotics OU  <info@zubax.com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without modification, are permitted provided that the
+ * following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following
+ *    disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the
+ *    following disclaimer in the documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its contributors may be used to endorse or promote
+ *    products derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <uavcan/driver/can.hpp>
+#include <uavcan/driver/system_clock.hpp>
+#include <cstdint>
+
+
+namespace uavcan_node
+{
+/**
+ * Histogram of durations with logarithmically spaced bins, plus the mean and the maximum.
+ * The interval maximum is reset by @ref startNewInterval(), everything else is cumulative.
+ */
+class DurationStatistics
+{
+public:
+    static constexpr unsigned NumBins = 6;
+
+    /// Upper bounds of the bins except the last one, which is unbounded
+    static constexpr std::uint32_t BinUpperBoundsUSec[NumBins - 1] = { 100, 300, 1000, 3000, 10000 };
+
+private:
+    std::uint64_t num_samples_ = 0;
+    std::uint64_t sum_usec_ = 0;
+    std::uint32_t max_usec_ = 0;
+    std::uint32_t interval_max_usec_ = 0;
+    std::uint32_t bins_[NumBins] = {};
+
+public:
+    void add(const std::uint32_t usec)
+    {
+        num_samples_++;
+        sum_usec_ += usec;
+        max_usec_ = (usec > max_usec_) ? usec : max_usec_;
+        interval_max_usec_ = (usec > interval_max_usec_) ? usec : interval_max_usec_;
+
+        unsigned i = 0;
+        while ((i < (NumBins - 1)) && (usec >= BinUpperBoundsUSec[i]))
+        {
+            i++;
+        }
+        bins_[i]++;
+    }
+
+    std::uint64_t getNumSamples() const { return num_samples_; }
+    std::uint64_t getSumUSec() const { return sum_usec_; }
+    std::uint32_t getMaxUSec() const { return max_usec_; }
+    std::uint32_t getIntervalMaxUSec() const { return interval_max_usec_; }
+    std::uint32_t getBin(const unsigned index) const { return (index < NumBins) ? bins_[index] : 0; }
+
+    void startNewInterval() { interval_max_usec_ = 0; }
+
+    void print(const char* const prefix) const;
+};
+
+/**
+ * Transparent wrapper over the CAN driver, which collects the statistics of the bus traffic of the local node.
+ *
+ * The TX latency is measured from the moment a frame is handed over to the driver until it is transmitted on the bus,
+ * i.e. it includes the time spent waiting in the TX mailboxes and losing arbitration. The moment of transmission is
+ * obtained from the loopback facility of the driver; the loopback frames requested by this wrapper are consumed here
+ * and are never reported to the library. The TX queue of the library itself is not observable from outside, so the
+ * TX queue depth is measured as the number of frames handed over to the driver but not yet transmitted.
+ *
+ * Must be used from the node thread only.
+ */
+class InstrumentedCanDriver : public uavcan::ICanDriver
+{
+public:
+    static constexpr unsigned NumPriorityClasses = 4;           ///< The 5-bit CAN ID priority divided by 8
+    static constexpr unsigned MaxFramesInFlight = 8;            ///< More than the number of the TX mailboxes
+
+    struct IfaceStatistics
+    {
+        std::uint64_t rx_frames = 0;
+        std::uint64_t tx_frames = 0;
+        std::uint32_t tx_dropped = 0;           ///< Rejected by the driver or not transmitted before the deadline
+        std::uint32_t tx_untracked = 0;         ///< Latency not measured because too many frames were in flight
+        std::uint32_t tx_depth_histogram[MaxFramesInFlight + 1] = {};  ///< Frames in flight, sampled on every TX
+        unsigned interval_max_tx_depth = 0;
+        DurationStatistics tx_latency[NumPriorityClasses];
+    };
+
+private:
+    class Iface : public uavcan::ICanIface
+    {
+        struct InFlightFrame
+        {
+            uavcan::CanFrame frame;
+            uavcan::MonotonicTime handed_over_at;
+            uavcan::MonotonicTime deadline;
+            uavcan::CanIOFlags flags = 0;
+            bool used = false;
+        };
+
+        struct ReceivedFrame
+        {
+            uavcan::CanFrame frame;
+            uavcan::MonotonicTime ts_monotonic;
+            uavcan::UtcTime ts_utc;
+            uavcan::CanIOFlags flags = 0;
+            std::int16_t result = 0;
+            bool used = false;
+        };
+
+        const uavcan::ISystemClock* clock_ = nullptr;
+        uavcan::ICanIface* target_ = nullptr;
+        InFlightFrame in_flight_[MaxFramesInFlight];
+        ReceivedFrame lookahead_;
+        IfaceStatistics statistics_;
+
+        unsigned getNumFramesInFlight() const;
+
+        bool handleLoopback(const uavcan::CanFrame& frame, uavcan::MonotonicTime ts_monotonic,
+                            uavcan::CanIOFlags& inout_flags);
+
+    public:
+        void init(uavcan::ICanIface* target, const uavcan::ISystemClock& clock)
+        {
+            target_ = target;
+            clock_ = &clock;
+        }
+
+        /**
+         * Reads the target until the first frame that should be reported to the library is found.
+         * Returns true if such frame is available.
+         */
+        bool prefetch();
+
+        /**
+         * Frames that could not be transmitted before their deadline are aborted by the driver silently,
+         * so their loopback never arrives.
+         */
+        void discardExpiredFrames(uavcan::MonotonicTime current_time);
+
+        bool hasPendingRxFrame() const { return lookahead_.used; }
+
+        const IfaceStatistics& getStatistics() const { return statistics_; }
+
+        void startNewInterval()
+        {
+            statistics_.interval_max_tx_depth = 0;
+            for (auto& x : statistics_.tx_latency)
+            {
+                x.startNewInterval();
+            }
+        }
+
+        std::int16_t send(const uavcan::CanFrame& frame, uavcan::MonotonicTime tx_deadline,
+                          uavcan::CanIOFlags flags) override;
+
+        std::int16_t receive(uavcan::CanFrame& out_frame, uavcan::MonotonicTime& out_ts_monotonic,
+                             uavcan::UtcTime& out_ts_utc, uavcan::CanIOFlags& out_flags) override;
+
+        std::int16_t configureFilters(const uavcan::CanFilterConfig* filter_configs,
+                                      std::uint16_t num_configs) override;
+
+        std::uint16_t getNumFilters() const override;
+
+        std::uint64_t getErrorCount() const override;
+    };
+
+    uavcan::ICanDriver& target_;
+    const uavcan::ISystemClock& clock_;
+    Iface ifaces_[uavcan::MaxCanIfaces];
+
+public:
+    InstrumentedCanDriver(uavcan::ICanDriver& target, const uavcan::ISystemClock& clock);
+
+    /**
+     * Returns nullptr if there is no such interface.
+     */
+    const IfaceStatistics* getIfaceStatistics(std::uint8_t iface_index) const;
+
+    /**
+     * Resets the interval maxima of all interfaces.
+     */
+    void startNewInterval();
+
+    uavcan::ICanIface* getIface(std::uint8_t iface_index) override;
+
+    std::uint8_t getNumIfaces() const override;
+
+    std::int16_t select(uavcan::CanSelectMasks& inout_masks,
+                        const uavcan::CanFrame* (& pending_tx)[uavcan::MaxCanIfaces],
+                        uavcan::MonotonicTime blocking_deadline) override;
+};
+
+}
@@ -23,13 +23,20 @@
  */
 
 #include "esc_controller.hpp"
+#include "uavcan_node.hpp"
 #include <uavcan/equipment/esc/RPMCommand.hpp>
 #include <uavcan/equipment/esc/RawCommand.hpp>
 #include <uavcan/equipment/esc/Status.hpp>
 #include <uavcan/protocol/debug/KeyValue.hpp>
+#include <zubax/esc/ExtendedStatus.hpp>
 #include <zubax_chibios/os.hpp>
 #include <foc/foc.hpp>
+#include <foc/latency_benchmark.hpp>
+#include <board/irq_profiler.hpp>
+#include <board/motor.hpp>
 #include <cstdint>
+#include <cmath>
+#include <algorithm>
 
 
 namespace uavcan_node
@@ -41,25 +48,240 @@ namespace
 
 const auto StatusTransferPriority = uavcan::TransferPriority::fromPercent<75>();
 
+#if defined(DEBUG_BUILD) && DEBUG_BUILD
+constexpr bool ExtendedStatusEnabledByDefault = true;
+#else
+constexpr bool ExtendedStatusEnabledByDefault = false;
+#endif
+
 
 os::config::Param<std::uint8_t> g_param_esc_index                  ("uavcan.esc_indx",     0,      0,      15);
 os::config::Param<float>        g_param_esc_cmd_ttl                ("uavcan.esc_ttl",   0.3F,   0.1F,   10.0F);
 os::config::Param<float>        g_param_esc_status_interval        ("uavcan.esc_si",   0.05F,  0.01F,    1.0F);
 os::config::Param<float>        g_param_esc_status_interval_passive("uavcan.esc_sip",   0.5F,  0.01F,   10.0F);
+os::config::Param<float>        g_param_esc_status_interval_steady ("uavcan.esc_sis",   0.2F,  0.01F,    1.0F);
+os::config::Param<bool>         g_param_esc_extended_status        ("uavcan.esc_ext",   ExtendedStatusEnabledByDefault);
 
 os::config::Param<unsigned>     g_param_esc_raw_control_mode       ("uavcan.esc_rcm",
                                                                     unsigned(foc::ControlMode::RatiometricVoltage),
                                                                     foc::FirstRatiometricControlMode,
                                                                     foc::LastRatiometricControlMode);
 
+os::config::Param<bool>         g_param_esc_raw_braking            ("uavcan.esc_brake", false);
+
+os::config::Param<bool>         g_param_irq_profiling_report       ("uavcan.irq_prof",  false);
+os::config::Param<bool>         g_param_latency_benchmark          ("uavcan.lat_bench", false);
+
+/// Number of ESCs sharing the DC bus whose PWM carriers are staggered; zero disables the interleaving
+os::config::Param<unsigned>     g_param_pwm_interleaving_group_size("uavcan.pwm_ilv",      0,      0,      16);
+
 
 uavcan::LazyConstructor<uavcan::Publisher<uavcan::equipment::esc::Status>> g_pub_status;
+uavcan::LazyConstructor<uavcan::Publisher<zubax::esc::ExtendedStatus>> g_pub_extended_status;
 uavcan::LazyConstructor<uavcan::Publisher<uavcan::protocol::debug::KeyValue>> g_pub_key_value;
 uavcan::LazyConstructor<uavcan::Timer> g_timer;
+uavcan::LazyConstructor<uavcan::Timer> g_carrier_alignment_timer;
 
 std::uint8_t g_self_index;
 float g_command_ttl;
 foc::ControlMode g_raw_control_mode;
+bool g_raw_active_braking;
+
+
+/**
+ * Keeps the PWM carrier at a fixed phase relative to the network-synchronized time, so that the switching instants
+ * of the ESCs that share the DC bus are evenly staggered across the carrier period instead of beating against each
+ * other. The phase offset of an ESC is its index modulo the size of the group, times the period over the group size.
+ * All ESCs in the group must run at the same PWM frequency.
+ *
+ * This is a PI phase-locked loop: the proportional term removes the phase error, the integral term learns the
+ * frequency mismatch between the local oscillator and the time sync master. The output is the phase slew rate,
+ * see @ref board::motor::setCarrierPhaseSlewRate().
+ */
+class CarrierPhaseAligner
+{
+    static constexpr float TimeConstant             = 1.0F;     ///< Second
+    static constexpr float IntegralTimeConstant     = 10.0F;    ///< Second
+
+    float period_ = 0;
+    float target_phase_ = 0;
+    float integrator_ = 0;
+
+public:
+    static constexpr unsigned UpdateIntervalMSec = 100;
+
+    void configure(const unsigned group_size, const unsigned index)
+    {
+        period_ = board::motor::getPWMParameters().period;
+        target_phase_ = period_ * float(index % group_size) / float(group_size);
+    }
+
+    void update()
+    {
+        const float phase =
+            convertCycleCountToSynchronizedTimePhase(board::motor::getCarrierPeriodStartCycleCount(), period_);
+        if (phase < 0)
+        {
+            // Not synchronized; keeping the nominal frequency until the time sync is restored
+            integrator_ = 0;
+            board::motor::setCarrierPhaseSlewRate(0);
+            return;
+        }
+
+        // Wrapping into [-period/2, period/2)
+        float error = std::fmod(target_phase_ - phase, period_);
+        if (error >= period_ * 0.5F)
+        {
+            error -= period_;
+        }
+        else if (error < -period_ * 0.5F)
+        {
+            error += period_;
+        }
+        else
+        {
+            ;   // Already there
+        }
+
+        const float max_rate = board::motor::getMaxCarrierPhaseSlewRate();
+        const float dt = float(UpdateIntervalMSec) * 1e-3F;
+
+        integrator_ += error * dt / (TimeConstant * IntegralTimeConstant);
+        integrator_ = math::Range<>(-max_rate, max_rate).constrain(integrator_);
+
+        board::motor::setCarrierPhaseSlewRate(error / TimeConstant + integrator_);
+    }
+} g_carrier_phase_aligner;
+
+void cbCarrierAlignmentTimer(const uavcan::TimerEvent&)
+{
+    g_carrier_phase_aligner.update();
+}
+
+/**
+ * Decides which timer events publish the status while the motor is active.
+ * The timer runs at the normal status interval. Every event that sees a large change of the RPM or the current
+ * since the last published status publishes immediately; otherwise the publication interval is doubled after
+ * every publication, until it reaches the steady state interval.
+ */
+class StatusScheduler
+{
+    static constexpr float RelativeChangeThreshold = 0.05F;
+    static constexpr float MinRPMChange     = 100.0F;
+    static constexpr float MinCurrentChange = 0.5F;         ///< Ampere
+
+    unsigned max_backoff_ticks_ = 1;
+    unsigned backoff_ticks_ = 1;
+    unsigned ticks_since_publication_ = 0;
+
+    float last_rpm_ = 0;
+    float last_current_ = 0;
+
+    static bool isSignificantChange(const float last, const float now, const float min_change)
+    {
+        return std::abs(now - last) > std::max(min_change, std::abs(last) * RelativeChangeThreshold);
+    }
+
+public:
+    void configure(const float normal_interval, const float steady_state_interval)
+    {
+        max_backoff_ticks_ = std::max(1U, unsigned(std::lround(steady_state_interval / normal_interval)));
+        reset();
+    }
+
+    /**
+     * Makes the next event publish, and restarts the back off.
+     */
+    void reset()
+    {
+        backoff_ticks_ = 1;
+        ticks_since_publication_ = backoff_ticks_;
+    }
+
+    bool shouldPublish(const float rpm, const float current)
+    {
+        ticks_since_publication_++;
+
+        if (isSignificantChange(last_rpm_, rpm, MinRPMChange) ||
+            isSignificantChange(last_current_, current, MinCurrentChange))
+        {
+            backoff_ticks_ = 1;
+        }
+        else if (ticks_since_publication_ >= backoff_ticks_)
+        {
+            backoff_ticks_ = std::min(backoff_ticks_ * 2U, max_backoff_ticks_);
+        }
+        else
+        {
+            return false;
+        }
+
+        ticks_since_publication_ = 0;
+        last_rpm_ = rpm;
+        last_current_ = current;
+        return true;
+    }
+} g_status_scheduler;
+
+
+/**
+ * Returns the fraction of the CPU time spent in the motor control IRQs since the previous call, in percent.
+ */
+std::uint8_t computeIRQLoadPercent()
+{
+    static std::uint32_t last_cycle_count = board::irq_profiler::getCycleCount();
+    static std::uint64_t last_irq_cycles = 0;
+
+    // The command delivery stage is measured across contexts, so it is not counted as IRQ load
+    std::uint64_t irq_cycles = 0;
+    for (unsigned i = 0; i < board::irq_profiler::NumStages; i++)
+    {
+        const auto stage = board::irq_profiler::Stage(i);
+        if (stage != board::irq_profiler::Stage::Command)
+        {
+            irq_cycles += board::irq_profiler::getStatistics(stage).total_cycles;
+        }
+    }
+
+    const std::uint32_t cycle_count = board::irq_profiler::getCycleCount();
+    const std::uint32_t elapsed_cycles = cycle_count - last_cycle_count;
+
+    // The statistics may have been reset in the meantime
+    const std::uint64_t spent_cycles = (irq_cycles >= last_irq_cycles) ? (irq_cycles - last_irq_cycles) : 0U;
+
+    last_cycle_count = cycle_count;
+    last_irq_cycles = irq_cycles;
+
+    if (elapsed_cycles == 0)
+    {
+        return 0;
+    }
+    return std::uint8_t(std::min<std::uint64_t>((spent_cycles * 100U) / elapsed_cycles, 100U));
+}
+
+
+/**
+ * Converts the hardware reception timestamp of a transfer into the cycle counter domain.
+ * Returns zero if the latency benchmark is not running or if the timestamp does not look sane.
+ */
+std::uint32_t computeReceptionCycleCount(const uavcan::MonotonicTime reception_timestamp)
+{
+    if (!foc::latency_benchmark::isActive())
+    {
+        return 0;
+    }
+
+    const std::uint32_t now_cycles = board::irq_profiler::getCycleCount();
+    const auto age_usec = (g_timer->getNode().getMonotonicTime() - reception_timestamp).toUSec();
+
+    if ((age_usec < 0) ||
+        (age_usec > 1000000))
+    {
+        return 0;
+    }
+
+    return now_cycles - std::uint32_t(age_usec) * std::uint32_t(STM32_SYSCLK / 1000000U);
+}
 
 
 void cbRawCommand(const uavcan::ReceivedDataStructure<uavcan::equipment::esc::RawCommand>& msg)
@@ -70,15 +292,20 @@ void cbRawCommand(const uavcan::ReceivedDataStructure<uavcan::equipment::esc::Ra
             float(msg.cmd[g_self_index]) /
             float(uavcan::equipment::esc::RawCommand::FieldTypes::cmd::RawValueType::max());
 
-        foc::setSetpoint(g_raw_control_mode, command, g_command_ttl);
+        foc::postSetpoint(g_raw_control_mode, command, g_command_ttl,
+                          computeReceptionCycleCount(msg.getMonotonicTimestamp()),
+                          g_raw_active_braking);
     }
 }
 
 
 void cbRPMCommand(const uavcan::ReceivedDataStructure<uavcan::equipment::esc::RPMCommand>& msg)
 {
-    (void) msg;
-    // TODO: Closed loop operation
+    if (msg.rpm.size() > g_self_index)
+    {
+        foc::postSetpoint(foc::ControlMode::MRPM, float(msg.rpm[g_self_index]), g_command_ttl,
+                          computeReceptionCycleCount(msg.getMonotonicTimestamp()));
+    }
 }
 
 
@@ -91,10 +318,18 @@ void cbTimer(const uavcan::TimerEvent& event)
         static const float interval_normal  = g_param_esc_status_interval.get();
         static const float interval_passive = g_param_esc_status_interval_passive.get();
 
+        const bool inactive = foc::isInactive();
+
         const auto current_interval = uavcan::MonotonicDuration::fromUSec(
-            std::uint64_t((foc::isInactive() ? interval_passive : interval_normal) * 1e6F));
+            std::uint64_t((inactive ? interval_passive : interval_normal) * 1e6F));
 
         g_timer->startOneShotWithDeadline(event.scheduled_time + current_interval);
+
+        // The passive interval is long enough already, and the first event after activation should publish
+        if (inactive)
+        {
+            g_status_scheduler.reset();
+        }
     }
 
     /*
@@ -102,6 +337,8 @@ void cbTimer(const uavcan::TimerEvent& event)
      */
     {
         uavcan::equipment::esc::Status status;
+        zubax::esc::ExtendedStatus extended_status;
+        std::uint32_t sampled_at = board::irq_profiler::getCycleCount();
         const auto hw_status = board::motor::getStatus();
 
         status.esc_index   = g_self_index;
@@ -113,12 +350,19 @@ void cbTimer(const uavcan::TimerEvent& event)
 
         if (foc::isRunning(&running_info))
         {
+            sampled_at = running_info.cycle_count;
             status.error_count = running_info.stall_count;
             status.current     = running_info.inverter_power_filtered / hw_status.inverter_voltage;
             status.rpm         = static_cast<std::int32_t>(std::round(running_info.mechanical_rpm));
 
             status.power_rating_pct =
                 std::uint8_t(std::min(running_info.demand_factor_filtered * 100.0F + 0.5F, 126.0F));
+
+            extended_status.current_dq[0] = running_info.Idq[0];
+            extended_status.current_dq[1] = running_info.Idq[1];
+            extended_status.voltage_dq[0] = running_info.Udq[0];
+            extended_status.voltage_dq[1] = running_info.Udq[1];
+            extended_status.observer_current_residual = running_info.observer_current_residual;
         }
         else if (foc::isMotorIdentificationInProgress(&motor_id_info))
         {
@@ -138,26 +382,102 @@ void cbTimer(const uavcan::TimerEvent& event)
             ; // Nothing to do
         }
 
-        (void) g_pub_status->broadcast(status);
+        if (g_status_scheduler.shouldPublish(float(status.rpm), status.current))
+        {
+            (void) g_pub_status->broadcast(status);
+
+            // The extended status is meant for debugging and tuning, so it is configurable
+            // It is also suspended while the motor control IRQs are shedding their load
+            static const bool extended_status_enabled = g_param_esc_extended_status.get();
+            const bool irq_budget_ok =
+                foc::getIRQBudgetStatus().degradation_level == foc::IRQBudgetMonitor::DegradationLevel::None;
+            if (extended_status_enabled && irq_budget_ok)
+            {
+                extended_status.timestamp.usec = convertCycleCountToSynchronizedTime(sampled_at);
+                extended_status.esc_index = g_self_index;
+                extended_status.irq_load_pct = computeIRQLoadPercent();
+
+                const auto thermal = foc::getThermalStatus();
+                extended_status.inverter_temperature = thermal.inverter_temperature;
+                extended_status.motor_temperature = thermal.motor_temperature;
+                extended_status.thermal_headroom = thermal.headroom;
+                extended_status.current_limit_pct =
+                    std::uint8_t(std::round(thermal.current_derating_factor * 100.0F));
+                (void) g_pub_extended_status->broadcast(extended_status);
+            }
+        }
     }
 
     /*
-     * Publishing debug parameters, only in debug builds
+     * Publishing IRQ profiling statistics, one stage per timer event in order to keep the bus load low
      */
-#if defined(DEBUG_BUILD) && DEBUG_BUILD
+    static const bool irq_profiling_report_enabled = g_param_irq_profiling_report.get();
+    if (irq_profiling_report_enabled)
+    {
+        static unsigned stage_index = 0;
+        const auto stage = board::irq_profiler::Stage(stage_index);
+        stage_index = (stage_index + 1U) % board::irq_profiler::NumStages;
+
+        const auto stat = board::irq_profiler::getStatistics(stage);
+
+        uavcan::protocol::debug::KeyValue msg;
 
-    for (auto& kv : foc::getDebugKeyValuePairs())
+        msg.key = "IRQ.";
+        msg.key += board::irq_profiler::getStageName(stage);
+        msg.key += ".avg";
+        msg.value = stat.getAverageDuration() * 1e6F;
+        (void) g_pub_key_value->broadcast(msg);
+
+        msg.key = "IRQ.";
+        msg.key += board::irq_profiler::getStageName(stage);
+        msg.key += ".max";
+        msg.value = stat.getWorstDuration() * 1e6F;
+        (void) g_pub_key_value->broadcast(msg);
+    }
+
+    /*
+     * Latency benchmark, controlled via the parameter so that it can be started remotely.
+     * The CLI can start it independently; when the parameter is set, the results are published.
+     */
     {
-        if (!kv.first.empty())
+        static bool was_enabled = false;
+        const bool enabled = g_param_latency_benchmark.get();
+
+        if (enabled != was_enabled)
         {
+            was_enabled = enabled;
+            if (enabled)
+            {
+                foc::latency_benchmark::start();
+            }
+            else
+            {
+                foc::latency_benchmark::stop();
+            }
+        }
+
+        if (enabled)
+        {
+            static unsigned item_index = 0;
+            static constexpr unsigned NumItems = 6;
+            const auto stat = foc::latency_benchmark::getStatistics();
+
             uavcan::protocol::debug::KeyValue msg;
-            msg.key = kv.first.c_str();
-            msg.value = kv.second;
+
+            switch (item_index)
+            {
+            case 0:  msg.key = "Latency.n";     msg.value = float(stat.num_samples);                break;
+            case 1:  msg.key = "Latency.avg";   msg.value = stat.getAverageLatency() * 1e6F;       break;
+            case 2:  msg.key = "Latency.p50";   msg.value = stat.getPercentile(50.0F) * 1e6F;      break;
+            case 3:  msg.key = "Latency.p99";   msg.value = stat.getPercentile(99.0F) * 1e6F;      break;
+            case 4:  msg.key = "Latency.p999";  msg.value = stat.getPercentile(99.9F) * 1e6F;      break;
+            default: msg.key = "Latency.max";   msg.value = stat.max_latency * 1e6F;                break;
+            }
+            item_index = (item_index + 1U) % NumItems;
+
             (void) g_pub_key_value->broadcast(msg);
         }
     }
-
-#endif
 }
 
 } // namespace
@@ -174,6 +494,9 @@ int init(uavcan::INode& node)
     g_self_index  = g_param_esc_index.get();
     g_command_ttl = g_param_esc_cmd_ttl.get();
     g_raw_control_mode = foc::ControlMode(g_param_esc_raw_control_mode.get());
+    g_raw_active_braking = g_param_esc_raw_braking.get();
+
+    g_status_scheduler.configure(g_param_esc_status_interval.get(), g_param_esc_status_interval_steady.get());
 
     /*
      * Publishers
@@ -185,6 +508,13 @@ int init(uavcan::INode& node)
         return pub_init_res;
     }
 
+    g_pub_extended_status.construct<uavcan::INode&>(node);
+    pub_init_res = g_pub_extended_status->init(StatusTransferPriority);
+    if (pub_init_res < 0)
+    {
+        return pub_init_res;
+    }
+
     g_pub_key_value.construct<uavcan::INode&>(node);
     pub_init_res = g_pub_key_value->init(uavcan::TransferPriority::OneHigherThanLowest);
     if (pub_init_res < 0)
@@ -223,6 +553,20 @@ int init(uavcan::INode& node)
     // Arbitrary delay to kickstart the process
     g_timer->startOneShotWithDelay(uavcan::MonotonicDuration::fromMSec(1000));
 
+    /*
+     * PWM carrier interleaving
+     */
+    const unsigned interleaving_group_size = g_param_pwm_interleaving_group_size.get();
+    if (interleaving_group_size > 0)
+    {
+        g_carrier_phase_aligner.configure(interleaving_group_size, g_self_index);
+
+        g_carrier_alignment_timer.construct<uavcan::INode&>(node);
+        g_carrier_alignment_timer->setCallback(&cbCarrierAlignmentTimer);
+        g_carrier_alignment_timer->startPeriodic(
+            uavcan::MonotonicDuration::fromMSec(CarrierPhaseAligner::UpdateIntervalMSec));
+    }
+
     return 0;
 }
 
@@ -24,6 +24,7 @@
 
 #include "uavcan_node.hpp"
 #include "esc_controller.hpp"
+#include "can_diagnostics.hpp"
 
 #include <zubax_chibios/os.hpp>
 #include <zubax_chibios/config/config.hpp>
@@ -33,11 +34,27 @@
 #include <uavcan/protocol/param_server.hpp>
 #include <uavcan/protocol/dynamic_node_id_client.hpp>
 #include <uavcan/protocol/restart_request_server.hpp>
+#include <uavcan/protocol/global_time_sync_slave.hpp>
+#include <uavcan/protocol/file/Read.hpp>
+#include <uavcan/protocol/file/Write.hpp>
+#include <zubax/param/GetBatch.hpp>
+#include <zubax/node/CANDiagnostics.hpp>
+#include <zubax/node/GetMemoryUsage.hpp>
 
 #include <board/board.hpp>
+#include <board/irq_profiler.hpp>
 #include <foc/foc.hpp>
+#include <foc/blackbox.hpp>
+#include <motor_database/motor_database.hpp>
+#include <memory_usage/memory_usage.hpp>
 
 #include <unistd.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <iterator>
+#include <limits>
 
 
 namespace uavcan_node
@@ -51,6 +68,9 @@ static constexpr unsigned MemoryPoolSize = 8192;
 static constexpr unsigned RxQueueDepth = 254;           ///< Can be safely reduced if we're tight on memory
 static constexpr unsigned NodeThreadPriority = (HIGHPRIO + NORMALPRIO) / 2;
 static constexpr unsigned FixedBitrateInitTimeoutSec = 10;
+static constexpr unsigned MaxNodeThreadIdlePeriodMSec = 1000;  ///< Must be well below the watchdog timeout
+static constexpr unsigned TimeReferenceUpdateIntervalMSec = 100;
+static constexpr unsigned CANDiagnosticsIntervalMSec = 1000;
 
 /**
  * Node declarations.
@@ -59,6 +79,8 @@ typedef uavcan::Node<MemoryPoolSize> Node;
 
 uavcan_stm32::CanInitHelper<RxQueueDepth> g_can;        ///< CAN driver instance.
 
+DurationStatistics g_spin_time;                         ///< Time spent in the node, per wake-up of the node thread
+
 uavcan::protocol::SoftwareVersion g_firmware_version;
 std::uint32_t g_can_bit_rate;
 uavcan::NodeID g_node_id;
@@ -73,6 +95,10 @@ volatile bool g_do_print_status = false;
  * Runtime configuration parameters.
  */
 os::config::Param<std::uint8_t> g_param_node_id("uavcan.node_id",       0,      0,      125);
+os::config::Param<bool>         g_param_can_diagnostics("uavcan.can_diag", false);
+
+/// Last known good bitrate, updated automatically; it is tried first when the bootloader does not provide a hint
+os::config::Param<unsigned>     g_param_bit_rate("uavcan.bitrate",      0,      0,      1000000);
 
 /**
  * Callbacks.
@@ -82,6 +108,16 @@ RebootRequestCallback g_on_reboot_requested;
 
 os::Logger g_logger("UAVCAN");
 
+/**
+ * Wakes up the node thread, which otherwise sleeps until the next CAN event or the next deadline of the node.
+ * This is the same event that is signaled by the CAN driver from its interrupts.
+ * Must not be invoked from IRQ context.
+ */
+void wakeNodeThread()
+{
+    g_can.driver.updateEvent().signal();
+}
+
 /// An experiment in minimalism.
 class LogMessageQueue
 {
@@ -92,9 +128,12 @@ class LogMessageQueue
 public:
     void push(const uavcan::protocol::debug::LogMessage& msg)
     {
-        os::MutexLocker locker(mutex_);
-        buffer_[int(write_pos_)] = {true, msg};
-        write_pos_ = !write_pos_;
+        {
+            os::MutexLocker locker(mutex_);
+            buffer_[int(write_pos_)] = {true, msg};
+            write_pos_ = !write_pos_;
+        }
+        wakeNodeThread();
     }
 
     bool pop(uavcan::protocol::debug::LogMessage& out_msg)
@@ -116,13 +155,110 @@ public:
     }
 } g_log_message_queue_;
 
+/**
+ * Relates the cycle counter to the synchronized UTC time.
+ * The cycle counter runs from the same oscillator as the UAVCAN clock, but the UTC time is being slewed by the time
+ * synchronization, so the rate is measured between the successive reference points.
+ */
+class SynchronizedTimeReference
+{
+    static constexpr float NominalCyclesPerMicrosecond = float(STM32_SYSCLK / 1000000U);
+    static constexpr float MaxRateError = 1e-3F;
+
+    struct Point
+    {
+        std::uint32_t cycle_count = 0;
+        std::uint64_t utc_usec = 0;         ///< Zero if not synchronized
+        float cycles_per_usec = NominalCyclesPerMicrosecond;
+    };
+
+    mutable chibios_rt::Mutex mutex_;
+    Point point_;
+
+public:
+    /**
+     * Invoked from the node thread.
+     */
+    void update(const bool synchronized, const uavcan::UtcTime utc_now)
+    {
+        Point p;
+        if (synchronized)
+        {
+            p.cycle_count = board::irq_profiler::getCycleCount();
+            p.utc_usec = utc_now.toUSec();
+        }
+
+        os::MutexLocker locker(mutex_);
+
+        if ((p.utc_usec > point_.utc_usec) && (point_.utc_usec > 0))
+        {
+            const float measured = float(p.cycle_count - point_.cycle_count) / float(p.utc_usec - point_.utc_usec);
+            if (std::abs(measured - NominalCyclesPerMicrosecond) < (NominalCyclesPerMicrosecond * MaxRateError))
+            {
+                p.cycles_per_usec = measured;
+            }
+        }
+
+        point_ = p;
+    }
+
+    std::uint64_t convert(const std::uint32_t cycle_count) const
+    {
+        Point p;
+        {
+            os::MutexLocker locker(mutex_);
+            p = point_;
+        }
+
+        if (p.utc_usec == 0)
+        {
+            return 0;
+        }
+
+        // Signed difference, the cycle count may have been sampled before the reference point
+        const auto delta_cycles = std::int32_t(cycle_count - p.cycle_count);
+        return std::uint64_t(std::int64_t(p.utc_usec) + std::int64_t(float(delta_cycles) / p.cycles_per_usec));
+    }
+
+    float convertToPhase(const std::uint32_t cycle_count, const float period) const
+    {
+        Point p;
+        {
+            os::MutexLocker locker(mutex_);
+            p = point_;
+        }
+
+        if ((p.utc_usec == 0) || !(period > 0))
+        {
+            return -1.0F;
+        }
+
+        // Double precision is required to keep the fractional microseconds of the large UTC value
+        const double period_usec = double(period) * 1e6;
+        const double delta_usec = double(std::int32_t(cycle_count - p.cycle_count)) / double(p.cycles_per_usec);
+
+        double phase_usec = std::fmod(std::fmod(double(p.utc_usec), period_usec) + delta_usec, period_usec);
+        if (phase_usec < 0)
+        {
+            phase_usec += period_usec;
+        }
+        return float(phase_usec * 1e-6);
+    }
+} g_synchronized_time_reference;
+
 /**
  * Implementation details.
  * Functions that return references to statics are designed this way as means to implement late initialization.
  */
+InstrumentedCanDriver& getCanDriver()
+{
+    static InstrumentedCanDriver driver(g_can.driver, uavcan_stm32::SystemClock::instance());
+    return driver;
+}
+
 Node& getNode()
 {
-    static Node node(g_can.driver, uavcan_stm32::SystemClock::instance());
+    static Node node(getCanDriver(), uavcan_stm32::SystemClock::instance());
     return node;
 }
 
@@ -132,6 +268,126 @@ uavcan::ParamServer& getParamServer()
     return server;
 }
 
+uavcan::GlobalTimeSyncSlave& getTimeSyncSlave()
+{
+    static uavcan::GlobalTimeSyncSlave slave(getNode());
+    return slave;
+}
+
+/**
+ * The set of configuration parameters is fixed at compile time, so their names and descriptors are cached once,
+ * and a name is resolved into the index by binary search instead of the linear lookup in the configuration storage.
+ * The values are cached too and re-read all at once when the configuration is modified, because the configuration
+ * API can only read a value by name.
+ */
+class ParamIndexCache
+{
+public:
+    static constexpr unsigned Capacity = 128;
+
+private:
+    std::array<ConfigParam, Capacity> descriptors_{};
+    std::array<float, Capacity> values_{};
+    std::array<std::uint8_t, Capacity> sorted_by_name_{};       ///< Indexes into the descriptors
+    unsigned size_ = 0;
+    unsigned values_modification_counter_ = 0;
+    bool values_valid_ = false;
+    bool initialized_ = false;
+    bool overflow_ = false;
+
+    void init()
+    {
+        initialized_ = true;
+
+        while (size_ < Capacity)
+        {
+            const char* const name = configNameByIndex(int(size_));
+            if ((name == nullptr) ||
+                (configGetDescr(name, &descriptors_[size_]) < 0))
+            {
+                break;
+            }
+            sorted_by_name_[size_] = std::uint8_t(size_);
+            size_++;
+        }
+
+        if (configNameByIndex(int(size_)) != nullptr)
+        {
+            overflow_ = true;
+            g_logger.println("PARAM INDEX CACHE OVERFLOW, CAPACITY %u", Capacity);
+        }
+
+        std::sort(sorted_by_name_.begin(), sorted_by_name_.begin() + size_,
+                  [this](std::uint8_t a, std::uint8_t b)
+                  {
+                      return std::strcmp(descriptors_[a].name, descriptors_[b].name) < 0;
+                  });
+    }
+
+public:
+    /**
+     * Must be invoked from the node thread only.
+     */
+    unsigned getSize()
+    {
+        if (!initialized_)
+        {
+            init();
+        }
+        return size_;
+    }
+
+    /**
+     * False if there are more parameters than the cache can hold.
+     * The parameters that did not fit can be accessed only via the configuration API directly.
+     */
+    bool isComplete()
+    {
+        (void) getSize();
+        return !overflow_;
+    }
+
+    /**
+     * Returns nullptr if the index is out of range.
+     */
+    const ConfigParam* getByIndex(const unsigned index)
+    {
+        return (index < getSize()) ? &descriptors_[index] : nullptr;
+    }
+
+    /**
+     * The index must be in range.
+     */
+    float getValueByIndex(const unsigned index)
+    {
+        assert(index < getSize());
+
+        const unsigned modification_counter = os::config::getModificationCounter();
+        if (!values_valid_ || (modification_counter != values_modification_counter_))
+        {
+            for (unsigned i = 0; i < size_; i++)
+            {
+                values_[i] = configGet(descriptors_[i].name);
+            }
+            values_modification_counter_ = modification_counter;
+            values_valid_ = true;
+        }
+
+        return values_[index];
+    }
+
+    const ConfigParam* getByName(const char* const name)
+    {
+        const auto end = sorted_by_name_.begin() + getSize();
+        const auto it = std::lower_bound(sorted_by_name_.begin(), end, name,
+                                         [this](std::uint8_t a, const char* b)
+                                         {
+                                             return std::strcmp(descriptors_[a].name, b) < 0;
+                                         });
+        return ((it != end) && (std::strcmp(descriptors_[*it].name, name) == 0)) ? &descriptors_[*it] : nullptr;
+    }
+} g_param_index_cache;
+
 /**
  * Param access server
  * TODO: Rewrite to use pure C++ API to Zubax ChibiOS.
@@ -174,9 +430,25 @@ class ParamManager : public uavcan::IParamManager
         }
     }
 
+    /**
+     * Falls back to the configuration API if the parameter did not fit into the index cache.
+     */
+    static bool findParam(const char* const name, ConfigParam& out_descr)
+    {
+        const auto descr = g_param_index_cache.getByName(name);
+        if (descr != nullptr)
+        {
+            out_descr = *descr;
+            return true;
+        }
+        return !g_param_index_cache.isComplete() && (configGetDescr(name, &out_descr) >= 0);
+    }
+
     void getParamNameByIndex(Index index, Name& out_name) const override
     {
-        const char* name = configNameByIndex(index);
+        const auto descr = g_param_index_cache.getByIndex(index);
+        const char* const name = (descr != nullptr) ? descr->name :
+                                 (g_param_index_cache.isComplete() ? nullptr : configNameByIndex(int(index)));
         if (name != nullptr)
         {
             out_name = name;
@@ -210,10 +482,9 @@ class ParamManager : public uavcan::IParamManager
     void readParamValue(const Name& name, Value& out_value) const override
     {
         ConfigParam descr;
-        const int res = configGetDescr(name.c_str(), &descr);
-        if (res >= 0)
+        if (findParam(name.c_str(), descr))
         {
-            convert(configGet(name.c_str()), descr.type, out_value);
+            convert(configGet(descr.name), descr.type, out_value);
         }
     }
 
@@ -221,8 +492,7 @@ class ParamManager : public uavcan::IParamManager
                                 NumericValue& out_max, NumericValue& out_min) const override
     {
         ConfigParam descr;
-        const int res = configGetDescr(name.c_str(), &descr);
-        if (res >= 0)
+        if (findParam(name.c_str(), descr))
         {
             convert(descr.default_, descr.type, out_default);
             convert(descr.max, descr.type, out_max);
@@ -293,6 +563,310 @@ void handleBeginFirmwareUpdateRequest(
     }
 }
 
+/**
+ * Batched parameter read server, see zubax.param.GetBatch.
+ */
+auto& getParamBatchServer()
+{
+    static uavcan::ServiceServer<zubax::param::GetBatch,
+        void (*)(const uavcan::ReceivedDataStructure<zubax::param::GetBatch::Request>&,
+                 zubax::param::GetBatch::Response&)> srv(getNode());
+    return srv;
+}
+
+void handleParamBatchRequest(const uavcan::ReceivedDataStructure<zubax::param::GetBatch::Request>& request,
+                             zubax::param::GetBatch::Response& response)
+{
+    using zubax::param::BatchEntry;
+
+    response.num_params = std::uint16_t(g_param_index_cache.getSize());
+
+    if (!g_param_index_cache.isComplete())
+    {
+        response.error = response.ERROR_TOO_MANY_PARAMS;
+        return;
+    }
+
+    for (unsigned index = request.first_index;
+         response.entries.size() < response.entries.capacity();
+         index++)
+    {
+        const auto descr = g_param_index_cache.getByIndex(index);
+        if (descr == nullptr)
+        {
+            break;
+        }
+
+        BatchEntry entry;
+        entry.index         = std::uint16_t(index);
+        entry.name          = descr->name;
+        entry.value         = g_param_index_cache.getValueByIndex(index);
+        entry.default_value = descr->default_;
+        entry.min_value     = descr->min;
+        entry.max_value     = descr->max;
+
+        switch (descr->type)
+        {
+        case CONFIG_TYPE_BOOL: entry.type = BatchEntry::TYPE_BOOLEAN; break;
+        case CONFIG_TYPE_INT:  entry.type = BatchEntry::TYPE_INTEGER; break;
+        default:               entry.type = BatchEntry::TYPE_REAL;    break;
+        }
+
+        response.entries.push_back(entry);
+    }
+}
+
+/**
+ * File read server; the only file is the frozen blackbox capture, see foc/blackbox.hpp.
+ */
+static constexpr const char* BlackboxFilePath = "blackbox.bin";
+
+auto& getFileReadServer()
+{
+    static uavcan::ServiceServer<uavcan::protocol::file::Read,
+        void (*)(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Read::Request>&,
+                 uavcan::protocol::file::Read::Response&)> srv(getNode());
+    return srv;
+}
+
+void handleFileReadRequest(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Read::Request>& request,
+                           uavcan::protocol::file::Read::Response& response)
+{
+    if (request.path.path != BlackboxFilePath)
+    {
+        response.error.value = response.error.NOT_FOUND;
+        return;
+    }
+
+    std::uint8_t buffer[uavcan::protocol::file::Read::Response::FieldTypes::data::MaxSize];
+
+    const int res = foc::blackbox::read(std::uint32_t(request.offset), buffer, sizeof(buffer));
+    if (res < 0)
+    {
+        response.error.value = response.error.ACCESS_DENIED;      // Not frozen, the data is being overwritten
+        return;
+    }
+
+    for (int i = 0; i < res; i++)
+    {
+        response.data.push_back(buffer[i]);
+    }
+}
+
+/**
+ * File write server; the only file is the user section of the motor database, see motor_database.hpp.
+ * The file is buffered in RAM and committed into flash by the main thread once complete, so the requests are
+ * served quickly; the next transfer is rejected until the commit is finished.
+ */
+auto& getFileWriteServer()
+{
+    static uavcan::ServiceServer<uavcan::protocol::file::Write,
+        void (*)(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Write::Request>&,
+                 uavcan::protocol::file::Write::Response&)> srv(getNode());
+    return srv;
+}
+
+void handleFileWriteRequest(const uavcan::ReceivedDataStructure<uavcan::protocol::file::Write::Request>& request,
+                            uavcan::protocol::file::Write::Response& response)
+{
+    if (request.path.path != motor_database::UserSectionFilePath)
+    {
+        response.error.value = response.error.NOT_FOUND;
+        return;
+    }
+
+    std::uint8_t buffer[uavcan::protocol::file::Write::Request::FieldTypes::data::MaxSize];
+    std::copy(request.data.begin(), request.data.end(), std::begin(buffer));
+
+    const int res = motor_database::writeUserSection(std::uint32_t(request.offset), buffer, request.data.size());
+    if (res == -EFBIG)
+    {
+        response.error.value = response.error.FILE_TOO_LARGE;
+    }
+    else if (res == -EINVAL)
+    {
+        response.error.value = response.error.INVALID_VALUE;      // Malformed file, or a non-sequential write
+    }
+    else if (res == -EBUSY)
+    {
+        response.error.value = response.error.ACCESS_DENIED;      // The previous file is not committed yet
+    }
+    else if (res < 0)
+    {
+        response.error.value = response.error.IO_ERROR;
+    }
+    else
+    {
+        ;   // Success, the error is OK by default
+    }
+}
+
+/**
+ * Memory utilization server, see zubax.node.GetMemoryUsage.
+ */
+auto& getMemoryUsageServer()
+{
+    static uavcan::ServiceServer<zubax::node::GetMemoryUsage,
+        void (*)(const uavcan::ReceivedDataStructure<zubax::node::GetMemoryUsage::Request>&,
+                 zubax::node::GetMemoryUsage::Response&)> srv(getNode());
+    return srv;
+}
+
+void handleMemoryUsageRequest(const uavcan::ReceivedDataStructure<zubax::node::GetMemoryUsage::Request>&,
+                              zubax::node::GetMemoryUsage::Response& response)
+{
+    using zubax::node::StackUsage;
+    constexpr unsigned MaxThreads = zubax::node::GetMemoryUsage::Response::FieldTypes::thread_stacks::MaxSize;
+
+    static const auto convert = [](const memory_usage::StackUsage& in)
+    {
+        StackUsage out;
+        out.size = std::uint16_t(std::min<unsigned>(in.size, 0xFFFFU));
+        out.free = std::uint16_t(std::min<unsigned>(in.free, 0xFFFFU));
+        for (const char* p = in.name; (*p != '\0') && (out.name.size() < out.name.capacity()); p++)
+        {
+            out.name.push_back(std::uint8_t(*p));
+        }
+        return out;
+    };
+
+    response.irq_stack = convert(memory_usage::getIRQStackUsage());
+
+    memory_usage::StackUsage threads[MaxThreads];
+    const unsigned num_threads = std::min(memory_usage::getThreadStackUsage(threads, MaxThreads), MaxThreads);
+    for (unsigned i = 0; i < num_threads; i++)
+    {
+        response.thread_stacks.push_back(convert(threads[i]));
+    }
+
+    const auto pool = getMemoryPoolUsage();
+    response.uavcan_pool_block_size = std::uint16_t(uavcan::MemPoolBlockSize);
+    response.uavcan_pool_capacity   = std::uint16_t(pool.capacity);
+    response.uavcan_pool_usage      = std::uint16_t(pool.usage);
+    response.uavcan_pool_peak_usage = std::uint16_t(pool.peak_usage);
+
+    const auto tasks = foc::getTaskPoolUsage();
+    response.task_pool_num_slots    = std::uint8_t(tasks.num_slots);
+    response.task_pool_slot_size    = std::uint16_t(tasks.slot_size);
+    response.largest_task_size      = std::uint16_t(tasks.largest_task_size);
+    response.peak_task_size         = std::uint16_t(tasks.peak_task_size);
+    response.subtask_pool_size      = std::uint16_t(tasks.subtask_pool_size);
+}
+
+/**
+ * Periodic CAN diagnostics, see zubax.node.CANDiagnostics.
+ * The rates and the means are computed from the differences of the cumulative statistics between the messages.
+ */
+struct CANDiagnosticsState
+{
+    static constexpr unsigned NumPriorityClasses = InstrumentedCanDriver::NumPriorityClasses;
+
+    std::uint64_t rx_frames[uavcan::MaxCanIfaces] = {};
+    std::uint64_t tx_frames[uavcan::MaxCanIfaces] = {};
+    std::uint64_t tx_latency_sum_usec[uavcan::MaxCanIfaces][NumPriorityClasses] = {};
+    std::uint64_t tx_latency_num_samples[uavcan::MaxCanIfaces][NumPriorityClasses] = {};
+    std::uint64_t spin_time_sum_usec = 0;
+    std::uint64_t spin_time_num_samples = 0;
+    uavcan::MonotonicTime timestamp;
+} g_can_diagnostics_state;
+
+auto& getCANDiagnosticsPublisher()
+{
+    static uavcan::Publisher<zubax::node::CANDiagnostics> pub(getNode());
+    return pub;
+}
+
+auto& getCANDiagnosticsTimer()
+{
+    static uavcan::Timer timer(getNode());
+    return timer;
+}
+
+std::uint16_t computeRate(const std::uint64_t delta, const float interval)
+{
+    return std::uint16_t(std::min(float(delta) / interval, float(std::numeric_limits<std::uint16_t>::max())));
+}
+
+void cbCANDiagnosticsTimer(const uavcan::TimerEvent& event)
+{
+    static constexpr float USecToSec = 1e-6F;
+    static constexpr float NaN = std::numeric_limits<float>::quiet_NaN();
+
+    auto& state = g_can_diagnostics_state;
+
+    const float interval = float((event.real_time - state.timestamp).toUSec()) * USecToSec;
+    state.timestamp = event.real_time;
+    if (interval <= 0.0F)
+    {
+        return;
+    }
+
+    zubax::node::CANDiagnostics msg;
+
+    const auto spin_time_sum_delta = g_spin_time.getSumUSec() - state.spin_time_sum_usec;
+    const auto spin_time_num_samples_delta = g_spin_time.getNumSamples() - state.spin_time_num_samples;
+    state.spin_time_sum_usec = g_spin_time.getSumUSec();
+    state.spin_time_num_samples = g_spin_time.getNumSamples();
+
+    msg.spin_load = float(spin_time_sum_delta) * USecToSec / interval;
+    msg.spin_time_mean = (spin_time_num_samples_delta > 0) ?
+                         (float(spin_time_sum_delta) * USecToSec / float(spin_time_num_samples_delta)) : 0.0F;
+    msg.spin_time_max = float(g_spin_time.getIntervalMaxUSec()) * USecToSec;
+    g_spin_time.startNewInterval();
+
+    for (std::uint8_t i = 0; i < getCanDriver().getNumIfaces(); i++)
+    {
+        const auto stat = getCanDriver().getIfaceStatistics(i);
+        if (stat == nullptr)
+        {
+            break;
+        }
+
+        zubax::node::CANIfaceDiagnostics iface;
+
+        iface.rx_frames_per_second = computeRate(stat->rx_frames - state.rx_frames[i], interval);
+        iface.tx_frames_per_second = computeRate(stat->tx_frames - state.tx_frames[i], interval);
+        state.rx_frames[i] = stat->rx_frames;
+        state.tx_frames[i] = stat->tx_frames;
+
+        iface.rx_overflow_count = g_can.driver.getIface(i)->getRxQueueOverflowCount();
+        iface.tx_drop_count = stat->tx_dropped;
+        iface.error_count = std::uint32_t(getCanDriver().getIface(i)->getErrorCount());
+        iface.tx_depth_max = std::uint8_t(std::min(stat->interval_max_tx_depth, 15U));
+
+        for (unsigned k = 0; k < CANDiagnosticsState::NumPriorityClasses; k++)
+        {
+            const auto& latency = stat->tx_latency[k];
+
+            const auto sum_delta = latency.getSumUSec() - state.tx_latency_sum_usec[i][k];
+            const auto num_samples_delta = latency.getNumSamples() - state.tx_latency_num_samples[i][k];
+            state.tx_latency_sum_usec[i][k] = latency.getSumUSec();
+            state.tx_latency_num_samples[i][k] = latency.getNumSamples();
+
+            if (num_samples_delta > 0)
+            {
+                iface.tx_latency_mean[k] = float(sum_delta) * USecToSec / float(num_samples_delta);
+                iface.tx_latency_max[k] = float(latency.getIntervalMaxUSec()) * USecToSec;
+            }
+            else
+            {
+                iface.tx_latency_mean[k] = NaN;
+                iface.tx_latency_max[k] = NaN;
+            }
+        }
+
+        msg.ifaces.push_back(iface);
+    }
+
+    getCanDriver().startNewInterval();
+
+    const int res = getCANDiagnosticsPublisher().broadcast(msg);
+    if (res < 0)
+    {
+        g_logger.println("CAN diag pub: %d", res);
+    }
+}
+
 /**
  * Log sink that prints to the system log.
  */
@@ -321,6 +895,16 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         std::printf("Node mode:   %u\n", g_node_status_mode);
         std::printf("Node health: %u\n", g_node_status_health);
 
+        if (getTimeSyncSlave().isActive())
+        {
+            std::printf("Time sync:   master %u, UTC %llu us\n",
+                        getTimeSyncSlave().getMasterNodeID().get(), getSynchronizedTime());
+        }
+        else
+        {
+            std::printf("Time sync:   not synchronized\n");
+        }
+
         const auto perf = getNode().getDispatcher().getTransferPerfCounter();
 
         const auto pool_capacity = getNode().getAllocator().getBlockCapacity();
@@ -339,12 +923,36 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         std::printf("Transfers RX/TX: %llu / %llu\n", perf.getRxTransferCount(), perf.getTxTransferCount());
         std::printf("Transfer errors: %llu\n", perf.getErrorCount());
 
+        std::printf("Spin time:\n");
+        g_spin_time.print("    ");
+
         for (std::uint8_t i = 0; i < num_ifaces; i++)
         {
             std::printf("CAN iface %u:\n", i);
             std::printf("    Frames RX/TX: %llu / %llu\n", iface_perf[i].frames_rx, iface_perf[i].frames_tx);
             std::printf("    RX overflows: %lu\n", g_can.driver.getIface(i)->getRxQueueOverflowCount());
             std::printf("    Errors:       %llu\n", iface_perf[i].errors);
+
+            const auto stat = getCanDriver().getIfaceStatistics(i);
+            if (stat == nullptr)
+            {
+                continue;
+            }
+
+            std::printf("    TX dropped:   %lu\n", stat->tx_dropped);
+            std::printf("    TX untracked: %lu\n", stat->tx_untracked);
+            std::printf("    TX depth:     ");
+            for (unsigned k = 0; k <= InstrumentedCanDriver::MaxFramesInFlight; k++)
+            {
+                std::printf("%u:%lu ", k, stat->tx_depth_histogram[k]);
+            }
+            std::printf("\n");
+
+            for (unsigned k = 0; k < InstrumentedCanDriver::NumPriorityClasses; k++)
+            {
+                std::printf("    TX latency, priority %u..%u:\n", k * 8U, k * 8U + 7U);
+                stat->tx_latency[k].print("        ");
+            }
         }
     }
 
@@ -357,6 +965,35 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         }
     }
 
+    static void waitRecommendedListeningDelay()
+    {
+        ::usleep(::useconds_t(g_can.getRecommendedListeningDelay().toUSec()));
+    }
+
+    /**
+     * Listens to the bus at the specified bitrate without disturbing it, same as the autodetection does.
+     * If there is traffic, the driver is reinitialized in the normal mode and true is returned.
+     */
+    static bool tryBitRate(const std::uint32_t bitrate)
+    {
+        if (g_can.driver.init(bitrate, uavcan_stm32::CanIface::SilentMode) < 0)
+        {
+            return false;
+        }
+
+        waitRecommendedListeningDelay();
+
+        for (std::uint8_t i = 0; i < g_can.driver.getNumIfaces(); i++)
+        {
+            if (!g_can.driver.getIface(i)->isRxBufferEmpty())
+            {
+                return g_can.driver.init(bitrate, uavcan_stm32::CanIface::NormalMode) >= 0;
+            }
+        }
+
+        return false;
+    }
+
     void initCAN()
     {
         int res = 0;
@@ -366,13 +1003,23 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         do
         {
             wdt_.reset();
-            ::sleep(1);
             pollCommandFlags();
 
             auto bitrate = g_can_bit_rate;
             const bool autodetect = bitrate == 0;
 
-            res = g_can.init([]() { ::usleep(::useconds_t(g_can.getRecommendedListeningDelay().toUSec())); }, bitrate);
+            // The last known good bitrate is verified first, which is much faster than the full autodetection
+            if (autodetect && (g_param_bit_rate.get() > 0) && tryBitRate(g_param_bit_rate.get()))
+            {
+                bitrate = g_param_bit_rate.get();
+                res = 0;
+            }
+            else
+            {
+                wdt_.reset();
+                res = g_can.init(&NodeThread::waitRecommendedListeningDelay, bitrate);
+            }
+
             if (res >= 0)
             {
                 g_can_bit_rate = bitrate;
@@ -396,12 +1043,21 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
                         g_can_bit_rate = 0;
                     }
                 }
+
+                ::sleep(1);
             }
         }
         while (res < 0);
 
         assert(g_can_bit_rate > 0);
-        g_logger.println("CAN inited at %u bps", unsigned(g_can_bit_rate));
+        g_logger.println("CAN inited at %u bps, %u ms since boot",
+                         unsigned(g_can_bit_rate), unsigned(ST2MS(chVTGetSystemTimeX())));
+
+        if (g_param_bit_rate.get() != g_can_bit_rate)
+        {
+            // Will be committed to the non-volatile storage by the main thread
+            (void) g_param_bit_rate.set(unsigned(g_can_bit_rate));
+        }
     }
 
     void initNode()
@@ -508,6 +1164,49 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
             board::die(res);
         }
 
+        res = getTimeSyncSlave().start();
+        if (res < 0)
+        {
+            board::die(res);
+        }
+
+        res = getParamBatchServer().start(&handleParamBatchRequest);
+        if (res < 0)
+        {
+            board::die(res);
+        }
+
+        res = getFileReadServer().start(&handleFileReadRequest);
+        if (res < 0)
+        {
+            board::die(res);
+        }
+
+        res = getFileWriteServer().start(&handleFileWriteRequest);
+        if (res < 0)
+        {
+            board::die(res);
+        }
+
+        res = getMemoryUsageServer().start(&handleMemoryUsageRequest);
+        if (res < 0)
+        {
+            board::die(res);
+        }
+
+        if (g_param_can_diagnostics.get())
+        {
+            res = getCANDiagnosticsPublisher().init(uavcan::TransferPriority::Lowest);
+            if (res < 0)
+            {
+                board::die(res);
+            }
+
+            g_can_diagnostics_state.timestamp = getNode().getMonotonicTime();
+            getCANDiagnosticsTimer().setCallback(&cbCANDiagnosticsTimer);
+            getCANDiagnosticsTimer().startPeriodic(uavcan::MonotonicDuration::fromMSec(CANDiagnosticsIntervalMSec));
+        }
+
         res = esc_controller::init(getNode());
         if (res < 0)
         {
@@ -517,7 +1216,8 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         // TODO: Indication API
         // TODO: Enumeration API
 
-        g_logger.println("Node started, ID %i", int(getNode().getNodeID().get()));
+        g_logger.println("Node started, ID %i, %u ms since boot",
+                         int(getNode().getNodeID().get()), unsigned(ST2MS(chVTGetSystemTimeX())));
     }
 
     void main() override
@@ -534,24 +1234,32 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
         assert(g_can_bit_rate > 0);
         assert(g_node_id.isUnicast());
 
+        /*
+         * The thread sleeps until woken up by the CAN driver (RX, TX completion, errors), by another thread
+         * (see wakeNodeThread()), or until the earliest deadline of the node's timers. Then the node processes
+         * everything that is pending without blocking, and the thread goes back to sleep.
+         */
+        auto next_time_reference_update = getNode().getMonotonicTime();
+
         while (!os::isRebootRequested())
         {
             wdt_.reset();
 
+            if (getNode().getMonotonicTime() >= next_time_reference_update)
+            {
+                next_time_reference_update = getNode().getMonotonicTime() +
+                                             uavcan::MonotonicDuration::fromMSec(TimeReferenceUpdateIntervalMSec);
+                g_synchronized_time_reference.update(getTimeSyncSlave().isActive(), getNode().getUtcTime());
+            }
+
             getNode().getNodeStatusProvider().setHealth(g_node_status_health);
             getNode().getNodeStatusProvider().setMode(g_node_status_mode);
             getNode().getNodeStatusProvider().setVendorSpecificStatusCode(g_vendor_specific_status);
 
-            const int spin_res = getNode().spin(uavcan::MonotonicDuration::fromMSec(100));
-            if (spin_res < 0)
-            {
-                g_logger.println("Spin: %d", spin_res);
-            }
-
             pollCommandFlags();
 
             uavcan::protocol::debug::LogMessage log_message;
-            if (g_log_message_queue_.pop(log_message))
+            while (g_log_message_queue_.pop(log_message))
             {
                 const int result = getNode().getLogger().log(log_message);
                 if (result < 0)
@@ -559,6 +1267,24 @@ class NodeThread : public chibios_rt::BaseStaticThread<4096>
                     g_logger.println("Log: %d", result);
                 }
             }
+
+            const auto spin_started_at = getNode().getMonotonicTime();
+
+            const int spin_res = getNode().spinOnce();
+            if (spin_res < 0)
+            {
+                g_logger.println("Spin: %d", spin_res);
+            }
+
+            g_spin_time.add(std::uint32_t((getNode().getMonotonicTime() - spin_started_at).toUSec()));
+
+            const auto now = getNode().getMonotonicTime();
+            const auto deadline =
+                std::min(getNode().getScheduler().getDeadlineScheduler().getEarliestDeadline(),
+                         now + uavcan::MonotonicDuration::fromMSec(MaxNodeThreadIdlePeriodMSec));
+
+            // Rounding up, otherwise the thread would be busy-polling during the last millisecond before a deadline
+            (void) g_can.driver.updateEvent().wait(deadline - now + uavcan::MonotonicDuration::fromMSec(1));
         }
 
         g_logger.puts("Goodbye");
@@ -660,10 +1386,36 @@ std::uint32_t getCANBusBitRate()
     return g_can_bit_rate;
 }
 
+MemoryPoolUsage getMemoryPoolUsage()
+{
+    // The counters are updated by the node thread; word reads are atomic, so no locking is needed
+    MemoryPoolUsage out;
+    out.capacity   = getNode().getAllocator().getBlockCapacity();
+    out.usage      = getNode().getAllocator().getNumUsedBlocks();
+    out.peak_usage = getNode().getAllocator().getPeakNumUsedBlocks();
+    return out;
+}
+
+std::uint64_t convertCycleCountToSynchronizedTime(std::uint32_t cycle_count)
+{
+    return g_synchronized_time_reference.convert(cycle_count);
+}
+
+float convertCycleCountToSynchronizedTimePhase(std::uint32_t cycle_count, float period)
+{
+    return g_synchronized_time_reference.convertToPhase(cycle_count, period);
+}
+
+std::uint64_t getSynchronizedTime()
+{
+    return g_synchronized_time_reference.convert(board::irq_profiler::getCycleCount());
+}
+
 void printStatusInfo()
 {
     // Ugh this is wrong
     g_do_print_status = true;
+    wakeNodeThread();
 
     for (int i = 0; i < 20; i++)
     {
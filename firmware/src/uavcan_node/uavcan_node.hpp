@@ -134,9 +134,42 @@ uavcan::NodeID getNodeID();
  */
 std::uint32_t getCANBusBitRate();
 
+/**
+ * Usage of the memory pool of the node, in blocks of uavcan::MemPoolBlockSize bytes.
+ */
+struct MemoryPoolUsage
+{
+    unsigned capacity = 0;
+    unsigned usage = 0;
+    unsigned peak_usage = 0;        ///< Since boot
+};
+
+MemoryPoolUsage getMemoryPoolUsage();
+
 /**
  * Prints node status information into stdout.
  */
 void printStatusInfo();
 
+/**
+ * Converts a value of the cycle counter (see board::irq_profiler::getCycleCount()) into the network-synchronized
+ * UTC time in microseconds, using uavcan.protocol.GlobalTimeSync. The cycle counter is meant to be sampled in the
+ * IRQ that produces the data, so the timestamp is not affected by the delays of the threads.
+ * The cycle count must not be older than a few seconds, because the counter overflows quickly.
+ * Returns zero if the time is not synchronized. Can be invoked from any thread, but not from IRQ.
+ */
+std::uint64_t convertCycleCountToSynchronizedTime(std::uint32_t cycle_count);
+
+/**
+ * Same as @ref convertCycleCountToSynchronizedTime(), but returns the synchronized time modulo the specified period,
+ * in seconds, with sub-microsecond resolution. Devices that share the time base can use it to align periodic
+ * processes with each other. Returns a negative value if the time is not synchronized.
+ */
+float convertCycleCountToSynchronizedTimePhase(std::uint32_t cycle_count, float period);
+
+/**
+ * Current network-synchronized UTC time in microseconds, or zero if not synchronized.
+ */
+std::uint64_t getSynchronizedTime();
+
 }
@@ -5,6 +5,12 @@
 # This is a quick hack that allows to plot values from serial port and at the same time have access to CLI.
 # This script may be superseded with Zubax Toolbox at some point.
 #
+# Two data formats are supported:
+#  - Text lines prefixed with '$', as printed by the CLI command 'plot'.
+#  - Binary COBS-encoded frames, as streamed by the CLI command 'telem'; see firmware/src/foc/telemetry.hpp.
+#
+# Usage: serial_plot.py [port [baudrate]]
+#
 
 import numpy
 import os
@@ -13,6 +19,7 @@ import threading
 import time
 import serial
 import glob
+import struct
 
 from PyQt5.QtWidgets import QVBoxLayout, QWidget, QApplication, QMainWindow, QAction
 from PyQt5.QtCore import Qt, QTimer
@@ -38,7 +45,7 @@ else:
     SER_PORT = glob.glob('/dev/serial/by-id/usb-*Black_Magic_Probe*-if02')[0]
     print('Selected port', SER_PORT)
 
-SER_BAUDRATE = 115200
+SER_BAUDRATE = int(sys.argv[2]) if len(sys.argv) > 2 else 115200
 
 
 # Borrowed from the UAVCAN GUI Tool
@@ -195,20 +202,162 @@ class Window(QMainWindow):
         return self._plot
 
 
+def decode_cobs(data):
+    out = bytearray()
+    index = 0
+    while index < len(data):
+        code = data[index]
+        if code == 0 or index + code > len(data) + 1:
+            raise ValueError('Invalid COBS code')
+        out += data[index + 1:index + code]
+        index += code
+        if code < 0xFF and index < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def compute_crc16_ccitt(data):
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if (crc & 0x8000) else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+class TelemetryDecoder:
+    """
+    Decodes binary telemetry frames, see firmware/src/foc/telemetry.hpp.
+    """
+    FRAME_TYPE_INFO = 0
+    FRAME_TYPE_FAST_IRQ = 1
+    FRAME_TYPE_MAIN_IRQ = 2
+    FRAME_TYPE_TIME_SYNC = 3
+
+    FAST_IRQ_CURVE_NAMES = ['Ia', 'Ib', 'Vinv', 'PWM A', 'PWM B', 'PWM C']
+
+    HEADER = struct.Struct('<BHI')
+
+    def __init__(self):
+        self._cycles_per_second = None
+        self._last_timestamp = None
+        self._timestamp_offset = 0
+        self._last_sequence = {}
+        self.num_dropped_samples = 0
+        self.num_bad_frames = 0
+        self._last_drop_report_ts = 0
+        self.synchronized_time_offset = None    # Add to the local timestamp to get the synchronized UTC time
+
+    def _unwrap_timestamp(self, ts):
+        if self._last_timestamp is not None and ts < self._last_timestamp - 0x40000000:
+            self._timestamp_offset += 1 << 32
+        self._last_timestamp = ts
+        return (ts + self._timestamp_offset) / self._cycles_per_second
+
+    def decode(self, raw, value_handler):
+        """Returns False if the frame is not a valid telemetry frame."""
+        try:
+            frame = decode_cobs(raw)
+        except ValueError:
+            self.num_bad_frames += 1
+            return False
+
+        if len(frame) < self.HEADER.size + 2 or compute_crc16_ccitt(frame[:-2]) != struct.unpack('<H', frame[-2:])[0]:
+            self.num_bad_frames += 1
+            return False
+
+        frame_type, sequence, timestamp = self.HEADER.unpack_from(frame)
+        payload = frame[self.HEADER.size:-2]
+
+        if frame_type == self.FRAME_TYPE_INFO:
+            cycles_per_second, fast_irq_period, decimation = struct.unpack('<ffH', payload)
+            self._cycles_per_second = cycles_per_second
+            self._last_timestamp = None
+            self._timestamp_offset = 0
+            self._last_sequence = {}
+            self.synchronized_time_offset = None
+            print('Telemetry: %.0f MHz, fast IRQ period %.1f us, decimation %d' %
+                  (cycles_per_second * 1e-6, fast_irq_period * 1e6, decimation))
+            return True
+
+        if self._cycles_per_second is None:
+            return True             # Waiting for the info frame
+
+        expected_sequence = self._last_sequence.get(frame_type)
+        if expected_sequence is not None and sequence != expected_sequence:
+            self.num_dropped_samples += (sequence - expected_sequence) & 0xFFFF
+            if time.monotonic() - self._last_drop_report_ts > 1:
+                self._last_drop_report_ts = time.monotonic()
+                print('Telemetry: %d samples dropped so far, %d bad frames' %
+                      (self.num_dropped_samples, self.num_bad_frames))
+        self._last_sequence[frame_type] = (sequence + 1) & 0xFFFF
+
+        if frame_type == self.FRAME_TYPE_TIME_SYNC:
+            utc_usec, = struct.unpack('<Q', payload)
+            local_time = self._unwrap_timestamp(timestamp)
+            if utc_usec > 0:
+                if self.synchronized_time_offset is None:
+                    print('Telemetry: time synchronized, UTC %.6f' % (utc_usec * 1e-6))
+                self.synchronized_time_offset = utc_usec * 1e-6 - local_time
+            elif self.synchronized_time_offset is not None:
+                print('Telemetry: time synchronization lost')
+                self.synchronized_time_offset = None
+            return True
+
+        values = struct.unpack('<%df' % (len(payload) // 4), payload)
+        if frame_type == self.FRAME_TYPE_FAST_IRQ:
+            names = self.FAST_IRQ_CURVE_NAMES
+        else:
+            names = ['%d' % i for i in range(len(values))]
+
+        value_handler(self._unwrap_timestamp(timestamp), zip(names, values))
+        return True
+
+
 class SerialReader:
     def __init__(self, port, baudrate, timeout=None, value_prefix='$'):
         self._value_prefix = value_prefix
         self._port = serial.Serial(port=port, baudrate=baudrate, timeout=timeout, writeTimeout=timeout)
+        self._decoder = TelemetryDecoder()
+        self._buffer = bytearray()
+        self._binary_mode = False
 
-    def poll(self, value_handler, raw_handler):
-        line = self._port.readline().decode()
+    def set_baudrate(self, baudrate):
+        self._port.baudrate = baudrate
+
+    def _handle_line(self, line, value_handler, raw_handler):
+        line = line.decode(errors='replace')
         if not line.startswith(self._value_prefix):
             raw_handler(line)
         else:
             items = eval(line[len(self._value_prefix):])
             if items and len(items) > 1:
                 timestamp, items = items[0], items[1:]
-                value_handler(timestamp, map(float, items))
+                value_handler(timestamp, enumerate(map(float, items)))
+
+    def poll(self, value_handler, raw_handler):
+        self._buffer += self._port.read(max(1, self._port.in_waiting))
+
+        while True:
+            zero_index = self._buffer.find(b'\0')
+            newline_index = self._buffer.find(b'\n')
+
+            # Binary frames may contain newline characters, so in the binary mode only the zero byte is the separator
+            if zero_index >= 0 and (self._binary_mode or newline_index < 0 or zero_index < newline_index):
+                chunk, self._buffer = bytes(self._buffer[:zero_index]), self._buffer[zero_index + 1:]
+                if self._decoder.decode(chunk, value_handler):
+                    self._binary_mode = True
+                elif chunk:
+                    self._binary_mode = False
+                    for line in chunk.split(b'\n'):
+                        if line.strip():
+                            self._handle_line(line, value_handler, raw_handler)
+            elif newline_index >= 0 and not self._binary_mode:
+                line, self._buffer = bytes(self._buffer[:newline_index + 1]), self._buffer[newline_index + 1:]
+                self._handle_line(line, value_handler, raw_handler)
+            else:
+                break
 
     def run(self, value_handler, raw_handler):
         while True:
@@ -234,7 +383,7 @@ class CLIInputReader(threading.Thread):
 
 
 def value_handler(x, values):
-    for i, val in enumerate(values):
+    for i, val in values:
         try:
             window.plot.update_values(i, [x], [val])
         except KeyError:
@@ -247,7 +396,28 @@ window = Window()
 
 reader = SerialReader(SER_PORT, SER_BAUDRATE)
 
-cli = CLIInputReader(lambda line: reader._port.write((line + '\r\n').encode()))
+telemetry_baudrate = None
+
+
+def send_cli_line(line):
+    """
+    The command 'telem' may change the baud rate for the duration of streaming, so we follow it here.
+    """
+    global telemetry_baudrate
+    reader._port.write((line + '\r\n').encode())
+    if telemetry_baudrate is not None:
+        time.sleep(0.1)
+        reader.set_baudrate(SER_BAUDRATE)
+        telemetry_baudrate = None
+    else:
+        args = line.split()
+        if len(args) >= 3 and args[0] == 'telem':
+            time.sleep(0.5)
+            telemetry_baudrate = int(args[2])
+            reader.set_baudrate(telemetry_baudrate)
+
+
+cli = CLIInputReader(send_cli_line)
 
 threading.Thread(target=reader.run, args=(value_handler, lambda s: print(s.rstrip())), daemon=True).start()
 